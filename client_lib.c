@@ -17,8 +17,10 @@
 #endif /* ?CLIENT_LIB_DEBUG */
 
 
-int
-init_pipe(in_port_t distant_port, struct in_addr *distant_addr, xen_shm_pipe_p *receive_fd, xen_shm_pipe_p *send_fd, uint8_t proposed_page_page_count)
+//The streams of the MUX mode are given in mux_grant
+static int
+init_channel(in_port_t distant_port, struct in_addr *distant_addr, xen_shm_pipe_p *receive_fd, xen_shm_pipe_p *send_fd, uint8_t proposed_page_page_count,
+        uint8_t mode, struct xen_shm_udp_proto_mux_grant *mux_grant)
 {
     struct sockaddr_in addr;
     int ret;
@@ -29,9 +31,11 @@ init_pipe(in_port_t distant_port, struct in_addr *distant_addr, xen_shm_pipe_p *
     struct xen_shm_udp_proto_header *header;
     struct xen_shm_udp_proto_client_hello *client_hello;
     struct xen_shm_udp_proto_grant *grant;
+    int duplex;
     //enum xen_shm_pipe_conv distant_convention;
 
     return_value = -1;
+    duplex = (mode != XEN_SHM_UDP_PROTO_GRANT_MODE_READER_OFFERER);
 
     client_fd = socket(PF_INET, SOCK_DGRAM, 0);
 
@@ -50,18 +54,31 @@ init_pipe(in_port_t distant_port, struct in_addr *distant_addr, xen_shm_pipe_p *
     client_hello = (struct xen_shm_udp_proto_client_hello*) buffer;
     grant = (struct xen_shm_udp_proto_grant*) buffer;
 
-    ret = xen_shm_pipe_init(receive_fd, xen_shm_pipe_mod_read, xen_shm_pipe_conv_reader_offers);
-    if (ret != 0) {
-        printf("Unable to init xen_shm_pipe\n");
-        perror("xen_shm_pipe_init");
-        goto shutdown_socket;
-    }
-
-    ret = xen_shm_pipe_init(send_fd, xen_shm_pipe_mod_write, xen_shm_pipe_conv_reader_offers);
-    if (ret != 0) {
-        printf("Unable to init xen_shm_pipe\n");
-        perror("xen_shm_pipe_init");
-        goto clean_receive_fd;
+    if (duplex) {
+        ret = xen_shm_pipe_init_duplex(receive_fd, send_fd, /* The server offers */ 0);
+        if (ret != 0) {
+            printf("Unable to init xen_shm_pipe\n");
+            perror("xen_shm_pipe_init_duplex");
+            goto shutdown_socket;
+        }
+        if (mode == XEN_SHM_UDP_PROTO_GRANT_MODE_MUX) {
+            xen_shm_pipe_set_type(*receive_fd, xen_shm_pipe_type_framed);
+            xen_shm_pipe_set_type(*send_fd, xen_shm_pipe_type_framed);
+        }
+    } else {
+        ret = xen_shm_pipe_init(receive_fd, xen_shm_pipe_mod_read, xen_shm_pipe_conv_reader_offers);
+        if (ret != 0) {
+            printf("Unable to init xen_shm_pipe\n");
+            perror("xen_shm_pipe_init");
+            goto shutdown_socket;
+        }
+
+        ret = xen_shm_pipe_init(send_fd, xen_shm_pipe_mod_write, xen_shm_pipe_conv_reader_offers);
+        if (ret != 0) {
+            printf("Unable to init xen_shm_pipe\n");
+            perror("xen_shm_pipe_init");
+            goto clean_receive_fd;
+        }
     }
 
     header->version = XEN_SHM_UDP_PROTO_VERSION;
@@ -72,6 +89,7 @@ init_pipe(in_port_t distant_port, struct in_addr *distant_addr, xen_shm_pipe_p *
         perror("xen_shm_pipe_getdomid");
         goto clean_send_fd;
     }
+    client_hello->mode = mode;
 
     len = sendto(client_fd, buffer, sizeof(struct xen_shm_udp_proto_client_hello), /* No flag */ 0, (struct sockaddr *) &addr, sizeof(struct sockaddr_in));
     if (len < 0) {
@@ -114,6 +132,27 @@ init_pipe(in_port_t distant_port, struct in_addr *distant_addr, xen_shm_pipe_p *
             goto cancel_server;
         case XEN_SHM_UDP_PROTO_GRANT_MODE_READER_OFFERER:
             //distant_convention = xen_shm_pipe_conv_reader_offers;
+            if (duplex) {
+                printf("Server without duplex support\n");
+                goto cancel_server;
+            }
+            break;
+        case XEN_SHM_UDP_PROTO_GRANT_MODE_DUPLEX:
+            if (mode != XEN_SHM_UDP_PROTO_GRANT_MODE_DUPLEX) {
+                printf("Protocol error: unexpected duplex grant\n");
+                goto cancel_server;
+            }
+            break;
+        case XEN_SHM_UDP_PROTO_GRANT_MODE_MUX:
+            if (mode != XEN_SHM_UDP_PROTO_GRANT_MODE_MUX) {
+                printf("Protocol error: unexpected mux grant\n");
+                goto cancel_server;
+            }
+            if ((size_t)len < sizeof(struct xen_shm_udp_proto_mux_grant)) {
+                printf("Bad packet: too short");
+                goto cancel_server;
+            }
+            memcpy(mux_grant, buffer, sizeof(struct xen_shm_udp_proto_mux_grant));
             break;
         default:
             printf("Protocol error: bad mode\n");
@@ -128,17 +167,24 @@ init_pipe(in_port_t distant_port, struct in_addr *distant_addr, xen_shm_pipe_p *
         goto cancel_server;
     }
 
-    PRINTF("New grant for %"PRIu32":", grant->domid);
-    ret = xen_shm_pipe_offers(*receive_fd, proposed_page_page_count, grant->domid, &grant->domid, &grant->grant_ref);
-    PRINTF("(from %"PRIu32"): first=%"PRIu32"\n", grant->domid, grant->grant_ref);
-    if (ret != 0) {
-        printf("Unable to offer xen_shm_pipe\n");
-        perror("xen_shm_pipe_offers");
-        goto cancel_server;
-    }
+    if (duplex) {
+        //Both directions are connected, just tell the server it can start
+        header->message = XEN_SHM_UDP_PROTO_CLIENT_GRANT;
+        grant->grant_ref = 0;
+        grant->page_count = 0;
+    } else {
+        PRINTF("New grant for %"PRIu32":", grant->domid);
+        ret = xen_shm_pipe_offers(*receive_fd, proposed_page_page_count, grant->domid, &grant->domid, &grant->grant_ref);
+        PRINTF("(from %"PRIu32"): first=%"PRIu32"\n", grant->domid, grant->grant_ref);
+        if (ret != 0) {
+            printf("Unable to offer xen_shm_pipe\n");
+            perror("xen_shm_pipe_offers");
+            goto cancel_server;
+        }
 
-    header->message = XEN_SHM_UDP_PROTO_CLIENT_GRANT;
-    grant->page_count = proposed_page_page_count;
+        header->message = XEN_SHM_UDP_PROTO_CLIENT_GRANT;
+        grant->page_count = proposed_page_page_count;
+    }
 
     len = sendto(client_fd, buffer, sizeof(struct xen_shm_udp_proto_grant), /* No flag */ 0, (struct sockaddr *) &addr, sizeof(struct sockaddr_in));
     if (len < 0) {
@@ -176,15 +222,48 @@ shutdown_socket:
 
 
 int
-run_client_thread(in_port_t distant_por, struct in_addr *distant_addr, uint8_t proposed_page_page_count,
+init_pipe(in_port_t distant_port, struct in_addr *distant_addr, xen_shm_pipe_p *receive_fd, xen_shm_pipe_p *send_fd, uint8_t proposed_page_page_count, int duplex)
+{
+    return init_channel(distant_port, distant_addr, receive_fd, send_fd, proposed_page_page_count,
+            (duplex)?XEN_SHM_UDP_PROTO_GRANT_MODE_DUPLEX:XEN_SHM_UDP_PROTO_GRANT_MODE_READER_OFFERER, NULL);
+}
+
+
+int
+init_mux(in_port_t distant_port, struct in_addr *distant_addr, uint8_t proposed_page_page_count, xen_shm_mux_p *mux)
+{
+    struct xen_shm_udp_proto_mux_grant mux_grant;
+    xen_shm_pipe_p receive_fd;
+    xen_shm_pipe_p send_fd;
+    int ret;
+
+    ret = init_channel(distant_port, distant_addr, &receive_fd, &send_fd, proposed_page_page_count, XEN_SHM_UDP_PROTO_GRANT_MODE_MUX, &mux_grant);
+    if (ret != 0) {
+        return ret;
+    }
+
+    ret = xen_shm_mux_init(mux, receive_fd, send_fd, mux_grant.stream_count, mux_grant.window);
+    if (ret != 0) {
+        printf("Unable to init xen_shm_mux\n");
+        perror("xen_shm_mux_init");
+        xen_shm_pipe_free(send_fd);
+        xen_shm_pipe_free(receive_fd);
+    }
+    return ret;
+}
+
+
+int
+run_client_thread(in_port_t distant_por, struct in_addr *distant_addr, uint8_t proposed_page_page_count, int duplex,
         handler_run handler_fct,  struct xen_shm_handler_data* hdlr_data, pthread_t* thread_info)
 {
 
     int ret;
 
     hdlr_data->stop = 0;
+    hdlr_data->mux = NULL;
 
-    ret = init_pipe(distant_por, distant_addr, &hdlr_data->receive_fd, &hdlr_data->send_fd, proposed_page_page_count);
+    ret = init_pipe(distant_por, distant_addr, &hdlr_data->receive_fd, &hdlr_data->send_fd, proposed_page_page_count, duplex);
     if(ret!=0) {
         perror("init pipe");
         return ret;
@@ -203,14 +282,15 @@ run_client_thread(in_port_t distant_por, struct in_addr *distant_addr, uint8_t p
 
 
 int
-run_client(in_port_t distant_por, struct in_addr *distant_addr, uint8_t proposed_page_page_count,
+run_client(in_port_t distant_por, struct in_addr *distant_addr, uint8_t proposed_page_page_count, int duplex,
         handler_run handler_fct,  struct xen_shm_handler_data* hdlr_data, void** returned_value)
 {
     int ret;
 
     hdlr_data->stop = 0;
+    hdlr_data->mux = NULL;
 
-    ret = init_pipe(distant_por, distant_addr, &hdlr_data->receive_fd, &hdlr_data->send_fd, proposed_page_page_count);
+    ret = init_pipe(distant_por, distant_addr, &hdlr_data->receive_fd, &hdlr_data->send_fd, proposed_page_page_count, duplex);
     if(ret!=0) {
         perror("init pipe");
         return ret;
@@ -221,3 +301,29 @@ run_client(in_port_t distant_por, struct in_addr *distant_addr, uint8_t proposed
     return 0;
 }
 
+
+int
+run_mux_client_thread(in_port_t distant_por, struct in_addr *distant_addr, uint8_t proposed_page_page_count,
+        handler_run handler_fct,  struct xen_shm_handler_data* hdlr_data, pthread_t* thread_info)
+{
+    int ret;
+
+    hdlr_data->stop = 0;
+    hdlr_data->receive_fd = NULL;
+    hdlr_data->send_fd = NULL;
+
+    ret = init_mux(distant_por, distant_addr, proposed_page_page_count, &hdlr_data->mux);
+    if(ret!=0) {
+        perror("init mux");
+        return ret;
+    }
+
+    ret = pthread_create(thread_info, /* Default attr */ NULL, (void * (*)(void *))handler_fct, hdlr_data);
+    if (ret != 0) {
+        perror("pthread create");
+        xen_shm_mux_free(hdlr_data->mux);
+        return ret;
+    }
+
+    return 0;
+}
@@ -9,18 +9,27 @@
 #include <pthread.h>
 
 #include "xen_shm_pipe.h"
+#include "xen_shm_mux.h"
 #include "handler_lib.h"
 
-int init_pipe(in_port_t distant_port, struct in_addr *distant_addr, xen_shm_pipe_p *receive_fd, xen_shm_pipe_p *send_fd, uint8_t proposed_page_page_count);
+//With duplex, both pipes share a single grant offered by the server (see xen_shm_pipe_init_duplex)
+int init_pipe(in_port_t distant_port, struct in_addr *distant_addr, xen_shm_pipe_p *receive_fd, xen_shm_pipe_p *send_fd, uint8_t proposed_page_page_count, int duplex);
 
 //Starts a handler in a new thread (given in thread_info)
-int run_client_thread(in_port_t distant_por, struct in_addr *distant_addr, uint8_t proposed_page_page_count,
+int run_client_thread(in_port_t distant_por, struct in_addr *distant_addr, uint8_t proposed_page_page_count, int duplex,
         handler_run handler_fct,  struct xen_shm_handler_data* hdlr_data, pthread_t* thread_info);
 
 //Runs the handler (and give the returned value in returned_value)
-int run_client(in_port_t distant_por, struct in_addr *distant_addr, uint8_t proposed_page_page_count,
+int run_client(in_port_t distant_por, struct in_addr *distant_addr, uint8_t proposed_page_page_count, int duplex,
         handler_run handler_fct,  struct xen_shm_handler_data* hdlr_data, void** returned_value);
 
+//MUX mode: the connections are the streams of a multiplexer over a single duplex grant, the server chooses the streams (see run_mux_server)
+int init_mux(in_port_t distant_port, struct in_addr *distant_addr, uint8_t proposed_page_page_count, xen_shm_mux_p *mux);
+
+//Starts a handler in a new thread (given in thread_info), with the multiplexer in hdlr_data->mux
+int run_mux_client_thread(in_port_t distant_por, struct in_addr *distant_addr, uint8_t proposed_page_page_count,
+        handler_run handler_fct,  struct xen_shm_handler_data* hdlr_data, pthread_t* thread_info);
+
 #endif /* __XEN_SHM_SERVER_LIB_H__ */
 
 
@@ -23,6 +23,9 @@ void* xen_shm_handler_ping_client (struct xen_shm_handler_data* data) {
     int i;
     ssize_t len;
     uint8_t noise[PING_PACKET_SIZE];
+    int deferred;
+
+    deferred = (xen_shm_pipe_set_wake_on_read(data->send_fd, 1) == 0); //Duplex channel: each ping goes with the wait for its answer
 
     while(!data->stop) {
         clock_gettime(CLOCK_REALTIME, &out_stamp);
@@ -33,14 +36,18 @@ void* xen_shm_handler_ping_client (struct xen_shm_handler_data* data) {
                 perror("xen_shm_pipe_write_all");
                 return NULL;
             }
-            xen_shm_pipe_flush(data->receive_fd);
+            if (!deferred) {
+                xen_shm_pipe_flush(data->receive_fd);
+            }
             len = xen_shm_pipe_read_all(data->receive_fd, noise, PING_PACKET_SIZE);
             if (len < 0) {
                 printf("Unable to receive\n");
                 perror("xen_shm_pipe_read_all");
                 return NULL;
             }
-            xen_shm_pipe_flush(data->receive_fd);
+            if (!deferred) {
+                xen_shm_pipe_flush(data->receive_fd);
+            }
         }
         clock_gettime(CLOCK_REALTIME, &in_stamp);
         printf("Sent at %ld.%09ld\n", out_stamp.tv_sec, out_stamp.tv_nsec);
@@ -52,6 +59,9 @@ void* xen_shm_handler_ping_client (struct xen_shm_handler_data* data) {
 void* xen_shm_handler_ping_server (struct xen_shm_handler_data* data) {
     uint8_t noise[PING_PACKET_SIZE];
     ssize_t len;
+    int deferred;
+
+    deferred = (xen_shm_pipe_set_wake_on_read(data->send_fd, 1) == 0); //Duplex channel: each answer goes with the wait for the next ping
 
     while (!data->stop) {
         len = xen_shm_pipe_read_all(data->receive_fd, &noise, PING_PACKET_SIZE);
@@ -60,14 +70,102 @@ void* xen_shm_handler_ping_server (struct xen_shm_handler_data* data) {
             perror("xen_shm_pipe_read_all");
             return NULL;
         }
-        xen_shm_pipe_flush(data->receive_fd);
+        if (!deferred) {
+            xen_shm_pipe_flush(data->receive_fd);
+        }
         len = xen_shm_pipe_write_all(data->send_fd, &noise, PING_PACKET_SIZE);
         if (len < 0) {
             printf("Unable to send\n");
             perror("xen_shm_pipe_write_all");
             return NULL;
         }
-        xen_shm_pipe_flush(data->send_fd);
+        if (!deferred) {
+            xen_shm_pipe_flush(data->send_fd);
+        }
+    }
+    return NULL;
+}
+
+int xen_shm_handler_ping_server_event (struct xen_shm_handler_data* data) {
+    uint8_t noise[PING_PACKET_SIZE];
+    ssize_t len;
+
+    for (;;) {
+        len = xen_shm_pipe_read(data->receive_fd, &noise, PING_PACKET_SIZE);
+        if (len == 0) {
+            return 1;
+        }
+        if (len < 0) {
+            if (errno == EAGAIN) {
+                return 0;
+            }
+            printf("Unable to receive\n");
+            perror("xen_shm_pipe_read");
+            return -1;
+        }
+        if (xen_shm_pipe_write_all(data->send_fd, &noise, (size_t) len) < 0) {
+            printf("Unable to send\n");
+            perror("xen_shm_pipe_write_all");
+            return -1;
+        }
+    }
+}
+
+void* xen_shm_handler_mux_ping_client (struct xen_shm_handler_data* data) {
+    struct timespec in_stamp;
+    struct timespec out_stamp;
+    uint32_t stream_count;
+    uint32_t stream;
+    int i;
+    size_t len;
+    uint8_t noise[PING_PACKET_SIZE];
+
+    stream_count = xen_shm_mux_stream_count(data->mux);
+    stream = 0;
+
+    while(!data->stop) {
+        clock_gettime(CLOCK_REALTIME, &out_stamp);
+        for (i = 0; i < PING_SERIES_LENGTH; ++i) {
+            if (xen_shm_mux_send(data->mux, stream, noise, PING_PACKET_SIZE) != 0) {
+                printf("Unable to send\n");
+                perror("xen_shm_mux_send");
+                return NULL;
+            }
+            if (xen_shm_mux_recv_stream(data->mux, stream, noise, PING_PACKET_SIZE, &len) != 1) {
+                printf("Unable to receive\n");
+                perror("xen_shm_mux_recv_stream");
+                return NULL;
+            }
+            stream = (stream + 1) % stream_count;
+        }
+        clock_gettime(CLOCK_REALTIME, &in_stamp);
+        printf("Sent at %ld.%09ld\n", out_stamp.tv_sec, out_stamp.tv_nsec);
+        printf("Received at %ld.%09ld\n", in_stamp.tv_sec, in_stamp.tv_nsec);
+    }
+    return NULL;
+}
+
+void* xen_shm_handler_mux_ping_server (struct xen_shm_handler_data* data) {
+    uint8_t noise[PING_PACKET_SIZE];
+    uint32_t stream;
+    size_t len;
+    int ret;
+
+    while (!data->stop) {
+        ret = xen_shm_mux_recv(data->mux, &stream, noise, PING_PACKET_SIZE, &len);
+        if (ret == 0) {
+            return NULL;
+        }
+        if (ret < 0) {
+            printf("Unable to receive\n");
+            perror("xen_shm_mux_recv");
+            return NULL;
+        }
+        if (xen_shm_mux_send(data->mux, stream, noise, len) != 0) {
+            printf("Unable to send\n");
+            perror("xen_shm_mux_send");
+            return NULL;
+        }
     }
     return NULL;
 }
@@ -5,16 +5,25 @@
 #include <inttypes.h>
 
 #include "xen_shm_pipe.h"
+#include "xen_shm_mux.h"
 
 struct xen_shm_handler_data {
   xen_shm_pipe_p receive_fd;
   xen_shm_pipe_p send_fd;
+  xen_shm_mux_p mux; //MUX mode (see run_mux_server and init_mux): the connections are its streams, no pipe is given
   volatile int stop;
   void *private_data;
 };
 
 typedef void* (*handler_run) (struct xen_shm_handler_data* data);
 
+/*
+ * Event server (see run_event_server): called by the event loop when the receive pipe may be readable, and once at the start.
+ * The receive pipe is in non-blocking mode: read until EAGAIN (which asks for the next event).
+ * Returns 0 to keep the connection, anything else to close it.
+ */
+typedef int (*handler_event) (struct xen_shm_handler_data* data);
+
 
 #define PING_PACKET_SIZE 10
 #define PING_SERIES_LENGTH  500
@@ -23,6 +32,14 @@ void* xen_shm_handler_ping_client (struct xen_shm_handler_data* data);
 
 void* xen_shm_handler_ping_server (struct xen_shm_handler_data* data);
 
+//Same, from the event loop
+int xen_shm_handler_ping_server_event (struct xen_shm_handler_data* data);
+
+//Same over the streams of a multiplexer, each ping on the next stream
+void* xen_shm_handler_mux_ping_client (struct xen_shm_handler_data* data);
+
+void* xen_shm_handler_mux_ping_server (struct xen_shm_handler_data* data);
+
 
 struct xen_shm_handler_transfert {
     size_t buffer_len;
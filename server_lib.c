@@ -4,6 +4,7 @@
 #include <netinet/in.h>
 #include <pthread.h>
 #include <signal.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -29,15 +30,31 @@ struct opening_list {
     in_port_t distant_port;
     struct in_addr distant_addr;
     xen_shm_pipe_p receive_fd;
+    xen_shm_pipe_p send_fd; //Only for duplex openings
     struct opening_list *next;
 };
 
+struct internal_data;
+
+//Event server: a connection run by the event loop
+struct event_list {
+    struct ev_io watcher; //On the fd of the receive pipe
+    struct xen_shm_handler_data child_data;
+    struct internal_data *server;
+    struct event_list *prev;
+    struct event_list *next;
+};
+
 struct internal_data {
     uint8_t proposed_page_page_count;
     void *private_data;
     handler_run initializer;
+    handler_event on_event; //Event server only (NULL otherwise)
+    struct event_list *events;
     struct pthread_list *childs;
     struct opening_list *current;
+    uint32_t stream_count; //MUX mode only (0 otherwise)
+    uint32_t window;
 };
 
 struct ev_loop *event_loop;
@@ -80,6 +97,12 @@ free_opening(struct internal_data *data, struct opening_list* o)
         return;
     }
 
+    if (temp == o) {
+        data->current = o->next;
+        free(o);
+        return;
+    }
+
     while (temp->next != NULL) {
         if (temp->next == o) {
             temp->next = o->next;
@@ -91,6 +114,69 @@ free_opening(struct internal_data *data, struct opening_list* o)
     free(o);
 }
 
+static void
+free_connection(struct internal_data *data, struct event_list *e)
+{
+    if (e->prev != NULL) {
+        e->prev->next = e->next;
+    } else {
+        data->events = e->next;
+    }
+    if (e->next != NULL) {
+        e->next->prev = e->prev;
+    }
+
+    xen_shm_pipe_free(e->child_data.send_fd);
+    xen_shm_pipe_free(e->child_data.receive_fd);
+    free(e);
+}
+
+static void
+pipe_readable_cb(struct ev_loop *loop, struct ev_io *w, int revents)
+{
+    struct event_list *e;
+
+    e = w->data;
+    if (e->server->on_event(&e->child_data) != 0) {
+        ev_io_stop(loop, w);
+        free_connection(e->server, e);
+    }
+}
+
+/*
+ * Event server: the connection goes to the event loop instead of a thread. The handler runs once at
+ * the start, as the other side may have written already, and reads until EAGAIN so that the fd
+ * becomes readable on the next progress. The send pipe stays blocking.
+ */
+static int
+watch_connection(struct internal_data *data, struct xen_shm_handler_data *child_data)
+{
+    struct event_list *e;
+
+    e = calloc(1, sizeof(struct event_list));
+    if (e == NULL) {
+        return -1;
+    }
+    e->child_data = *child_data;
+    e->server = data;
+    e->next = data->events;
+    if (data->events != NULL) {
+        data->events->prev = e;
+    }
+    data->events = e;
+
+    xen_shm_pipe_set_nonblock(e->child_data.receive_fd, 1);
+    if (data->on_event(&e->child_data) != 0) { //Already done
+        free_connection(data, e);
+        return 0;
+    }
+
+    ev_io_init(&e->watcher, pipe_readable_cb, xen_shm_pipe_get_fd(e->child_data.receive_fd), EV_READ);
+    e->watcher.data = e;
+    ev_io_start(event_loop, &e->watcher);
+    return 0;
+}
+
 
 static void
 udp_readable_cb(struct ev_loop *loop, struct ev_io *w, int revents)
@@ -107,6 +193,8 @@ udp_readable_cb(struct ev_loop *loop, struct ev_io *w, int revents)
     struct xen_shm_udp_proto_header *header;
     struct xen_shm_udp_proto_client_hello *client_hello;
     struct xen_shm_udp_proto_grant *grant;
+    struct xen_shm_udp_proto_mux_grant *mux_grant;
+    uint8_t mode;
 
     data = w->data;
     send_len = 0;
@@ -139,20 +227,38 @@ udp_readable_cb(struct ev_loop *loop, struct ev_io *w, int revents)
         }
         switch(header->message) {
             case XEN_SHM_UDP_PROTO_CLIENT_HELLO:
-                if ((size_t)len < sizeof(struct xen_shm_udp_proto_client_hello)) {
+                if ((size_t)len < offsetof(struct xen_shm_udp_proto_client_hello, mode)) {
                     printf("Packet too short !\n");
                     return;
                 }
                 client_hello = (struct xen_shm_udp_proto_client_hello*) buffer;
+                mode = ((size_t)len < sizeof(struct xen_shm_udp_proto_client_hello))?XEN_SHM_UDP_PROTO_GRANT_MODE_READER_OFFERER:client_hello->mode;
                 o_new = calloc(1, sizeof(struct opening_list));
                 if (o_new == NULL) {
                     printf("Calloc error !\n");
                     return;
                 }
-                ret = xen_shm_pipe_init(&o_new->receive_fd, xen_shm_pipe_mod_read, xen_shm_pipe_conv_reader_offers);
+                if (data->stream_count != 0) { //Multiplexed channels only
+                    if (mode != XEN_SHM_UDP_PROTO_GRANT_MODE_MUX) {
+                        printf("Unsupported mode !\n");
+                        free(o_new);
+                        goto server_reset;
+                    }
+                    ret = xen_shm_pipe_init_duplex(&o_new->receive_fd, &o_new->send_fd, /* We offer */ 1);
+                    if (ret == 0) {
+                        xen_shm_pipe_set_type(o_new->receive_fd, xen_shm_pipe_type_framed);
+                        xen_shm_pipe_set_type(o_new->send_fd, xen_shm_pipe_type_framed);
+                    }
+                } else if (mode == XEN_SHM_UDP_PROTO_GRANT_MODE_DUPLEX) {
+                    ret = xen_shm_pipe_init_duplex(&o_new->receive_fd, &o_new->send_fd, /* We offer */ 1);
+                } else {
+                    mode = XEN_SHM_UDP_PROTO_GRANT_MODE_READER_OFFERER;
+                    ret = xen_shm_pipe_init(&o_new->receive_fd, xen_shm_pipe_mod_read, xen_shm_pipe_conv_reader_offers);
+                }
                 if (ret != 0) {
                     printf("Unable to init xen_shm_pipe\n");
                     perror("xen_shm_pipe_init");
+                    free(o_new);
                     goto server_reset;
                 }
                 grant = (struct xen_shm_udp_proto_grant*)buffer;
@@ -162,15 +268,25 @@ udp_readable_cb(struct ev_loop *loop, struct ev_io *w, int revents)
                 if (ret != 0) {
                     printf("Unable to init xen_shm_pipe in offerer mode \n");
                     perror("xen_shm_pipe_offers");
+                    if (o_new->send_fd != NULL) {
+                        xen_shm_pipe_free(o_new->send_fd);
+                    }
                     xen_shm_pipe_free(o_new->receive_fd);
+                    free(o_new);
                     goto server_reset;
                 }
                 o_new->distant_port = source.sin_port;
                 memcpy(&o_new->distant_addr, (struct in_addr*) &source.sin_addr, sizeof(struct in_addr));
                 grant->header.message = XEN_SHM_UDP_PROTO_SERVER_GRANT;
-                grant->mode = XEN_SHM_UDP_PROTO_GRANT_MODE_READER_OFFERER;
+                grant->mode = mode;
                 grant->page_count = data->proposed_page_page_count;
                 send_len = sizeof(struct xen_shm_udp_proto_grant);
+                if (mode == XEN_SHM_UDP_PROTO_GRANT_MODE_MUX) {
+                    mux_grant = (struct xen_shm_udp_proto_mux_grant*)buffer;
+                    mux_grant->stream_count = data->stream_count;
+                    mux_grant->window = data->window;
+                    send_len = sizeof(struct xen_shm_udp_proto_mux_grant);
+                }
                 o_new->next = data->current;
                 data->current = o_new;
                 goto send;
@@ -202,33 +318,69 @@ udp_readable_cb(struct ev_loop *loop, struct ev_io *w, int revents)
                     printf("Calloc error !\n");
                     goto free_data;
                 }
-                if (grant->mode != XEN_SHM_UDP_PROTO_GRANT_MODE_READER_OFFERER) {
-                    printf("Unsupported mode !\n");
-                    goto free_data;
-                }
-                ret = xen_shm_pipe_init(&c_new->child_data.send_fd, xen_shm_pipe_mod_write, xen_shm_pipe_conv_reader_offers);
-                if (ret != 0) {
-                    printf("Unable to init xen_shm_pipe\n");
-                    perror("xen_shm_pipe_init");
-                    goto free_data;
+                if (data->stream_count != 0) { //The client connected to our grant, the multiplexer takes both pipes
+                    if (grant->mode != XEN_SHM_UDP_PROTO_GRANT_MODE_MUX) {
+                        printf("Unsupported mode !\n");
+                        goto free_data;
+                    }
+                    ret = xen_shm_mux_init(&c_new->child_data.mux, o_new->receive_fd, o_new->send_fd, data->stream_count, data->window);
+                    if (ret != 0) {
+                        printf("Unable to init xen_shm_mux\n");
+                        perror("xen_shm_mux_init");
+                        goto free_data;
+                    }
+                } else if (o_new->send_fd != NULL) { //Duplex: the client connected to our grant, nothing more to map
+                    if (grant->mode != XEN_SHM_UDP_PROTO_GRANT_MODE_DUPLEX) {
+                        printf("Unsupported mode !\n");
+                        goto free_data;
+                    }
+                    c_new->child_data.send_fd = o_new->send_fd;
+                } else {
+                    if (grant->mode != XEN_SHM_UDP_PROTO_GRANT_MODE_READER_OFFERER) {
+                        printf("Unsupported mode !\n");
+                        goto free_data;
+                    }
+                    ret = xen_shm_pipe_init(&c_new->child_data.send_fd, xen_shm_pipe_mod_write, xen_shm_pipe_conv_reader_offers);
+                    if (ret != 0) {
+                        printf("Unable to init xen_shm_pipe\n");
+                        perror("xen_shm_pipe_init");
+                        goto free_data;
+                    }
+                    ret = xen_shm_pipe_connect(c_new->child_data.send_fd, grant->page_count, grant->domid, grant->grant_ref);
+                    PRINTF("Mapping grant from %"PRIu32": first=%"PRIu32"\n", grant->domid, grant->grant_ref);
+                    if (ret != 0) {
+                        printf("Unable to init xen_shm_receiver\n");
+                        perror("xen_shm_pipe_connect");
+                        xen_shm_pipe_free(c_new->child_data.send_fd);
+                        goto free_data;
+                    }
                 }
-                ret = xen_shm_pipe_connect(c_new->child_data.send_fd, grant->page_count, grant->domid, grant->grant_ref);
-                PRINTF("Mapping grant from %"PRIu32": first=%"PRIu32"\n", grant->domid, grant->grant_ref);
-                if (ret != 0) {
-                    printf("Unable to init xen_shm_receiver\n");
-                    perror("xen_shm_pipe_connect");
-                    xen_shm_pipe_free(c_new->child_data.send_fd);
-                    goto free_data;
+                if (c_new->child_data.mux == NULL) {
+                    c_new->child_data.receive_fd = o_new->receive_fd;
                 }
-                c_new->child_data.receive_fd = o_new->receive_fd;
                 c_new->child_data.private_data = data->private_data;
                 c_new->child_data.stop = 0;
+                if (data->on_event != NULL) { //No thread, the event loop runs the handler
+                    ret = watch_connection(data, &c_new->child_data);
+                    if (ret != 0) {
+                        printf("Calloc error !\n");
+                        xen_shm_pipe_free(c_new->child_data.receive_fd);
+                        xen_shm_pipe_free(c_new->child_data.send_fd);
+                    }
+                    free_opening(data, o_new); //The connection owns the pipes
+                    free(c_new);
+                    return;
+                }
                 ret = pthread_create(&c_new->child, /* Default attr */ NULL, (void * (*)(void *))data->initializer, &c_new->child_data);
                 if (ret != 0) {
                     printf("Unable to run child\n");
                     perror("pthead");
-                    xen_shm_pipe_free(c_new->child_data.receive_fd);
-                    xen_shm_pipe_free(c_new->child_data.send_fd);
+                    if (c_new->child_data.mux != NULL) {
+                        xen_shm_mux_free(c_new->child_data.mux);
+                    } else {
+                        xen_shm_pipe_free(c_new->child_data.receive_fd);
+                        xen_shm_pipe_free(c_new->child_data.send_fd);
+                    }
                     free_opening(data, o_new);
                     free(c_new);
                     return;
@@ -247,6 +399,9 @@ free_data:
     free(c_new);
 
 free_o_new:
+    if (o_new->send_fd != NULL) {
+        xen_shm_pipe_free(o_new->send_fd);
+    }
     xen_shm_pipe_free(o_new->receive_fd);
     free_opening(data, o_new);
 
@@ -264,8 +419,9 @@ send:
 
 
 
-int
-run_server(int port, uint8_t proposed_page_page_count, handler_run initializer, void *private_data)
+static int
+start_server(int port, uint8_t proposed_page_page_count, uint32_t stream_count, uint32_t window,
+        handler_run initializer, handler_event on_event, void *private_data)
 {
     struct internal_data *data;
     struct ev_io *event;
@@ -298,7 +454,11 @@ run_server(int port, uint8_t proposed_page_page_count, handler_run initializer,
     }
     data->private_data = private_data;
     data->initializer = initializer;
+    data->on_event = on_event;
+    data->events = NULL;
     data->proposed_page_page_count = proposed_page_page_count;
+    data->stream_count = stream_count;
+    data->window = window;
     data->childs = NULL;
     data->current = NULL;
 
@@ -334,6 +494,9 @@ run_server(int port, uint8_t proposed_page_page_count, handler_run initializer,
     /* Close the currently half-opened connections */
     o_it = data->current;
     while (o_it != NULL) {
+        if (o_it->send_fd != NULL) {
+            xen_shm_pipe_free(o_it->send_fd);
+        }
         if (o_it->receive_fd != NULL) {
             xen_shm_pipe_free(o_it->receive_fd);
         }
@@ -342,6 +505,12 @@ run_server(int port, uint8_t proposed_page_page_count, handler_run initializer,
         o_it = o_next;
     }
 
+    /* Close the connections of the event loop */
+    while (data->events != NULL) {
+        ev_io_stop(event_loop, &data->events->watcher);
+        free_connection(data, data->events);
+    }
+
     /* Ask childs to die */
     c_it = data->childs;
     while (c_it != NULL) {
@@ -374,3 +543,25 @@ free_data:
 
     return 0;
 }
+
+int
+run_server(int port, uint8_t proposed_page_page_count, handler_run initializer, void *private_data)
+{
+    return start_server(port, proposed_page_page_count, 0, 0, initializer, NULL, private_data);
+}
+
+int
+run_event_server(int port, uint8_t proposed_page_page_count, handler_event on_event, void *private_data)
+{
+    return start_server(port, proposed_page_page_count, 0, 0, NULL, on_event, private_data);
+}
+
+int
+run_mux_server(int port, uint8_t proposed_page_page_count, uint32_t stream_count, uint32_t window, handler_run initializer, void *private_data)
+{
+    if (stream_count == 0) {
+        printf("A multiplexer needs streams\n");
+        return -1;
+    }
+    return start_server(port, proposed_page_page_count, stream_count, window, initializer, NULL, private_data);
+}
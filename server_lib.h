@@ -12,6 +12,12 @@
 
 int run_server(int port, uint8_t proposed_page_page_count, handler_run initializer, void *private_data);
 
+//No thread per connection: the handler is called by the event loop, through a watcher on the fd of the receive pipe
+int run_event_server(int port, uint8_t proposed_page_page_count, handler_event on_event, void *private_data);
+
+//Each client gets a single duplex grant whose connections are the streams of a multiplexer (see xen_shm_mux.h), given to the handler in data->mux
+int run_mux_server(int port, uint8_t proposed_page_page_count, uint32_t stream_count, uint32_t window, handler_run initializer, void *private_data);
+
 #endif /* __XEN_SHM_SERVER_LIB_H__ */
 
 
@@ -141,7 +141,7 @@ int client(int argc, char **argv) {
 
         datas[i].private_data = &(trs[i]);
 
-        retval = run_client_thread(port, &addr, page_count, xen_shm_handler_sender,  &(datas[i]), &(thread_infos[i]));
+        retval = run_client_thread(port, &addr, page_count, 0, xen_shm_handler_sender,  &(datas[i]), &(thread_infos[i]));
 
         if(retval != 0) {
             perror("run client thread");
@@ -0,0 +1,148 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <inttypes.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "../xen_shm_pipe_copy.h"
+
+/*
+ * Measures the bandwidth of every copy kernel the CPU supports,
+ * for all the 64 (source, destination) alignment offsets (modulo 8).
+ */
+
+#define ALIGN_OFFSETS 8
+#define BUFFER_ALIGN 64
+
+static uint32_t message_size;
+static uint32_t iterations;
+
+
+void usage(void);
+int check_kernel(xen_shm_pipe_copy_fn copy, uint8_t* src, uint8_t* dst);
+double measure(xen_shm_pipe_copy_fn copy, uint8_t* src, uint8_t* dst);
+
+
+void
+usage(void)
+{
+    printf("Usage: copy_perf <message_size> <iterations>\n");
+    exit(-1);
+}
+
+/* Returns 0 if the kernel gives the right result for every alignment and size up to message_size */
+int
+check_kernel(xen_shm_pipe_copy_fn copy, uint8_t* src, uint8_t* dst) {
+    uint32_t len;
+    uint32_t src_off;
+    uint32_t dst_off;
+
+    for(src_off = 0; src_off < BUFFER_ALIGN; src_off++) {
+        for(dst_off = 0; dst_off < BUFFER_ALIGN; dst_off+=7) {
+            for(len = 0; len <= message_size && len < 1024; len++) {
+                memset(dst, 0, message_size + 2*BUFFER_ALIGN);
+                copy(dst + dst_off, src + src_off, len);
+                if(memcmp(dst + dst_off, src + src_off, len)
+                        || (dst_off && dst[dst_off - 1] != 0)
+                        || dst[dst_off + len] != 0) {
+                    printf("Error: src_off=%"PRIu32" dst_off=%"PRIu32" len=%"PRIu32"\n", src_off, dst_off, len);
+                    return -1;
+                }
+            }
+        }
+    }
+
+    return 0;
+}
+
+/* Returns the bandwidth in MBps */
+double
+measure(xen_shm_pipe_copy_fn copy, uint8_t* src, uint8_t* dst) {
+    struct timeval start;
+    struct timeval stop;
+    uint64_t usec_interval;
+    uint32_t i;
+
+    gettimeofday(&start , NULL);
+    for(i=0; i<iterations; i++) {
+        copy(dst, src, message_size);
+    }
+    gettimeofday(&stop , NULL);
+
+    usec_interval = (uint64_t) ((stop.tv_sec*1000000 + stop.tv_usec) - (start.tv_sec*1000000 + start.tv_usec));
+    if(usec_interval == 0) {
+        usec_interval = 1;
+    }
+
+    return ((double) message_size)*((double) iterations)/((double) usec_interval);
+}
+
+
+int main(int argc, char **argv) {
+    uint8_t* src;
+    uint8_t* dst;
+    uint32_t i;
+    uint32_t src_off;
+    uint32_t dst_off;
+    int kernel;
+    xen_shm_pipe_copy_fn copy;
+
+    if(argc < 3) {
+        usage();
+    }
+
+    if(sscanf(argv[1], "%"SCNu32, &message_size) != 1) {
+        printf("Invalid size\n");
+        usage();
+    }
+
+    if(sscanf(argv[2], "%"SCNu32, &iterations) != 1) {
+        printf("Invalid iterations\n");
+        usage();
+    }
+
+    if(posix_memalign((void**) &src, BUFFER_ALIGN, message_size + 2*BUFFER_ALIGN)
+            || posix_memalign((void**) &dst, BUFFER_ALIGN, message_size + 2*BUFFER_ALIGN)) {
+        printf("Memory error\n");
+        return -1;
+    }
+
+    for(i = 0; i < message_size + 2*BUFFER_ALIGN; i++) {
+        src[i] = (uint8_t) (i*7 + 1);
+    }
+
+    printf("Best kernel: %s\n", xen_shm_pipe_copy_name(xen_shm_pipe_copy_best()));
+
+    for(kernel = 0; kernel < xen_shm_pipe_copy_kernel_count; kernel++) {
+        copy = xen_shm_pipe_copy_get((enum xen_shm_pipe_copy_kernel) kernel);
+        printf("\nKernel %s: ", xen_shm_pipe_copy_name((enum xen_shm_pipe_copy_kernel) kernel));
+        if(copy == NULL) {
+            printf("not supported\n");
+            continue;
+        }
+
+        if(check_kernel(copy, src, dst)) {
+            return -1;
+        }
+        printf("MBps (rows: source offset, columns: destination offset)\n");
+
+        printf("    ");
+        for(dst_off = 0; dst_off < ALIGN_OFFSETS; dst_off++) {
+            printf(" %8"PRIu32, dst_off);
+        }
+        printf("\n");
+
+        for(src_off = 0; src_off < ALIGN_OFFSETS; src_off++) {
+            printf("%4"PRIu32, src_off);
+            for(dst_off = 0; dst_off < ALIGN_OFFSETS; dst_off++) {
+                printf(" %8.0f", measure(copy, src + src_off, dst + dst_off));
+            }
+            printf("\n");
+        }
+    }
+
+    free(src);
+    free(dst);
+
+    return 0;
+}
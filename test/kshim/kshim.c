@@ -0,0 +1,1133 @@
+/*
+ * Kernel shim for the module test
+ *
+ * Authors: Vincent Brillault <git@lerya.net>
+ *          Pierre Pfister    <oryon@darou.fr>
+ *
+ * Implementation of the interfaces declared in kshim.h, and of the
+ * device as the userspace sees it (open, ioctl, mmap, poll, close on
+ * XEN_SHM_DEVICE_PATH), through the linker's --wrap option.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "kshim.h"
+
+#define XEN_SHM_DEVICE_PATH "/dev/xen_shm"
+
+#define KSHIM_ARENA_PAGES 16384 //Pages the "kernel" can allocate
+#define KSHIM_GRANTS 4096
+#define KSHIM_FIRST_GRANT 8
+#define KSHIM_PORTS 1024
+#define KSHIM_IRQ_BASE 100
+#define KSHIM_FILES 1024
+#define KSHIM_FREE_BLOCKS 4096
+#define KSHIM_POLL_SLICE_NS 10000000ull //Poll: real descriptors are looked at that often
+
+
+/* The wrapped C library calls */
+int __real_open(const char* path, int flags, ...);
+int __real_close(int fd);
+int __real_ioctl(int fd, unsigned long request, ...);
+void* __real_mmap(void* addr, size_t len, int prot, int flags, int fd, off_t offset);
+int __real_munmap(void* addr, size_t len);
+int __real_poll(struct pollfd* fds, nfds_t nfds, int timeout);
+
+int __wrap_open(const char* path, int flags, ...);
+int __wrap_close(int fd);
+int __wrap_ioctl(int fd, unsigned long request, ...);
+void* __wrap_mmap(void* addr, size_t len, int prot, int flags, int fd, off_t offset);
+int __wrap_munmap(void* addr, size_t len);
+int __wrap_poll(struct pollfd* fds, nfds_t nfds, int timeout);
+
+
+/*
+ * State
+ */
+struct mm_struct {
+    int unused;
+};
+
+struct kshim_grant {
+    int used;
+    domid_t domid;
+    unsigned long frame;
+    int map_count;
+};
+
+struct kshim_port {
+    int state; //EVTCHNSTAT_*
+    domid_t remote_dom;
+    evtchn_port_t peer;
+    irq_handler_t handler;
+    void* dev_id;
+};
+
+struct kshim_free_block {
+    unsigned long pfn;
+    unsigned int order;
+};
+
+struct kshim_mapping {
+    struct vm_area_struct vma;
+    struct kshim_mapping* next;
+};
+
+static pthread_mutex_t kshim_lock = PTHREAD_MUTEX_INITIALIZER; //The big lock of the "kernel"
+static pthread_cond_t kshim_poll_cond; //Broadcast by each wake up, for the polls
+static pthread_once_t kshim_once = PTHREAD_ONCE_INIT;
+
+static int kshim_memfd = -1;
+static int kshim_memfd_ro = -1; //Read only descriptor of the same memory, for the mappings that can't become writable
+static uint8_t* kshim_arena;
+static unsigned long kshim_next_pfn = 1; //Frame 0 is never given
+static struct kshim_free_block kshim_free[KSHIM_FREE_BLOCKS];
+static int kshim_free_count;
+
+static struct kshim_grant kshim_grants[KSHIM_GRANTS];
+static struct kshim_port kshim_ports[KSHIM_PORTS];
+static struct file* kshim_files[KSHIM_FILES];
+static struct kshim_mapping* kshim_mappings;
+static const struct file_operations* kshim_fops;
+
+static struct task_struct kshim_task = { .timer_slack_ns = 50000 }; //The kernel's default slack
+static struct mm_struct kshim_mm;
+struct task_struct* kshim_current = &kshim_task;
+
+static int kshim_verbose;
+static u64 kshim_delivered;
+static u64 kshim_woken;
+
+/* The wait of the last prepare_to_wait of the thread, for schedule_hrtimeout_range */
+static __thread wait_queue_head_t* kshim_wait_queue;
+static __thread wait_queue_t* kshim_wait_entry;
+
+
+static void
+kshim_die(const char* what)
+{
+    perror(what);
+    abort();
+}
+
+static void
+kshim_setup(void)
+{
+    pthread_condattr_t attr;
+    char path[64];
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&kshim_poll_cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    kshim_memfd = (int) syscall(SYS_memfd_create, "kshim", 0);
+    if(kshim_memfd < 0 || ftruncate(kshim_memfd, (off_t) (KSHIM_ARENA_PAGES*PAGE_SIZE)) != 0) {
+        kshim_die("kshim: memory file");
+    }
+    snprintf(path, sizeof(path), "/proc/self/fd/%i", kshim_memfd);
+    kshim_memfd_ro = __real_open(path, O_RDONLY);
+    if(kshim_memfd_ro < 0) {
+        kshim_die("kshim: read only memory file");
+    }
+    kshim_arena = __real_mmap(NULL, KSHIM_ARENA_PAGES*PAGE_SIZE, PROT_READ|PROT_WRITE, MAP_SHARED, kshim_memfd, 0);
+    if(kshim_arena == MAP_FAILED) {
+        kshim_die("kshim: arena");
+    }
+}
+
+static void
+kshim_init(void)
+{
+    pthread_once(&kshim_once, kshim_setup);
+}
+
+void
+kshim_set_verbose(int verbose)
+{
+    kshim_verbose = verbose;
+}
+
+u64
+kshim_signals_delivered(void)
+{
+    return __atomic_load_n(&kshim_delivered, __ATOMIC_RELAXED);
+}
+
+u64
+kshim_wakeups(void)
+{
+    return __atomic_load_n(&kshim_woken, __ATOMIC_RELAXED);
+}
+
+int
+printk(const char* fmt, ...)
+{
+    va_list ap;
+    int ret;
+
+    if(!kshim_verbose) {
+        return 0;
+    }
+    va_start(ap, fmt);
+    ret = vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    return ret;
+}
+
+
+/*
+ * Time
+ */
+u64
+kshim_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((u64) ts.tv_sec)*1000000000ull + (u64) ts.tv_nsec;
+}
+
+ktime_t
+ktime_get(void)
+{
+    return ns_to_ktime(kshim_now_ns());
+}
+
+
+/*
+ * Memory
+ */
+void*
+kmalloc(size_t size, gfp_t flags)
+{
+    return malloc(size);
+}
+
+void
+kfree(const void* p)
+{
+    free((void*) (uintptr_t) p);
+}
+
+unsigned long
+__get_free_pages(gfp_t flags, unsigned int order)
+{
+    unsigned long pfn;
+    int i;
+
+    kshim_init();
+    for(i = 0; i < kshim_free_count; i++) {
+        if(kshim_free[i].order == order) {
+            pfn = kshim_free[i].pfn;
+            kshim_free[i] = kshim_free[--kshim_free_count];
+            return (unsigned long) (uintptr_t) (kshim_arena + (pfn << PAGE_SHIFT));
+        }
+    }
+
+    if(kshim_next_pfn + (1ul << order) > KSHIM_ARENA_PAGES) {
+        return 0;
+    }
+    pfn = kshim_next_pfn;
+    kshim_next_pfn += 1ul << order;
+    return (unsigned long) (uintptr_t) (kshim_arena + (pfn << PAGE_SHIFT));
+}
+
+void
+free_pages(unsigned long addr, unsigned int order)
+{
+    if(addr == 0 || kshim_free_count == KSHIM_FREE_BLOCKS) { //Leaked when too many are free
+        return;
+    }
+    kshim_free[kshim_free_count].pfn = kshim_virt_to_pfn(addr);
+    kshim_free[kshim_free_count].order = order;
+    kshim_free_count++;
+}
+
+unsigned long
+get_zeroed_page(gfp_t flags)
+{
+    unsigned long addr;
+
+    addr = __get_free_pages(flags, 0);
+    if(addr != 0) {
+        memset((void*) addr, 0, PAGE_SIZE);
+    }
+    return addr;
+}
+
+unsigned long
+kshim_virt_to_pfn(unsigned long addr)
+{
+    if(addr < (unsigned long) kshim_arena || addr >= (unsigned long) kshim_arena + KSHIM_ARENA_PAGES*PAGE_SIZE) {
+        fprintf(stderr, "kshim: %#lx is not a kernel page\n", addr);
+        abort();
+    }
+    return (addr - (unsigned long) kshim_arena) >> PAGE_SHIFT;
+}
+
+void*
+kshim_pfn_to_kaddr(unsigned long pfn)
+{
+    return kshim_arena + (pfn << PAGE_SHIFT);
+}
+
+pte_t*
+lookup_address(unsigned long address, unsigned int* level)
+{
+    static pte_t pte;
+
+    return &pte;
+}
+
+xmaddr_t
+arbitrary_virt_to_machine(void* vaddr)
+{
+    xmaddr_t m;
+
+    m.maddr = (phys_addr_t) (uintptr_t) vaddr;
+    return m;
+}
+
+struct vm_struct*
+alloc_vm_area(size_t size, pte_t** ptes)
+{
+    struct vm_struct* area;
+
+    area = malloc(sizeof(struct vm_struct));
+    if(area == NULL) {
+        return NULL;
+    }
+    area->size = size;
+    area->addr = __real_mmap(NULL, size, PROT_NONE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if(area->addr == MAP_FAILED) {
+        free(area);
+        return NULL;
+    }
+    return area;
+}
+
+void
+free_vm_area(struct vm_struct* area)
+{
+    __real_munmap(area->addr, area->size);
+    free(area);
+}
+
+/* Maps frames of the arena at a fixed address */
+static int
+kshim_map_frames(unsigned long addr, unsigned long pfn, unsigned long size, unsigned long vm_flags)
+{
+    void* mapped;
+    int prot;
+
+    prot = PROT_READ | ((vm_flags & VM_WRITE)?PROT_WRITE:0);
+    mapped = __real_mmap((void*) addr, size, prot, MAP_SHARED|MAP_FIXED,
+                         (vm_flags & VM_MAYWRITE)?kshim_memfd:kshim_memfd_ro, (off_t) (pfn << PAGE_SHIFT));
+    return (mapped == MAP_FAILED)?-EAGAIN:0;
+}
+
+int
+remap_pfn_range(struct vm_area_struct* vma, unsigned long addr, unsigned long pfn, unsigned long size, pgprot_t prot)
+{
+    if(addr < vma->vm_start || addr + size > vma->vm_end || pfn + (size >> PAGE_SHIFT) > KSHIM_ARENA_PAGES) {
+        return -EINVAL;
+    }
+    return kshim_map_frames(addr, pfn, size, vma->vm_flags);
+}
+
+int
+vm_insert_page(struct vm_area_struct* vma, unsigned long addr, struct page* page)
+{
+    if(addr < vma->vm_start || addr + PAGE_SIZE > vma->vm_end) {
+        return -EFAULT;
+    }
+    return kshim_map_frames(addr, (page->alias != 0)?page->alias:page->pfn, PAGE_SIZE, vma->vm_flags);
+}
+
+int
+apply_to_page_range(struct mm_struct* mm, unsigned long address, unsigned long size, pte_fn_t fn, void* data)
+{
+    pte_t pte;
+    unsigned long addr;
+    int err;
+
+    for(addr = address; addr < address + size; addr += PAGE_SIZE) {
+        pte.pte = 0;
+        err = fn(&pte, NULL, addr, data);
+        if(err != 0) {
+            return err;
+        }
+    }
+    return 0;
+}
+
+
+/*
+ * Tasks and mmu notifiers
+ */
+struct mm_struct*
+get_task_mm(struct task_struct* task)
+{
+    return &kshim_mm;
+}
+
+void
+mmput(struct mm_struct* mm)
+{
+}
+
+int
+mmu_notifier_register(struct mmu_notifier* mn, struct mm_struct* mm)
+{
+    return 0;
+}
+
+void
+mmu_notifier_unregister(struct mmu_notifier* mn, struct mm_struct* mm)
+{
+}
+
+
+/*
+ * Wait queues. Always called with the big lock held.
+ */
+void
+init_waitqueue_head(wait_queue_head_t* wq)
+{
+    wq->head = NULL;
+}
+
+void
+wake_up_interruptible(wait_queue_head_t* wq)
+{
+    struct kshim_waiter* w;
+    int exclusive_done;
+
+    exclusive_done = 0;
+    for(w = wq->head; w != NULL; w = w->next) {
+        if(w->exclusive) {
+            if(exclusive_done || w->woken) {
+                continue;
+            }
+            exclusive_done = 1;
+        }
+        w->woken = 1;
+        pthread_cond_signal(&w->cond);
+    }
+    pthread_cond_broadcast(&kshim_poll_cond);
+}
+
+void
+wake_up_interruptible_all(wait_queue_head_t* wq)
+{
+    struct kshim_waiter* w;
+
+    for(w = wq->head; w != NULL; w = w->next) {
+        w->woken = 1;
+        pthread_cond_signal(&w->cond);
+    }
+    pthread_cond_broadcast(&kshim_poll_cond);
+}
+
+void
+kshim_wait_add(wait_queue_head_t* wq, struct kshim_waiter* w, int exclusive)
+{
+    struct kshim_waiter** tail;
+    pthread_condattr_t attr;
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&w->cond, &attr);
+    pthread_condattr_destroy(&attr);
+    w->exclusive = exclusive;
+    w->woken = 0;
+    w->queued = 1;
+    w->next = NULL;
+
+    for(tail = &wq->head; *tail != NULL; tail = &(*tail)->next);
+    *tail = w;
+}
+
+void
+kshim_wait_del(wait_queue_head_t* wq, struct kshim_waiter* w)
+{
+    struct kshim_waiter** it;
+
+    for(it = &wq->head; *it != NULL; it = &(*it)->next) {
+        if(*it == w) {
+            *it = w->next;
+            break;
+        }
+    }
+    w->queued = 0;
+    pthread_cond_destroy(&w->cond);
+}
+
+/*
+ * Sleeps until woken up or the deadline. Returns 1 if the deadline is reached.
+ * A woken exclusive waiter goes back to the end of the queue, as the kernel dequeues it.
+ */
+int
+kshim_wait_sleep(wait_queue_head_t* wq, struct kshim_waiter* w, u64 deadline)
+{
+    struct timespec ts;
+    int expired;
+
+    if(deadline == 0) {
+        while(!w->woken) {
+            pthread_cond_wait(&w->cond, &kshim_lock);
+        }
+        expired = 0;
+    } else {
+        ts.tv_sec = (time_t) (deadline/1000000000ull);
+        ts.tv_nsec = (long) (deadline%1000000000ull);
+        while(!w->woken && kshim_now_ns() < deadline) {
+            pthread_cond_timedwait(&w->cond, &kshim_lock, &ts);
+        }
+        expired = !w->woken;
+    }
+    __atomic_add_fetch(&kshim_woken, 1, __ATOMIC_RELAXED);
+
+    if(w->exclusive && w->woken) {
+        kshim_wait_del(wq, w);
+        kshim_wait_add(wq, w, 1);
+    }
+    w->woken = 0;
+    return expired;
+}
+
+
+static void
+kshim_prepare_wait(wait_queue_head_t* wq, wait_queue_t* wait, int exclusive)
+{
+    if(!wait->queued) {
+        kshim_wait_add(wq, wait, exclusive);
+    }
+    wait->woken = 0; //Sleeping again: the wake ups that came before are for the condition to see
+    kshim_wait_queue = wq;
+    kshim_wait_entry = wait;
+}
+
+void
+prepare_to_wait(wait_queue_head_t* wq, wait_queue_t* wait, int state)
+{
+    kshim_prepare_wait(wq, wait, 0);
+}
+
+void
+prepare_to_wait_exclusive(wait_queue_head_t* wq, wait_queue_t* wait, int state)
+{
+    kshim_prepare_wait(wq, wait, 1);
+}
+
+void
+finish_wait(wait_queue_head_t* wq, wait_queue_t* wait)
+{
+    if(wait->queued) {
+        kshim_wait_del(wq, wait);
+    }
+    kshim_wait_queue = NULL;
+    kshim_wait_entry = NULL;
+}
+
+/*
+ * The timer fires at expires, the slack is not used
+ */
+int
+schedule_hrtimeout_range(ktime_t* expires, unsigned long delta, const enum hrtimer_mode mode)
+{
+    u64 deadline;
+
+    if(kshim_wait_entry == NULL) {
+        kshim_die("kshim: schedule_hrtimeout_range without prepare_to_wait");
+    }
+
+    deadline = (u64) ktime_to_ns(*expires);
+    if(mode == HRTIMER_MODE_REL) {
+        deadline += kshim_now_ns();
+    }
+    if(!kshim_wait_entry->woken && kshim_now_ns() >= deadline) {
+        return 0;
+    }
+    return kshim_wait_sleep(kshim_wait_queue, kshim_wait_entry, deadline)?0:-EINTR;
+}
+
+/*
+ * Devices
+ */
+void
+cdev_init(struct cdev* cdev, const struct file_operations* fops)
+{
+    cdev->ops = fops;
+}
+
+int
+cdev_add(struct cdev* cdev, dev_t dev, unsigned int count)
+{
+    kshim_fops = cdev->ops;
+    return 0;
+}
+
+void
+cdev_del(struct cdev* cdev)
+{
+    kshim_fops = NULL;
+}
+
+int
+register_chrdev_region(dev_t from, unsigned count, const char* name)
+{
+    return 0;
+}
+
+int
+alloc_chrdev_region(dev_t* dev, unsigned baseminor, unsigned count, const char* name)
+{
+    *dev = MKDEV(250u, baseminor);
+    return 0;
+}
+
+void
+unregister_chrdev_region(dev_t from, unsigned count)
+{
+}
+
+
+/*
+ * Event channels. Signals are delivered at once to the handler bound to the other end.
+ */
+static int
+kshim_port_valid(evtchn_port_t port)
+{
+    return port > 0 && port < KSHIM_PORTS && kshim_ports[port].state != EVTCHNSTAT_closed;
+}
+
+static evtchn_port_t
+kshim_port_alloc(void)
+{
+    evtchn_port_t port;
+
+    for(port = 1; port < KSHIM_PORTS; port++) {
+        if(kshim_ports[port].state == EVTCHNSTAT_closed) {
+            memset(&kshim_ports[port], 0, sizeof(struct kshim_port));
+            return port;
+        }
+    }
+    return 0;
+}
+
+static void
+kshim_port_close(evtchn_port_t port)
+{
+    struct kshim_port* p;
+
+    p = &kshim_ports[port];
+    if(p->state == EVTCHNSTAT_interdomain) { //The other end goes back to unbound
+        kshim_ports[p->peer].state = EVTCHNSTAT_unbound;
+        kshim_ports[p->peer].peer = 0;
+    }
+    memset(p, 0, sizeof(struct kshim_port));
+}
+
+int
+HYPERVISOR_event_channel_op(int cmd, void* arg)
+{
+    struct evtchn_alloc_unbound* alloc_unbound;
+    struct evtchn_bind_interdomain* bind;
+    struct evtchn_close* close_op;
+    struct evtchn_status* status;
+    evtchn_port_t port;
+
+    switch(cmd) {
+        case EVTCHNOP_alloc_unbound:
+            alloc_unbound = arg;
+            port = kshim_port_alloc();
+            if(port == 0) {
+                return -ENOSPC;
+            }
+            kshim_ports[port].state = EVTCHNSTAT_unbound;
+            kshim_ports[port].remote_dom = (alloc_unbound->remote_dom == DOMID_SELF)?KSHIM_DOMID:alloc_unbound->remote_dom;
+            alloc_unbound->port = port;
+            return 0;
+        case EVTCHNOP_bind_interdomain:
+            bind = arg;
+            if(!kshim_port_valid(bind->remote_port) || kshim_ports[bind->remote_port].state != EVTCHNSTAT_unbound) {
+                return -EINVAL;
+            }
+            port = kshim_port_alloc();
+            if(port == 0) {
+                return -ENOSPC;
+            }
+            kshim_ports[port].state = EVTCHNSTAT_interdomain;
+            kshim_ports[port].peer = bind->remote_port;
+            kshim_ports[bind->remote_port].state = EVTCHNSTAT_interdomain;
+            kshim_ports[bind->remote_port].peer = port;
+            bind->local_port = port;
+            return 0;
+        case EVTCHNOP_close:
+            close_op = arg;
+            if(!kshim_port_valid(close_op->port)) {
+                return -EINVAL;
+            }
+            kshim_port_close(close_op->port);
+            return 0;
+        case EVTCHNOP_status:
+            status = arg;
+            if(!kshim_port_valid(status->port)) {
+                status->status = EVTCHNSTAT_closed;
+                return 0;
+            }
+            status->status = (uint32_t) kshim_ports[status->port].state;
+            status->u.unbound.dom = kshim_ports[status->port].remote_dom;
+            return 0;
+        default:
+            return -ENOSYS;
+    }
+}
+
+int
+bind_evtchn_to_irqhandler(unsigned int evtchn, irq_handler_t handler, unsigned long irqflags, const char* devname, void* dev_id)
+{
+    if(!kshim_port_valid(evtchn)) {
+        return -EINVAL;
+    }
+    kshim_ports[evtchn].handler = handler;
+    kshim_ports[evtchn].dev_id = dev_id;
+    return (int) evtchn + KSHIM_IRQ_BASE;
+}
+
+void
+unbind_from_irqhandler(unsigned int irq, void* dev_id)
+{
+    evtchn_port_t port;
+
+    port = irq - KSHIM_IRQ_BASE;
+    if(kshim_port_valid(port) && kshim_ports[port].dev_id == dev_id) {
+        kshim_port_close(port);
+    }
+}
+
+void
+notify_remote_via_evtchn(int port)
+{
+    struct kshim_port* p;
+    struct kshim_port* peer;
+
+    if(!kshim_port_valid((evtchn_port_t) port)) {
+        return;
+    }
+    p = &kshim_ports[port];
+    if(p->state != EVTCHNSTAT_interdomain) {
+        return;
+    }
+    peer = &kshim_ports[p->peer];
+    if(peer->handler != NULL) {
+        __atomic_add_fetch(&kshim_delivered, 1, __ATOMIC_RELAXED);
+        peer->handler((int) p->peer + KSHIM_IRQ_BASE, peer->dev_id);
+    }
+}
+
+
+/*
+ * Grant tables
+ */
+int
+gnttab_grant_foreign_access(domid_t domid, unsigned long frame, int readonly)
+{
+    int ref;
+
+    for(ref = KSHIM_FIRST_GRANT; ref < KSHIM_GRANTS; ref++) {
+        if(!kshim_grants[ref].used) {
+            kshim_grants[ref].used = 1;
+            kshim_grants[ref].domid = domid;
+            kshim_grants[ref].frame = frame;
+            kshim_grants[ref].map_count = 0;
+            return ref;
+        }
+    }
+    return -ENOSPC;
+}
+
+int
+gnttab_end_foreign_access_ref(grant_ref_t ref, int readonly)
+{
+    if(ref >= KSHIM_GRANTS || !kshim_grants[ref].used || kshim_grants[ref].map_count != 0) { //Still mapped
+        return 0;
+    }
+    kshim_grants[ref].used = 0;
+    return 1;
+}
+
+static struct kshim_grant*
+kshim_grant_get(grant_ref_t ref)
+{
+    if(ref < KSHIM_FIRST_GRANT || ref >= KSHIM_GRANTS || !kshim_grants[ref].used) {
+        return NULL;
+    }
+    return &kshim_grants[ref];
+}
+
+int
+HYPERVISOR_grant_table_op(unsigned int cmd, void* uop, unsigned int count)
+{
+    struct gnttab_map_grant_ref* map;
+    struct gnttab_unmap_grant_ref* unmap;
+    struct kshim_grant* grant;
+    unsigned int i;
+
+    for(i = 0; i < count; i++) {
+        switch(cmd) {
+            case GNTTABOP_map_grant_ref:
+                map = (struct gnttab_map_grant_ref*) uop + i;
+                grant = kshim_grant_get(map->ref);
+                if(grant == NULL || kshim_map_frames((unsigned long) map->host_addr, grant->frame, PAGE_SIZE, VM_WRITE|VM_MAYWRITE) != 0) {
+                    map->status = -1;
+                    continue;
+                }
+                grant->map_count++;
+                map->handle = map->ref;
+                map->status = 0;
+                break;
+            case GNTTABOP_unmap_grant_ref:
+                unmap = (struct gnttab_unmap_grant_ref*) uop + i;
+                grant = kshim_grant_get(unmap->handle);
+                if(grant == NULL || grant->map_count == 0) {
+                    unmap->status = -1;
+                    continue;
+                }
+                grant->map_count--;
+                __real_mmap((void*) (uintptr_t) unmap->host_addr, PAGE_SIZE, PROT_NONE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_FIXED, -1, 0);
+                unmap->status = 0;
+                break;
+            default:
+                return -ENOSYS;
+        }
+    }
+    return 0;
+}
+
+int
+gnttab_map_refs(struct gnttab_map_grant_ref* map_ops, struct gnttab_map_grant_ref* kmap_ops, struct page** pages, unsigned int count)
+{
+    struct kshim_grant* grant;
+    unsigned int i;
+
+    for(i = 0; i < count; i++) {
+        grant = kshim_grant_get(map_ops[i].ref);
+        if(grant == NULL) {
+            map_ops[i].status = -1;
+            continue;
+        }
+        grant->map_count++;
+        pages[i]->alias = grant->frame;
+        map_ops[i].handle = map_ops[i].ref;
+        map_ops[i].status = 0;
+    }
+    return 0;
+}
+
+static int
+kshim_unmap_refs(struct gnttab_unmap_grant_ref* unmap_ops, struct page** pages, unsigned int count)
+{
+    struct kshim_grant* grant;
+    unsigned int i;
+
+    for(i = 0; i < count; i++) {
+        grant = kshim_grant_get(unmap_ops[i].handle);
+        if(grant == NULL || grant->map_count == 0 || pages[i]->alias != grant->frame) {
+            unmap_ops[i].status = -1;
+            continue;
+        }
+        grant->map_count--;
+        pages[i]->alias = 0;
+        unmap_ops[i].status = 0;
+    }
+    return 0;
+}
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3, 3, 0)
+int
+gnttab_unmap_refs(struct gnttab_unmap_grant_ref* unmap_ops, struct page** pages, unsigned int count)
+{
+    return kshim_unmap_refs(unmap_ops, pages, count);
+}
+#elif LINUX_VERSION_CODE < KERNEL_VERSION(3, 5, 0)
+int
+gnttab_unmap_refs(struct gnttab_unmap_grant_ref* unmap_ops, struct page** pages, unsigned int count, bool clear_pte)
+{
+    return kshim_unmap_refs(unmap_ops, pages, count);
+}
+#else
+int
+gnttab_unmap_refs(struct gnttab_unmap_grant_ref* unmap_ops, struct gnttab_map_grant_ref* kunmap_ops, struct page** pages, unsigned int count)
+{
+    return kshim_unmap_refs(unmap_ops, pages, count);
+}
+#endif
+
+
+/*
+ * Balloon
+ */
+int
+alloc_xenballooned_pages(int nr_pages, struct page** pages, bool highmem)
+{
+    unsigned long addr;
+    int i;
+
+    for(i = 0; i < nr_pages; i++) {
+        pages[i] = malloc(sizeof(struct page));
+        addr = __get_free_pages(GFP_KERNEL, 0);
+        if(pages[i] == NULL || addr == 0) {
+            free(pages[i]);
+            free_xenballooned_pages(i, pages);
+            return -ENOMEM;
+        }
+        pages[i]->pfn = kshim_virt_to_pfn(addr);
+        pages[i]->alias = 0;
+    }
+    return 0;
+}
+
+void
+free_xenballooned_pages(int nr_pages, struct page** pages)
+{
+    int i;
+
+    for(i = 0; i < nr_pages; i++) {
+        free_page((unsigned long) (uintptr_t) (kshim_arena + (pages[i]->pfn << PAGE_SHIFT)));
+        free(pages[i]);
+        pages[i] = NULL;
+    }
+}
+
+
+/*
+ * The device, as the userspace sees it
+ */
+static struct file*
+kshim_file(int fd)
+{
+    if(fd < 0 || fd >= KSHIM_FILES) {
+        return NULL;
+    }
+    return kshim_files[fd];
+}
+
+static int
+kshim_errno(long ret)
+{
+    errno = (ret == -ERESTARTSYS)?EINTR:(int) -ret;
+    return -1;
+}
+
+int
+__wrap_open(const char* path, int flags, ...)
+{
+    struct inode inode;
+    struct file* filp;
+    va_list ap;
+    mode_t mode;
+    int ret;
+    int fd;
+
+    if(strcmp(path, XEN_SHM_DEVICE_PATH) != 0) {
+        va_start(ap, flags);
+        mode = (flags & O_CREAT)?(mode_t) va_arg(ap, int):0;
+        va_end(ap);
+        return __real_open(path, flags, mode);
+    }
+
+    kshim_init();
+    if(kshim_fops == NULL) { //Module not loaded
+        errno = ENOENT;
+        return -1;
+    }
+
+    filp = calloc(1, sizeof(struct file));
+    if(filp == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    pthread_mutex_lock(&kshim_lock);
+    ret = kshim_fops->open(&inode, filp);
+    pthread_mutex_unlock(&kshim_lock);
+    if(ret < 0) {
+        free(filp);
+        return kshim_errno(ret);
+    }
+
+    fd = __real_open("/dev/null", O_RDWR); //Reserves the descriptor number
+    if(fd < 0 || fd >= KSHIM_FILES) {
+        kshim_die("kshim: descriptor");
+    }
+    kshim_files[fd] = filp;
+    return fd;
+}
+
+int
+__wrap_close(int fd)
+{
+    struct inode inode;
+    struct file* filp;
+
+    filp = kshim_file(fd);
+    if(filp != NULL) {
+        pthread_mutex_lock(&kshim_lock);
+        kshim_files[fd] = NULL;
+        kshim_fops->release(&inode, filp);
+        pthread_mutex_unlock(&kshim_lock);
+        free(filp);
+    }
+    return __real_close(fd);
+}
+
+int
+__wrap_ioctl(int fd, unsigned long request, ...)
+{
+    struct file* filp;
+    unsigned long arg;
+    va_list ap;
+    long ret;
+
+    va_start(ap, request);
+    arg = va_arg(ap, unsigned long);
+    va_end(ap);
+
+    filp = kshim_file(fd);
+    if(filp == NULL) {
+        return __real_ioctl(fd, request, arg);
+    }
+
+    pthread_mutex_lock(&kshim_lock);
+    ret = kshim_fops->unlocked_ioctl(filp, (unsigned int) request, arg);
+    pthread_mutex_unlock(&kshim_lock);
+    if(ret < 0) {
+        return kshim_errno(ret);
+    }
+    return (int) ret;
+}
+
+void*
+__wrap_mmap(void* addr, size_t len, int prot, int flags, int fd, off_t offset)
+{
+    struct kshim_mapping* m;
+    struct file* filp;
+    void* area;
+    int ret;
+
+    filp = kshim_file(fd);
+    if(filp == NULL) {
+        return __real_mmap(addr, len, prot, flags, fd, offset);
+    }
+
+    m = calloc(1, sizeof(struct kshim_mapping));
+    if(m == NULL) {
+        errno = ENOMEM;
+        return MAP_FAILED;
+    }
+    area = __real_mmap(addr, len, PROT_NONE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if(area == MAP_FAILED) {
+        free(m);
+        return MAP_FAILED;
+    }
+    m->vma.vm_start = (unsigned long) area;
+    m->vma.vm_end = (unsigned long) area + len;
+    m->vma.vm_pgoff = (unsigned long) offset >> PAGE_SHIFT;
+    m->vma.vm_flags = VM_MAYREAD | VM_MAYWRITE; //Opened read-write
+    m->vma.vm_flags |= (prot & PROT_READ)?VM_READ:0;
+    m->vma.vm_flags |= (prot & PROT_WRITE)?VM_WRITE:0;
+    m->vma.vm_flags |= (flags & MAP_SHARED)?VM_SHARED:0;
+    m->vma.vm_mm = &kshim_mm;
+
+    pthread_mutex_lock(&kshim_lock);
+    ret = kshim_fops->mmap(filp, &m->vma);
+    if(ret == 0) {
+        m->next = kshim_mappings;
+        kshim_mappings = m;
+    }
+    pthread_mutex_unlock(&kshim_lock);
+    if(ret < 0) {
+        __real_munmap(area, len);
+        free(m);
+        kshim_errno(ret);
+        return MAP_FAILED;
+    }
+    return area;
+}
+
+int
+__wrap_munmap(void* addr, size_t len)
+{
+    struct kshim_mapping** it;
+    struct kshim_mapping* m;
+
+    pthread_mutex_lock(&kshim_lock);
+    for(it = &kshim_mappings; *it != NULL; it = &(*it)->next) {
+        if((*it)->vma.vm_start == (unsigned long) addr) {
+            m = *it;
+            *it = m->next;
+            free(m);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&kshim_lock);
+    return __real_munmap(addr, len);
+}
+
+/* Polls the device descriptors through the module, the others through the C library */
+int
+__wrap_poll(struct pollfd* fds, nfds_t nfds, int timeout)
+{
+    struct timespec ts;
+    struct file* filp;
+    u64 deadline;
+    u64 wake;
+    nfds_t i;
+    int others;
+    int ready;
+
+    deadline = (timeout < 0)?0:kshim_now_ns() + (u64) timeout*(u64) 1000000;
+
+    pthread_mutex_lock(&kshim_lock);
+    for(;;) {
+        ready = 0;
+        others = 0;
+        for(i = 0; i < nfds; i++) {
+            filp = kshim_file(fds[i].fd);
+            if(filp != NULL) {
+                fds[i].revents = (short) (kshim_fops->poll(filp, NULL) & ((unsigned int) fds[i].events | POLLERR | POLLHUP));
+            } else {
+                others = 1;
+                fds[i].revents = 0;
+                if(fds[i].fd >= 0 && __real_poll(&fds[i], 1, 0) < 0) {
+                    fds[i].revents = POLLNVAL;
+                }
+            }
+            ready += (fds[i].revents != 0);
+        }
+        if(ready || timeout == 0 || (deadline != 0 && kshim_now_ns() >= deadline)) {
+            break;
+        }
+
+        wake = (others || deadline == 0)?kshim_now_ns() + KSHIM_POLL_SLICE_NS:deadline;
+        if(deadline != 0 && wake > deadline) {
+            wake = deadline;
+        }
+        ts.tv_sec = (time_t) (wake/1000000000ull);
+        ts.tv_nsec = (long) (wake%1000000000ull);
+        pthread_cond_timedwait(&kshim_poll_cond, &kshim_lock, &ts);
+    }
+    pthread_mutex_unlock(&kshim_lock);
+
+    return ready;
+}
@@ -0,0 +1,432 @@
+/*
+ * Kernel shim for the module test
+ *
+ * Authors: Vincent Brillault <git@lerya.net>
+ *          Pierre Pfister    <oryon@darou.fr>
+ *
+ * This file declares the small part of the Linux and Xen kernel
+ * interfaces the xen_shm module uses, so that xen_shm.c can be built
+ * as a userspace object and driven by module_test.
+ *
+ * It models the interfaces of the kernels the module supports
+ * (3.2 to 3.5): the prototypes that changed between those versions
+ * follow LINUX_VERSION_CODE, so that each branch of the module is
+ * compiled against the interface it was written for.
+ * It is not a kernel: it only checks that the module uses these
+ * interfaces consistently, a build against the real headers is still
+ * needed.
+ *
+ * Every kernel entry point (file operations) runs under one big lock,
+ * that the waits release while sleeping. Event channels deliver their
+ * signals synchronously to the handler of the other end. Pages come
+ * from one memory file, so that grants and mmaps share them.
+ *
+ */
+
+#ifndef __KSHIM_H__
+#define __KSHIM_H__
+
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "kshim_test.h"
+
+
+/*
+ * Versions
+ */
+#define KERNEL_VERSION(a, b, c) (((a) << 16) + ((b) << 8) + (c))
+#ifndef KSHIM_LINUX_VERSION_CODE
+# define KSHIM_LINUX_VERSION_CODE KERNEL_VERSION(3, 5, 4)
+#endif
+#define LINUX_VERSION_CODE KSHIM_LINUX_VERSION_CODE
+
+
+/*
+ * Types and helpers
+ */
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef uint64_t u64;
+typedef int64_t s64;
+typedef u64 phys_addr_t;
+typedef unsigned int gfp_t;
+
+#define __user
+#define __init
+#define __exit
+#define likely(x) (x)
+#define unlikely(x) (x)
+
+#define container_of(ptr, type, member) ((type*) ((char*) (ptr) - offsetof(type, member)))
+#define min(x, y) ({ typeof(x) __x = (x); typeof(y) __y = (y); (void) (&__x == &__y); __x < __y ? __x : __y; })
+#define max(x, y) ({ typeof(x) __x = (x); typeof(y) __y = (y); (void) (&__x == &__y); __x > __y ? __x : __y; })
+#define max_t(type, x, y) ({ type __x = (x); type __y = (y); __x > __y ? __x : __y; })
+
+#define ERESTARTSYS 512
+
+#define KERN_DEBUG "<7>"
+#define KERN_INFO "<6>"
+#define KERN_WARNING "<4>"
+int printk(const char* fmt, ...) __attribute__ ((format (printf, 1, 2)));
+
+#define NSEC_PER_MSEC 1000000L
+#define NSEC_PER_SEC 1000000000L
+static inline u64 div_u64(u64 dividend, u32 divisor) { return dividend/divisor; }
+
+
+/*
+ * Time
+ */
+typedef union { s64 tv64; } ktime_t;
+ktime_t ktime_get(void);
+static inline ktime_t ktime_sub(ktime_t a, ktime_t b) { ktime_t r; r.tv64 = a.tv64 - b.tv64; return r; }
+static inline s64 ktime_to_ns(ktime_t k) { return k.tv64; }
+static inline ktime_t ns_to_ktime(u64 ns) { ktime_t r; r.tv64 = (s64) ns; return r; }
+static inline ktime_t ktime_add_ns(ktime_t k, u64 ns) { ktime_t r; r.tv64 = k.tv64 + (s64) ns; return r; }
+
+
+/*
+ * Atomics
+ */
+typedef struct { int counter; } atomic_t;
+#define ATOMIC_INIT(i) { (i) }
+static inline int atomic_dec_and_test(atomic_t* v) { return __atomic_sub_fetch(&v->counter, 1, __ATOMIC_SEQ_CST) == 0; }
+static inline void atomic_inc(atomic_t* v) { __atomic_add_fetch(&v->counter, 1, __ATOMIC_SEQ_CST); }
+
+
+/*
+ * Spinlocks: everything runs under the big lock, including the event handlers
+ */
+typedef struct { int unused; } spinlock_t;
+#define spin_lock_init(lock) ((void) (lock))
+#define spin_lock(lock) ((void) (lock))
+#define spin_unlock(lock) ((void) (lock))
+#define spin_lock_irqsave(lock, flags) ((void) (lock), (flags) = 0)
+#define spin_unlock_irqrestore(lock, flags) ((void) (lock), (void) (flags))
+
+
+/*
+ * Memory
+ */
+#define PAGE_SHIFT 12
+#define PAGE_SIZE (1UL << PAGE_SHIFT)
+#define GFP_KERNEL 0x10u
+
+struct page {
+    unsigned long pfn;   //The frame of the page
+    unsigned long alias; //The granted frame mapped on it, if any
+};
+
+void* kmalloc(size_t size, gfp_t flags);
+void kfree(const void* p);
+unsigned long __get_free_pages(gfp_t flags, unsigned int order);
+void free_pages(unsigned long addr, unsigned int order);
+unsigned long get_zeroed_page(gfp_t flags);
+#define free_page(addr) free_pages((addr), 0)
+
+unsigned long kshim_virt_to_pfn(unsigned long addr);
+void* kshim_pfn_to_kaddr(unsigned long pfn);
+#define virt_to_pfn(v) kshim_virt_to_pfn((unsigned long) (v))
+#define virt_to_mfn(v) kshim_virt_to_pfn((unsigned long) (v))
+#define pfn_to_kaddr(pfn) kshim_pfn_to_kaddr(pfn)
+#define page_to_pfn(page) ((page)->pfn)
+
+typedef struct { unsigned long pte; } pte_t;
+typedef void* pgtable_t;
+typedef struct { phys_addr_t maddr; } xmaddr_t;
+pte_t* lookup_address(unsigned long address, unsigned int* level);
+xmaddr_t arbitrary_virt_to_machine(void* vaddr);
+
+struct vm_struct {
+    void* addr;
+    unsigned long size;
+};
+struct vm_struct* alloc_vm_area(size_t size, pte_t** ptes);
+void free_vm_area(struct vm_struct* area);
+
+#define VM_READ       0x00000001UL
+#define VM_WRITE      0x00000002UL
+#define VM_SHARED     0x00000008UL
+#define VM_MAYREAD    0x00000010UL
+#define VM_MAYWRITE   0x00000020UL
+#define VM_DONTCOPY   0x00020000UL
+#define VM_DONTEXPAND 0x00040000UL
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3, 7, 0)
+# define VM_RESERVED  0x00080000UL
+#endif
+
+typedef struct { unsigned long pgprot; } pgprot_t;
+struct mm_struct;
+struct vm_area_struct {
+    unsigned long vm_start;
+    unsigned long vm_end;
+    unsigned long vm_pgoff;
+    unsigned long vm_flags;
+    pgprot_t vm_page_prot;
+    struct mm_struct* vm_mm;
+};
+int remap_pfn_range(struct vm_area_struct* vma, unsigned long addr, unsigned long pfn, unsigned long size, pgprot_t prot);
+int vm_insert_page(struct vm_area_struct* vma, unsigned long addr, struct page* page);
+typedef int (*pte_fn_t)(pte_t* pte, pgtable_t token, unsigned long addr, void* data);
+int apply_to_page_range(struct mm_struct* mm, unsigned long address, unsigned long size, pte_fn_t fn, void* data);
+
+
+/*
+ * Tasks and mmu notifiers
+ */
+struct task_struct {
+    unsigned long timer_slack_ns;
+};
+extern struct task_struct* kshim_current;
+#define current kshim_current
+#define TASK_RUNNING 0
+#define TASK_INTERRUPTIBLE 1
+#define signal_pending(task) ((void) (task), 0) //The test threads get no signals
+struct mm_struct* get_task_mm(struct task_struct* task);
+void mmput(struct mm_struct* mm);
+
+struct mmu_notifier;
+struct mmu_notifier_ops {
+    void (*release)(struct mmu_notifier* mn, struct mm_struct* mm);
+    void (*invalidate_page)(struct mmu_notifier* mn, struct mm_struct* mm, unsigned long address);
+    void (*invalidate_range_start)(struct mmu_notifier* mn, struct mm_struct* mm, unsigned long start, unsigned long end);
+};
+struct mmu_notifier {
+    const struct mmu_notifier_ops* ops;
+};
+int mmu_notifier_register(struct mmu_notifier* mn, struct mm_struct* mm);
+void mmu_notifier_unregister(struct mmu_notifier* mn, struct mm_struct* mm);
+
+
+/*
+ * Wait queues
+ * A waiter stays queued during its whole wait. A wake up wakes all the waiters, but
+ * only the first exclusive one that has not been woken yet (all of them with the _all variant), like the kernel does.
+ */
+struct kshim_waiter {
+    pthread_cond_t cond;
+    int exclusive;
+    int woken;
+    int queued;
+    struct kshim_waiter* next;
+};
+typedef struct {
+    struct kshim_waiter* head;
+} wait_queue_head_t;
+typedef struct kshim_waiter wait_queue_t;
+
+void init_waitqueue_head(wait_queue_head_t* wq);
+void wake_up_interruptible(wait_queue_head_t* wq);
+void wake_up_interruptible_all(wait_queue_head_t* wq);
+void kshim_wait_add(wait_queue_head_t* wq, struct kshim_waiter* w, int exclusive);
+void kshim_wait_del(wait_queue_head_t* wq, struct kshim_waiter* w);
+u64 kshim_now_ns(void);
+int kshim_wait_sleep(wait_queue_head_t* wq, struct kshim_waiter* w, u64 deadline);
+
+/* Sleeps until the condition is true or the deadline (0: none). Returns 1 if the deadline expired first */
+#define __kshim_wait_event(wq, condition, exclusive, deadline) ({ \
+    struct kshim_waiter __w; \
+    int __expired = 0; \
+    kshim_wait_add(&(wq), &__w, (exclusive)); \
+    while(!(condition)) { \
+        if(kshim_wait_sleep(&(wq), &__w, (deadline))) { \
+            __expired = !(condition); \
+            break; \
+        } \
+    } \
+    kshim_wait_del(&(wq), &__w); \
+    __expired; })
+
+#define wait_event_interruptible(wq, condition) \
+    (__kshim_wait_event(wq, condition, 0, 0), 0)
+#define wait_event_interruptible_exclusive(wq, condition) \
+    (__kshim_wait_event(wq, condition, 1, 0), 0)
+
+/*
+ * Waits written by hand: prepare_to_wait queues the current thread (once) and makes it sleeping,
+ * a wake up makes it running again, so that schedule_hrtimeout_range returns at once if one came in between.
+ */
+#define DEFINE_WAIT(name) wait_queue_t name = { .queued = 0 }
+void prepare_to_wait(wait_queue_head_t* wq, wait_queue_t* wait, int state);
+void prepare_to_wait_exclusive(wait_queue_head_t* wq, wait_queue_t* wait, int state);
+void finish_wait(wait_queue_head_t* wq, wait_queue_t* wait);
+
+/* Sleeps on the entry of the last prepare_to_wait. Returns 0 once expires is reached, -EINTR if woken up before */
+enum hrtimer_mode {
+    HRTIMER_MODE_ABS = 0x0,
+    HRTIMER_MODE_REL = 0x1,
+};
+int schedule_hrtimeout_range(ktime_t* expires, unsigned long delta, const enum hrtimer_mode mode);
+
+
+/*
+ * Files and devices
+ */
+struct module;
+#define THIS_MODULE ((struct module*) NULL)
+struct inode {
+    int unused;
+};
+struct file {
+    void* private_data;
+};
+typedef struct { int unused; } poll_table;
+static inline void poll_wait(struct file* filp, wait_queue_head_t* wq, poll_table* p) { }
+
+struct file_operations {
+    struct module* owner;
+    int (*open)(struct inode* inode, struct file* filp);
+    long (*unlocked_ioctl)(struct file* filp, unsigned int cmd, unsigned long arg);
+    int (*mmap)(struct file* filp, struct vm_area_struct* vma);
+    unsigned int (*poll)(struct file* filp, poll_table* wait);
+    int (*release)(struct inode* inode, struct file* filp);
+};
+
+struct cdev {
+    const struct file_operations* ops;
+};
+void cdev_init(struct cdev* cdev, const struct file_operations* fops);
+int cdev_add(struct cdev* cdev, dev_t dev, unsigned int count);
+void cdev_del(struct cdev* cdev);
+
+#define MINORBITS 20
+#define MKDEV(ma, mi) (((ma) << MINORBITS) | (mi))
+#define MAJOR(dev) ((unsigned int) ((dev) >> MINORBITS))
+int register_chrdev_region(dev_t from, unsigned count, const char* name);
+int alloc_chrdev_region(dev_t* dev, unsigned baseminor, unsigned count, const char* name);
+void unregister_chrdev_region(dev_t from, unsigned count);
+
+#define VERIFY_READ 0
+#define VERIFY_WRITE 1
+#define access_ok(type, addr, size) ((void) (type), (void) (addr), (void) (size), 1)
+static inline unsigned long copy_from_user(void* to, const void __user* from, unsigned long n) { memcpy(to, from, n); return 0; }
+static inline unsigned long copy_to_user(void __user* to, const void* from, unsigned long n) { memcpy(to, from, n); return 0; }
+
+
+/*
+ * Modules
+ */
+#define module_param(name, type, perm) static inline void* __kshim_param_##name(void) { return &name; }
+#define MODULE_PARM_DESC(name, desc)
+#define MODULE_LICENSE(x)
+#define MODULE_AUTHOR(x)
+#define MODULE_DESCRIPTION(x)
+#define module_init(fn) int kshim_module_init(void) { return fn(); }
+#define module_exit(fn) void kshim_module_exit(void) { fn(); }
+
+
+/*
+ * Xen
+ */
+typedef uint16_t domid_t;
+typedef uint32_t grant_ref_t;
+typedef uint32_t grant_handle_t;
+typedef uint32_t evtchn_port_t;
+#define DOMID_SELF ((domid_t) 0x7FF0U)
+
+static inline int xen_pv_domain(void) { return 0; } //HVM: the receiver maps with vm_insert_page
+
+/* Event channels */
+#define EVTCHNOP_bind_interdomain 0
+#define EVTCHNOP_close            3
+#define EVTCHNOP_status           5
+#define EVTCHNOP_alloc_unbound    6
+#define EVTCHNSTAT_closed         0
+#define EVTCHNSTAT_unbound        1
+#define EVTCHNSTAT_interdomain    2
+struct evtchn_alloc_unbound {
+    domid_t dom, remote_dom;
+    evtchn_port_t port;
+};
+struct evtchn_bind_interdomain {
+    domid_t remote_dom;
+    evtchn_port_t remote_port;
+    evtchn_port_t local_port;
+};
+struct evtchn_close {
+    evtchn_port_t port;
+};
+struct evtchn_status {
+    domid_t dom;
+    evtchn_port_t port;
+    uint32_t status;
+    uint32_t vcpu;
+    union {
+        struct { domid_t dom; } unbound;
+        struct { domid_t dom; evtchn_port_t port; } interdomain;
+    } u;
+};
+int HYPERVISOR_event_channel_op(int cmd, void* arg);
+
+typedef enum { IRQ_NONE, IRQ_HANDLED, IRQ_WAKE_THREAD } irqreturn_t;
+typedef irqreturn_t (*irq_handler_t)(int irq, void* dev_id);
+int bind_evtchn_to_irqhandler(unsigned int evtchn, irq_handler_t handler, unsigned long irqflags, const char* devname, void* dev_id);
+void unbind_from_irqhandler(unsigned int irq, void* dev_id);
+void notify_remote_via_evtchn(int port);
+
+/* Grant tables */
+#define GNTTABOP_map_grant_ref   0
+#define GNTTABOP_unmap_grant_ref 1
+#define GNTMAP_device_map        (1 << 0)
+#define GNTMAP_host_map          (1 << 1)
+#define GNTMAP_readonly          (1 << 2)
+#define GNTMAP_application_map   (1 << 3)
+#define GNTMAP_contains_pte      (1 << 4)
+struct gnttab_map_grant_ref {
+    uint64_t host_addr;
+    uint32_t flags;
+    grant_ref_t ref;
+    domid_t dom;
+    int16_t status;
+    grant_handle_t handle;
+    uint64_t dev_bus_addr;
+};
+struct gnttab_unmap_grant_ref {
+    uint64_t host_addr;
+    uint64_t dev_bus_addr;
+    grant_handle_t handle;
+    int16_t status;
+};
+static inline void
+gnttab_set_map_op(struct gnttab_map_grant_ref* map, phys_addr_t addr, uint32_t flags, grant_ref_t ref, domid_t domid)
+{
+    map->host_addr = addr;
+    map->flags = flags;
+    map->ref = ref;
+    map->dom = domid;
+}
+static inline void
+gnttab_set_unmap_op(struct gnttab_unmap_grant_ref* unmap, phys_addr_t addr, uint32_t flags, grant_handle_t handle)
+{
+    unmap->host_addr = addr;
+    unmap->handle = handle;
+    unmap->dev_bus_addr = 0;
+}
+int HYPERVISOR_grant_table_op(unsigned int cmd, void* uop, unsigned int count);
+int gnttab_grant_foreign_access(domid_t domid, unsigned long frame, int readonly);
+int gnttab_end_foreign_access_ref(grant_ref_t ref, int readonly);
+int gnttab_map_refs(struct gnttab_map_grant_ref* map_ops, struct gnttab_map_grant_ref* kmap_ops, struct page** pages, unsigned int count);
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3, 3, 0)
+int gnttab_unmap_refs(struct gnttab_unmap_grant_ref* unmap_ops, struct page** pages, unsigned int count);
+#elif LINUX_VERSION_CODE < KERNEL_VERSION(3, 5, 0)
+int gnttab_unmap_refs(struct gnttab_unmap_grant_ref* unmap_ops, struct page** pages, unsigned int count, bool clear_pte);
+#else
+int gnttab_unmap_refs(struct gnttab_unmap_grant_ref* unmap_ops, struct gnttab_map_grant_ref* kunmap_ops, struct page** pages, unsigned int count);
+#endif
+
+/* Balloon */
+int alloc_xenballooned_pages(int nr_pages, struct page** pages, bool highmem);
+void free_xenballooned_pages(int nr_pages, struct page** pages);
+
+
+#endif /* __KSHIM_H__ */
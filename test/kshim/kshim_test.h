@@ -0,0 +1,29 @@
+/*
+ * Kernel shim for the module test: the test side
+ *
+ * Authors: Vincent Brillault <git@lerya.net>
+ *          Pierre Pfister    <oryon@darou.fr>
+ *
+ * The calls on XEN_SHM_DEVICE_PATH, and on the descriptors it gives, are
+ * routed to the file operations registered by the module when the test is
+ * linked with -Wl,--wrap=open,--wrap=close,--wrap=ioctl,--wrap=mmap,--wrap=munmap,--wrap=poll.
+ * The other calls go to the C library.
+ *
+ */
+
+#ifndef __KSHIM_TEST_H__
+#define __KSHIM_TEST_H__
+
+#include <stdint.h>
+
+#define KSHIM_DOMID 7 //Domain id of the single test domain
+
+/* The module's init and exit functions */
+int kshim_module_init(void);
+void kshim_module_exit(void);
+
+void kshim_set_verbose(int verbose); //Prints the module's messages
+uint64_t kshim_signals_delivered(void); //Signals delivered through the event channels, since the start
+uint64_t kshim_wakeups(void); //Returns of sleeping waiters (woken up or timed out), since the start
+
+#endif /* __KSHIM_TEST_H__ */
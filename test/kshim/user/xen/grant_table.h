@@ -0,0 +1,14 @@
+/*
+ * The grant and domain types xen_shm.h needs on the userspace side,
+ * for the objects of the module test (no Xen headers needed)
+ */
+#ifndef __KSHIM_USER_GRANT_TABLE_H__
+#define __KSHIM_USER_GRANT_TABLE_H__
+
+#include <stdint.h>
+
+typedef uint16_t domid_t;
+typedef uint32_t grant_ref_t;
+#define DOMID_SELF ((domid_t) 0x7FF0U)
+
+#endif
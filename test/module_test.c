@@ -0,0 +1,1161 @@
+/*
+ * Tests of the xen_shm module, run in a single process.
+ *
+ * The module is built as a userspace object against the kernel shim (kshim/),
+ * the open, ioctl, mmap, poll and close calls on the device are routed to it.
+ * Both sides of each channel run in this process, as if the distant domain was the local one.
+ *
+ * Usage: module_test [-v] [test name]
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../xen_shm.h"
+#include "../xen_shm_pipe.h"
+#include "../xen_shm_mux.h"
+
+#include "kshim/kshim_test.h"
+
+#define PAGE_SIZE 4096
+#define ECHO_ROUND_TRIPS 1000
+#define DUPLEX_MESSAGES 20000
+#define MULTI_READERS 4
+#define MULTI_READER_MESSAGES 20000
+#define MULTI_WRITERS 4
+#define MULTI_WRITER_MESSAGES 10000 //Per writer
+#define MUX_STREAMS 4
+#define MUX_MESSAGES 5000 //Per stream and direction
+#define MUX_WINDOW 1024
+
+#define CHECK(cond) do { \
+        if(!(cond)) { \
+            printf("  %s:%d: check failed: %s (errno: %s)\n", __FILE__, __LINE__, #cond, strerror(errno)); \
+            return -1; \
+        } \
+    } while(0)
+
+struct channel {
+    int offerer;
+    int receiver;
+};
+
+struct echo_server {
+    xen_shm_pipe_p receive_pipe;
+    xen_shm_pipe_p send_pipe;
+    int count;
+    int ret;
+};
+
+struct wake_waiter {
+    int fd;
+    unsigned long arg; //XEN_SHM_AWAIT_WAKE_ARG
+    int ret;
+};
+
+struct stream_thread {
+    xen_shm_pipe_p pipe;
+    int count;
+    int ret;
+};
+
+struct multi_reader {
+    xen_shm_pipe_p pipe;
+    uint32_t* seen; //Times each message was received
+    int ret;
+};
+
+struct multi_writer {
+    xen_shm_pipe_p pipe;
+    uint32_t id;
+    int ret;
+};
+
+struct mux_server {
+    xen_shm_mux_p mux;
+    int ret;
+};
+
+static int verbose;
+
+
+/*
+ * Opens an offerer and a receiver sharing pages_count pages
+ */
+static int
+channel_open(struct channel* c, uint8_t pages_count)
+{
+    struct xen_shm_ioctlarg_offerer offerer;
+    struct xen_shm_ioctlarg_receiver receiver;
+    struct xen_shm_ioctlarg_getdomid getdomid;
+
+    c->offerer = open(XEN_SHM_DEVICE_PATH, O_RDWR);
+    c->receiver = open(XEN_SHM_DEVICE_PATH, O_RDWR);
+    CHECK(c->offerer >= 0 && c->receiver >= 0);
+
+    CHECK(ioctl(c->receiver, XEN_SHM_IOCTL_GET_DOMID, &getdomid) == 0);
+    offerer.pages_count = pages_count;
+    offerer.dist_domid = getdomid.local_domid;
+    CHECK(ioctl(c->offerer, XEN_SHM_IOCTL_INIT_OFFERER, &offerer) == 0);
+
+    receiver.pages_count = pages_count;
+    receiver.dist_domid = offerer.local_domid;
+    receiver.grant = offerer.grant;
+    CHECK(ioctl(c->receiver, XEN_SHM_IOCTL_INIT_RECEIVER, &receiver) == 0);
+    return 0;
+}
+
+static void
+channel_close(struct channel* c)
+{
+    close(c->receiver);
+    close(c->offerer);
+}
+
+/* Waits for a signal not handled yet on fd, for at most timeout_ms */
+static int
+await_latent(int fd, unsigned long timeout_ms)
+{
+    struct xen_shm_ioctlarg_await await;
+
+    await.request_flags = XEN_SHM_IOCTL_AWAIT_LATENT_USER;
+    await.timeout_ms = timeout_ms;
+    await.remaining_ms = 0;
+    if(ioctl(fd, XEN_SHM_IOCTL_AWAIT, &await) != 0) {
+        return -1;
+    }
+    return (await.remaining_ms == 0)?-2:0;
+}
+
+static uint64_t
+now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec*1000000000ull + (uint64_t) ts.tv_nsec;
+}
+
+/* Consumes the signals pending on fd */
+static void
+drain(int fd)
+{
+    struct xen_shm_ioctlarg_await await;
+
+    await.request_flags = XEN_SHM_IOCTL_AWAIT_LATENT_USER | XEN_SHM_IOCTL_AWAIT_NOWAIT;
+    await.timeout_ms = 0;
+    while(ioctl(fd, XEN_SHM_IOCTL_AWAIT, &await) == 0);
+}
+
+
+/*
+ * The tests
+ */
+static int
+test_domid(void)
+{
+    struct xen_shm_ioctlarg_getdomid getdomid;
+    int fd;
+
+    fd = open(XEN_SHM_DEVICE_PATH, O_RDWR);
+    CHECK(fd >= 0);
+    CHECK(ioctl(fd, XEN_SHM_IOCTL_GET_DOMID, &getdomid) == 0);
+    CHECK(getdomid.local_domid == KSHIM_DOMID);
+    close(fd);
+    return 0;
+}
+
+static int
+test_not_initialized(void)
+{
+    int fd;
+
+    fd = open(XEN_SHM_DEVICE_PATH, O_RDWR);
+    CHECK(fd >= 0);
+    CHECK(ioctl(fd, XEN_SHM_IOCTL_SSIG, 0) == -1 && errno == ENOTTY);
+    CHECK(ioctl(fd, XEN_SHM_IOCTL_WAIT, 0) == -1 && errno == ENOTTY);
+    CHECK(mmap(NULL, PAGE_SIZE, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0) == MAP_FAILED && errno == ENODATA);
+    close(fd);
+    return 0;
+}
+
+static int
+test_shared_pages(void)
+{
+    struct channel c;
+    uint8_t* offerer_mem;
+    uint8_t* receiver_mem;
+
+    CHECK(channel_open(&c, 2) == 0);
+    offerer_mem = mmap(NULL, 2*PAGE_SIZE, PROT_READ|PROT_WRITE, MAP_SHARED, c.offerer, 0);
+    receiver_mem = mmap(NULL, 2*PAGE_SIZE, PROT_READ|PROT_WRITE, MAP_SHARED, c.receiver, 0);
+    CHECK(offerer_mem != MAP_FAILED && receiver_mem != MAP_FAILED);
+
+    strcpy((char*) offerer_mem + PAGE_SIZE + 10, "from the offerer");
+    CHECK(strcmp((char*) receiver_mem + PAGE_SIZE + 10, "from the offerer") == 0);
+    receiver_mem[0] = 42;
+    CHECK(offerer_mem[0] == 42);
+
+    CHECK(mmap(NULL, PAGE_SIZE, PROT_READ|PROT_WRITE, MAP_SHARED, c.receiver, 0) == MAP_FAILED); //Already mapped
+    CHECK(mmap(NULL, PAGE_SIZE, PROT_READ|PROT_WRITE, MAP_PRIVATE, c.offerer, 0) == MAP_FAILED && errno == EINVAL);
+
+    munmap(receiver_mem, 2*PAGE_SIZE);
+    munmap(offerer_mem, 2*PAGE_SIZE);
+    channel_close(&c);
+    return 0;
+}
+
+static int
+test_signals(void)
+{
+    struct channel c;
+
+    CHECK(channel_open(&c, 1) == 0);
+    drain(c.offerer); //The receiver's initial signal
+
+    CHECK(ioctl(c.receiver, XEN_SHM_IOCTL_SSIG, 0) == 0);
+    CHECK(ioctl(c.offerer, XEN_SHM_IOCTL_WAIT, 0) == 0);
+    CHECK(ioctl(c.offerer, XEN_SHM_IOCTL_SSIG, 0) == 0);
+    CHECK(await_latent(c.receiver, 1000) == 0);
+
+    channel_close(&c);
+    return 0;
+}
+
+static int
+test_closed_peer(void)
+{
+    struct channel c;
+
+    CHECK(channel_open(&c, 1) == 0);
+    close(c.receiver);
+    CHECK(ioctl(c.offerer, XEN_SHM_IOCTL_WAIT, 0) == -1 && errno == EPIPE);
+    close(c.offerer);
+    return 0;
+}
+
+/*
+ * Signal and wait in one call, with nothing to copy (request-response round trips)
+ */
+static int
+test_ssig_await_closed(void)
+{
+    struct channel c;
+    uint64_t delivered;
+
+    /* Fails before waiting: sends nothing */
+    CHECK(channel_open(&c, 1) == 0);
+    close(c.offerer);
+    delivered = kshim_signals_delivered();
+    CHECK(ioctl(c.receiver, XEN_SHM_IOCTL_AWAIT_WAKE, XEN_SHM_AWAIT_WAKE_ARG(0, XEN_SHM_IOCTL_AWAIT_WAKE_SSIG)) == -1
+          && errno == EPIPE);
+    CHECK(kshim_signals_delivered() == delivered);
+    close(c.receiver);
+    return 0;
+}
+
+/* Answers each signal of the receiver, until it closes */
+static void*
+signal_echo(void* arg)
+{
+    struct xen_shm_ioctlarg_await await;
+    int fd;
+
+    fd = *(int*) arg;
+    for(;;) {
+        await.request_flags = XEN_SHM_IOCTL_AWAIT_LATENT_USER;
+        await.timeout_ms = 0;
+        if(ioctl(fd, XEN_SHM_IOCTL_AWAIT, &await) != 0 || ioctl(fd, XEN_SHM_IOCTL_SSIG, 0) != 0) {
+            return NULL;
+        }
+    }
+}
+
+/* Answers one signal of the other side */
+static void*
+signal_answer(void* arg)
+{
+    if(await_latent(*(int*) arg, 1000) == 0) {
+        ioctl(*(int*) arg, XEN_SHM_IOCTL_SSIG, 0);
+    }
+    return NULL;
+}
+
+static int
+test_ssig_await_round_trips(void)
+{
+    const volatile struct xen_shm_status* status;
+    struct channel c;
+    pthread_t thread;
+    uint64_t wake;
+    int i;
+
+    CHECK(channel_open(&c, 1) == 0);
+    drain(c.offerer);
+    status = mmap(NULL, PAGE_SIZE, PROT_READ, MAP_SHARED, c.receiver, XEN_SHM_STATUS_PAGE_OFFSET);
+    CHECK(status != MAP_FAILED);
+    CHECK(pthread_create(&thread, NULL, signal_echo, &c.offerer) == 0);
+
+    for(i = 0; i < ECHO_ROUND_TRIPS; i++) {
+        wake = status->wake_count;
+        CHECK(ioctl(c.receiver, XEN_SHM_IOCTL_AWAIT_WAKE, XEN_SHM_AWAIT_WAKE_ARG(wake, XEN_SHM_IOCTL_AWAIT_WAKE_SSIG)) == 0);
+        CHECK(status->wake_count != wake);
+    }
+    CHECK(status->signals_sent == ECHO_ROUND_TRIPS);
+
+    munmap((void*) (uintptr_t) status, PAGE_SIZE);
+    close(c.receiver);
+    pthread_join(thread, NULL);
+    close(c.offerer);
+    return 0;
+}
+
+
+/*
+ * Duplex pipes: the server offers
+ */
+static int
+duplex_open_ring(xen_shm_pipe_p server[2], xen_shm_pipe_p client[2], enum xen_shm_pipe_type type, enum xen_shm_pipe_ring ring)
+{
+    uint32_t client_domid, server_domid, grant;
+
+    CHECK(xen_shm_pipe_init_duplex(&server[0], &server[1], 1) == 0);
+    CHECK(xen_shm_pipe_init_duplex(&client[0], &client[1], 0) == 0);
+    xen_shm_pipe_set_type(server[0], type);
+    xen_shm_pipe_set_type(server[1], type);
+    xen_shm_pipe_set_ring(server[0], ring);
+    xen_shm_pipe_set_ring(server[1], ring);
+    CHECK(xen_shm_pipe_getdomid(client[0], &client_domid) == 0);
+    CHECK(xen_shm_pipe_offers(server[0], 4, client_domid, &server_domid, &grant) == 0);
+    CHECK(xen_shm_pipe_connect(client[0], 4, server_domid, grant) == 0);
+    CHECK(xen_shm_pipe_wait(server[0], 1000) == 0);
+    return 0;
+}
+
+static int
+duplex_open(xen_shm_pipe_p server[2], xen_shm_pipe_p client[2], enum xen_shm_pipe_type type)
+{
+    return duplex_open_ring(server, client, type, xen_shm_pipe_ring_default);
+}
+
+static void
+duplex_close(xen_shm_pipe_p pipes[2])
+{
+    xen_shm_pipe_free(pipes[1]);
+    xen_shm_pipe_free(pipes[0]);
+}
+
+static void*
+echo_server(void* arg)
+{
+    struct echo_server* s;
+    char buf[256];
+    size_t len;
+    int i;
+
+    s = arg;
+    xen_shm_pipe_set_wake_on_read(s->send_pipe, 1);
+    s->ret = -1;
+    for(i = 0; i < s->count; i++) {
+        if(xen_shm_pipe_recv_msg(s->receive_pipe, buf, sizeof(buf), &len) != 1 ||
+           xen_shm_pipe_send_msg(s->send_pipe, buf, len) != 0) {
+            return NULL;
+        }
+    }
+    xen_shm_pipe_flush(s->send_pipe);
+    s->ret = 0;
+    return NULL;
+}
+
+static int
+test_pipe_echo(void)
+{
+    xen_shm_pipe_p server[2], client[2];
+    struct xen_shm_pipe_stats stats;
+    struct echo_server s;
+    pthread_t thread;
+    char msg[64], buf[64];
+    size_t len;
+    int i;
+
+    CHECK(duplex_open(server, client, xen_shm_pipe_type_framed) == 0);
+    CHECK(xen_shm_pipe_set_wake_on_read(client[1], 1) == 0);
+    s.receive_pipe = server[0];
+    s.send_pipe = server[1];
+    s.count = ECHO_ROUND_TRIPS;
+    CHECK(pthread_create(&thread, NULL, echo_server, &s) == 0);
+
+    for(i = 0; i < ECHO_ROUND_TRIPS; i++) {
+        len = (size_t) snprintf(msg, sizeof(msg), "request %i", i) + 1;
+        CHECK(xen_shm_pipe_send_msg(client[1], msg, len) == 0);
+        CHECK(xen_shm_pipe_recv_msg(client[0], buf, sizeof(buf), &len) == 1);
+        CHECK(strcmp(buf, msg) == 0);
+    }
+    pthread_join(thread, NULL);
+    CHECK(s.ret == 0);
+
+    /* The sleeps of the client sent its requests' wake up */
+    stats = xen_shm_pipe_get_stats(client[0]);
+    if(verbose) {
+        printf("  client: %"PRIu64" awaits, %"PRIu64" ssig, %"PRIu64" ssig_await\n",
+               stats.ioctl_count_await, stats.ioctl_count_ssig, stats.ioctl_count_ssig_await);
+    }
+    CHECK(stats.ioctl_count_ssig_await > 0);
+
+    duplex_close(client);
+    duplex_close(server);
+    return 0;
+}
+
+
+/*
+ * Timeouts: never early, zero remaining time only on timeout
+ */
+static int
+test_await_timeout(void)
+{
+    struct xen_shm_ioctlarg_await await;
+    struct channel c;
+    uint64_t start;
+
+    CHECK(channel_open(&c, 1) == 0);
+    drain(c.receiver);
+
+    await.request_flags = XEN_SHM_IOCTL_AWAIT_USER;
+    await.timeout_ms = 10;
+    await.remaining_ms = 42;
+    start = now_ns();
+    CHECK(ioctl(c.receiver, XEN_SHM_IOCTL_AWAIT, &await) == 0);
+    CHECK(now_ns() - start >= 10000000ull);
+    CHECK(await.remaining_ms == 0);
+
+    channel_close(&c);
+    return 0;
+}
+
+static int
+test_await_ns_timeout(void)
+{
+    static const uint64_t timeouts[] = { 1, 999999, 1000000, 5500000, 12345678 };
+    struct xen_shm_ioctlarg_await_ns await;
+    struct channel c;
+    uint64_t start, elapsed;
+    size_t i;
+
+    CHECK(channel_open(&c, 1) == 0);
+    drain(c.receiver);
+
+    for(i = 0; i < sizeof(timeouts)/sizeof(timeouts[0]); i++) {
+        await.request_flags = XEN_SHM_IOCTL_AWAIT_LATENT_USER;
+        await.timeout_ns = timeouts[i];
+        await.remaining_ns = 42;
+        start = now_ns();
+        CHECK(ioctl(c.receiver, XEN_SHM_IOCTL_AWAIT_NS, &await) == 0);
+        elapsed = now_ns() - start;
+        if(verbose) {
+            printf("  timeout %"PRIu64" ns: returned after %"PRIu64" ns\n", timeouts[i], elapsed);
+        }
+        CHECK(elapsed >= timeouts[i]);
+        CHECK(await.remaining_ns == 0);
+    }
+
+    channel_close(&c);
+    return 0;
+}
+
+/*
+ * Sub-millisecond timeouts run on a high resolution timer, not on the tick. Best of a few tries, for the scheduling noise.
+ */
+static int
+test_await_ns_precision(void)
+{
+    struct xen_shm_ioctlarg_await_ns await;
+    struct channel c;
+    uint64_t start, elapsed, best;
+    int i;
+
+    CHECK(channel_open(&c, 1) == 0);
+    drain(c.receiver);
+
+    best = UINT64_MAX;
+    for(i = 0; i < 5; i++) {
+        await.request_flags = XEN_SHM_IOCTL_AWAIT_LATENT_USER;
+        await.timeout_ns = 200000;
+        start = now_ns();
+        CHECK(ioctl(c.receiver, XEN_SHM_IOCTL_AWAIT_NS, &await) == 0 && await.remaining_ns == 0);
+        elapsed = now_ns() - start;
+        CHECK(elapsed >= 200000);
+        if(elapsed < best) {
+            best = elapsed;
+        }
+    }
+    if(verbose) {
+        printf("  timeout 200000 ns: returned after %"PRIu64" ns at best\n", best);
+    }
+    CHECK(best < 1000000); //A tick is 1 ms at best
+
+    channel_close(&c);
+    return 0;
+}
+
+static int
+test_await_remaining(void)
+{
+    struct xen_shm_ioctlarg_await await;
+    struct xen_shm_ioctlarg_await_ns await_ns;
+    struct channel c;
+
+    CHECK(channel_open(&c, 1) == 0);
+    drain(c.receiver);
+
+    /* A signal already there: nearly all the time remains, rounded up to the ms */
+    CHECK(ioctl(c.offerer, XEN_SHM_IOCTL_SSIG, 0) == 0);
+    await.request_flags = XEN_SHM_IOCTL_AWAIT_LATENT_USER;
+    await.timeout_ms = 1;
+    CHECK(ioctl(c.receiver, XEN_SHM_IOCTL_AWAIT, &await) == 0);
+    CHECK(await.remaining_ms == 1);
+
+    CHECK(ioctl(c.offerer, XEN_SHM_IOCTL_SSIG, 0) == 0);
+    await_ns.request_flags = XEN_SHM_IOCTL_AWAIT_LATENT_USER;
+    await_ns.timeout_ns = 1000000000ull;
+    CHECK(ioctl(c.receiver, XEN_SHM_IOCTL_AWAIT_NS, &await_ns) == 0);
+    CHECK(await_ns.remaining_ns > 0 && await_ns.remaining_ns <= 1000000000ull);
+
+    /* Nothing pending: NOWAIT keeps the whole time */
+    await_ns.request_flags = XEN_SHM_IOCTL_AWAIT_LATENT_USER | XEN_SHM_IOCTL_AWAIT_NOWAIT;
+    CHECK(ioctl(c.receiver, XEN_SHM_IOCTL_AWAIT_NS, &await_ns) == -1 && errno == EAGAIN);
+
+    channel_close(&c);
+    return 0;
+}
+
+static int
+test_pipe_timed_read(void)
+{
+    xen_shm_pipe_p server[2], client[2];
+    uint64_t start;
+    char buf[16];
+
+    CHECK(duplex_open(server, client, xen_shm_pipe_type_stream) == 0);
+
+    start = now_ns();
+    CHECK(xen_shm_pipe_read_timed(client[0], buf, sizeof(buf), 5) == -1 && errno == ETIME);
+    CHECK(now_ns() - start >= 5000000ull);
+
+    CHECK(xen_shm_pipe_write(server[1], "late", 4) == 4);
+    CHECK(xen_shm_pipe_read_timed(client[0], buf, sizeof(buf), 1000) == 4);
+
+    duplex_close(client);
+    duplex_close(server);
+    return 0;
+}
+
+
+/*
+ * Status page
+ */
+static int
+test_status_page(void)
+{
+    const volatile struct xen_shm_status* offerer_status;
+    const volatile struct xen_shm_status* receiver_status;
+    struct xen_shm_ioctlarg_await await;
+    struct pollfd pfd;
+    struct channel c;
+    void* page;
+
+    c.offerer = open(XEN_SHM_DEVICE_PATH, O_RDWR);
+    CHECK(c.offerer >= 0);
+
+    /* Read-only, one page, at any time */
+    CHECK(mmap(NULL, PAGE_SIZE, PROT_READ|PROT_WRITE, MAP_SHARED, c.offerer, XEN_SHM_STATUS_PAGE_OFFSET) == MAP_FAILED && errno == EINVAL);
+    CHECK(mmap(NULL, 2*PAGE_SIZE, PROT_READ, MAP_SHARED, c.offerer, XEN_SHM_STATUS_PAGE_OFFSET) == MAP_FAILED && errno == EINVAL);
+    page = mmap(NULL, PAGE_SIZE, PROT_READ, MAP_SHARED, c.offerer, XEN_SHM_STATUS_PAGE_OFFSET);
+    CHECK(page != MAP_FAILED);
+    CHECK(mprotect(page, PAGE_SIZE, PROT_READ|PROT_WRITE) == -1 && errno == EACCES);
+    offerer_status = page;
+    CHECK(offerer_status->magic == XEN_SHM_STATUS_MAGIC);
+    CHECK(offerer_status->offerer_state == 0 && offerer_status->receiver_state == 0);
+    munmap(page, PAGE_SIZE);
+    close(c.offerer);
+
+    CHECK(channel_open(&c, 1) == 0);
+    offerer_status = mmap(NULL, PAGE_SIZE, PROT_READ, MAP_SHARED, c.offerer, XEN_SHM_STATUS_PAGE_OFFSET);
+    receiver_status = mmap(NULL, PAGE_SIZE, PROT_READ, MAP_SHARED, c.receiver, XEN_SHM_STATUS_PAGE_OFFSET);
+    CHECK(offerer_status != MAP_FAILED && receiver_status != MAP_FAILED);
+
+    /* Both sides opened, after the initial signals */
+    CHECK(offerer_status->offerer_state == XEN_SHM_META_PAGE_STATE_OPENED);
+    CHECK(offerer_status->receiver_state == XEN_SHM_META_PAGE_STATE_OPENED);
+    CHECK(receiver_status->offerer_state == XEN_SHM_META_PAGE_STATE_OPENED);
+    CHECK(receiver_status->receiver_state == XEN_SHM_META_PAGE_STATE_OPENED);
+    CHECK(offerer_status->signals_received == 0 && offerer_status->latent_user_signal == 0);
+
+    /* A signal: latent until consumed, counted on both sides */
+    CHECK(ioctl(c.receiver, XEN_SHM_IOCTL_SSIG, 0) == 0);
+    CHECK(ioctl(c.receiver, XEN_SHM_IOCTL_SSIG, 0) == 0);
+    CHECK(receiver_status->signals_sent == 2);
+    CHECK(offerer_status->signals_received == 2);
+    CHECK(offerer_status->latent_user_signal == 1);
+    pfd.fd = c.offerer;
+    pfd.events = POLLIN;
+    CHECK(poll(&pfd, 1, 0) == 1 && pfd.revents == POLLIN);
+
+    await.request_flags = XEN_SHM_IOCTL_AWAIT_LATENT_USER | XEN_SHM_IOCTL_AWAIT_NOWAIT;
+    await.timeout_ms = 0;
+    CHECK(ioctl(c.offerer, XEN_SHM_IOCTL_AWAIT, &await) == 0);
+    CHECK(offerer_status->latent_user_signal == 0);
+    CHECK(poll(&pfd, 1, 0) == 0);
+
+    /* The other side closing */
+    close(c.receiver);
+    CHECK(offerer_status->receiver_state == XEN_SHM_META_PAGE_STATE_CLOSED);
+    CHECK(poll(&pfd, 1, 0) == 1 && (pfd.revents & POLLHUP));
+
+    munmap((void*) (uintptr_t) receiver_status, PAGE_SIZE);
+    munmap((void*) (uintptr_t) offerer_status, PAGE_SIZE);
+    close(c.offerer);
+    return 0;
+}
+
+
+/*
+ * Wake count: waits that consume nothing, for the waiters sharing an instance
+ */
+static void*
+wake_waiter(void* arg)
+{
+    struct wake_waiter* w;
+
+    w = arg;
+    w->ret = ioctl(w->fd, XEN_SHM_IOCTL_AWAIT_WAKE, w->arg);
+    return NULL;
+}
+
+static int
+test_await_wake(void)
+{
+    const volatile struct xen_shm_status* status;
+    struct xen_shm_ioctlarg_await_wake await;
+    struct wake_waiter waiter;
+    struct channel c;
+    pthread_t thread;
+    uint64_t wake;
+
+    c.offerer = open(XEN_SHM_DEVICE_PATH, O_RDWR);
+    CHECK(c.offerer >= 0);
+    await.request_flags = 0;
+    await.wake_count = 0;
+    await.timeout_ns = 1;
+    CHECK(ioctl(c.offerer, XEN_SHM_IOCTL_AWAIT_WAKE, XEN_SHM_AWAIT_WAKE_ARG(0, 0)) == -1 && errno == ENOTTY);
+    CHECK(ioctl(c.offerer, XEN_SHM_IOCTL_AWAIT_WAKE_TIMED, &await) == -1 && errno == ENOTTY);
+    CHECK(ioctl(c.offerer, XEN_SHM_IOCTL_PASS_WAKE, 0) == -1 && errno == ENOTTY);
+    close(c.offerer);
+
+    CHECK(channel_open(&c, 1) == 0);
+    status = mmap(NULL, PAGE_SIZE, PROT_READ, MAP_SHARED, c.offerer, XEN_SHM_STATUS_PAGE_OFFSET);
+    CHECK(status != MAP_FAILED);
+    CHECK(status->wake_count == 0); //The initial signal doesn't count
+
+    /* A signal since the count was read: returns at once, consumes nothing */
+    wake = status->wake_count;
+    CHECK(ioctl(c.receiver, XEN_SHM_IOCTL_SSIG, 0) == 0);
+    CHECK(status->wake_count != wake);
+    CHECK(ioctl(c.offerer, XEN_SHM_IOCTL_AWAIT_WAKE, XEN_SHM_AWAIT_WAKE_ARG(wake, 0)) == 0);
+    CHECK(ioctl(c.offerer, XEN_SHM_IOCTL_AWAIT_WAKE, XEN_SHM_AWAIT_WAKE_ARG(wake, 0)) == 0);
+    CHECK(status->latent_user_signal == 1);
+    drain(c.offerer); //Another waiter took the latent signal
+    await.wake_count = wake;
+    await.timeout_ns = 1000000000ull;
+    CHECK(ioctl(c.offerer, XEN_SHM_IOCTL_AWAIT_WAKE_TIMED, &await) == 0 && await.remaining_ns != 0);
+
+    /* Not copied back without a timeout */
+    await.timeout_ns = 0;
+    await.remaining_ns = 42;
+    CHECK(ioctl(c.offerer, XEN_SHM_IOCTL_AWAIT_WAKE_TIMED, &await) == 0 && await.remaining_ns == 42);
+
+    /* Nothing since: times out */
+    await.wake_count = status->wake_count;
+    await.timeout_ns = 20000000;
+    CHECK(ioctl(c.offerer, XEN_SHM_IOCTL_AWAIT_WAKE_TIMED, &await) == 0 && await.remaining_ns == 0);
+
+    /* Exclusive waits time out too */
+    await.request_flags = XEN_SHM_IOCTL_AWAIT_WAKE_EXCLUSIVE;
+    CHECK(ioctl(c.offerer, XEN_SHM_IOCTL_AWAIT_WAKE_TIMED, &await) == 0 && await.remaining_ns == 0);
+
+    /* A pass wakes an exclusive waiter up, without a signal */
+    waiter.fd = c.offerer;
+    waiter.arg = XEN_SHM_AWAIT_WAKE_ARG(status->wake_count, XEN_SHM_IOCTL_AWAIT_WAKE_EXCLUSIVE);
+    waiter.ret = -1;
+    CHECK(pthread_create(&thread, NULL, wake_waiter, &waiter) == 0);
+    usleep(20000);
+    wake = status->wake_count;
+    CHECK(ioctl(c.offerer, XEN_SHM_IOCTL_PASS_WAKE, 0) == 0);
+    pthread_join(thread, NULL);
+    CHECK(waiter.ret == 0);
+    CHECK(status->wake_count != wake && status->latent_user_signal == 0);
+
+    /* The signal flag: sent once the wait started, the answer ends it */
+    await.request_flags = XEN_SHM_IOCTL_AWAIT_WAKE_SSIG;
+    await.wake_count = status->wake_count;
+    await.timeout_ns = 1000000000ull;
+    CHECK(pthread_create(&thread, NULL, signal_answer, &c.receiver) == 0);
+    CHECK(ioctl(c.offerer, XEN_SHM_IOCTL_AWAIT_WAKE_TIMED, &await) == 0 && await.remaining_ns != 0);
+    CHECK(status->signals_sent == 1);
+    pthread_join(thread, NULL);
+
+    /* The other side closing */
+    wake = status->wake_count;
+    close(c.receiver);
+    CHECK(ioctl(c.offerer, XEN_SHM_IOCTL_AWAIT_WAKE, XEN_SHM_AWAIT_WAKE_ARG(wake, 0)) == -1 && errno == EPIPE);
+
+    munmap((void*) (uintptr_t) status, PAGE_SIZE);
+    close(c.offerer);
+    return 0;
+}
+
+static void*
+stream_sender(void* arg)
+{
+    struct stream_thread* t;
+    uint32_t msg[64];
+    int i;
+
+    t = arg;
+    t->ret = -1;
+    memset(msg, 0, sizeof(msg));
+    for(i = 0; i < t->count; i++) {
+        msg[0] = (uint32_t) i;
+        if(xen_shm_pipe_send_msg(t->pipe, msg, sizeof(msg)) != 0) {
+            return NULL;
+        }
+    }
+    xen_shm_pipe_flush(t->pipe);
+    t->ret = 0;
+    return NULL;
+}
+
+static void*
+stream_receiver(void* arg)
+{
+    struct stream_thread* t;
+    uint32_t msg[64];
+    size_t len;
+    int i;
+
+    t = arg;
+    t->ret = -1;
+    for(i = 0; i < t->count; i++) {
+        if(xen_shm_pipe_recv_msg(t->pipe, msg, sizeof(msg), &len) != 1 || len != sizeof(msg) || msg[0] != (uint32_t) i) {
+            return NULL;
+        }
+    }
+    t->ret = 0;
+    return NULL;
+}
+
+/*
+ * Both pipes of both duplex channels block at the same time, in their own threads, on the fd they share:
+ * a signal meant for one pipe must not be lost by the other one
+ */
+static int
+test_duplex_shared_waits(void)
+{
+    xen_shm_pipe_p server[2], client[2];
+    xen_shm_pipe_p* pipes[4];
+    struct stream_thread t[4];
+    pthread_t threads[4];
+    int i;
+
+    CHECK(duplex_open(server, client, xen_shm_pipe_type_framed) == 0);
+    pipes[0] = &server[0];
+    pipes[1] = &server[1];
+    pipes[2] = &client[0];
+    pipes[3] = &client[1];
+    for(i = 0; i < 4; i++) {
+        xen_shm_pipe_set_wait_policy(*pipes[i], xen_shm_pipe_wait_power_save);
+        t[i].pipe = *pipes[i];
+        t[i].count = DUPLEX_MESSAGES;
+        CHECK(pthread_create(&threads[i], NULL, (i%2 == 0)?stream_receiver:stream_sender, &t[i]) == 0);
+    }
+    for(i = 0; i < 4; i++) {
+        pthread_join(threads[i], NULL);
+        CHECK(t[i].ret == 0);
+    }
+
+    duplex_close(client);
+    duplex_close(server);
+    return 0;
+}
+
+/*
+ * Idle waits don't wake up until something comes
+ */
+static int
+test_duplex_idle(void)
+{
+    xen_shm_pipe_p server[2], client[2];
+    struct stream_thread t[2];
+    struct stream_thread senders[2];
+    pthread_t threads[2];
+    uint64_t wakeups;
+    int i;
+
+    CHECK(duplex_open(server, client, xen_shm_pipe_type_framed) == 0);
+    t[0].pipe = server[0];
+    t[1].pipe = client[0];
+    for(i = 0; i < 2; i++) {
+        xen_shm_pipe_set_wait_policy(t[i].pipe, xen_shm_pipe_wait_power_save);
+        t[i].count = 1;
+        CHECK(pthread_create(&threads[i], NULL, stream_receiver, &t[i]) == 0);
+    }
+    usleep(20000); //Both asleep
+
+    wakeups = kshim_wakeups();
+    usleep(100000);
+    if(verbose) {
+        printf("  %"PRIu64" wake ups while idle\n", kshim_wakeups() - wakeups);
+    }
+    CHECK(kshim_wakeups() == wakeups);
+
+    senders[0].pipe = client[1];
+    senders[1].pipe = server[1];
+    for(i = 0; i < 2; i++) {
+        senders[i].count = 1;
+        stream_sender(&senders[i]);
+        CHECK(senders[i].ret == 0);
+    }
+    for(i = 0; i < 2; i++) {
+        pthread_join(threads[i], NULL);
+        CHECK(t[i].ret == 0);
+    }
+
+    duplex_close(client);
+    duplex_close(server);
+    return 0;
+}
+
+
+/*
+ * Multi-reader mode: each message is received once, a signal wakes one idle reader up
+ * and the readers it leaves asleep get the rest (the end of file included)
+ */
+static void*
+multi_reader_thread(void* arg)
+{
+    struct multi_reader* r;
+    uint32_t msg[16];
+    size_t len;
+    int ret;
+
+    r = arg;
+    while((ret = xen_shm_pipe_recv_msg(r->pipe, msg, sizeof(msg), &len)) == 1) {
+        if(len != sizeof(msg) || msg[0] >= MULTI_READER_MESSAGES) {
+            r->ret = -1;
+            return NULL;
+        }
+        __atomic_add_fetch(&r->seen[msg[0]], 1, __ATOMIC_RELAXED);
+    }
+    r->ret = ret;
+    return NULL;
+}
+
+static int
+test_multi_reader(void)
+{
+    xen_shm_pipe_p server[2], client[2];
+    struct multi_reader readers[MULTI_READERS];
+    pthread_t threads[MULTI_READERS];
+    uint32_t* seen;
+    uint32_t msg[16];
+    uint64_t wakeups;
+    int i;
+
+    CHECK(duplex_open_ring(server, client, xen_shm_pipe_type_framed, xen_shm_pipe_ring_pow2) == 0);
+    CHECK(xen_shm_pipe_set_multi_reader(server[0], 1) == 0);
+    seen = calloc(MULTI_READER_MESSAGES, sizeof(uint32_t));
+    CHECK(seen != NULL);
+    for(i = 0; i < MULTI_READERS; i++) {
+        readers[i].pipe = server[0];
+        readers[i].seen = seen;
+        readers[i].ret = -1;
+        CHECK(pthread_create(&threads[i], NULL, multi_reader_thread, &readers[i]) == 0);
+    }
+    usleep(20000); //All asleep
+
+    /* Idle readers sleep until something comes */
+    wakeups = kshim_wakeups();
+    usleep(100000);
+    if(verbose) {
+        printf("  %"PRIu64" wake ups while idle\n", kshim_wakeups() - wakeups);
+    }
+    CHECK(kshim_wakeups() == wakeups);
+
+    memset(msg, 0, sizeof(msg));
+    for(i = 0; i < MULTI_READER_MESSAGES; i++) {
+        msg[0] = (uint32_t) i;
+        CHECK(xen_shm_pipe_send_msg(client[1], msg, sizeof(msg)) == 0);
+        if(i%1000 == 0) { //Lets the readers fall asleep now and then
+            usleep(1000);
+        }
+    }
+    usleep(50000); //All asleep again: the end of file wakes one of them up
+    xen_shm_pipe_free(client[1]); //The fd stays open
+
+    for(i = 0; i < MULTI_READERS; i++) {
+        pthread_join(threads[i], NULL);
+        CHECK(readers[i].ret == 0);
+    }
+    for(i = 0; i < MULTI_READER_MESSAGES; i++) {
+        CHECK(seen[i] == 1);
+    }
+
+    free(seen);
+    xen_shm_pipe_free(client[0]);
+    duplex_close(server);
+    return 0;
+}
+
+
+/*
+ * Multi-writer mode: the records of the writer threads come whole and each writer's in order.
+ * Without any spin (power save policy), a writer sleeps until the earlier ones publish.
+ */
+static void*
+multi_writer_thread(void* arg)
+{
+    struct multi_writer* w;
+    uint32_t msg[16];
+    uint32_t i;
+
+    w = arg;
+    memset(msg, 0, sizeof(msg));
+    msg[0] = w->id;
+    for(i = 0; i < MULTI_WRITER_MESSAGES; i++) {
+        msg[1] = i;
+        msg[15] = w->id ^ i;
+        if(xen_shm_pipe_send_msg(w->pipe, msg, sizeof(msg)) != 0) {
+            w->ret = -1;
+            return NULL;
+        }
+    }
+    w->ret = 0;
+    return NULL;
+}
+
+static int
+test_multi_writer(void)
+{
+    xen_shm_pipe_p server[2], client[2];
+    struct multi_writer writers[MULTI_WRITERS];
+    pthread_t threads[MULTI_WRITERS];
+    uint32_t next[MULTI_WRITERS];
+    uint32_t msg[16];
+    size_t len;
+    int i;
+
+    CHECK(duplex_open_ring(server, client, xen_shm_pipe_type_framed, xen_shm_pipe_ring_pow2) == 0);
+    CHECK(xen_shm_pipe_set_multi_writer(client[1], 1) == 0);
+    xen_shm_pipe_set_wait_policy(client[1], xen_shm_pipe_wait_power_save);
+    for(i = 0; i < MULTI_WRITERS; i++) {
+        writers[i].pipe = client[1];
+        writers[i].id = (uint32_t) i;
+        writers[i].ret = -1;
+        CHECK(pthread_create(&threads[i], NULL, multi_writer_thread, &writers[i]) == 0);
+    }
+
+    memset(next, 0, sizeof(next));
+    for(i = 0; i < MULTI_WRITERS*MULTI_WRITER_MESSAGES; i++) {
+        CHECK(xen_shm_pipe_recv_msg(server[0], msg, sizeof(msg), &len) == 1);
+        CHECK(len == sizeof(msg) && msg[0] < MULTI_WRITERS);
+        CHECK(msg[1] == next[msg[0]] && msg[15] == (msg[0] ^ msg[1]));
+        next[msg[0]]++;
+    }
+    for(i = 0; i < MULTI_WRITERS; i++) {
+        pthread_join(threads[i], NULL);
+        CHECK(writers[i].ret == 0);
+    }
+
+    duplex_close(client);
+    duplex_close(server);
+    return 0;
+}
+
+
+/*
+ * Streams over a multiplexed duplex channel: messages of a stream come in order, whatever the stream read
+ */
+static int
+mux_message(uint32_t* msg, uint32_t stream, uint32_t seq)
+{
+    msg[0] = stream;
+    msg[1] = seq;
+    return (int) (2 + seq % 32) * (int) sizeof(uint32_t);
+}
+
+static void*
+mux_server(void* arg)
+{
+    struct mux_server* s;
+    uint32_t msg[64];
+    uint32_t next[MUX_STREAMS];
+    uint32_t stream;
+    size_t len;
+    uint32_t i;
+
+    s = arg;
+    s->ret = -1;
+
+    /* Any stream, in the order they come */
+    memset(next, 0, sizeof(next));
+    for(i = 0; i < MUX_STREAMS*MUX_MESSAGES; i++) {
+        if(xen_shm_mux_recv(s->mux, &stream, msg, sizeof(msg), &len) != 1 || stream >= MUX_STREAMS
+           || msg[0] != stream || msg[1] != next[stream]
+           || len != (size_t) mux_message(msg, stream, next[stream])) {
+            return NULL;
+        }
+        next[stream]++;
+    }
+
+    /* Then the other way, round robin */
+    for(i = 0; i < MUX_MESSAGES; i++) {
+        for(stream = 0; stream < MUX_STREAMS; stream++) {
+            len = (size_t) mux_message(msg, stream, i);
+            if(xen_shm_mux_send(s->mux, stream, msg, len) != 0) {
+                return NULL;
+            }
+        }
+    }
+    s->ret = 0;
+    return NULL;
+}
+
+static int
+test_mux(void)
+{
+    xen_shm_pipe_p server[2], client[2];
+    xen_shm_mux_p mux;
+    struct mux_server s;
+    pthread_t thread;
+    uint32_t msg[64];
+    uint32_t stream;
+    size_t len;
+    uint32_t i;
+
+    CHECK(duplex_open(server, client, xen_shm_pipe_type_framed) == 0);
+    CHECK(xen_shm_mux_init(&mux, server[0], client[1], MUX_STREAMS, MUX_WINDOW) == -1 && errno == EINVAL); //Not siblings
+    CHECK(xen_shm_mux_init(&mux, server[1], server[0], MUX_STREAMS, MUX_WINDOW) == -1 && errno == EINVAL); //Swapped
+    CHECK(xen_shm_mux_init(&s.mux, server[0], server[1], MUX_STREAMS, MUX_WINDOW) == 0);
+    CHECK(xen_shm_mux_init(&mux, client[0], client[1], MUX_STREAMS, MUX_WINDOW) == 0);
+    CHECK(xen_shm_mux_send(mux, MUX_STREAMS, msg, 8) == -1 && errno == EINVAL);
+    CHECK(xen_shm_mux_send(mux, 0, msg, MUX_WINDOW) == -1 && errno == EMSGSIZE);
+    CHECK(pthread_create(&thread, NULL, mux_server, &s) == 0);
+
+    /* All the streams at once: a stream out of credit waits for its own window only */
+    for(i = 0; i < MUX_MESSAGES; i++) {
+        for(stream = 0; stream < MUX_STREAMS; stream++) {
+            len = (size_t) mux_message(msg, stream, i);
+            CHECK(xen_shm_mux_send(mux, stream, msg, len) == 0);
+        }
+    }
+
+    /* Last stream first: the messages of the other ones are kept meanwhile */
+    for(i = 0; i < MUX_MESSAGES; i++) {
+        for(stream = MUX_STREAMS; stream-- > 0;) {
+            CHECK(xen_shm_mux_recv_stream(mux, stream, msg, sizeof(msg), &len) == 1);
+            CHECK(msg[0] == stream && msg[1] == i && len == (size_t) mux_message(msg, stream, i));
+        }
+    }
+    pthread_join(thread, NULL);
+    CHECK(s.ret == 0);
+
+    xen_shm_mux_free(s.mux);
+    CHECK(xen_shm_mux_recv(mux, &stream, msg, sizeof(msg), &len) == 0);
+    xen_shm_mux_free(mux);
+    return 0;
+}
+
+
+/*
+ * Runner
+ */
+struct test {
+    const char* name;
+    int (*run)(void);
+};
+
+static const struct test tests[] = {
+    { "domid", test_domid },
+    { "not_initialized", test_not_initialized },
+    { "shared_pages", test_shared_pages },
+    { "signals", test_signals },
+    { "closed_peer", test_closed_peer },
+    { "ssig_await_closed", test_ssig_await_closed },
+    { "ssig_await_round_trips", test_ssig_await_round_trips },
+    { "pipe_echo", test_pipe_echo },
+    { "await_timeout", test_await_timeout },
+    { "await_ns_timeout", test_await_ns_timeout },
+    { "await_ns_precision", test_await_ns_precision },
+    { "await_remaining", test_await_remaining },
+    { "pipe_timed_read", test_pipe_timed_read },
+    { "status_page", test_status_page },
+    { "await_wake", test_await_wake },
+    { "duplex_shared_waits", test_duplex_shared_waits },
+    { "duplex_idle", test_duplex_idle },
+    { "multi_reader", test_multi_reader },
+    { "multi_writer", test_multi_writer },
+    { "mux", test_mux },
+    { NULL, NULL }
+};
+
+int
+main(int argc, char *argv[])
+{
+    const struct test* t;
+    const char* only;
+    int failed, run;
+
+    only = NULL;
+    for(run = 1; run < argc; run++) {
+        if(strcmp(argv[run], "-v") == 0) {
+            verbose = 1;
+            kshim_set_verbose(1);
+        } else {
+            only = argv[run];
+        }
+    }
+
+    if(kshim_module_init() != 0) {
+        printf("Module init failed\n");
+        return 1;
+    }
+
+    failed = 0;
+    run = 0;
+    for(t = tests; t->name != NULL; t++) {
+        if(only != NULL && strcmp(only, t->name) != 0) {
+            continue;
+        }
+        printf("%s\n", t->name);
+        run++;
+        if(t->run() != 0) {
+            printf("FAILED: %s\n", t->name);
+            failed++;
+        }
+    }
+
+    kshim_module_exit();
+
+    printf("%i/%i tests passed\n", run - failed, run);
+    return (failed == 0 && run > 0)?0:1;
+}
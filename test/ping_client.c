@@ -4,6 +4,7 @@
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
@@ -26,15 +27,17 @@ main(int argc, char *argv[])
     struct in_addr addr;
     struct xen_shm_handler_data hdrl_data;
     pthread_t thread_info;
+    int duplex;
+    int mux;
 
 
-    if (argc > 4) {
+    if (argc > 5) {
         printf("Too many arguments\n");
         return -1;
     }
 
     if (argc < 4) {
-        printf("Not enough arguments (addr, port, pages)\n");
+        printf("Not enough arguments (addr, port, pages [duplex|mux])\n");
         return -1;
     }
 
@@ -54,7 +57,24 @@ main(int argc, char *argv[])
         return -1;
     }
 
-    retval = run_client_thread(port, &addr, page_count, xen_shm_handler_ping_client,  &hdrl_data, &thread_info);
+    duplex = 0;
+    mux = 0;
+    if (argc == 5) {
+        if (strcmp(argv[4], "duplex") == 0) {
+            duplex = 1;
+        } else if (strcmp(argv[4], "mux") == 0) {
+            mux = 1;
+        } else {
+            printf("Bad mode\n");
+            return -1;
+        }
+    }
+
+    if (mux) { //The server must run with streams
+        retval = run_mux_client_thread(port, &addr, page_count, xen_shm_handler_mux_ping_client,  &hdrl_data, &thread_info);
+    } else {
+        retval = run_client_thread(port, &addr, page_count, duplex, xen_shm_handler_ping_client,  &hdrl_data, &thread_info);
+    }
 
     if(retval != 0) {
         return retval;
@@ -4,6 +4,7 @@
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/ioctl.h>
 #include <unistd.h>
 
@@ -15,14 +16,15 @@ main(int argc, char *argv[])
 {
     in_port_t port;
     uint8_t page_count;
+    uint32_t stream_count;
 
-    if (argc > 3) {
+    if (argc > 4) {
         printf("Too many arguments\n");
         return -1;
     }
 
     if (argc < 3) {
-        printf("Not enough arguments (port, pages)\n");
+        printf("Not enough arguments (port, pages [streams|event])\n");
         return -1;
     }
 
@@ -36,6 +38,18 @@ main(int argc, char *argv[])
         return -1;
     }
 
+    if (argc == 4 && strcmp(argv[3], "event") == 0) { //A single thread for all the clients
+        return run_event_server(port, page_count, xen_shm_handler_ping_server_event, NULL);
+    }
+
+    if (argc == 4) { //Each client gets a multiplexer, the ring of a direction holds two windows
+        if (sscanf(argv[3], "%"SCNu32, &stream_count) != 1 || stream_count == 0) {
+            printf("Bad stream number\n");
+            return -1;
+        }
+        return run_mux_server(port, page_count, stream_count, ((uint32_t) page_count)*4096/4, xen_shm_handler_mux_ping_server, NULL);
+    }
+
     return run_server(port, page_count, xen_shm_handler_ping_server, NULL);
 }
 
@@ -6,8 +6,10 @@
 #include <signal.h>
 #include <malloc.h>
 #include <sys/time.h>
+#include <pthread.h>
 
 #include "../xen_shm_pipe.h"
+#include "../xen_shm_mux.h"
 
 //#define SHOW_STATS
 
@@ -19,16 +21,52 @@ static xen_shm_pipe_p xpipe;
 static struct timeval start;
 static struct timeval stop;
 static int pipe_used;
+static uint64_t msg_count;
+static uint32_t batch_size;
+static enum xen_shm_pipe_type pipe_type = xen_shm_pipe_type_default;
+static enum xen_shm_pipe_ring pipe_ring = xen_shm_pipe_ring_default;
+static uint32_t thread_count;
+static enum xen_shm_pipe_wait_policy wait_policy = xen_shm_pipe_wait_throughput;
+static uint32_t stream_count; //Non zero: a multiplexed duplex channel
+static xen_shm_pipe_p xpipe_back; //The other direction of the duplex channel
+static xen_shm_mux_p xmux;
 
 
 void usage(void);
 void pipe_read(void);
+void pipe_zc_read(void);
 void pipe_write(void);
+void pipe_zc_write(void);
+void pipe_publish_write(void);
+void pipe_coalesce_write(void);
+void pipe_msg_read(void);
+void pipe_msg_write(void);
+void pipe_queue_read(void);
+void pipe_queue_write(void);
+void* pipe_mw_write_thread(void* arg);
+void pipe_mw_write(void);
+void pipe_mux_read(void);
+void pipe_mux_write(void);
+uint32_t mux_window(void);
 void init_pipe_reader(void);
 void init_pipe_writer(void);
 void read_pc_and_size(int argc, char **argv);
+void read_batch_size(char *arg);
+void read_wait_policy(char *arg);
 void pipe_reader(int argc, char **argv);
+void pipe_zc_reader(int argc, char **argv);
 void pipe_writer(int argc, char **argv);
+void pipe_zc_writer(int argc, char **argv);
+void pipe_publish_writer(int argc, char **argv);
+void pipe_coalesce_writer(int argc, char **argv);
+void pipe_msg_reader(int argc, char **argv);
+void pipe_msg_writer(int argc, char **argv);
+void pipe_queue_reader(int argc, char **argv);
+void pipe_queue_writer(int argc, char **argv);
+void pipe_mw_writer(int argc, char **argv);
+void pipe_msg_workers(int argc, char **argv);
+void pipe_mux_reader(int argc, char **argv);
+void pipe_mux_writer(int argc, char **argv);
 void pipe_ramwriter(int argc, char **argv);
 
 
@@ -56,22 +94,39 @@ clean(int sig)
         bandwidth = ((double) byte_count)/((double) usec_interval); //MBps
         printf("Time lapse : %f seconds\n", seconds);
         printf("Bandwidth  : %f MBps  =   %f Mbps\n", bandwidth, bandwidth*8);
+        if(msg_count) {
+            printf("Messages   : %"PRIu64"\n", msg_count);
+            printf("Msg rate   : %f msg/s\n", ((double) msg_count)/seconds);
+        }
     }
 
 #ifdef XSHMP_STATS
     stats = xen_shm_pipe_get_stats(xpipe);
     printf("\nWait calls   : %"PRIu64"\n", stats.ioctl_count_await);
     printf("Signal calls : %"PRIu64"\n", stats.ioctl_count_ssig);
+    printf("Signal+wait  : %"PRIu64"\n", stats.ioctl_count_ssig_await);
     printf("Write calls  : %"PRIu64"\n", stats.write_count);
     printf("Read calls   : %"PRIu64"\n", stats.read_count);
     printf("Waiting      : %"PRIu8"\n", stats.waiting);
     printf("Epipe Prone  : %"PRIu64"\n", stats.ioctl_count_epipe_prone);
+    printf("Index loads  : %"PRIu64"\n", stats.remote_index_loads);
+    printf("Index cached : %"PRIu64"\n", stats.remote_index_cached);
+    printf("Spin waits   : %"PRIu64"\n", stats.spin_waits);
+    printf("Sleep waits  : %"PRIu64"\n", stats.sleep_waits);
+    printf("Spins        : %"PRIu64"\n", stats.spin_count);
+    printf("Held writes  : %"PRIu64"\n", stats.held_writes);
+    printf("Put off      : %"PRIu64"\n", stats.signals_suppressed);
+    printf("Wake latency : %f us (%"PRIu64" wake ups)\n", stats.wake_latency_count?((double) stats.wake_latency_ns)/((double) stats.wake_latency_count)/1000.0:0.0, stats.wake_latency_count);
 #endif
 
 
 
     printf("Now closing the pipe\n");
-    xen_shm_pipe_free(xpipe);
+    if(xmux != NULL) {
+        xen_shm_mux_free(xmux); //Frees both pipes
+    } else {
+        xen_shm_pipe_free(xpipe);
+    }
 
     exit(0);
 }
@@ -79,8 +134,21 @@ clean(int sig)
 void
 usage(void)
 {
-    printf("Usage: reader <page_count> <buffer_size>\n");
+    printf("Usage: [-w throughput|latency|power_save|adaptive] <mode> ...\n");
+    printf("Modes: reader <page_count> <buffer_size>\n");
+    printf("  OR   zc_reader <page_count>\n");
     printf("  OR   writer <page_count> <message_size> <iterations>\n");
+    printf("  OR   zc_writer <page_count> <message_size> <iterations>\n");
+    printf("  OR   publish_writer <page_count> <message_size> <iterations>\n");
+    printf("  OR   coalesce_writer <page_count> <iterations>\n");
+    printf("  OR   msg_reader <page_count> <batch_size>\n");
+    printf("  OR   msg_writer <page_count> <message_size> <message_count> <batch_size> [pow2]\n");
+    printf("  OR   queue_reader <page_count>\n");
+    printf("  OR   queue_writer <page_count> <message_size> <message_count>\n");
+    printf("  OR   mw_writer <page_count> <message_size> <iterations> <thread_count>\n");
+    printf("  OR   msg_workers <page_count> <process_count>\n");
+    printf("  OR   mux_reader <page_count> <stream_count>\n");
+    printf("  OR   mux_writer <page_count> <message_size> <iterations> <stream_count>\n");
     printf("  OR   ram_writer <message_size> <iterations>\n");
     exit(-1);
 }
@@ -122,6 +190,34 @@ void pipe_read(void) {
 
 }
 
+/*
+ * Same as pipe_read, but bytes are consumed in place (zero-copy)
+ */
+void pipe_zc_read(void) {
+    const void* region;
+    size_t region_len;
+
+    gettimeofday(&start , NULL);
+    for(;;) {
+        if(xen_shm_pipe_read_peek(xpipe, &region, &region_len)) {
+            perror("Xen pipe read peek");
+            break;
+        }
+        if(region_len == 0) {
+            printf("End of file \n");
+            break;
+        }
+        if(xen_shm_pipe_read_consume(xpipe, region_len)) {
+            perror("Xen pipe read consume");
+            break;
+        }
+        byte_count += (uint64_t) region_len;
+    }
+
+    clean(0);
+
+}
+
 void pipe_write(void) {
     uint8_t* buffer;
     ssize_t retval;
@@ -163,6 +259,437 @@ void pipe_write(void) {
 
 }
 
+/*
+ * Same as pipe_write, but messages are directly built in the pipe (zero-copy)
+ */
+void pipe_zc_write(void) {
+    uint8_t* region;
+    size_t region_len;
+    size_t remaining;
+    uint32_t i;
+
+    gettimeofday(&start , NULL);
+    for(i=0; i<iterations; i++) {
+        remaining = buffer_size;
+        while(remaining) {
+            if(xen_shm_pipe_write_reserve(xpipe, remaining, (void**) &region, &region_len)) {
+                perror("Xen pipe write reserve");
+                clean(0);
+            }
+            if(region_len > remaining) {
+                region_len = remaining;
+            }
+            memset(region, 'u', region_len);
+            if(xen_shm_pipe_write_commit(xpipe, region_len)) {
+                perror("Xen pipe write commit");
+                clean(0);
+            }
+            remaining -= region_len;
+            byte_count+=(uint64_t) region_len;
+        }
+    }
+
+    clean(0);
+
+}
+
+/*
+ * Same as pipe_write, done once for each index publish interval.
+ * The bandwidth of each round is printed, the reader only sees one long stream.
+ */
+void pipe_publish_write(void) {
+    static const size_t intervals[] = {XEN_SHM_PIPE_PUBLISH_CHUNK, 256, 4096, 65536, XEN_SHM_PIPE_PUBLISH_END};
+    uint8_t* buffer;
+    ssize_t retval;
+    uint32_t i;
+    size_t k;
+    uint64_t round_count;
+    uint64_t usec_interval;
+    struct timeval round_start;
+
+    if((buffer = malloc(sizeof(uint8_t)*buffer_size))== NULL) {
+        printf("Memory error\n");
+        clean(0);
+    }
+
+    for(i = 0; i<buffer_size; i++) {
+        buffer[i] = 'u';
+    }
+    gettimeofday(&start , NULL);
+    for(k = 0; k < sizeof(intervals)/sizeof(intervals[0]); k++) {
+        xen_shm_pipe_set_publish_interval(xpipe, intervals[k]);
+        round_count = 0;
+        gettimeofday(&round_start , NULL);
+        for(i=0; i<iterations; i++) {
+            retval = xen_shm_pipe_write_all(xpipe, buffer, buffer_size);
+            if(retval <= 0) {
+                perror("Xen pipe write");
+                clean(0);
+            }
+            round_count+=(uint64_t) retval;
+        }
+        gettimeofday(&stop , NULL);
+        byte_count += round_count;
+
+        usec_interval = (uint64_t) ((stop.tv_sec*1000000 + stop.tv_usec) - (round_start.tv_sec*1000000 + round_start.tv_usec));
+        if(intervals[k] == XEN_SHM_PIPE_PUBLISH_CHUNK) {
+            printf("Publish each chunk : ");
+        } else if(intervals[k] == XEN_SHM_PIPE_PUBLISH_END) {
+            printf("Publish at the end : ");
+        } else {
+            printf("Publish every %6zu: ", intervals[k]);
+        }
+        printf("%f MBps\n", (usec_interval)?((double) round_count)/((double) usec_interval):0.0);
+    }
+
+    clean(0);
+
+}
+
+/*
+ * Small writes (16 to 256 bytes), without and with coalescing, 'iterations' writes per round.
+ * The rate and the signals sent to the reader are printed for each round, the reader only sees one long stream.
+ */
+void pipe_coalesce_write(void) {
+    static const size_t sizes[] = {16, 32, 64, 128, 256};
+    static const size_t coalesce_bytes[] = {0, 4096};
+    static const unsigned long coalesce_usecs = 100;
+    uint8_t buffer[256];
+    ssize_t retval;
+    uint32_t i;
+    size_t k;
+    size_t c;
+    uint64_t round_count;
+    uint64_t usec_interval;
+    struct timeval round_start;
+#ifdef XSHMP_STATS
+    uint64_t round_signals;
+#endif
+
+    memset(buffer, 'u', sizeof(buffer));
+    gettimeofday(&start , NULL);
+    for(k = 0; k < sizeof(sizes)/sizeof(sizes[0]); k++) {
+        for(c = 0; c < sizeof(coalesce_bytes)/sizeof(coalesce_bytes[0]); c++) {
+            if(xen_shm_pipe_set_coalesce(xpipe, coalesce_bytes[c], coalesce_usecs)) {
+                perror("Xen pipe set coalesce");
+                clean(0);
+            }
+#ifdef XSHMP_STATS
+            round_signals = xen_shm_pipe_get_stats(xpipe).ioctl_count_ssig;
+#endif
+            round_count = 0;
+            gettimeofday(&round_start , NULL);
+            for(i=0; i<iterations; i++) {
+                retval = xen_shm_pipe_write_all(xpipe, buffer, sizes[k]);
+                if(retval <= 0) {
+                    perror("Xen pipe write");
+                    clean(0);
+                }
+                round_count+=(uint64_t) retval;
+            }
+            if(xen_shm_pipe_flush(xpipe)) {
+                perror("Xen pipe flush");
+                clean(0);
+            }
+            gettimeofday(&stop , NULL);
+            byte_count += round_count;
+
+            usec_interval = (uint64_t) ((stop.tv_sec*1000000 + stop.tv_usec) - (round_start.tv_sec*1000000 + round_start.tv_usec));
+            if(coalesce_bytes[c]) {
+                printf("%3zu bytes, coalesce %4zu: ", sizes[k], coalesce_bytes[c]);
+            } else {
+                printf("%3zu bytes, no coalesce  : ", sizes[k]);
+            }
+            printf("%f MBps %f writes/s", (usec_interval)?((double) round_count)/((double) usec_interval):0.0,
+                   (usec_interval)?((double) iterations)*1000000.0/((double) usec_interval):0.0);
+#ifdef XSHMP_STATS
+            printf(" %"PRIu64" signals", xen_shm_pipe_get_stats(xpipe).ioctl_count_ssig - round_signals);
+#endif
+            printf("\n");
+        }
+    }
+
+    clean(0);
+
+}
+
+/*
+ * Receives messages from a framed pipe, batch_size at a time
+ */
+void pipe_msg_read(void) {
+    struct iovec* msgs;
+    size_t max_size;
+    uint32_t i;
+    int retval;
+
+    max_size = (size_t) page_count*4096;
+    if((msgs = malloc(sizeof(struct iovec)*batch_size)) == NULL) {
+        printf("Memory error\n");
+        clean(0);
+    }
+    for(i = 0; i < batch_size; i++) {
+        if((msgs[i].iov_base = malloc(max_size)) == NULL) {
+            printf("Memory error\n");
+            clean(0);
+        }
+    }
+
+    gettimeofday(&start , NULL);
+    for(;;) {
+        for(i = 0; i < batch_size; i++) {
+            msgs[i].iov_len = max_size;
+        }
+        retval = xen_shm_pipe_recv_batch(xpipe, msgs, (int) batch_size);
+        if(retval <= 0) {
+            break;
+        }
+        for(i = 0; i < (uint32_t) retval; i++) {
+            byte_count += (uint64_t) msgs[i].iov_len;
+        }
+        msg_count += (uint64_t) retval;
+    }
+
+    if(retval == 0) {
+        printf("End of file \n");
+    } else {
+        perror("Xen pipe receive batch");
+    }
+
+    clean(0);
+
+}
+
+/*
+ * Sends 'iterations' messages of buffer_size bytes in a framed pipe, batch_size at a time
+ */
+void pipe_msg_write(void) {
+    uint8_t* buffer;
+    struct iovec* msgs;
+    uint32_t i;
+    uint32_t count;
+    int retval;
+
+    if((buffer = malloc(sizeof(uint8_t)*buffer_size + 1))== NULL) {
+        printf("Memory error\n");
+        clean(0);
+    }
+    memset(buffer, 'u', buffer_size);
+
+    if((msgs = malloc(sizeof(struct iovec)*batch_size)) == NULL) {
+        printf("Memory error\n");
+        clean(0);
+    }
+    for(i = 0; i < batch_size; i++) {
+        msgs[i].iov_base = buffer;
+        msgs[i].iov_len = buffer_size;
+    }
+
+    gettimeofday(&start , NULL);
+    while(msg_count < iterations) {
+        count = batch_size;
+        if(count > iterations - msg_count) {
+            count = (uint32_t) (iterations - msg_count);
+        }
+        retval = xen_shm_pipe_send_batch(xpipe, msgs, (int) count);
+        if(retval < 0) {
+            perror("Xen pipe send batch");
+            clean(0);
+        }
+        msg_count += (uint64_t) retval;
+        byte_count += (uint64_t) retval * buffer_size;
+    }
+
+    clean(0);
+
+}
+
+/*
+ * Pops messages from a queue pipe
+ */
+void pipe_queue_read(void) {
+    uint8_t buffer[XEN_SHM_QUEUE_MSG_MAX];
+    size_t len;
+    int retval;
+
+    gettimeofday(&start , NULL);
+    while((retval = xen_shm_queue_pop(xpipe, buffer, &len)) > 0) {
+        byte_count += (uint64_t) len;
+        msg_count++;
+    }
+
+    if(retval == 0) {
+        printf("End of file \n");
+    } else {
+        perror("Xen queue pop");
+    }
+
+    clean(0);
+
+}
+
+/*
+ * Pushes 'iterations' messages of buffer_size bytes in a queue pipe
+ */
+void pipe_queue_write(void) {
+    uint8_t buffer[XEN_SHM_QUEUE_MSG_MAX];
+
+    memset(buffer, 'u', sizeof(buffer));
+
+    gettimeofday(&start , NULL);
+    while(msg_count < iterations) {
+        if(xen_shm_queue_push(xpipe, buffer, buffer_size)) {
+            perror("Xen queue push");
+            clean(0);
+        }
+        msg_count++;
+        byte_count += buffer_size;
+    }
+
+    clean(0);
+
+}
+
+/*
+ * Each writer thread writes 'iterations' messages of buffer_size bytes in the same pipe
+ */
+void* pipe_mw_write_thread(void* arg) {
+    uint8_t* buffer;
+    uint32_t i;
+
+    if((buffer = malloc(sizeof(uint8_t)*buffer_size + 1))== NULL) {
+        printf("Memory error\n");
+        return arg;
+    }
+    memset(buffer, 'u', buffer_size);
+
+    for(i=0; i<iterations; i++) {
+        if(xen_shm_pipe_write_all(xpipe, buffer, buffer_size) != (ssize_t) buffer_size) {
+            perror("Xen pipe write");
+            break;
+        }
+    }
+
+    free(buffer);
+    return NULL;
+}
+
+void pipe_mw_write(void) {
+    pthread_t* threads;
+    uint32_t i;
+
+    if((threads = malloc(sizeof(pthread_t)*thread_count)) == NULL) {
+        printf("Memory error\n");
+        clean(0);
+    }
+
+    if(xen_shm_pipe_set_multi_writer(xpipe, 1)) {
+        perror("Xen pipe set multi writer");
+        clean(0);
+    }
+
+    gettimeofday(&start , NULL);
+    for(i = 0; i < thread_count; i++) {
+        if(pthread_create(&threads[i], NULL, pipe_mw_write_thread, NULL)) {
+            perror("pthread create");
+            thread_count = i;
+            break;
+        }
+    }
+    for(i = 0; i < thread_count; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    byte_count = (uint64_t) thread_count * iterations * buffer_size;
+    msg_count = (uint64_t) thread_count * iterations;
+
+    clean(0);
+
+}
+
+/*
+ * Receives the messages of all the streams of a multiplexer, until EOF
+ */
+void pipe_mux_read(void) {
+    uint8_t* buffer;
+    uint64_t* stream_msgs;
+    uint32_t stream;
+    uint32_t window;
+    size_t len;
+    int retval;
+
+    window = mux_window();
+    if(xen_shm_mux_init(&xmux, xpipe, xpipe_back, stream_count, window)) {
+        perror("Xen mux init");
+        clean(0);
+    }
+
+    if((buffer = malloc(window)) == NULL || (stream_msgs = calloc(stream_count, sizeof(uint64_t))) == NULL) {
+        printf("Memory error\n");
+        clean(0);
+    }
+
+    gettimeofday(&start , NULL);
+    while((retval = xen_shm_mux_recv(xmux, &stream, buffer, window, &len)) > 0) {
+        byte_count += (uint64_t) len;
+        msg_count++;
+        stream_msgs[stream]++;
+    }
+
+    if(retval == 0) {
+        printf("End of file \n");
+    } else {
+        perror("Xen mux receive");
+    }
+
+    for(stream = 0; stream < stream_count; stream++) {
+        printf("Stream %"PRIu32" : %"PRIu64" messages\n", stream, stream_msgs[stream]);
+    }
+
+    clean(0);
+}
+
+/*
+ * Sends 'iterations' messages of buffer_size bytes, round robin over the streams of a multiplexer
+ */
+void pipe_mux_write(void) {
+    uint8_t* buffer;
+    uint32_t window;
+
+    window = mux_window();
+    if(buffer_size + 8 > window) {
+        printf("Message size must be at most %"PRIu32"\n", window - 8);
+        clean(0);
+    }
+
+    if(xen_shm_mux_init(&xmux, xpipe_back, xpipe, stream_count, window)) {
+        perror("Xen mux init");
+        clean(0);
+    }
+
+    if((buffer = malloc(sizeof(uint8_t)*buffer_size + 1))== NULL) {
+        printf("Memory error\n");
+        clean(0);
+    }
+    memset(buffer, 'u', buffer_size);
+
+    gettimeofday(&start , NULL);
+    while(msg_count < iterations) {
+        if(xen_shm_mux_send(xmux, (uint32_t) (msg_count % stream_count), buffer, buffer_size)) {
+            perror("Xen mux send");
+            clean(0);
+        }
+        msg_count++;
+        byte_count += buffer_size;
+    }
+
+    clean(0);
+}
+
+/*
+ * Both sides must use the same window: a quarter of the pages, half the ring of each direction
+ */
+uint32_t mux_window(void) {
+    return ((uint32_t) page_count)*4096/4;
+}
 
 void init_pipe_reader(void) {
     uint32_t local_domid;
@@ -170,12 +697,23 @@ void init_pipe_reader(void) {
     uint32_t grant_ref;
 
     printf("\nInit: Reader - Receiver\n");
-    if(xen_shm_pipe_init(&xpipe, xen_shm_pipe_mod_read, xen_shm_pipe_conv_writer_offers)) {
+    if(stream_count) {
+        if(xen_shm_pipe_init_duplex(&xpipe, &xpipe_back, 0)) {
+            perror("Pipe init duplex");
+            exit(-1);
+        }
+        xen_shm_pipe_set_type(xpipe_back, pipe_type);
+        xen_shm_pipe_set_ring(xpipe_back, pipe_ring);
+        xen_shm_pipe_set_wait_policy(xpipe_back, wait_policy);
+    } else if(xen_shm_pipe_init(&xpipe, xen_shm_pipe_mod_read, xen_shm_pipe_conv_writer_offers)) {
         perror("Pipe init");
         exit(-1);
     }
 
     pipe_used = 1;
+    xen_shm_pipe_set_type(xpipe, pipe_type);
+    xen_shm_pipe_set_ring(xpipe, pipe_ring);
+    xen_shm_pipe_set_wait_policy(xpipe, wait_policy);
 
     if(xen_shm_pipe_getdomid(xpipe, &local_domid)) {
         perror("Pipe get domid");
@@ -216,12 +754,23 @@ void init_pipe_writer(void) {
 
     printf("Init: Writer - Offerer\n");
 
-    if(xen_shm_pipe_init(&xpipe, xen_shm_pipe_mod_write, xen_shm_pipe_conv_writer_offers)) {
+    if(stream_count) {
+        if(xen_shm_pipe_init_duplex(&xpipe_back, &xpipe, 1)) {
+            perror("Pipe init duplex");
+            exit(-1);
+        }
+        xen_shm_pipe_set_type(xpipe_back, pipe_type);
+        xen_shm_pipe_set_ring(xpipe_back, pipe_ring);
+        xen_shm_pipe_set_wait_policy(xpipe_back, wait_policy);
+    } else if(xen_shm_pipe_init(&xpipe, xen_shm_pipe_mod_write, xen_shm_pipe_conv_writer_offers)) {
         perror("Pipe init");
         exit(-1);
     }
 
     pipe_used = 1;
+    xen_shm_pipe_set_type(xpipe, pipe_type);
+    xen_shm_pipe_set_ring(xpipe, pipe_ring);
+    xen_shm_pipe_set_wait_policy(xpipe, wait_policy);
 
     printf("Distant domain id: ");
     if((scanf("%"SCNu32, &dist_domid)!=1)) {
@@ -281,6 +830,24 @@ void pipe_reader(int argc, char **argv) {
     pipe_read();
 }
 
+void pipe_zc_reader(int argc, char **argv) {
+
+    if(argc < 3) {
+        usage();
+    }
+
+    byte_count = 0;
+    if(sscanf(argv[2], "%"SCNu8, &page_count) ) {
+        printf("Page count: %"PRIu8"\n", page_count);
+    } else {
+        printf("Invalid page count\n");
+        usage();
+    }
+
+    init_pipe_reader();
+
+    pipe_zc_read();
+}
 
 
 void pipe_writer(int argc, char **argv) {
@@ -303,6 +870,336 @@ void pipe_writer(int argc, char **argv) {
     pipe_write();
 }
 
+void pipe_zc_writer(int argc, char **argv) {
+
+    if(argc < 5) {
+        usage();
+    }
+
+    read_pc_and_size(argc, argv);
+
+    if(sscanf(argv[4], "%"SCNu32, &iterations) ) {
+        printf("Iterations: %"PRIu32"\n", iterations);
+    } else {
+        printf("Invalid size\n");
+        usage();
+    }
+
+    init_pipe_writer();
+
+    pipe_zc_write();
+}
+
+void pipe_publish_writer(int argc, char **argv) {
+
+    if(argc < 5) {
+        usage();
+    }
+
+    read_pc_and_size(argc, argv);
+
+    if(sscanf(argv[4], "%"SCNu32, &iterations) ) {
+        printf("Iterations: %"PRIu32"\n", iterations);
+    } else {
+        printf("Invalid size\n");
+        usage();
+    }
+
+    init_pipe_writer();
+
+    pipe_publish_write();
+}
+
+void pipe_coalesce_writer(int argc, char **argv) {
+
+    if(argc < 4) {
+        usage();
+    }
+
+    byte_count = 0;
+    if(sscanf(argv[2], "%"SCNu8, &page_count) ) {
+        printf("Page count: %"PRIu8"\n", page_count);
+    } else {
+        printf("Invalid page count\n");
+        usage();
+    }
+
+    if(sscanf(argv[3], "%"SCNu32, &iterations) ) {
+        printf("Iterations: %"PRIu32"\n", iterations);
+    } else {
+        printf("Invalid iterations\n");
+        usage();
+    }
+
+    init_pipe_writer();
+
+    pipe_coalesce_write();
+}
+
+void read_batch_size(char *arg) {
+    if(sscanf(arg, "%"SCNu32, &batch_size) && batch_size > 0) {
+        printf("Batch size: %"PRIu32"\n", batch_size);
+    } else {
+        printf("Invalid batch size\n");
+        usage();
+    }
+}
+
+void read_wait_policy(char *arg) {
+    if(strcmp(arg, "throughput") == 0) {
+        wait_policy = xen_shm_pipe_wait_throughput;
+    } else if(strcmp(arg, "latency") == 0) {
+        wait_policy = xen_shm_pipe_wait_latency;
+    } else if(strcmp(arg, "power_save") == 0) {
+        wait_policy = xen_shm_pipe_wait_power_save;
+    } else if(strcmp(arg, "adaptive") == 0) {
+        wait_policy = xen_shm_pipe_wait_adaptive;
+    } else {
+        printf("Invalid wait policy\n");
+        usage();
+    }
+    printf("Wait policy: %s\n", arg);
+}
+
+void pipe_msg_reader(int argc, char **argv) {
+
+    if(argc < 4) {
+        usage();
+    }
+
+    byte_count = 0;
+    msg_count = 0;
+    if(sscanf(argv[2], "%"SCNu8, &page_count) ) {
+        printf("Page count: %"PRIu8"\n", page_count);
+    } else {
+        printf("Invalid page count\n");
+        usage();
+    }
+    read_batch_size(argv[3]);
+
+    pipe_type = xen_shm_pipe_type_framed;
+    init_pipe_reader();
+
+    pipe_msg_read();
+}
+
+void pipe_msg_writer(int argc, char **argv) {
+
+    if(argc < 6) {
+        usage();
+    }
+
+    read_pc_and_size(argc, argv);
+    msg_count = 0;
+
+    if(sscanf(argv[4], "%"SCNu32, &iterations) ) {
+        printf("Messages: %"PRIu32"\n", iterations);
+    } else {
+        printf("Invalid message count\n");
+        usage();
+    }
+    read_batch_size(argv[5]);
+
+    if(argc > 6 && strcmp(argv[6], "pow2") == 0) { //For msg_workers
+        pipe_ring = xen_shm_pipe_ring_pow2;
+    }
+
+    pipe_type = xen_shm_pipe_type_framed;
+    init_pipe_writer();
+
+    pipe_msg_write();
+}
+
+void pipe_queue_reader(int argc, char **argv) {
+
+    if(argc < 3) {
+        usage();
+    }
+
+    byte_count = 0;
+    msg_count = 0;
+    if(sscanf(argv[2], "%"SCNu8, &page_count) ) {
+        printf("Page count: %"PRIu8"\n", page_count);
+    } else {
+        printf("Invalid page count\n");
+        usage();
+    }
+
+    pipe_type = xen_shm_pipe_type_queue;
+    init_pipe_reader();
+
+    pipe_queue_read();
+}
+
+void pipe_queue_writer(int argc, char **argv) {
+
+    if(argc < 5) {
+        usage();
+    }
+
+    read_pc_and_size(argc, argv);
+    msg_count = 0;
+    if(buffer_size > XEN_SHM_QUEUE_MSG_MAX) {
+        printf("Message size must be at most %d\n", XEN_SHM_QUEUE_MSG_MAX);
+        usage();
+    }
+
+    if(sscanf(argv[4], "%"SCNu32, &iterations) ) {
+        printf("Messages: %"PRIu32"\n", iterations);
+    } else {
+        printf("Invalid message count\n");
+        usage();
+    }
+
+    pipe_type = xen_shm_pipe_type_queue;
+    init_pipe_writer();
+
+    pipe_queue_write();
+}
+
+void pipe_mw_writer(int argc, char **argv) {
+
+    if(argc < 6) {
+        usage();
+    }
+
+    read_pc_and_size(argc, argv);
+    msg_count = 0;
+
+    if(sscanf(argv[4], "%"SCNu32, &iterations) ) {
+        printf("Iterations: %"PRIu32"\n", iterations);
+    } else {
+        printf("Invalid size\n");
+        usage();
+    }
+
+    if(sscanf(argv[5], "%"SCNu32, &thread_count) && thread_count > 0) {
+        printf("Writer threads: %"PRIu32"\n", thread_count);
+    } else {
+        printf("Invalid thread count\n");
+        usage();
+    }
+
+    pipe_ring = xen_shm_pipe_ring_pow2; //Needed for the multi-writer mode
+    init_pipe_writer();
+
+    pipe_mw_write();
+}
+
+/*
+ * Receives messages from a framed pipe with several processes, each one printing what it received
+ */
+void pipe_msg_workers(int argc, char **argv) {
+    uint32_t workers;
+    uint32_t i;
+
+    if(argc < 4) {
+        usage();
+    }
+
+    byte_count = 0;
+    msg_count = 0;
+    if(sscanf(argv[2], "%"SCNu8, &page_count) ) {
+        printf("Page count: %"PRIu8"\n", page_count);
+    } else {
+        printf("Invalid page count\n");
+        usage();
+    }
+
+    if(sscanf(argv[3], "%"SCNu32, &workers) && workers > 0) {
+        printf("Reader processes: %"PRIu32"\n", workers);
+    } else {
+        printf("Invalid process count\n");
+        usage();
+    }
+
+    batch_size = 1;
+    pipe_type = xen_shm_pipe_type_framed;
+    pipe_ring = xen_shm_pipe_ring_pow2; //Needed for the multi-reader mode
+    init_pipe_reader();
+
+    if(xen_shm_pipe_set_multi_reader(xpipe, 1)) {
+        perror("Xen pipe set multi reader");
+        clean(0);
+    }
+
+    for(i = 1; i < workers; i++) {
+        if(xen_shm_pipe_add_reader(xpipe)) {
+            perror("Xen pipe add reader");
+            clean(0);
+        }
+        if(fork() == 0) {
+            break;
+        }
+    }
+
+    printf("Reader process %d\n", (int) getpid());
+    pipe_msg_read();
+}
+
+/*
+ * Receives stream_count streams multiplexed over a duplex channel
+ */
+void pipe_mux_reader(int argc, char **argv) {
+
+    if(argc < 4) {
+        usage();
+    }
+
+    byte_count = 0;
+    msg_count = 0;
+    if(sscanf(argv[2], "%"SCNu8, &page_count) && page_count > 0) {
+        printf("Page count: %"PRIu8"\n", page_count);
+    } else {
+        printf("Invalid page count\n");
+        usage();
+    }
+
+    if(sscanf(argv[3], "%"SCNu32, &stream_count) && stream_count > 0) {
+        printf("Streams: %"PRIu32"\n", stream_count);
+    } else {
+        printf("Invalid stream count\n");
+        usage();
+    }
+
+    pipe_type = xen_shm_pipe_type_framed;
+    init_pipe_reader();
+
+    pipe_mux_read();
+}
+
+/*
+ * Sends stream_count streams multiplexed over a duplex channel
+ */
+void pipe_mux_writer(int argc, char **argv) {
+
+    if(argc < 6) {
+        usage();
+    }
+
+    read_pc_and_size(argc, argv);
+    msg_count = 0;
+
+    if(sscanf(argv[4], "%"SCNu32, &iterations) ) {
+        printf("Messages: %"PRIu32"\n", iterations);
+    } else {
+        printf("Invalid message count\n");
+        usage();
+    }
+
+    if(sscanf(argv[5], "%"SCNu32, &stream_count) && stream_count > 0) {
+        printf("Streams: %"PRIu32"\n", stream_count);
+    } else {
+        printf("Invalid stream count\n");
+        usage();
+    }
+
+    pipe_type = xen_shm_pipe_type_framed;
+    init_pipe_writer();
+
+    pipe_mux_write();
+}
+
 void pipe_ramwriter(int argc, char **argv) {
     uint8_t* buffer;
     uint8_t* buffer_2;
@@ -370,10 +1267,43 @@ int main(int argc, char **argv) {
 
     pipe_used = 0;
 
+    if(strcmp(argv[1], "-w") == 0) { //Wait policy, for all the modes
+        if(argc < 4) {
+            usage();
+        }
+        read_wait_policy(argv[2]);
+        argc -= 2;
+        argv += 2;
+    }
+
     if(strcmp(argv[1], "reader") == 0) {
         pipe_reader(argc, argv);
+    } else if(strcmp(argv[1], "zc_reader")==0) {
+        pipe_zc_reader(argc, argv);
     } else if(strcmp(argv[1], "writer")==0) {
         pipe_writer(argc, argv);
+    } else if(strcmp(argv[1], "zc_writer")==0) {
+        pipe_zc_writer(argc, argv);
+    } else if(strcmp(argv[1], "publish_writer")==0) {
+        pipe_publish_writer(argc, argv);
+    } else if(strcmp(argv[1], "coalesce_writer")==0) {
+        pipe_coalesce_writer(argc, argv);
+    } else if(strcmp(argv[1], "msg_reader")==0) {
+        pipe_msg_reader(argc, argv);
+    } else if(strcmp(argv[1], "msg_writer")==0) {
+        pipe_msg_writer(argc, argv);
+    } else if(strcmp(argv[1], "queue_reader")==0) {
+        pipe_queue_reader(argc, argv);
+    } else if(strcmp(argv[1], "queue_writer")==0) {
+        pipe_queue_writer(argc, argv);
+    } else if(strcmp(argv[1], "mw_writer")==0) {
+        pipe_mw_writer(argc, argv);
+    } else if(strcmp(argv[1], "msg_workers")==0) {
+        pipe_msg_workers(argc, argv);
+    } else if(strcmp(argv[1], "mux_reader")==0) {
+        pipe_mux_reader(argc, argv);
+    } else if(strcmp(argv[1], "mux_writer")==0) {
+        pipe_mux_writer(argc, argv);
     } else if(strcmp(argv[1], "ram_writer")==0) {
         pipe_ramwriter(argc, argv);
     }
@@ -27,13 +27,18 @@
 #include <asm/xen/hypercall.h>
 #include <linux/cdev.h>
 #include <linux/fs.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
 #include <linux/kernel.h>
+#include <linux/math64.h>
 #include <linux/mm.h>
 #include <linux/mmu_notifier.h>
 #include <linux/module.h>
 #include <linux/moduleparam.h>
+#include <linux/poll.h>
 #include <linux/sched.h>
 #include <linux/slab.h>
+#include <linux/spinlock.h>
 #include <linux/types.h>
 #include <linux/uaccess.h>
 #include <linux/version.h>
@@ -74,6 +79,37 @@
 # define GNTTAB_UNMAP_REFS(unmap_ops, kmap_ops, page, count) gnttab_unmap_refs(unmap_ops, kmap_ops, page, count)
 #endif /* LINUX_VERSION_CODE ? */
 
+/*
+ * Timed waits on a high resolution timer. wait_event_interruptible_hrtimeout is 3.10, but the timer it
+ * sleeps on (schedule_hrtimeout_range) is older than the supported kernels, so the wait loop is written here.
+ * The deadline is absolute, so that the spurious wake ups don't push it back. The timer slack is the task's one.
+ * Returns 0 if the condition is true, -ETIME on timeout, -ERESTARTSYS if a signal is pending.
+ */
+#define XEN_SHM_WAIT_EVENT_TIMEOUT_NS(wq, condition, timeout_ns, exclusive) \
+    ({ DEFINE_WAIT(__wait); \
+       ktime_t __expires = ktime_add_ns(ktime_get(), timeout_ns); \
+       int __ret = 0; \
+       for(;;) { \
+           if(exclusive) { \
+               prepare_to_wait_exclusive(&(wq), &__wait, TASK_INTERRUPTIBLE); \
+           } else { \
+               prepare_to_wait(&(wq), &__wait, TASK_INTERRUPTIBLE); \
+           } \
+           if(condition) { \
+               break; \
+           } \
+           if(signal_pending(current)) { \
+               __ret = -ERESTARTSYS; \
+               break; \
+           } \
+           if(schedule_hrtimeout_range(&__expires, current->timer_slack_ns, HRTIMER_MODE_ABS) == 0) { \
+               __ret = (condition)?0:-ETIME; \
+               break; \
+           } \
+       } \
+       finish_wait(&(wq), &__wait); \
+       __ret; })
+
 
 /*
  * Fix USHRT_MAX declaration on strange linux
@@ -109,11 +145,8 @@ enum xen_shm_state_t {
     XEN_SHM_STATE_RECEIVER_MAPPED /* First page is mapped in the kernel, other pages in the userspace. Pipe is connected. */
 };
 
-/* Both sides maintain a state in the shared page. It is used for termination. */
+/* Both sides maintain a state in the shared page (XEN_SHM_META_PAGE_STATE_*). It is used for termination. */
 typedef uint8_t xen_shm_meta_page_state;
-#define XEN_SHM_META_PAGE_STATE_NONE    0x01 //The peer didn't do anything
-#define XEN_SHM_META_PAGE_STATE_OPENED  0x02 //The peer is using the pages
-#define XEN_SHM_META_PAGE_STATE_CLOSED  0x03 //Receiver: Pages are unmapped -- Offerer: The receiver must close asap
 
 
 /*
@@ -148,7 +181,8 @@ struct xen_shm_instance_data {
     unsigned int ec_irq;          //The event channel irq
     uint8_t initial_signal;       //0 before the initial signal has been received, 1 after
     uint8_t user_signal;          //0 when a process is waiting, the handler sets it to one and wakes-up the queue
-    uint8_t latent_user_signal;   //0 when the signal is handled, 1 when a signal has been received
+    struct xen_shm_status* status; //The status page, which also holds the latent user signal (0 when the signal is handled, 1 when a signal has been received)
+    spinlock_t wake_lock;          //Serializes the changes of the wake count (handler and XEN_SHM_IOCTL_PASS_WAKE)
 
     /* State depend variables */
     /* Both */
@@ -226,6 +260,34 @@ MODULE_PARM_DESC(xen_shm_domid, "Local domain id");
  *****************/
 
 
+/*
+ * Detect broken pipes
+ */
+static int
+__xen_shm_is_broken_pipe(struct xen_shm_meta_page_data* meta_page_p) {
+    return (meta_page_p->offerer_state == XEN_SHM_META_PAGE_STATE_CLOSED
+            || meta_page_p->receiver_state == XEN_SHM_META_PAGE_STATE_CLOSED);
+}
+
+
+/*
+ * Copies the states of both sides from the shared page to the status page
+ */
+static void
+__xen_shm_update_status(struct xen_shm_instance_data* data)
+{
+    struct xen_shm_meta_page_data* meta_page_p;
+
+    meta_page_p = (struct xen_shm_meta_page_data*) data->shared_memory;
+    if(meta_page_p == NULL) { //Not initialized
+        return;
+    }
+
+    data->status->offerer_state = meta_page_p->offerer_state;
+    data->status->receiver_state = meta_page_p->receiver_state;
+}
+
+
 /*
  * Signal handler
  */
@@ -233,6 +295,7 @@ static irqreturn_t
 xen_shm_event_handler(int irq, void* arg)
 {
     struct xen_shm_instance_data* data;
+    struct xen_shm_meta_page_data* meta_page_p;
 
     data = (struct xen_shm_instance_data*) arg;
 
@@ -243,10 +306,20 @@ xen_shm_event_handler(int irq, void* arg)
         data->initial_signal = 1;
     } else {
         data->user_signal = 1;
-        data->latent_user_signal = 1;
+        data->status->latent_user_signal = 1;
+        data->status->signals_received++;
+        spin_lock(&data->wake_lock);
+        data->status->wake_count++;
+        spin_unlock(&data->wake_lock);
     }
+    __xen_shm_update_status(data); //The other side may have closed
 
-    wake_up_interruptible(&data->wait_queue);
+    meta_page_p = (struct xen_shm_meta_page_data*) data->shared_memory;
+    if(meta_page_p != NULL && __xen_shm_is_broken_pipe(meta_page_p)) { //No exclusive waiter may keep sleeping
+        wake_up_interruptible_all(&data->wait_queue);
+    } else {
+        wake_up_interruptible(&data->wait_queue);
+    }
 
     return IRQ_HANDLED; //Can also return IRQ_NONE or IRQ_WAKE_THREAD
 }
@@ -574,6 +647,7 @@ __xen_shm_free_delayed_queue(void)
             current_i = current_i->next_delayed; //Next
 
             printk(KERN_WARNING "xen_shm: Finally freeing instance (%i) from the queue\n", to_delete->first_page_grant);
+            free_page((unsigned long) to_delete->status);
             kfree(to_delete);
         } else {
             previous = current_i;
@@ -738,6 +812,7 @@ __xen_shm_ioctl_init_offerer(struct xen_shm_instance_data* data,
     /* If OK, states are changed*/
     data->state = XEN_SHM_STATE_OFFERER;
     meta_page_p->offerer_state = XEN_SHM_META_PAGE_STATE_OPENED;
+    __xen_shm_update_status(data);
 
 
     return 0;
@@ -843,6 +918,7 @@ __xen_shm_ioctl_init_receiver(struct xen_shm_instance_data* data,
     /* If OK, states are changed*/
     data->state = XEN_SHM_STATE_RECEIVER;
     meta_page_p->receiver_state = XEN_SHM_META_PAGE_STATE_OPENED;
+    __xen_shm_update_status(data);
 
     /* Send the initial signal */
     notify_remote_via_evtchn(data->local_ec_port);
@@ -863,34 +939,28 @@ undo_alloc:
 
 
 /*
- * Detect broken pipes
- */
-static int
-__xen_shm_is_broken_pipe(struct xen_shm_meta_page_data* meta_page_p) {
-    return (meta_page_p->offerer_state == XEN_SHM_META_PAGE_STATE_CLOSED
-            || meta_page_p->receiver_state == XEN_SHM_META_PAGE_STATE_CLOSED);
-}
-
-
-/*
- * Helper for XEN_SHM_IOCTL_WAIT and XEN_SHM_IOCTL_AWAIT
+ * Helper for XEN_SHM_IOCTL_WAIT, XEN_SHM_IOCTL_AWAIT and XEN_SHM_IOCTL_AWAIT_NS
+ * The timeout and the remaining time are in ns.
  */
 static int
 __xen_shm_ioctl_await(struct xen_shm_instance_data* data,
-                      struct xen_shm_ioctlarg_await* arg)
+                      struct xen_shm_ioctlarg_await_ns* arg)
 {
     struct xen_shm_meta_page_data* meta_page_p;
-    unsigned long jiffies;
+    ktime_t start;
+    s64 elapsed;
     int retval;
     int user_flag;
     int init_flag;
     int mutex_flag;
     int user_latent_flag;
+    int nowait_flag;
 
     user_flag = arg->request_flags & XEN_SHM_IOCTL_AWAIT_USER;
     user_latent_flag = arg->request_flags & XEN_SHM_IOCTL_AWAIT_LATENT_USER;
     init_flag = arg->request_flags & XEN_SHM_IOCTL_AWAIT_INIT;
     mutex_flag = arg->request_flags & XEN_SHM_IOCTL_AWAIT_MUTEX;
+    nowait_flag = arg->request_flags & XEN_SHM_IOCTL_AWAIT_NOWAIT;
 
     if(data->state == XEN_SHM_STATE_OPENED) //Not opened yet
     {
@@ -908,35 +978,47 @@ __xen_shm_ioctl_await(struct xen_shm_instance_data* data,
         return -EDEADLK;
     }
 
-    //Condition telling wether the pipe is known to be closed
+    if(nowait_flag) { //Only looks at what already happened (after a poll)
+        if((user_latent_flag&&data->status->latent_user_signal) || (init_flag&&data->initial_signal)) {
+            if(user_latent_flag) {
+                data->status->latent_user_signal = 0;
+            }
+            arg->remaining_ns = arg->timeout_ns;
+            retval = 0;
+        } else {
+            retval = -EAGAIN;
+        }
+        goto unlock_and_return;
+    }
+
+    //Condition telling wether one of the events happened or the pipe is known to be closed
+#define XEN_SHM_IOCTL_AWAIT_COND ((user_flag&&data->user_signal) || (init_flag&&data->initial_signal) \
+                                  || (user_latent_flag&&data->status->latent_user_signal) || __xen_shm_is_broken_pipe(meta_page_p))
 
     data->user_signal = 0; //Trigger the wait
 
-    if(arg->timeout_ms == 0) {
-        retval = wait_event_interruptible(data->wait_queue,
-                (user_flag&&data->user_signal) || (init_flag&&data->initial_signal)
-                || (user_latent_flag&&data->latent_user_signal) ||
-                __xen_shm_is_broken_pipe(meta_page_p));
+    if(arg->timeout_ns == 0) {
+        retval = wait_event_interruptible(data->wait_queue, XEN_SHM_IOCTL_AWAIT_COND);
         if(retval < 0) {
             goto unlock_and_return;
         }
     } else {
-        jiffies = (arg->timeout_ms*HZ)/1000;
-        jiffies = (jiffies==0)?1:jiffies; //Cannot be null
-        retval = wait_event_interruptible_timeout(data->wait_queue,
-                (user_flag&&data->user_signal) || (init_flag&&data->initial_signal)
-                || (user_latent_flag&&data->latent_user_signal) ||
-                __xen_shm_is_broken_pipe(meta_page_p),
-                        jiffies);
-        if(retval < 0) {
+        start = ktime_get();
+        retval = XEN_SHM_WAIT_EVENT_TIMEOUT_NS(data->wait_queue, XEN_SHM_IOCTL_AWAIT_COND, arg->timeout_ns, 0);
+        if(retval == -ETIME) { //Not an error
+            arg->remaining_ns = 0;
+        } else if(retval < 0) {
             goto unlock_and_return;
+        } else {
+            elapsed = ktime_to_ns(ktime_sub(ktime_get(), start));
+            arg->remaining_ns = (elapsed < 0)?arg->timeout_ns:
+                                ((u64) elapsed < arg->timeout_ns)?arg->timeout_ns - (u64) elapsed:1; //Zero means the timeout
         }
-        arg->remaining_ms = (retval==jiffies)?arg->timeout_ms:(retval*1000)/HZ;
         retval = 0;
     }
 
     if(user_flag || user_latent_flag) {
-        data->latent_user_signal = 0;
+        data->status->latent_user_signal = 0;
     }
 
     if(__xen_shm_is_broken_pipe(meta_page_p)) {
@@ -971,6 +1053,96 @@ __xen_shm_ioctl_ssig(struct xen_shm_instance_data* data) {
     }
 
     notify_remote_via_evtchn(data->local_ec_port);
+    data->status->signals_sent++;
+
+    return 0;
+}
+
+
+/*
+ * Helper for XEN_SHM_IOCTL_AWAIT_WAKE and XEN_SHM_IOCTL_AWAIT_WAKE_TIMED
+ * Nothing is consumed: all the waiters see the wake count change (the exclusive ones are woken up one at a time).
+ * Only the bits of count_mask of the wake count are compared to arg->wake_count.
+ */
+static int
+__xen_shm_ioctl_await_wake(struct xen_shm_instance_data* data,
+                           struct xen_shm_ioctlarg_await_wake* arg,
+                           u64 count_mask)
+{
+    struct xen_shm_meta_page_data* meta_page_p;
+    ktime_t start;
+    s64 elapsed;
+    int retval;
+    int exclusive_flag;
+
+    exclusive_flag = arg->request_flags & XEN_SHM_IOCTL_AWAIT_WAKE_EXCLUSIVE;
+
+    if(data->state == XEN_SHM_STATE_OPENED) //Not opened yet
+    {
+        return -ENOTTY;
+    }
+
+    meta_page_p = (struct xen_shm_meta_page_data*) data->shared_memory;
+
+    if(__xen_shm_is_broken_pipe(meta_page_p)) {
+        return -EPIPE;
+    }
+
+    //Condition telling wether the wake count changed since the caller read it or the pipe is known to be closed
+#define XEN_SHM_IOCTL_AWAIT_WAKE_COND ((data->status->wake_count & count_mask) != arg->wake_count || __xen_shm_is_broken_pipe(meta_page_p))
+
+    if(arg->request_flags & XEN_SHM_IOCTL_AWAIT_WAKE_SSIG) { //The answer changes the wake count, it can't be missed
+        notify_remote_via_evtchn(data->local_ec_port);
+        data->status->signals_sent++;
+    }
+
+    if(arg->timeout_ns == 0) {
+        if(exclusive_flag) {
+            retval = wait_event_interruptible_exclusive(data->wait_queue, XEN_SHM_IOCTL_AWAIT_WAKE_COND);
+        } else {
+            retval = wait_event_interruptible(data->wait_queue, XEN_SHM_IOCTL_AWAIT_WAKE_COND);
+        }
+    } else {
+        start = ktime_get();
+        retval = XEN_SHM_WAIT_EVENT_TIMEOUT_NS(data->wait_queue, XEN_SHM_IOCTL_AWAIT_WAKE_COND, arg->timeout_ns, exclusive_flag);
+        if(retval == -ETIME) { //Not an error
+            arg->remaining_ns = 0;
+            retval = 0;
+        } else if(retval == 0) {
+            elapsed = ktime_to_ns(ktime_sub(ktime_get(), start));
+            arg->remaining_ns = (elapsed < 0)?arg->timeout_ns:
+                                ((u64) elapsed < arg->timeout_ns)?arg->timeout_ns - (u64) elapsed:1; //Zero means the timeout
+        }
+    }
+#undef XEN_SHM_IOCTL_AWAIT_WAKE_COND
+    if(retval < 0) {
+        return retval;
+    }
+
+    if(__xen_shm_is_broken_pipe(meta_page_p)) {
+        return -EPIPE;
+    }
+
+    return 0;
+}
+
+
+/*
+ * Helper for XEN_SHM_IOCTL_PASS_WAKE
+ */
+static int
+__xen_shm_ioctl_pass_wake(struct xen_shm_instance_data* data) {
+    unsigned long flags;
+
+    if(data->state == XEN_SHM_STATE_OPENED) {
+        return -ENOTTY;
+    }
+
+    spin_lock_irqsave(&data->wake_lock, flags);
+    data->status->wake_count++;
+    spin_unlock_irqrestore(&data->wake_lock, flags);
+
+    wake_up_interruptible(&data->wait_queue);
 
     return 0;
 }
@@ -1012,7 +1184,13 @@ xen_shm_open(struct inode * inode, struct file * filp)
     instance_data->user_mem = NULL;
     instance_data->initial_signal = 0;
     instance_data->user_signal = 0;
-    instance_data->latent_user_signal = 0;
+    spin_lock_init(&instance_data->wake_lock);
+    instance_data->status = (struct xen_shm_status*) get_zeroed_page(GFP_KERNEL);
+    if (instance_data->status == NULL) {
+        kfree(instance_data);
+        return -ENOMEM;
+    }
+    instance_data->status->magic = XEN_SHM_STATUS_MAGIC;
     instance_data->use_ptemod = xen_pv_domain();
     if (instance_data->use_ptemod) {
         instance_data->mm = get_task_mm(current);
@@ -1039,6 +1217,7 @@ xen_shm_open(struct inode * inode, struct file * filp)
     return 0;
 
 clean:
+    free_page((unsigned long) instance_data->status);
     kfree(instance_data);
     return -ENOMEM;
 }
@@ -1065,6 +1244,8 @@ xen_shm_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
     struct xen_shm_ioctlarg_receiver receiver_karg;
     struct xen_shm_ioctlarg_getdomid getdomid_karg;
     struct xen_shm_ioctlarg_await await_karg;
+    struct xen_shm_ioctlarg_await_ns await_ns_karg;
+    struct xen_shm_ioctlarg_await_wake await_wake_karg;
 
     /* retval */
     int retval = 0;
@@ -1126,10 +1307,11 @@ xen_shm_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
             /*
              * Waits until a signal is received through the event channel
              */
-            await_karg.remaining_ms = 0;
-            await_karg.request_flags = XEN_SHM_IOCTL_AWAIT_INIT | XEN_SHM_IOCTL_AWAIT_USER;
+            await_ns_karg.timeout_ns = 0;
+            await_ns_karg.remaining_ns = 0;
+            await_ns_karg.request_flags = XEN_SHM_IOCTL_AWAIT_INIT | XEN_SHM_IOCTL_AWAIT_USER;
 
-            return __xen_shm_ioctl_await(instance_data, &await_karg);
+            return __xen_shm_ioctl_await(instance_data, &await_ns_karg);
 
             break;
         case XEN_SHM_IOCTL_AWAIT:
@@ -1140,14 +1322,38 @@ xen_shm_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
             if (retval != 0)
                 return -EFAULT;
 
-            retval = __xen_shm_ioctl_await(instance_data, &await_karg);
+            await_ns_karg.request_flags = await_karg.request_flags;
+            await_ns_karg.timeout_ns = (u64) await_karg.timeout_ms*NSEC_PER_MSEC;
+            await_ns_karg.remaining_ns = 0;
+
+            retval = __xen_shm_ioctl_await(instance_data, &await_ns_karg);
             if (retval != 0)
                 return retval;
 
+            //Rounded up: zero only means the timeout
+            await_karg.remaining_ms = (unsigned long) div_u64(await_ns_karg.remaining_ns + NSEC_PER_MSEC - 1, NSEC_PER_MSEC);
+
             retval = copy_to_user(arg_p, &await_karg, sizeof(struct xen_shm_ioctlarg_await)); //Copying to userspace
             if (retval != 0)
                 return -EFAULT;
 
+            break;
+        case XEN_SHM_IOCTL_AWAIT_NS:
+            /*
+             * Same as XEN_SHM_IOCTL_AWAIT, with a timeout in nanoseconds
+             */
+            retval = copy_from_user(&await_ns_karg, arg_p, sizeof(struct xen_shm_ioctlarg_await_ns)); //Copying from userspace
+            if (retval != 0)
+                return -EFAULT;
+
+            retval = __xen_shm_ioctl_await(instance_data, &await_ns_karg);
+            if (retval != 0)
+                return retval;
+
+            retval = copy_to_user(arg_p, &await_ns_karg, sizeof(struct xen_shm_ioctlarg_await_ns)); //Copying to userspace
+            if (retval != 0)
+                return -EFAULT;
+
             break;
         case XEN_SHM_IOCTL_SSIG:
             /*
@@ -1167,6 +1373,43 @@ xen_shm_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
             if (retval != 0)
                 return -EFAULT;
 
+            break;
+        case XEN_SHM_IOCTL_AWAIT_WAKE:
+            /*
+             * Waits for the wake count to change, without consuming anything (shared instances).
+             * The count and the flags are in the argument itself: nothing to copy
+             */
+            await_wake_karg.request_flags = (uint8_t) (arg & XEN_SHM_AWAIT_WAKE_FLAGS_MASK);
+            await_wake_karg.wake_count = arg >> XEN_SHM_AWAIT_WAKE_FLAGS_BITS;
+            await_wake_karg.timeout_ns = 0;
+
+            return __xen_shm_ioctl_await_wake(instance_data, &await_wake_karg, ULONG_MAX >> XEN_SHM_AWAIT_WAKE_FLAGS_BITS);
+
+            break;
+        case XEN_SHM_IOCTL_AWAIT_WAKE_TIMED:
+            /*
+             * Same, with a timeout: the remaining time is copied back
+             */
+            retval = copy_from_user(&await_wake_karg, arg_p, sizeof(struct xen_shm_ioctlarg_await_wake)); //Copying from userspace
+            if (retval != 0)
+                return -EFAULT;
+
+            retval = __xen_shm_ioctl_await_wake(instance_data, &await_wake_karg, ~0ULL);
+            if (retval != 0 || await_wake_karg.timeout_ns == 0)
+                return retval;
+
+            retval = copy_to_user(arg_p, &await_wake_karg, sizeof(struct xen_shm_ioctlarg_await_wake)); //Copying to userspace
+            if (retval != 0)
+                return -EFAULT;
+
+            break;
+        case XEN_SHM_IOCTL_PASS_WAKE:
+            /*
+             * Hands a wake up over to another waiter
+             */
+
+            return __xen_shm_ioctl_pass_wake(instance_data);
+
             break;
         default:
             return -ENOTTY;
@@ -1195,6 +1438,14 @@ xen_shm_mmap(struct file *filp, struct vm_area_struct *vma)
 
     data = (struct xen_shm_instance_data*) filp->private_data;
 
+    if (vma->vm_pgoff == (XEN_SHM_STATUS_PAGE_OFFSET >> PAGE_SHIFT)) { //The status page, in any state
+        if ((vma->vm_flags & VM_WRITE) || vma->vm_end - vma->vm_start != PAGE_SIZE) {
+            return -EINVAL;
+        }
+        vma->vm_flags &= ~VM_MAYWRITE; //Read-only for good (no mprotect)
+        return remap_pfn_range(vma, vma->vm_start, virt_to_pfn(data->status), PAGE_SIZE, vma->vm_page_prot);
+    }
+
     switch(data->state) {
         case XEN_SHM_STATE_OPENED:
             // Too soon
@@ -1375,6 +1626,7 @@ xen_shm_release(struct inode * inode, struct file * filp)
         return 0;
     }
 
+    free_page((unsigned long) data->status);
     kfree(filp->private_data);
 
     if (data->use_ptemod) {
@@ -1385,6 +1637,37 @@ xen_shm_release(struct inode * inode, struct file * filp)
 }
 
 
+/*
+ * POLL.
+ * Readable when a user signal has been received and not handled yet, hung up when the memory has been closed on one side.
+ * The signal is not consumed here, see XEN_SHM_IOCTL_AWAIT_NOWAIT.
+ */
+static unsigned int
+xen_shm_poll(struct file *filp, poll_table *wait)
+{
+    struct xen_shm_instance_data* data;
+    unsigned int mask;
+
+    data = (struct xen_shm_instance_data*) filp->private_data;
+
+    if(data->state == XEN_SHM_STATE_OPENED) { //Not initialized, nothing will ever happen
+        return POLLERR;
+    }
+
+    poll_wait(filp, &data->wait_queue, wait); //Woken up by the event handler and on release
+
+    mask = 0;
+    if(data->status->latent_user_signal) {
+        mask |= POLLIN | POLLRDNORM;
+    }
+    if(__xen_shm_is_broken_pipe((struct xen_shm_meta_page_data*) data->shared_memory)) {
+        mask |= POLLHUP;
+    }
+
+    return mask;
+}
+
+
 /*
  * Defines the device file operations
  */
@@ -1393,6 +1676,7 @@ const struct file_operations xen_shm_file_ops = {
     .open = xen_shm_open,
     .unlocked_ioctl = xen_shm_ioctl,
     .mmap = xen_shm_mmap,
+    .poll = xen_shm_poll,
     .release = xen_shm_release,
 };
 
@@ -101,16 +101,17 @@ struct xen_shm_ioctlarg_receiver {
  *         -ENOTTY if the memory has not been initialized
  *         -EPIPE if the memory has been closed on one side
  *         -EDEADLK if the mutex flag is set and the other process is already waiting with the mutex flag set
+ *         -EAGAIN if the nowait flag is set and none of the events happened
  *         0 otherwise
  */
 #define XEN_SHM_IOCTL_AWAIT           _IOWR(XEN_SHM_MAGIC_NUMBER, 4, struct xen_shm_ioctlarg_await )
 struct xen_shm_ioctlarg_await {
     /* In arguments */
     uint8_t request_flags;      //Indicate what events to wait for (0 means you wait until the memory is closed)
-    unsigned long timeout_ms;   //Timeout in ms (0 for no timeout) /!\ Jiffies are used, so the precision is bad (typically some ms)
+    unsigned long timeout_ms;   //Timeout in ms (0 for no timeout)
 
     /* Out arguments */
-    unsigned long remaining_ms; //Zero if the timeout has reached its end. Approximate remaining time otherwise.
+    unsigned long remaining_ms; //Zero if the timeout has reached its end. Remaining time otherwise (rounded up).
 };
 /* Waits for a userspace signal. */
 #define XEN_SHM_IOCTL_AWAIT_USER 0x01
@@ -120,6 +121,32 @@ struct xen_shm_ioctlarg_await {
 #define XEN_SHM_IOCTL_AWAIT_MUTEX 0x04
 /* Wait for a user event that has not been handled (returns immediately if a signal has been received but not handled)  */
 #define XEN_SHM_IOCTL_AWAIT_LATENT_USER 0x08
+/* Does not sleep: returns -EAGAIN if none of the awaited events happened (consumes the latent user signal otherwise) */
+#define XEN_SHM_IOCTL_AWAIT_NOWAIT 0x10
+
+/*
+ * Same as XEN_SHM_IOCTL_AWAIT, with a timeout in nanoseconds.
+ * The timeout runs on a high resolution timer: it never expires early, and late by the task's timer slack at most
+ * (50 us by default, see PR_SET_TIMERSLACK), plus the scheduling latency.
+ * remaining_ns is measured with the nanosecond clock.
+ */
+#define XEN_SHM_IOCTL_AWAIT_NS        _IOWR(XEN_SHM_MAGIC_NUMBER, 9, struct xen_shm_ioctlarg_await_ns )
+struct xen_shm_ioctlarg_await_ns {
+    /* In arguments */
+    uint8_t request_flags;      //Same as XEN_SHM_IOCTL_AWAIT
+    uint64_t timeout_ns;        //Timeout in ns (0 for no timeout)
+
+    /* Out arguments */
+    uint64_t remaining_ns;      //Zero if the timeout has reached its end. Remaining time otherwise.
+};
+
+
+/*
+ * The device can be polled (poll, select, epoll):
+ * POLLIN when a user signal has been received and not handled yet (see XEN_SHM_IOCTL_AWAIT_LATENT_USER),
+ * POLLHUP when the memory has been closed on one side, POLLERR if it has not been initialized.
+ * Polling does not consume the signal: use XEN_SHM_IOCTL_AWAIT with XEN_SHM_IOCTL_AWAIT_LATENT_USER|XEN_SHM_IOCTL_AWAIT_NOWAIT.
+ */
 
 
 /*
@@ -141,4 +168,83 @@ struct xen_shm_ioctlarg_getdomid {
 
 };
 
+
+/*
+ * Status page.
+ * A read-only page can be mapped at this offset (one page, PROT_READ and MAP_SHARED), at any time after open.
+ * It tells the states of both sides and if a user signal is pending with plain loads, without any ioctl.
+ * The module updates it when a signal is received or consumed, when a side is initialized and on XEN_SHM_IOCTL_PASS_WAKE.
+ * The other side closing sends a signal, so its state is up to date once the signal is received.
+ */
+#define XEN_SHM_STATUS_PAGE_OFFSET 0x10000000 //Far after the shared pages
+
+#define XEN_SHM_STATUS_MAGIC 0x5853484d
+
+/* States of the sides (0 before the initialization) */
+#define XEN_SHM_META_PAGE_STATE_NONE    0x01 //The peer didn't do anything
+#define XEN_SHM_META_PAGE_STATE_OPENED  0x02 //The peer is using the pages
+#define XEN_SHM_META_PAGE_STATE_CLOSED  0x03 //Receiver: Pages are unmapped -- Offerer: The receiver must close asap
+
+struct xen_shm_status {
+    uint32_t magic;              //XEN_SHM_STATUS_MAGIC
+    uint8_t offerer_state;       //The state of the offerer
+    uint8_t receiver_state;      //The state of the receiver
+    uint8_t latent_user_signal;  //1 when a user signal has been received and not handled yet (see XEN_SHM_IOCTL_AWAIT_LATENT_USER)
+    uint8_t padding;
+    uint64_t signals_received;   //User signals received through the event channel
+    uint64_t signals_sent;       //Signals sent with XEN_SHM_IOCTL_SSIG and XEN_SHM_IOCTL_AWAIT_WAKE(_TIMED)
+    uint64_t wake_count;         //Changes on each user signal received and each XEN_SHM_IOCTL_PASS_WAKE (see XEN_SHM_IOCTL_AWAIT_WAKE)
+};
+
+
+/*
+ * Waits until the wake count of the status page is not the given one anymore, or the memory is closed. No timeout.
+ * The wake count is read from the status page before looking at the shared memory one last time: a signal
+ * received since then makes the call return at once. Unlike the latent user signal, nothing is consumed,
+ * so any number of waiters can share the instance (both pipes of a duplex channel, several threads).
+ * The argument is not a pointer: it is XEN_SHM_AWAIT_WAKE_ARG(wake_count, flags), so that nothing is copied
+ * (one system call per round trip of a request-response protocol, with XEN_SHM_IOCTL_AWAIT_WAKE_SSIG).
+ * Only the bits of the wake count that fit in it are compared (all but the two highest ones).
+ * Returns -ERESTARTSYS if a signal interrupted the wait.
+ *         -ENOTTY if the memory has not been initialized
+ *         -EPIPE if the memory has been closed on one side
+ *         0 otherwise
+ * The signal of XEN_SHM_IOCTL_AWAIT_WAKE_SSIG is not sent if the call fails before waiting.
+ */
+#define XEN_SHM_IOCTL_AWAIT_WAKE      _IO(XEN_SHM_MAGIC_NUMBER, 10)
+#define XEN_SHM_AWAIT_WAKE_FLAGS_BITS 2
+#define XEN_SHM_AWAIT_WAKE_FLAGS_MASK ((1UL << XEN_SHM_AWAIT_WAKE_FLAGS_BITS) - 1)
+#define XEN_SHM_AWAIT_WAKE_ARG(wake_count, flags) \
+    (((unsigned long) (wake_count) << XEN_SHM_AWAIT_WAKE_FLAGS_BITS) | ((unsigned long) (flags) & XEN_SHM_AWAIT_WAKE_FLAGS_MASK))
+
+
+/*
+ * Same as XEN_SHM_IOCTL_AWAIT_WAKE, with a timeout (the whole wake count is compared).
+ * The timeout has the same precision as XEN_SHM_IOCTL_AWAIT_NS. The argument is copied back only with a timeout.
+ * Returns the same values as XEN_SHM_IOCTL_AWAIT_WAKE (remaining_ns is zero if the timeout has reached its end).
+ */
+#define XEN_SHM_IOCTL_AWAIT_WAKE_TIMED _IOWR(XEN_SHM_MAGIC_NUMBER, 12, struct xen_shm_ioctlarg_await_wake )
+struct xen_shm_ioctlarg_await_wake {
+    /* In arguments */
+    uint8_t request_flags;      //XEN_SHM_IOCTL_AWAIT_WAKE_* flags
+    uint64_t wake_count;        //The wake count read from the status page
+    uint64_t timeout_ns;        //Timeout in ns (0 for no timeout)
+
+    /* Out arguments */
+    uint64_t remaining_ns;      //Zero if the timeout has reached its end. Remaining time otherwise.
+};
+/* Sends a signal through the event channel once the wait is started: an answer to it can't be missed */
+#define XEN_SHM_IOCTL_AWAIT_WAKE_SSIG 0x01
+/* Among the exclusive waiters, a signal or a XEN_SHM_IOCTL_PASS_WAKE only wakes one up */
+#define XEN_SHM_IOCTL_AWAIT_WAKE_EXCLUSIVE 0x02
+
+
+/*
+ * Changes the wake count and wakes up the waiters of XEN_SHM_IOCTL_AWAIT_WAKE(_TIMED) as a received signal would
+ * (one of the exclusive ones). A woken waiter passes the wake up on this way when it leaves work for another one.
+ * Returns -ENOTTY if the memory has not been initialized.
+ * Argument is ignored
+ */
+#define XEN_SHM_IOCTL_PASS_WAKE       _IO(XEN_SHM_MAGIC_NUMBER, 11)
+
 #endif
@@ -0,0 +1,539 @@
+/*
+ * Xen shared memory stream multiplexer
+ *
+ * Authors: Vincent Brillault <git@lerya.net>
+ *          Pierre Pfister    <oryon@darou.fr>
+ *
+ * This file contains the code and private headers of the
+ * Xen shared memory stream multiplexer. See the headers file for
+ * precisions about this module.
+ *
+ * Every message carries a header with its stream and the credit
+ * given back for that stream in the other direction. A message without
+ * payload only gives credit back. Both pipes are used in non-blocking
+ * mode, and the multiplexer sleeps on the wake count of the fd they share
+ * (xen_shm_pipe_wait_wake), so that a side waiting to send still receives
+ * (and a full ring in both directions can't deadlock).
+ *
+ */
+#include <errno.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "xen_shm_mux.h"
+
+
+/*
+ * No stream wanted in particular
+ */
+#define XEN_SHM_MUX_ANY_STREAM UINT32_MAX
+
+
+/*
+ * The header of each message
+ */
+struct xen_shm_mux_header {
+    uint32_t stream;
+    uint32_t credit; //Bytes of that stream given back to the other side
+};
+
+/*
+ * The flow control state of a stream
+ */
+struct xen_shm_mux_stream {
+    uint32_t credit;   //Bytes we can still send
+    uint32_t consumed; //Bytes received by the application and not given back yet
+};
+
+/*
+ * A received message kept for a later receive call
+ */
+struct xen_shm_mux_pending {
+    struct xen_shm_mux_pending* next;
+    uint32_t stream;
+    size_t len;
+    uint8_t data[];
+};
+
+struct xen_shm_mux {
+    xen_shm_pipe_p receive;
+    xen_shm_pipe_p send;
+
+    uint32_t stream_count;
+    uint32_t window;
+    struct xen_shm_mux_stream* streams;
+    uint32_t owed; //Streams whose consumed bytes reached half the window
+
+    /* Received messages, in order */
+    struct xen_shm_mux_pending* pending_head;
+    struct xen_shm_mux_pending* pending_tail;
+
+    uint8_t* scratch; //Copy of a message that goes through the end of the ring
+    int peeked;       //A message is peeked in the receive pipe
+
+    /* The message given by the last peek, until done (its credit is applied already) */
+    int held;
+    uint32_t held_stream;
+    const uint8_t* held_payload;
+    size_t held_len;
+
+    int eof;
+};
+
+
+int __xen_shm_mux_peek(struct xen_shm_mux* mux, uint32_t* stream, const uint8_t** payload, size_t* len);
+void __xen_shm_mux_done(struct xen_shm_mux* mux);
+int __xen_shm_mux_keep(struct xen_shm_mux* mux, uint32_t stream, const uint8_t* payload, size_t len);
+int __xen_shm_mux_service(struct xen_shm_mux* mux);
+void __xen_shm_mux_consumed(struct xen_shm_mux* mux, uint32_t stream, size_t len);
+void __xen_shm_mux_flush_credits(struct xen_shm_mux* mux);
+int __xen_shm_mux_wait(struct xen_shm_mux* mux, size_t room);
+int __xen_shm_mux_recv(struct xen_shm_mux* mux, uint32_t want, uint32_t* stream, void* buf, size_t size, size_t* len);
+
+
+int
+xen_shm_mux_init(xen_shm_mux_p* xmux, xen_shm_pipe_p receive_pipe, xen_shm_pipe_p send_pipe,
+                 uint32_t stream_count, uint32_t window) {
+    struct xen_shm_mux* mux;
+    uint32_t i;
+
+    if(stream_count == 0 || stream_count == XEN_SHM_MUX_ANY_STREAM
+       || window <= sizeof(struct xen_shm_mux_header)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if(!xen_shm_pipe_is_duplex(receive_pipe, send_pipe)) { //The credits come back on the other direction of the channel
+        errno = EINVAL;
+        return -1;
+    }
+
+    if(xen_shm_pipe_writable(send_pipe, window) < 0 || xen_shm_pipe_readable(receive_pipe) < 0) {
+        return -1;
+    }
+
+    mux = malloc(sizeof(struct xen_shm_mux));
+    if(mux == NULL) {
+        return -1;
+    }
+    memset(mux, 0, sizeof(struct xen_shm_mux));
+
+    mux->streams = malloc(sizeof(struct xen_shm_mux_stream) * stream_count);
+    mux->scratch = malloc(window);
+    if(mux->streams == NULL || mux->scratch == NULL) {
+        free(mux->streams);
+        free(mux->scratch);
+        free(mux);
+        return -1;
+    }
+
+    for(i = 0; i < stream_count; i++) {
+        mux->streams[i].credit = window;
+        mux->streams[i].consumed = 0;
+    }
+
+    mux->receive = receive_pipe;
+    mux->send = send_pipe;
+    mux->stream_count = stream_count;
+    mux->window = window;
+
+    xen_shm_pipe_set_nonblock(receive_pipe, 1);
+    xen_shm_pipe_set_nonblock(send_pipe, 1);
+
+    *xmux = mux;
+    return 0;
+}
+
+uint32_t
+xen_shm_mux_stream_count(xen_shm_mux_p xmux) {
+    return xmux->stream_count;
+}
+
+void
+xen_shm_mux_free(xen_shm_mux_p xmux) {
+    struct xen_shm_mux* mux;
+    struct xen_shm_mux_pending* pending;
+
+    mux = xmux;
+
+    while(mux->pending_head != NULL) {
+        pending = mux->pending_head;
+        mux->pending_head = pending->next;
+        free(pending);
+    }
+
+    xen_shm_pipe_free(mux->send);
+    xen_shm_pipe_free(mux->receive);
+
+    free(mux->streams);
+    free(mux->scratch);
+    free(mux);
+}
+
+/*
+ * Gets the next message with a payload from the receive pipe. The credits found on the way are applied.
+ * The message must be released with __xen_shm_mux_done.
+ * Returns 1 if a message is there, 0 if EOF, -1 on error (EAGAIN if nothing is there yet).
+ */
+int
+__xen_shm_mux_peek(struct xen_shm_mux* mux, uint32_t* stream, const uint8_t** payload, size_t* len) {
+    struct xen_shm_mux_header header;
+    const void* ptr;
+    size_t msg_len;
+    int ret;
+
+    if(mux->held) { //Not done yet, its credit must not be applied twice
+        *stream = mux->held_stream;
+        *payload = mux->held_payload;
+        *len = mux->held_len;
+        return 1;
+    }
+
+    for(;;) {
+        ret = xen_shm_pipe_recv_msg_peek(mux->receive, &ptr, &msg_len);
+        if(ret <= 0) {
+            return ret;
+        }
+
+        if(msg_len < sizeof(struct xen_shm_mux_header) || msg_len > mux->window) {
+            errno = EPROTO;
+            return -1;
+        }
+
+        if(ptr == NULL) { //Goes through the end of the ring
+            if(xen_shm_pipe_recv_msg(mux->receive, mux->scratch, mux->window, &msg_len) <= 0) {
+                return -1;
+            }
+            ptr = mux->scratch;
+        } else {
+            mux->peeked = 1;
+        }
+
+        memcpy(&header, ptr, sizeof(struct xen_shm_mux_header));
+        if(header.stream >= mux->stream_count
+           || header.credit > mux->window - mux->streams[header.stream].credit) {
+            __xen_shm_mux_done(mux);
+            errno = EPROTO;
+            return -1;
+        }
+        mux->streams[header.stream].credit += header.credit;
+
+        if(msg_len > sizeof(struct xen_shm_mux_header)) {
+            mux->held = 1;
+            mux->held_stream = header.stream;
+            mux->held_payload = (const uint8_t*) ptr + sizeof(struct xen_shm_mux_header);
+            mux->held_len = msg_len - sizeof(struct xen_shm_mux_header);
+            *stream = mux->held_stream;
+            *payload = mux->held_payload;
+            *len = mux->held_len;
+            return 1;
+        }
+
+        __xen_shm_mux_done(mux); //Only a credit
+    }
+}
+
+/* Gives the last peeked message back to the other side */
+void
+__xen_shm_mux_done(struct xen_shm_mux* mux) {
+    if(mux->peeked) {
+        xen_shm_pipe_recv_msg_consume(mux->receive);
+        mux->peeked = 0;
+    }
+    mux->held = 0;
+}
+
+/* Keeps a copy of a received message for a later receive call */
+int
+__xen_shm_mux_keep(struct xen_shm_mux* mux, uint32_t stream, const uint8_t* payload, size_t len) {
+    struct xen_shm_mux_pending* pending;
+
+    pending = malloc(sizeof(struct xen_shm_mux_pending) + len);
+    if(pending == NULL) {
+        return -1;
+    }
+
+    pending->next = NULL;
+    pending->stream = stream;
+    pending->len = len;
+    memcpy(pending->data, payload, len);
+
+    if(mux->pending_tail == NULL) {
+        mux->pending_head = pending;
+    } else {
+        mux->pending_tail->next = pending;
+    }
+    mux->pending_tail = pending;
+
+    return 0;
+}
+
+/*
+ * Takes everything the receive pipe holds: credits are applied and messages are kept.
+ * Returns 0 once the pipe is empty (or EOF), -1 on error.
+ */
+int
+__xen_shm_mux_service(struct xen_shm_mux* mux) {
+    const uint8_t* payload;
+    uint32_t stream;
+    size_t len;
+    int ret;
+
+    while(!mux->eof) {
+        ret = __xen_shm_mux_peek(mux, &stream, &payload, &len);
+        if(ret == 0) {
+            mux->eof = 1;
+        } else if(ret < 0) {
+            return (errno == EAGAIN)?0:-1;
+        } else {
+            if(__xen_shm_mux_keep(mux, stream, payload, len)) {
+                return -1; //Held, given again by the next peek
+            }
+            __xen_shm_mux_done(mux);
+        }
+    }
+
+    return 0;
+}
+
+/* Accounts the bytes of a message given to the application */
+void
+__xen_shm_mux_consumed(struct xen_shm_mux* mux, uint32_t stream, size_t len) {
+    struct xen_shm_mux_stream* s;
+
+    s = &mux->streams[stream];
+    if(s->consumed < mux->window/2) {
+        s->consumed += (uint32_t) (len + sizeof(struct xen_shm_mux_header));
+        if(s->consumed >= mux->window/2) {
+            mux->owed++;
+        }
+    } else {
+        s->consumed += (uint32_t) (len + sizeof(struct xen_shm_mux_header));
+    }
+}
+
+/*
+ * Gives the credits of the streams that consumed half their window back to the other side, as long as the ring has room.
+ * If the other side can't read them anymore, they are dropped.
+ */
+void
+__xen_shm_mux_flush_credits(struct xen_shm_mux* mux) {
+    struct xen_shm_mux_header header;
+    uint32_t i;
+
+    for(i = 0; i < mux->stream_count && mux->owed != 0; i++) {
+        if(mux->streams[i].consumed < mux->window/2) {
+            continue;
+        }
+
+        header.stream = i;
+        header.credit = mux->streams[i].consumed;
+        if(xen_shm_pipe_send_msg(mux->send, &header, sizeof(struct xen_shm_mux_header))) {
+            if(errno == EAGAIN) { //Next time
+                return;
+            }
+            for(i = 0; i < mux->stream_count; i++) {
+                mux->streams[i].consumed = 0;
+            }
+            mux->owed = 0;
+            return;
+        }
+
+        mux->streams[i].consumed = 0;
+        mux->owed--;
+    }
+}
+
+/*
+ * Sleeps until one of the pipes moved, once the calls that failed with EAGAIN armed them.
+ * 'room' is the record the sender is waiting for (0 if none).
+ * Returns 0 when it is worth trying again, -1 with errno set to EPIPE if the other side is gone.
+ */
+int
+__xen_shm_mux_wait(struct xen_shm_mux* mux, size_t room) {
+    uint64_t wake;
+
+    wake = xen_shm_pipe_wake_count(mux->send); //Before the last look: a signal coming after it ends the wait at once
+    if(room != 0 && xen_shm_pipe_writable(mux->send, room) != 0) {
+        return 0;
+    }
+    if(mux->owed != 0 && xen_shm_pipe_writable(mux->send, sizeof(struct xen_shm_mux_header)) != 0) {
+        return 0;
+    }
+    if(!mux->eof && xen_shm_pipe_readable(mux->receive) != 0) {
+        return 0;
+    }
+
+    if(xen_shm_pipe_wait_wake(mux->send, wake) < 0 && errno != EINTR) {
+        return -1;
+    }
+
+    return 0;
+}
+
+int
+xen_shm_mux_send(xen_shm_mux_p xmux, uint32_t stream, const void* buf, size_t len) {
+    struct xen_shm_mux* mux;
+    struct xen_shm_mux_header header;
+    struct iovec iov[2];
+    size_t cost;
+    size_t room;
+
+    mux = xmux;
+
+    if(stream >= mux->stream_count) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if(len > mux->window - sizeof(struct xen_shm_mux_header)) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    cost = len + sizeof(struct xen_shm_mux_header);
+
+    iov[0].iov_base = &header;
+    iov[0].iov_len = sizeof(struct xen_shm_mux_header);
+    iov[1].iov_base = (void*) (uintptr_t) buf; //Will not be modified
+    iov[1].iov_len = len;
+
+    for(;;) {
+        room = 0;
+        if(mux->streams[stream].credit >= cost) {
+            header.stream = stream;
+            header.credit = mux->streams[stream].consumed; //Piggybacked
+            if(xen_shm_pipe_send_msgv(mux->send, iov, 2) == 0) {
+                mux->streams[stream].credit -= (uint32_t) cost;
+                if(mux->streams[stream].consumed >= mux->window/2) {
+                    mux->owed--;
+                }
+                mux->streams[stream].consumed = 0;
+                return 0;
+            }
+            if(errno != EAGAIN) {
+                return -1;
+            }
+            room = cost;
+        } else if(mux->eof) { //No credit will ever come
+            errno = EPIPE;
+            return -1;
+        }
+
+        //Credits may be there, and the other side may be waiting for ours
+        if(__xen_shm_mux_service(mux)) {
+            return -1;
+        }
+        __xen_shm_mux_flush_credits(mux);
+
+        if(mux->streams[stream].credit >= cost && room == 0) {
+            continue;
+        }
+
+        if(__xen_shm_mux_wait(mux, room)) {
+            return -1;
+        }
+    }
+}
+
+/* Receive calls, for one stream or any of them */
+int
+__xen_shm_mux_recv(struct xen_shm_mux* mux, uint32_t want, uint32_t* stream, void* buf, size_t size, size_t* len) {
+    struct xen_shm_mux_pending* pending;
+    struct xen_shm_mux_pending* prev;
+    const uint8_t* payload;
+    uint32_t msg_stream;
+    size_t msg_len;
+    int ret;
+
+    for(;;) {
+        prev = NULL;
+        pending = mux->pending_head;
+        while(pending != NULL && want != XEN_SHM_MUX_ANY_STREAM && pending->stream != want) {
+            prev = pending;
+            pending = pending->next;
+        }
+
+        if(pending != NULL) { //Kept earlier
+            *stream = pending->stream;
+            *len = pending->len;
+            if(pending->len > size) {
+                errno = EMSGSIZE;
+                return -1;
+            }
+
+            memcpy(buf, pending->data, pending->len);
+            if(prev == NULL) {
+                mux->pending_head = pending->next;
+            } else {
+                prev->next = pending->next;
+            }
+            if(mux->pending_tail == pending) {
+                mux->pending_tail = prev;
+            }
+            __xen_shm_mux_consumed(mux, pending->stream, pending->len);
+            free(pending);
+
+            __xen_shm_mux_flush_credits(mux);
+            return 1;
+        }
+
+        if(mux->eof) {
+            return 0;
+        }
+
+        ret = __xen_shm_mux_peek(mux, &msg_stream, &payload, &msg_len);
+        if(ret > 0) {
+            if((want != XEN_SHM_MUX_ANY_STREAM && msg_stream != want) || msg_len > size) {
+                if(__xen_shm_mux_keep(mux, msg_stream, payload, msg_len)) {
+                    return -1;
+                }
+                __xen_shm_mux_done(mux);
+                continue; //Found again in the kept messages
+            }
+
+            //Straight from the ring
+            *stream = msg_stream;
+            *len = msg_len;
+            memcpy(buf, payload, msg_len);
+            __xen_shm_mux_done(mux);
+            __xen_shm_mux_consumed(mux, msg_stream, msg_len);
+
+            __xen_shm_mux_flush_credits(mux);
+            return 1;
+        }
+
+        if(ret == 0) {
+            mux->eof = 1;
+            continue;
+        }
+        if(errno != EAGAIN) {
+            return -1;
+        }
+
+        __xen_shm_mux_flush_credits(mux);
+        if(__xen_shm_mux_wait(mux, 0)) {
+            if(errno != EPIPE) {
+                return -1;
+            }
+            mux->eof = 1; //Nothing more will come
+        }
+    }
+}
+
+int
+xen_shm_mux_recv(xen_shm_mux_p mux, uint32_t* stream, void* buf, size_t size, size_t* len) {
+    return __xen_shm_mux_recv(mux, XEN_SHM_MUX_ANY_STREAM, stream, buf, size, len);
+}
+
+int
+xen_shm_mux_recv_stream(xen_shm_mux_p mux, uint32_t stream, void* buf, size_t size, size_t* len) {
+    uint32_t msg_stream;
+
+    if(stream >= mux->stream_count) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return __xen_shm_mux_recv(mux, stream, &msg_stream, buf, size, len);
+}
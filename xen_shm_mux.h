@@ -0,0 +1,90 @@
+/*
+ * Xen shared memory stream multiplexer headers
+ *
+ * Authors: Vincent Brillault <git@lerya.net>
+ *          Pierre Pfister    <oryon@darou.fr>
+ *
+ * Each pipe costs a kernel instance, an event channel and its own
+ * pages. This file provides many logical streams carried by the two
+ * framed pipes of a single duplex channel, so that a pair of domains
+ * only needs one event channel whatever the number of flows.
+ *
+ * Each stream has its own flow control: a sender may only have
+ * 'window' bytes (payload plus an 8 bytes header per message) in flight
+ * on a stream, and the receiver gives credits back as the messages are
+ * received by the application. So a slow stream never takes the whole
+ * ring from the other ones.
+ *
+ * It is built on the pipe API only. server_lib and client_lib carry
+ * their connections over it with run_mux_server and init_mux (the MUX
+ * grant mode). test/pipe_perf runs it too (mux_reader and mux_writer
+ * modes).
+ *
+ */
+
+#ifndef __XEN_SHM_MUX_H__
+#define __XEN_SHM_MUX_H__
+
+#include <inttypes.h>
+#include <unistd.h>
+
+#include "xen_shm_pipe.h"
+
+
+/*
+ * A multiplexer is a pointer to a private structure
+ */
+typedef struct xen_shm_mux* xen_shm_mux_p;
+
+
+/*
+ * Init a multiplexer over a connected duplex channel (see xen_shm_pipe_init_duplex). Both pipes must be framed pipes,
+ * the two directions of the same duplex channel (EINVAL otherwise).
+ * Both sides must use the same stream count and window. The window can't be bigger than the biggest message
+ * of the pipes, and the messages of a stream can't be bigger than the window minus their 8 bytes header.
+ * The multiplexer owns the pipes: they are put in non-blocking mode and freed with it.
+ * The calls are not thread safe, a multiplexer is driven by one thread.
+ * On succes, returns 0. On error, -1 is returned, and errno is set appropriately (the pipes are then left untouched).
+ */
+int xen_shm_mux_init(xen_shm_mux_p* mux,              /* A returned pointer to a multiplexer */
+                     xen_shm_pipe_p receive_pipe,     /* The receive pipe of the duplex channel */
+                     xen_shm_pipe_p send_pipe,        /* The send pipe of the duplex channel */
+                     uint32_t stream_count,           /* Streams are numbered from 0 to stream_count - 1 */
+                     uint32_t window                  /* Bytes a sender may have in flight on each stream */
+                     );
+
+/*
+ * Returns the number of streams of the multiplexer.
+ */
+uint32_t xen_shm_mux_stream_count(xen_shm_mux_p mux);
+
+/*
+ * Frees the multiplexer and both its pipes (which closes them).
+ */
+void xen_shm_mux_free(xen_shm_mux_p mux);
+
+/*
+ * Sends one message on a stream. Blocks until the stream has enough credit and the ring has room for it.
+ * While blocked, the messages coming from the other side are received and kept for the next receive calls,
+ * so that both sides can send at the same time.
+ * Returns 0 on success. On error, -1 is returned and errno is set approprietely (EINVAL for an unknown stream,
+ * EMSGSIZE if the message is bigger than the window allows, EPIPE if the other side is gone).
+ */
+int xen_shm_mux_send(xen_shm_mux_p mux, uint32_t stream, const void* buf, size_t len);
+
+/*
+ * Receives the next message of any stream in buf, its stream in 'stream' and its length in 'len'.
+ * Blocks until a message is available.
+ * Returns 1 on success, 0 if EOF. On error, -1 is returned and errno is set approprietely.
+ * If the message is bigger than size, errno is set to EMSGSIZE, stream and len are set and the message is kept.
+ */
+int xen_shm_mux_recv(xen_shm_mux_p mux, uint32_t* stream, void* buf, size_t size, size_t* len);
+
+/*
+ * Receives the next message of the given stream. The messages of the other streams that come before it
+ * are kept for later receive calls (at most a window per stream, as their senders lack credit after that).
+ * Same return values as xen_shm_mux_recv.
+ */
+int xen_shm_mux_recv_stream(xen_shm_mux_p mux, uint32_t stream, void* buf, size_t size, size_t* len);
+
+#endif
@@ -13,22 +13,42 @@
 #include <stdlib.h>
 #include <inttypes.h>
 #include <sys/ioctl.h>
+#include <poll.h>
 #include <errno.h>
 #include <sys/mman.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <stddef.h>
+#include <sys/uio.h>
+#include <sched.h>
+#include <time.h>
 
 #include "xen_shm_pipe.h"
+#include "xen_shm_pipe_copy.h"
 #include "xen_shm.h"
 
 #define XEN_SHM_PIPE_PAGE_SIZE 4096 //Todo, find an interface
 
 
-#define XEN_SHM_PIPE_FAST_CHECK_INTERVAL 128 //Will check for the other after the first <value> written or read values (for better delays, it is a small value)
-#define XEN_SHM_PIPE_WAIT_CHECK_PER_ROUND 4 //Minimal number of time the writer/read checks the otherone state while writing/reading
+#define XEN_SHM_PIPE_NOTIFY_MIN_BYTES 128 //Automatic moderation: smallest number of bytes between two checks of the other side while writing/reading (for better delays)
+#define XEN_SHM_PIPE_WAIT_CHECK_PER_ROUND 4 //Automatic moderation: minimal number of time the writer/read checks the otherone state per buffer
+#define XEN_SHM_PIPE_NOTIFY_DEFAULT_US 50 //Longest time a sleeping other side is left asleep during a transfer, by default
 #define XEN_SHM_PIPE_WAIT_LOOP_LIMIT 10000 //Number of loops a wait can do (in active mode) before performing an ioctl to see if the pipe is broken
 #define XEN_SHM_PIPE_WAIT_LOOP_ACTIVE_MAX 10000
+#define XEN_SHM_PIPE_SPIN_BACKOFF_MAX 8 //Most cpu relax instructions between two checks of a spinning wait
+#define XEN_SHM_PIPE_SPIN_CLOCK_INTERVAL 16 //Spins between two clock reads, for the policies with a time budget
+#define XEN_SHM_PIPE_SPIN_LATENCY_NS 1000000 //Latency policy: spin budget
+#define XEN_SHM_PIPE_SPIN_ADAPTIVE_MAX_NS 200000 //Adaptive policy: longest spin budget
+#define XEN_SHM_PIPE_SHARED_AWAIT_MS 10 //Modules without XEN_SHM_IOCTL_AWAIT_WAKE: the waiters sharing an fd (duplex channel, threads) re-check their ring at least that often, in case another one took their signal
+
+/* Spin loop hint: frees the pipeline for the sibling hyperthread and saves power while spinning */
+#if defined(__i386__) || defined(__x86_64__)
+#define XSHMP_CPU_RELAX() __builtin_ia32_pause()
+#elif defined(__aarch64__)
+#define XSHMP_CPU_RELAX() __asm__ __volatile__ ("yield" ::: "memory")
+#else
+#define XSHMP_CPU_RELAX() __asm__ __volatile__ ("" ::: "memory")
+#endif
 
 /* Different reader/writer flags */
 #define XSHMP_OPENED   0x00000001u
@@ -37,6 +57,27 @@
 #define XSHMP_SLEEPING 0x00000008u
 #define XSHMP_ACTIVE   0x00000010u
 
+/*
+ * Shared area identification, written by the offerer.
+ * Both words have the XSHMP_CLOSED bit set where a v1 peer expects its flags,
+ * so an old peer sees a closed pipe.
+ */
+#define XSHMP_MAGIC    0x58534d32u //"2MSX"
+#define XSHMP_VERSION  0x00000002u
+
+#define XSHMP_CACHE_LINE 64 //Fields written by different sides must not share a line
+
+/* Features chosen by the offerer */
+#define XSHMP_FEATURE_POW2   0x00000001u //Power of two buffer and 64 bits head/tail counters
+#define XSHMP_FEATURE_FRAMED 0x00000002u //Messages instead of a byte stream
+#define XSHMP_FEATURE_QUEUE  0x00000004u //Fixed size slots instead of a byte stream (with XSHMP_FEATURE_POW2)
+#define XSHMP_FEATURES_KNOWN (XSHMP_FEATURE_POW2|XSHMP_FEATURE_FRAMED|XSHMP_FEATURE_QUEUE)
+
+#define XSHMP_QUEUE_POS(local) ((local)/sizeof(struct xen_shm_queue_slot)) //Sequence number of a queue position
+
+#define XSHMP_RECORD_ALIGN 8 //Records start on 8 bytes boundaries, so the 64 bits copy path always applies
+#define XSHMP_RECORD_SIZE(len) (sizeof(struct xen_shm_pipe_record) + (((len) + XSHMP_RECORD_ALIGN - 1) & ~((size_t) XSHMP_RECORD_ALIGN - 1)))
+
 
 
 
@@ -48,11 +89,50 @@ struct xen_shm_pipe_priv {
     enum xen_shm_pipe_conv conv;
 
     struct xen_shm_pipe_shared* shared;
-
+    void* mapping; //The whole mapped area (shared by both directions of a duplex channel)
+    size_t mapping_size;
+    size_t area_size; //Size of the part of the mapping used by this pipe
+    struct xen_shm_pipe_priv* sibling; //Other direction of a duplex channel, using the same fd and mapping
+    volatile struct xen_shm_status* status; //The status page of the module (NULL if it lacks one), shared with the sibling
+
+    enum xen_shm_pipe_ring ring;
+    enum xen_shm_pipe_type type;
     size_t buffer_size;
-    ptrdiff_t wait_check_interval;
+    size_t notify_bytes; //Moderation: bytes between two checks of the other side during the transfers (0 if automatic)
+    uint64_t notify_ns; //Moderation: time after which a sleeping other side is woken up at the next check
+    size_t notify_interval; //Bytes between the last check and the next one
+    size_t notify_left; //Bytes left before the next check
+    uint64_t notify_last_ns; //Date of the last check
+    uint64_t notify_rate; //Automatic moderation: moving average of the transfer rate, in bytes per millisecond
+    uint32_t notify_sleep_freq; //Automatic moderation: moving average of the checks that found the other side asleep, out of 256
+    uint64_t notify_put_off_ns; //Date the sleeping other side was first left asleep, until it is woken up (statistics)
+    size_t publish_interval; //Bytes copied before publishing the index (0 means after each chunk)
     struct xen_shm_ioctlarg_await await_op;
     int saw_epipe;
+    size_t reserved; //Size of the region given by the last write reserve
+    size_t peeked; //Size of the region (or of the record) given by the last read peek
+    xen_shm_pipe_copy_fn copy; //The copy kernel, chosen at init
+    uint64_t local; //This side's position, published in the shared memory by __xen_shm_pipe_publish
+    uint64_t remote; //Last known position of the other side
+    int multi_writer; //Several threads write, see xen_shm_pipe_set_multi_writer
+    uint64_t claim; //Multi-writer mode: end of the room reserved by the writer threads
+    uint32_t sleepers; //Multi-writer mode: number of writer threads sleeping
+    uint32_t publish_sleepers; //Multi-writer mode: number of writer threads sleeping until the earlier ones publish
+    int claim_error; //Multi-writer mode: errno of a thread that gave up its reserved room
+    int multi_reader; //Several threads or processes read, see xen_shm_pipe_set_multi_reader
+    enum xen_shm_pipe_wait_policy wait_policy;
+    uint64_t wait_avg_ns; //Adaptive policy: moving average of the waits duration
+    int nonblock; //Fails with EAGAIN instead of waiting
+    int armed; //Non-blocking mode: the other side was asked to signal its next progress
+    uint64_t deadline_ns; //Timed calls: the waits fail with ETIME after this date (0 if none)
+    size_t coalesce_bytes; //Coalescing writer: unpublished bytes that make a write publish (0 if not coalescing)
+    uint64_t coalesce_ns; //Coalescing writer: age of the unpublished bytes that makes a write publish (0 if none)
+    size_t held; //Coalescing writer: bytes written in the ring and not published yet
+    uint64_t held_since_ns; //Coalescing writer: date of the first of them
+    int wake_on_read; //Duplex writer: the wake up at the end of a write is left to the next read, see xen_shm_pipe_set_wake_on_read
+    int wake_pending; //Such a wake up was left to the next read of the sibling
+    int await_ns; //XEN_SHM_IOCTL_AWAIT_NS: 1 until the module is found to lack it
+    int await_wake; //XEN_SHM_IOCTL_AWAIT_WAKE: 1 until the module is found to lack it
 
 
 #ifdef XSHMP_STATS
@@ -61,25 +141,141 @@ struct xen_shm_pipe_priv {
 
 };
 
-/* Structure of the shared area */
+/*
+ * Structure of the shared area (layout v2)
+ * Constant data, writer's data, reader's data and the buffer are on different cache lines,
+ * so that index updates of one side don't invalidate the line the other side spins on.
+ */
 struct xen_shm_pipe_shared {
-    uint32_t writer_flags;
-    uint32_t reader_flags;
-    uint32_t write;
-    uint32_t read;
-    uint8_t buffer[0];
+    /* Written once by the offerer */
+    uint32_t magic;
+    uint32_t version;
+    uint32_t features;
+
+    /* Only written by the writer */
+    uint32_t writer_flags __attribute__ ((aligned (XSHMP_CACHE_LINE)));
+    uint32_t write; //Legacy ring
+    uint64_t head; //Power of two ring
+    uint32_t writer_lowat; //Free bytes the writer waits for before being woken up (0 or 1: any)
+
+    /* Only written by the reader(s) */
+    uint32_t reader_flags __attribute__ ((aligned (XSHMP_CACHE_LINE)));
+    uint32_t read; //Legacy ring
+    uint64_t tail; //Power of two ring
+    uint64_t claim; //Multi-reader mode: end of the records taken by the readers
+    uint32_t readers; //Multi-reader mode: number of reader processes
+    uint32_t sleepers; //Multi-reader mode: number of readers waiting for a record
+    uint32_t reader_lowat; //Bytes the reader waits for before being woken up (0 or 1: any)
+
+    uint8_t buffer[0] __attribute__ ((aligned (XSHMP_CACHE_LINE)));
+};
+
+/*
+ * Header of a record in a framed pipe.
+ * The payload follows, padded to XSHMP_RECORD_ALIGN. The header itself never wraps.
+ */
+struct xen_shm_pipe_record {
+    uint32_t len;
+    uint32_t pad;
+};
+
+/*
+ * A slot of a queue pipe. One cache line, so that the writer and the reader only share the line of the slot they use.
+ * The sequence number tells the state of the slot, so that none of the sides has to look at the other's index:
+ * for position 'pos', the slot is free when seq == pos, and full when seq == pos + 1.
+ * The reader frees it for the next round with seq = pos + slot count.
+ */
+struct xen_shm_queue_slot {
+    uint32_t seq;
+    uint32_t len;
+    uint8_t data[XEN_SHM_QUEUE_MSG_MAX];
+} __attribute__ ((aligned (XSHMP_CACHE_LINE)));
+
+/* State of a wait, applying the wait policy */
+struct xen_shm_pipe_wait_state {
+    uint32_t spins; //Spins done so far
+    uint32_t backoff; //Cpu relax instructions of the next spin
+    uint64_t start_ns; //Start of the wait (policies with a time budget)
+    uint64_t budget_ns; //Time the wait can spin (policies with a time budget)
+    int slept;
 };
 
 inline int __xen_shm_pipe_is_offerer(struct xen_shm_pipe_priv* p);
+struct xen_shm_pipe_priv* __xen_shm_pipe_alloc(int fd, enum xen_shm_pipe_mod mod, enum xen_shm_pipe_conv conv);
 int __xen_shm_pipe_map_shared_memory(struct xen_shm_pipe_priv* p, uint8_t page_count);
+void __xen_shm_pipe_unmap_shared_memory(struct xen_shm_pipe_priv* p);
+void __xen_shm_pipe_map_status(struct xen_shm_pipe_priv* p);
+void __xen_shm_pipe_unmap_status(struct xen_shm_pipe_priv* p);
+void __xen_shm_pipe_set_geometry(struct xen_shm_pipe_priv* p);
+void __xen_shm_pipe_setup_offerer(struct xen_shm_pipe_priv* p);
+int __xen_shm_pipe_setup_receiver(struct xen_shm_pipe_priv* p);
 uint32_t* __xen_shm_pipe_get_flags(struct xen_shm_pipe_priv* p, int my_flags);
 int __xen_shm_pipe_send_signal(struct xen_shm_pipe_priv* p);
-int __xen_shm_pipe_wait_signal(struct xen_shm_pipe_priv* p);
-int __xen_shm_pipe_wait_writer(struct xen_shm_pipe_priv* p);
+int __xen_shm_pipe_wait_signal(struct xen_shm_pipe_priv* p, uint64_t wake);
+uint64_t __xen_shm_pipe_wake_count(struct xen_shm_pipe_priv* p);
+int __xen_shm_pipe_await_wake(struct xen_shm_pipe_priv* p, uint64_t wake, uint8_t flags);
+void __xen_shm_pipe_lacks_await_wake(struct xen_shm_pipe_priv* p);
+int __xen_shm_pipe_read_ready(struct xen_shm_pipe_priv* p, int reload);
+int __xen_shm_pipe_write_ready(struct xen_shm_pipe_priv* p, size_t needed, int contiguous, int reload);
+struct xen_shm_queue_slot* __xen_shm_queue_slot(struct xen_shm_pipe_priv* p);
+int __xen_shm_pipe_wait_writer(struct xen_shm_pipe_priv* p, size_t needed, int contiguous);
+size_t __xen_shm_pipe_offset(struct xen_shm_pipe_priv* p, uint64_t pos);
+void __xen_shm_pipe_advance(struct xen_shm_pipe_priv* p, size_t nbytes);
+void __xen_shm_pipe_publish(struct xen_shm_pipe_priv* p);
+uint64_t __xen_shm_pipe_load_remote(struct xen_shm_pipe_priv* p);
+size_t __xen_shm_pipe_write_contiguous(struct xen_shm_pipe_priv* p);
+size_t __xen_shm_pipe_write_contiguous_max(struct xen_shm_pipe_priv* p);
+size_t __xen_shm_pipe_write_space(struct xen_shm_pipe_priv* p, int contiguous);
+void __xen_shm_pipe_to_ring(struct xen_shm_pipe_priv* p, const uint8_t* buf, size_t len);
+void __xen_shm_pipe_from_ring(struct xen_shm_pipe_priv* p, uint8_t* buf, size_t len);
+size_t __xen_shm_pipe_msg_max(struct xen_shm_pipe_priv* p);
+int __xen_shm_pipe_msg_check(struct xen_shm_pipe_priv* p, enum xen_shm_pipe_mod mod);
+int __xen_shm_pipe_wait_record(struct xen_shm_pipe_priv* p, size_t* msg_len);
+size_t __xen_shm_pipe_record_len(struct xen_shm_pipe_priv* p);
+void __xen_shm_pipe_put_record(struct xen_shm_pipe_priv* p, const void* buf, size_t len);
+void __xen_shm_pipe_put_recordv(struct xen_shm_pipe_priv* p, const struct iovec* iov, int iovcnt, size_t len);
+void __xen_shm_pipe_get_record(struct xen_shm_pipe_priv* p, void* buf, size_t len);
+void __xen_shm_pipe_release_records(struct xen_shm_pipe_priv* p);
+size_t __xen_shm_pipe_read_contiguous(struct xen_shm_pipe_priv* p);
 int __xen_shm_pipe_wait_reader(struct xen_shm_pipe_priv* p);
-size_t __xen_shm_pipe_read_avail(struct xen_shm_pipe_priv* p, void* buf, size_t nbytes);
-size_t __xen_shm_pipe_write_avail(struct xen_shm_pipe_priv* p, const void* buf, size_t nbytes);
+size_t __xen_shm_pipe_read_avail(struct xen_shm_pipe_priv* p, const struct iovec* iov, int iovcnt, size_t offset);
+size_t __xen_shm_pipe_write_avail(struct xen_shm_pipe_priv* p, const struct iovec* iov, int iovcnt, size_t offset);
+ssize_t __xen_shm_pipe_readv(struct xen_shm_pipe_priv* p, const struct iovec* iov, int iovcnt, size_t offset);
+ssize_t __xen_shm_pipe_writev(struct xen_shm_pipe_priv* p, const struct iovec* iov, int iovcnt, size_t offset);
 int __xen_shm_pipe_prone_for_epipe(struct xen_shm_pipe_priv* p);
+void __xen_shm_pipe_copy_at(struct xen_shm_pipe_priv* p, uint64_t pos, const void* buf, size_t len);
+int __xen_shm_pipe_claim_wait(struct xen_shm_pipe_priv* p, uint64_t end);
+int __xen_shm_pipe_publish_wait(struct xen_shm_pipe_priv* p, uint64_t start);
+void __xen_shm_pipe_publish_pass(struct xen_shm_pipe_priv* p);
+ssize_t __xen_shm_pipe_claim_writev(struct xen_shm_pipe_priv* p, const struct iovec* iov, int iovcnt, size_t offset, int record);
+void __xen_shm_pipe_copy_from(struct xen_shm_pipe_priv* p, uint64_t pos, void* buf, size_t len);
+int __xen_shm_pipe_take_record(struct xen_shm_pipe_priv* p, size_t size, uint64_t* start, size_t* msg_len);
+int __xen_shm_pipe_take_wait(struct xen_shm_pipe_priv* p, int* slept);
+void __xen_shm_pipe_take_pass(struct xen_shm_pipe_priv* p);
+void __xen_shm_pipe_take_release(struct xen_shm_pipe_priv* p, uint64_t start, size_t msg_len);
+int __xen_shm_pipe_take_recv(struct xen_shm_pipe_priv* p, void* buf, size_t size, size_t* len);
+uint64_t __xen_shm_pipe_now_ns(void);
+void __xen_shm_pipe_wait_begin(struct xen_shm_pipe_priv* p, struct xen_shm_pipe_wait_state* ws);
+int __xen_shm_pipe_wait_spin(struct xen_shm_pipe_priv* p, struct xen_shm_pipe_wait_state* ws, uint32_t other_flags);
+void __xen_shm_pipe_wait_end(struct xen_shm_pipe_priv* p, struct xen_shm_pipe_wait_state* ws);
+void __xen_shm_pipe_set_sleeping(struct xen_shm_pipe_priv* p, int sleeping);
+uint64_t __xen_shm_pipe_sleep_begin(struct xen_shm_pipe_priv* p);
+int __xen_shm_pipe_wait_shared(struct xen_shm_pipe_priv* p, uint64_t wake, int exclusive);
+void __xen_shm_pipe_arm(struct xen_shm_pipe_priv* p);
+void __xen_shm_pipe_disarm(struct xen_shm_pipe_priv* p);
+ssize_t __xen_shm_pipe_timed(struct xen_shm_pipe_priv* p, const struct iovec* iov, int all, unsigned long timeout_ms);
+size_t __xen_shm_pipe_capacity(struct xen_shm_pipe_priv* p);
+size_t __xen_shm_pipe_used(struct xen_shm_pipe_priv* p);
+int __xen_shm_pipe_peer_needs_wake(struct xen_shm_pipe_priv* p);
+void __xen_shm_pipe_wake_peer(struct xen_shm_pipe_priv* p);
+void __xen_shm_pipe_wake_peer_last(struct xen_shm_pipe_priv* p);
+void __xen_shm_pipe_signal_sent(struct xen_shm_pipe_priv* p);
+void __xen_shm_pipe_send_deferred(struct xen_shm_pipe_priv* p);
+int __xen_shm_pipe_hold(struct xen_shm_pipe_priv* p, size_t bytes);
+size_t __xen_shm_pipe_notify_start(struct xen_shm_pipe_priv* p, uint32_t other_flags);
+size_t __xen_shm_pipe_notify_next(struct xen_shm_pipe_priv* p, int asleep);
+void __xen_shm_pipe_notify_put_off(struct xen_shm_pipe_priv* p, uint64_t now);
+void __xen_shm_pipe_release_held(struct xen_shm_pipe_priv* p);
 
 
 inline int
@@ -99,56 +295,420 @@ __xen_shm_pipe_get_flags(struct xen_shm_pipe_priv* p, int my_flags)
     }
 }
 
+/*
+ * Maps the shared memory.
+ * A duplex channel maps it once for both directions: the first half carries what the offerer writes,
+ * the second half what the receiver writes.
+ */
 int
 __xen_shm_pipe_map_shared_memory(struct xen_shm_pipe_priv* p, uint8_t page_count)
 {
-    void* shared;
-
-    shared = mmap(0, (size_t) page_count*XEN_SHM_PIPE_PAGE_SIZE, PROT_READ|PROT_WRITE, MAP_SHARED, p->fd, 0);
-    if (shared == MAP_FAILED) {
+    void* mapping;
+    size_t size;
+    size_t half;
+    struct xen_shm_pipe_priv* pipes[2];
+    int i;
+
+    size = (size_t) page_count*XEN_SHM_PIPE_PAGE_SIZE;
+    mapping = mmap(0, size, PROT_READ|PROT_WRITE, MAP_SHARED, p->fd, 0);
+    if (mapping == MAP_FAILED) {
         return -1;
     }
 
-    p->shared = shared;
+    __xen_shm_pipe_map_status(p);
+
+    if(p->sibling == NULL) {
+        p->mapping = mapping;
+        p->mapping_size = size;
+        p->shared = mapping;
+        p->area_size = size;
+        return 0;
+    }
+
+    half = (size/2) & ~((size_t) XSHMP_CACHE_LINE - 1);
+    pipes[0] = p;
+    pipes[1] = p->sibling;
+    for(i = 0; i < 2; i++) {
+        pipes[i]->mapping = mapping;
+        pipes[i]->mapping_size = size;
+        pipes[i]->area_size = half;
+        if((pipes[i]->mod == xen_shm_pipe_mod_write) == __xen_shm_pipe_is_offerer(pipes[i])) {
+            pipes[i]->shared = mapping;
+        } else {
+            pipes[i]->shared = (struct xen_shm_pipe_shared*) ((uint8_t*) mapping + half);
+        }
+    }
+
     return 0;
 }
 
-int
-xen_shm_pipe_init(xen_shm_pipe_p * xpipe,enum xen_shm_pipe_mod mod,enum xen_shm_pipe_conv conv)
+void
+__xen_shm_pipe_unmap_shared_memory(struct xen_shm_pipe_priv* p)
+{
+    munmap(p->mapping, p->mapping_size);
+    p->mapping = NULL;
+    p->shared = NULL;
+    if(p->sibling != NULL) {
+        p->sibling->mapping = NULL;
+        p->sibling->shared = NULL;
+    }
+    __xen_shm_pipe_unmap_status(p);
+}
+
+/*
+ * Maps the read-only status page of the module, so that the broken pipes and the pending signals
+ * are seen without ioctl. Without it (older module), the pipe falls back to the ioctls.
+ */
+void
+__xen_shm_pipe_map_status(struct xen_shm_pipe_priv* p)
+{
+    void* status;
+
+    status = mmap(0, XEN_SHM_PIPE_PAGE_SIZE, PROT_READ, MAP_SHARED, p->fd, XEN_SHM_STATUS_PAGE_OFFSET);
+    if(status == MAP_FAILED) {
+        return;
+    }
+    if(((struct xen_shm_status*) status)->magic != XEN_SHM_STATUS_MAGIC) { //An older module mapped something else
+        munmap(status, XEN_SHM_PIPE_PAGE_SIZE);
+        return;
+    }
+
+    p->status = status;
+    if(p->sibling != NULL) {
+        p->sibling->status = status;
+    }
+}
+
+void
+__xen_shm_pipe_unmap_status(struct xen_shm_pipe_priv* p)
+{
+    if(p->status == NULL) {
+        return;
+    }
+    munmap((void*) (uintptr_t) p->status, XEN_SHM_PIPE_PAGE_SIZE);
+    p->status = NULL;
+    if(p->sibling != NULL) {
+        p->sibling->status = NULL;
+    }
+}
+
+/* Computes the buffer size once the ring geometry is known */
+void
+__xen_shm_pipe_set_geometry(struct xen_shm_pipe_priv* p)
+{
+    size_t size;
+
+    size = p->area_size - sizeof(struct xen_shm_pipe_shared);
+    if(p->ring == xen_shm_pipe_ring_pow2) {
+        while(size & (size - 1)) { //Keep the highest bit only
+            size &= size - 1;
+        }
+    }
+
+    p->buffer_size = size;
+    p->notify_interval = p->buffer_size/XEN_SHM_PIPE_WAIT_CHECK_PER_ROUND;
+    p->notify_left = p->notify_interval;
+    p->local = 0;
+    p->remote = 0;
+}
+
+struct xen_shm_pipe_priv*
+__xen_shm_pipe_alloc(int fd, enum xen_shm_pipe_mod mod, enum xen_shm_pipe_conv conv)
 {
     struct xen_shm_pipe_priv* p = malloc(sizeof(struct xen_shm_pipe_priv));
 
     if(p==NULL) {
         errno = ENOMEM;
-        return -1;
-    }
-
-    p->fd = open(XEN_SHM_DEVICE_PATH , O_RDWR);
-    if (p->fd < 0) {
-       free(p);
-       errno = ENODEV;
-       return -1;
+        return NULL;
     }
 
+    p->fd = fd;
     p->conv = conv;
     p->mod = mod;
     p->shared = NULL;
+    p->mapping = NULL;
+    p->mapping_size = 0;
+    p->area_size = 0;
+    p->sibling = NULL;
+    p->status = NULL;
+    p->ring = xen_shm_pipe_ring_default;
+    p->type = xen_shm_pipe_type_default;
     p->await_op.request_flags = XEN_SHM_IOCTL_AWAIT_LATENT_USER;
     p->await_op.timeout_ms = 0;
     p->saw_epipe = 0;
-    *xpipe = p;
+    p->reserved = 0;
+    p->peeked = 0;
+    p->local = 0;
+    p->remote = 0;
+    p->publish_interval = XEN_SHM_PIPE_PUBLISH_CHUNK;
+    p->copy = xen_shm_pipe_copy_get(xen_shm_pipe_copy_best());
+    p->multi_writer = 0;
+    p->claim = 0;
+    p->sleepers = 0;
+    p->publish_sleepers = 0;
+    p->claim_error = 0;
+    p->multi_reader = 0;
+    p->wait_policy = xen_shm_pipe_wait_throughput;
+    p->wait_avg_ns = 0;
+    p->nonblock = 0;
+    p->armed = 0;
+    p->deadline_ns = 0;
+    p->coalesce_bytes = 0;
+    p->coalesce_ns = 0;
+    p->held = 0;
+    p->held_since_ns = 0;
+    p->notify_bytes = XEN_SHM_PIPE_NOTIFY_AUTO;
+    p->notify_ns = ((uint64_t) XEN_SHM_PIPE_NOTIFY_DEFAULT_US)*1000;
+    p->notify_interval = 0;
+    p->notify_left = 0;
+    p->notify_last_ns = 0;
+    p->notify_rate = 0;
+    p->notify_sleep_freq = 0;
+    p->notify_put_off_ns = 0;
+    p->wake_on_read = 0;
+    p->wake_pending = 0;
+    p->await_ns = 1;
+    p->await_wake = 1;
 
 #ifdef XSHMP_STATS
     p->stats.ioctl_count_await = 0;
     p->stats.ioctl_count_ssig = 0;
+    p->stats.ioctl_count_ssig_await = 0;
     p->stats.read_count = 0;
     p->stats.write_count = 0;
     p->stats.waiting = 0;
     p->stats.ioctl_count_epipe_prone = 0;
+    p->stats.remote_index_loads = 0;
+    p->stats.remote_index_cached = 0;
+    p->stats.spin_waits = 0;
+    p->stats.sleep_waits = 0;
+    p->stats.spin_count = 0;
+    p->stats.held_writes = 0;
+    p->stats.signals_suppressed = 0;
+    p->stats.wake_latency_ns = 0;
+    p->stats.wake_latency_count = 0;
 #endif
 
+    return p;
+}
+
+int
+xen_shm_pipe_init(xen_shm_pipe_p * xpipe,enum xen_shm_pipe_mod mod,enum xen_shm_pipe_conv conv)
+{
+    struct xen_shm_pipe_priv* p;
+    int fd;
+
+    fd = open(XEN_SHM_DEVICE_PATH , O_RDWR);
+    if (fd < 0) {
+       errno = ENODEV;
+       return -1;
+    }
+
+    p = __xen_shm_pipe_alloc(fd, mod, conv);
+    if(p==NULL) {
+        close(fd);
+        return -1;
+    }
+
+    *xpipe = p;
+    return 0;
+
+}
+
+int
+xen_shm_pipe_init_duplex(xen_shm_pipe_p* receive_pipe, xen_shm_pipe_p* send_pipe, int offers)
+{
+    struct xen_shm_pipe_priv* r;
+    struct xen_shm_pipe_priv* w;
+    int fd;
+
+    fd = open(XEN_SHM_DEVICE_PATH , O_RDWR);
+    if (fd < 0) {
+       errno = ENODEV;
+       return -1;
+    }
+
+    //The conventions make both pipes offerers (or receivers) of the same region
+    r = __xen_shm_pipe_alloc(fd, xen_shm_pipe_mod_read, (offers)?xen_shm_pipe_conv_reader_offers:xen_shm_pipe_conv_writer_offers);
+    if(r==NULL) {
+        close(fd);
+        return -1;
+    }
+
+    w = __xen_shm_pipe_alloc(fd, xen_shm_pipe_mod_write, (offers)?xen_shm_pipe_conv_writer_offers:xen_shm_pipe_conv_reader_offers);
+    if(w==NULL) {
+        free(r);
+        close(fd);
+        return -1;
+    }
+
+    r->sibling = w;
+    w->sibling = r;
+
+    *receive_pipe = r;
+    *send_pipe = w;
+    return 0;
+}
+
+int
+xen_shm_pipe_set_copy_kernel(xen_shm_pipe_p xpipe, enum xen_shm_pipe_copy_kernel kernel) {
+    struct xen_shm_pipe_priv* p;
+    xen_shm_pipe_copy_fn copy;
+
+    p = xpipe;
+    copy = xen_shm_pipe_copy_get(kernel);
+    if(copy == NULL) {
+        errno = ENOTSUP;
+        return -1;
+    }
+
+    p->copy = copy;
+    return 0;
+}
+
+int
+xen_shm_pipe_set_ring(xen_shm_pipe_p xpipe, enum xen_shm_pipe_ring ring) {
+    struct xen_shm_pipe_priv* p;
+
+    p = xpipe;
+    if(p->shared != NULL) { //Too late
+        errno = EISCONN;
+        return -1;
+    }
+
+    p->ring = ring;
+    return 0;
+}
+
+int
+xen_shm_pipe_set_type(xen_shm_pipe_p xpipe, enum xen_shm_pipe_type type) {
+    struct xen_shm_pipe_priv* p;
+
+    p = xpipe;
+    if(p->shared != NULL) { //Too late
+        errno = EISCONN;
+        return -1;
+    }
+
+    p->type = type;
+    return 0;
+}
+
+void
+xen_shm_pipe_set_publish_interval(xen_shm_pipe_p xpipe, size_t bytes) {
+    struct xen_shm_pipe_priv* p;
+
+    p = xpipe;
+    p->publish_interval = bytes;
+}
+
+void
+xen_shm_pipe_set_wait_policy(xen_shm_pipe_p xpipe, enum xen_shm_pipe_wait_policy policy) {
+    struct xen_shm_pipe_priv* p;
+
+    p = xpipe;
+    p->wait_policy = policy;
+}
+
+void
+xen_shm_pipe_set_nonblock(xen_shm_pipe_p xpipe, int enable) {
+    struct xen_shm_pipe_priv* p;
+
+    p = xpipe;
+    p->nonblock = enable?1:0;
+    if(!p->nonblock && p->shared != NULL) {
+        __xen_shm_pipe_disarm(p);
+    }
+}
+
+int
+xen_shm_pipe_set_lowat(xen_shm_pipe_p xpipe, size_t bytes) {
+    struct xen_shm_pipe_priv* p;
+
+    p = xpipe;
+
+    if(p->shared == NULL || p->type == xen_shm_pipe_type_queue) {
+        errno = EMEDIUMTYPE;
+        return -1;
+    }
+
+    if(bytes > __xen_shm_pipe_capacity(p)) {
+        bytes = __xen_shm_pipe_capacity(p);
+    }
+
+    if(p->mod == xen_shm_pipe_mod_write) {
+        p->shared->writer_lowat = (uint32_t) bytes;
+    } else {
+        p->shared->reader_lowat = (uint32_t) bytes;
+    }
+    return 0;
+}
+
+int
+xen_shm_pipe_set_coalesce(xen_shm_pipe_p xpipe, size_t bytes, unsigned long usecs) {
+    struct xen_shm_pipe_priv* p;
+
+    p = xpipe;
+
+    if(p->mod != xen_shm_pipe_mod_write || p->type == xen_shm_pipe_type_queue) {
+        errno = EMEDIUMTYPE;
+        return -1;
+    }
+
+    p->coalesce_bytes = bytes;
+    p->coalesce_ns = ((uint64_t) usecs)*1000;
+    if(bytes == 0 && p->held) { //Nothing stays behind
+        __xen_shm_pipe_release_held(p);
+    }
+    return 0;
+}
+
+void
+xen_shm_pipe_set_notify_moderation(xen_shm_pipe_p xpipe, size_t bytes, unsigned long usecs) {
+    struct xen_shm_pipe_priv* p;
+
+    p = xpipe;
+    p->notify_bytes = bytes;
+    if(usecs == 0) {
+        usecs = XEN_SHM_PIPE_NOTIFY_DEFAULT_US;
+    }
+    p->notify_ns = ((uint64_t) usecs)*1000;
+}
+
+int
+xen_shm_pipe_set_wake_on_read(xen_shm_pipe_p xpipe, int enable) {
+    struct xen_shm_pipe_priv* p;
+
+    p = xpipe;
+
+    if(p->mod != xen_shm_pipe_mod_write || p->sibling == NULL) {
+        errno = EMEDIUMTYPE;
+        return -1;
+    }
+
+    p->wake_on_read = enable?1:0;
+    if(!p->wake_on_read && p->wake_pending) { //Nothing stays behind
+        __xen_shm_pipe_send_signal(p);
+    }
     return 0;
+}
+
+int
+xen_shm_pipe_get_fd(xen_shm_pipe_p xpipe) {
+    struct xen_shm_pipe_priv* p;
+
+    p = xpipe;
+    return p->fd;
+}
+
+int
+xen_shm_pipe_is_duplex(xen_shm_pipe_p receive_pipe, xen_shm_pipe_p send_pipe) {
+    struct xen_shm_pipe_priv* r;
+    struct xen_shm_pipe_priv* s;
 
+    r = receive_pipe;
+    s = send_pipe;
+    return r->mod == xen_shm_pipe_mod_read && s->mod == xen_shm_pipe_mod_write && r->sibling == s && s->sibling == r;
 }
 
 int xen_shm_pipe_getdomid(xen_shm_pipe_p xpipe, uint32_t* receiver_domid) {
@@ -171,6 +731,52 @@ int xen_shm_pipe_getdomid(xen_shm_pipe_p xpipe, uint32_t* receiver_domid) {
     return 0;
 }
 
+/* Chooses the geometry of an offered area and initializes its header */
+void
+__xen_shm_pipe_setup_offerer(struct xen_shm_pipe_priv* p)
+{
+    struct xen_shm_queue_slot* slots;
+    size_t i;
+
+    if(p->ring == xen_shm_pipe_ring_default) {
+        p->ring = xen_shm_pipe_ring_legacy;
+    }
+    if(p->type == xen_shm_pipe_type_default) {
+        p->type = xen_shm_pipe_type_stream;
+    }
+    if(p->type == xen_shm_pipe_type_queue) { //Slots are found with a mask
+        p->ring = xen_shm_pipe_ring_pow2;
+    }
+    __xen_shm_pipe_set_geometry(p);
+    //init structure
+    p->shared->magic = XSHMP_MAGIC;
+    p->shared->version = XSHMP_VERSION;
+    p->shared->features = (p->ring == xen_shm_pipe_ring_pow2)?XSHMP_FEATURE_POW2:0;
+    p->shared->features |= (p->type == xen_shm_pipe_type_framed)?XSHMP_FEATURE_FRAMED:0;
+    p->shared->features |= (p->type == xen_shm_pipe_type_queue)?XSHMP_FEATURE_QUEUE:0;
+    p->shared->reader_flags = 0;
+    p->shared->writer_flags = 0;
+    p->shared->read = 0;
+    p->shared->write = 0;
+    p->shared->head = 0;
+    p->shared->tail = 0;
+    p->shared->claim = 0;
+    p->shared->readers = 0;
+    p->shared->sleepers = 0;
+    p->shared->writer_lowat = 0;
+    p->shared->reader_lowat = 0;
+    if(p->type == xen_shm_pipe_type_queue) {
+        slots = (struct xen_shm_queue_slot*) p->shared->buffer;
+        for(i = 0; i < p->buffer_size/sizeof(struct xen_shm_queue_slot); i++) {
+            slots[i].seq = (uint32_t) i; //All free for the first round
+        }
+    }
+
+    //Set my flag to open
+    uint32_t* myflags = __xen_shm_pipe_get_flags(p, 1);
+    *myflags |= XSHMP_OPENED;
+}
+
 int
 xen_shm_pipe_offers(xen_shm_pipe_p xpipe, uint8_t page_count,
         uint32_t receiver_domid, uint32_t* offerer_domid, uint32_t* grant_ref)
@@ -199,21 +805,51 @@ xen_shm_pipe_offers(xen_shm_pipe_p xpipe, uint8_t page_count,
 
     *offerer_domid = (uint32_t) init_offerer.local_domid;
     *grant_ref = (uint32_t) init_offerer.grant;
-    p->buffer_size = (size_t) page_count*XEN_SHM_PIPE_PAGE_SIZE - sizeof(struct xen_shm_pipe_shared);
-    p->wait_check_interval = ((ptrdiff_t) p->buffer_size)/XEN_SHM_PIPE_WAIT_CHECK_PER_ROUND;
-    //init structure
-    p->shared->reader_flags = 0;
-    p->shared->writer_flags = 0;
-    p->shared->read = 0;
-    p->shared->write = 0;
-
-    //Set my flag to open
-    uint32_t* myflags = __xen_shm_pipe_get_flags(p, 1);
-    *myflags |= XSHMP_OPENED;
+    __xen_shm_pipe_setup_offerer(p);
+    if(p->sibling != NULL) {
+        __xen_shm_pipe_setup_offerer(p->sibling);
+    }
 
     return 0;
 }
 
+/* Checks the header of a received area, and adopts the geometry chosen by the offerer */
+int
+__xen_shm_pipe_setup_receiver(struct xen_shm_pipe_priv* p)
+{
+    enum xen_shm_pipe_ring offered_ring;
+    enum xen_shm_pipe_type offered_type;
+
+    //Check the offerer uses the same layout
+    if(p->shared->magic != XSHMP_MAGIC) { //v1 offerer
+        errno = EPROTO;
+        return -1;
+    }
+    if(p->shared->version != XSHMP_VERSION || (p->shared->features & ~XSHMP_FEATURES_KNOWN)) {
+        errno = EPROTONOSUPPORT;
+        return -1;
+    }
+
+    //Use the ring geometry and the pipe type the offerer chose, if they are the ones we asked for
+    offered_ring = (p->shared->features & XSHMP_FEATURE_POW2)?xen_shm_pipe_ring_pow2:xen_shm_pipe_ring_legacy;
+    if(p->shared->features & XSHMP_FEATURE_QUEUE) {
+        offered_type = xen_shm_pipe_type_queue;
+    } else if(p->shared->features & XSHMP_FEATURE_FRAMED) {
+        offered_type = xen_shm_pipe_type_framed;
+    } else {
+        offered_type = xen_shm_pipe_type_stream;
+    }
+    if((p->ring != xen_shm_pipe_ring_default && p->ring != offered_ring)
+            || (p->type != xen_shm_pipe_type_default && p->type != offered_type)) {
+        errno = EPROTONOSUPPORT;
+        return -1;
+    }
+    p->ring = offered_ring;
+    p->type = offered_type;
+    __xen_shm_pipe_set_geometry(p);
+
+    return 0;
+}
 
 int
 xen_shm_pipe_connect(xen_shm_pipe_p xpipe, uint8_t page_count, uint32_t offerer_domid, uint32_t grant_ref)
@@ -240,11 +876,19 @@ xen_shm_pipe_connect(xen_shm_pipe_p xpipe, uint8_t page_count, uint32_t offerer_
         return -1;
     }
 
-    p->buffer_size = (size_t) page_count*XEN_SHM_PIPE_PAGE_SIZE - sizeof(struct xen_shm_pipe_shared);
-    p->wait_check_interval = ((ptrdiff_t) p->buffer_size)/XEN_SHM_PIPE_WAIT_CHECK_PER_ROUND;
+    if(__xen_shm_pipe_setup_receiver(p)
+            || (p->sibling != NULL && __xen_shm_pipe_setup_receiver(p->sibling))) {
+        __xen_shm_pipe_unmap_shared_memory(p);
+        return -1;
+    }
+
     //Set my flag to open
     uint32_t* myflags = __xen_shm_pipe_get_flags(p, 1);
     *myflags |= XSHMP_OPENED;
+    if(p->sibling != NULL) {
+        myflags = __xen_shm_pipe_get_flags(p->sibling, 1);
+        *myflags |= XSHMP_OPENED;
+    }
 
     return 0;
 }
@@ -280,31 +924,201 @@ void xen_shm_pipe_free(xen_shm_pipe_p xpipe) {
     struct xen_shm_pipe_priv* p;
 
     p = xpipe;
-    if(p->shared !=NULL) {
+    if(p->held) { //Coalesced bytes come before the end of file
+        __xen_shm_pipe_release_held(p);
+    }
+    if(p->shared !=NULL && (!p->multi_reader || __atomic_sub_fetch(&p->shared->readers, 1, __ATOMIC_ACQ_REL) == 0)) { //The last reader closes
         uint32_t* myflags = __xen_shm_pipe_get_flags(p, 1);
         *myflags |= XSHMP_CLOSED;
-
-        munmap(p->shared, p->buffer_size + sizeof(struct xen_shm_pipe_shared));
     }
 
+    if(p->sibling != NULL) { //The other direction keeps the fd and the mapping
+        if(p->shared != NULL) {
+            __xen_shm_pipe_send_signal(p); //The fd stays open, so the other side has to be woken up to see the closed flag
+        }
+        p->sibling->sibling = NULL;
+        free(xpipe);
+        return;
+    }
+
+    if(p->mapping != NULL) {
+        munmap(p->mapping, p->mapping_size);
+    }
+    __xen_shm_pipe_unmap_status(p);
+
     close(p->fd);
     free(xpipe);
 }
 
+/*
+ * The threads of the multi-writer and multi-reader modes signal at the same time through the same pipe:
+ * they only count the signal, atomically, and leave the wake ups put off alone (their modes put none off).
+ */
 int
 __xen_shm_pipe_send_signal(struct xen_shm_pipe_priv* p) {
+    if(p->multi_writer || p->multi_reader) {
+#ifdef XSHMP_STATS
+        __atomic_fetch_add(&p->stats.ioctl_count_ssig, 1, __ATOMIC_RELAXED);
+#endif
+        return ioctl(p->fd, XEN_SHM_IOCTL_SSIG, 0);
+    }
 #ifdef XSHMP_STATS
             p->stats.ioctl_count_ssig++;
 #endif
+            __xen_shm_pipe_signal_sent(p);
             return ioctl(p->fd, XEN_SHM_IOCTL_SSIG, 0);
 }
 
+/* A signal is going out on the event channel, which both directions of a duplex channel share: no wake up is pending anymore */
+void
+__xen_shm_pipe_signal_sent(struct xen_shm_pipe_priv* p) {
+#ifdef XSHMP_STATS
+    if(p->notify_put_off_ns != 0) { //The wake up was put off
+        p->stats.wake_latency_ns += __xen_shm_pipe_now_ns() - p->notify_put_off_ns;
+        p->stats.wake_latency_count++;
+        p->notify_put_off_ns = 0;
+    }
+#endif
+    p->wake_pending = 0;
+    if(p->sibling != NULL) {
+        p->sibling->wake_pending = 0;
+    }
+}
+
+/*
+ * Sends the wake up that the write side of the duplex channel left to this reader, if any.
+ * The threads of the shared modes don't: it belongs to the thread of the other direction.
+ */
+void
+__xen_shm_pipe_send_deferred(struct xen_shm_pipe_priv* p) {
+    if(p->sibling != NULL && p->sibling->wake_pending && !p->multi_writer && !p->multi_reader) {
+        __xen_shm_pipe_send_signal(p->sibling);
+    }
+}
+
+/*
+ * Reads the wake count of the module (0 without a status page). Read before the last look at the shared memory,
+ * it makes the following wait return at once if a signal came in between.
+ */
+uint64_t
+__xen_shm_pipe_wake_count(struct xen_shm_pipe_priv* p) {
+    if(p->status == NULL) {
+        return 0;
+    }
+    return __atomic_load_n(&p->status->wake_count, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Sleeps until the wake count is not 'wake' anymore (XEN_SHM_IOCTL_AWAIT_WAKE), until the deadline of a timed call at most.
+ * Without deadline, the count and the flags go in the argument itself: nothing is copied.
+ * The wake up left by the write side of the duplex channel goes with the wait.
+ * Returns -1 and errno is set to ENOTTY if the module lacks the call (the wake up left is then sent on its own).
+ */
+int
+__xen_shm_pipe_await_wake(struct xen_shm_pipe_priv* p, uint64_t wake, uint8_t flags) {
+    struct xen_shm_ioctlarg_await_wake await;
+    uint64_t now;
+    int deferred;
+    int retval;
+
+    deferred = (p->sibling != NULL && p->sibling->wake_pending && !p->multi_writer && !p->multi_reader);
+    if(deferred) { //Request-response: the request goes with the wait for the answer
+        flags |= XEN_SHM_IOCTL_AWAIT_WAKE_SSIG;
+#ifdef XSHMP_STATS
+        p->stats.ioctl_count_ssig_await++;
+#endif
+        __xen_shm_pipe_signal_sent(p->sibling);
+    }
+
+    if(p->deadline_ns == 0) {
+        retval = ioctl(p->fd, XEN_SHM_IOCTL_AWAIT_WAKE, XEN_SHM_AWAIT_WAKE_ARG(wake, flags));
+    } else {
+        now = __xen_shm_pipe_now_ns();
+        await.request_flags = flags;
+        await.wake_count = wake;
+        await.timeout_ns = (now >= p->deadline_ns)?1:p->deadline_ns - now;
+        await.remaining_ns = 0;
+        retval = ioctl(p->fd, XEN_SHM_IOCTL_AWAIT_WAKE_TIMED, &await);
+    }
+    if(retval == 0) {
+        return 0;
+    }
+    if(errno == ENOTTY) {
+        __xen_shm_pipe_lacks_await_wake(p);
+        if(deferred) {
+            ioctl(p->fd, XEN_SHM_IOCTL_SSIG, 0);
+        }
+        errno = ENOTTY;
+    }
+    return -1;
+}
+
+/*
+ * The module lacks XEN_SHM_IOCTL_AWAIT_WAKE: the waits consume the latent signal. The waiters of a duplex channel
+ * can take the signal of each other, so they only sleep XEN_SHM_PIPE_SHARED_AWAIT_MS at a time.
+ */
+void
+__xen_shm_pipe_lacks_await_wake(struct xen_shm_pipe_priv* p) {
+    p->await_wake = 0;
+    if(p->sibling != NULL) {
+        p->await_op.timeout_ms = XEN_SHM_PIPE_SHARED_AWAIT_MS;
+        p->sibling->await_wake = 0;
+        p->sibling->await_op.timeout_ms = XEN_SHM_PIPE_SHARED_AWAIT_MS;
+    }
+}
+
+/*
+ * Sleeps until the other side signals, until the deadline of a timed call at most (the caller checks it again).
+ * 'wake' is the wake count read before the last look at the shared memory (see __xen_shm_pipe_wake_count).
+ * The signal is not consumed, so both pipes of a duplex channel can sleep at the same time without taking
+ * the signal of each other. Modules without XEN_SHM_IOCTL_AWAIT_WAKE wait for the latent signal instead.
+ */
 int
-__xen_shm_pipe_wait_signal(struct xen_shm_pipe_priv* p) {
+__xen_shm_pipe_wait_signal(struct xen_shm_pipe_priv* p, uint64_t wake) {
+    struct xen_shm_ioctlarg_await await;
+    struct xen_shm_ioctlarg_await_ns await_ns;
+    uint64_t now;
+    uint64_t left_ns;
+    unsigned long left_ms;
+    int retval;
+
 #ifdef XSHMP_STATS
-            p->stats.ioctl_count_await++;
+    p->stats.ioctl_count_await++;
 #endif
-            return ioctl(p->fd, XEN_SHM_IOCTL_AWAIT, &p->await_op);
+    if(p->await_wake && p->status != NULL) {
+        retval = __xen_shm_pipe_await_wake(p, wake, 0);
+        if(retval == 0 || errno != ENOTTY) {
+            return retval;
+        }
+    }
+
+    __xen_shm_pipe_send_deferred(p);
+    if(p->deadline_ns == 0) {
+        return ioctl(p->fd, XEN_SHM_IOCTL_AWAIT, &p->await_op);
+    }
+
+    //Timed call: sleeps until the deadline at most (the caller checks it again)
+    now = __xen_shm_pipe_now_ns();
+    left_ns = (now >= p->deadline_ns)?1:p->deadline_ns - now;
+    if(p->await_ns) {
+        await_ns.request_flags = p->await_op.request_flags;
+        await_ns.timeout_ns = ((uint64_t) p->await_op.timeout_ms)*1000000;
+        if(await_ns.timeout_ns == 0 || await_ns.timeout_ns > left_ns) {
+            await_ns.timeout_ns = left_ns;
+        }
+        retval = ioctl(p->fd, XEN_SHM_IOCTL_AWAIT_NS, &await_ns);
+        if(retval == 0 || errno != ENOTTY) {
+            return retval;
+        }
+        p->await_ns = 0; //Old module: millisecond timeouts
+    }
+
+    left_ms = (unsigned long) ((left_ns + 999999)/1000000); //Rounded up
+    await = p->await_op;
+    if(await.timeout_ms == 0 || await.timeout_ms > left_ms) {
+        await.timeout_ms = left_ms;
+    }
+    return ioctl(p->fd, XEN_SHM_IOCTL_AWAIT, &await);
 }
 
 /* Tests for EPIPE, returns -1 if EPIPE, 0 otherwise */
@@ -312,11 +1126,16 @@ int
 __xen_shm_pipe_prone_for_epipe(struct xen_shm_pipe_priv* p) {
     struct xen_shm_ioctlarg_await await;
 
+    if(p->status != NULL) { //Plain loads
+        return (p->status->offerer_state == XEN_SHM_META_PAGE_STATE_CLOSED
+                || p->status->receiver_state == XEN_SHM_META_PAGE_STATE_CLOSED)?-1:0;
+    }
+
 #ifdef XSHMP_STATS
             p->stats.ioctl_count_epipe_prone++;
 #endif
-    await.request_flags = XEN_SHM_IOCTL_AWAIT_INIT;
-    await.timeout_ms = 1;
+    await.request_flags = XEN_SHM_IOCTL_AWAIT_INIT | XEN_SHM_IOCTL_AWAIT_NOWAIT; //Never sleeps
+    await.timeout_ms = 0;
 
     if(ioctl(p->fd, XEN_SHM_IOCTL_AWAIT, &await)<0 && errno == EPIPE)  {
         return -1;
@@ -327,6 +1146,343 @@ __xen_shm_pipe_prone_for_epipe(struct xen_shm_pipe_priv* p) {
 }
 
 
+/*
+ * Position helpers.
+ * p->local is this side's position (not always published yet), p->remote the cached position of the other side.
+ * With the legacy ring, positions are offsets in the buffer and one byte is kept free to tell full from empty.
+ * With the power of two ring, positions are free running counters: the offset is a mask and the occupancy a subtraction.
+ */
+
+/* Returns the offset in the buffer of a position */
+size_t
+__xen_shm_pipe_offset(struct xen_shm_pipe_priv* p, uint64_t pos) {
+    if(p->ring == xen_shm_pipe_ring_pow2) {
+        return (size_t) (pos & (uint64_t) (p->buffer_size - 1));
+    }
+    return (size_t) pos;
+}
+
+/* Moves the local position forward, without publishing it */
+void
+__xen_shm_pipe_advance(struct xen_shm_pipe_priv* p, size_t nbytes) {
+    p->local += nbytes;
+    if(p->ring != xen_shm_pipe_ring_pow2 && p->local >= p->buffer_size) {
+        p->local -= p->buffer_size;
+    }
+}
+
+/*
+ * Publishes the local position in the shared memory.
+ * The 64 bits counters are stored atomically, so that a 32 bits peer never sees half of it.
+ */
+void
+__xen_shm_pipe_publish(struct xen_shm_pipe_priv* p) {
+    volatile struct xen_shm_pipe_shared* sv;
+
+    sv = p->shared;
+    if(p->mod == xen_shm_pipe_mod_write) {
+        if(p->ring == xen_shm_pipe_ring_pow2) {
+            __atomic_store_n(&sv->head, p->local, __ATOMIC_RELEASE);
+        } else {
+            sv->write = (uint32_t) p->local;
+        }
+        p->held = 0; //Whatever was held is visible now
+    } else {
+        if(p->ring == xen_shm_pipe_ring_pow2) {
+            __atomic_store_n(&sv->tail, p->local, __ATOMIC_RELEASE);
+        } else {
+            sv->read = (uint32_t) p->local;
+        }
+    }
+}
+
+/*
+ * Reloads the other side's index from the shared memory and caches it.
+ * The other side's index lives on its cache line, that is modified each time it publishes,
+ * so this load is avoided as long as the cached value says there is something to do.
+ * The cached value can only be late, so it never gives more room than the real one.
+ */
+uint64_t
+__xen_shm_pipe_load_remote(struct xen_shm_pipe_priv* p) {
+    volatile struct xen_shm_pipe_shared* sv;
+
+    sv = p->shared;
+    if(p->mod == xen_shm_pipe_mod_write) {
+        if(p->ring == xen_shm_pipe_ring_pow2) {
+            p->remote = __atomic_load_n(&sv->tail, __ATOMIC_ACQUIRE);
+        } else {
+            p->remote = sv->read;
+        }
+    } else {
+        if(p->ring == xen_shm_pipe_ring_pow2) {
+            p->remote = __atomic_load_n(&sv->head, __ATOMIC_ACQUIRE);
+        } else {
+            p->remote = sv->write;
+        }
+    }
+
+#ifdef XSHMP_STATS
+    p->stats.remote_index_loads++;
+#endif
+
+    return p->remote;
+}
+
+/* Returns the number of bytes that can be read contiguously at the current read position, according to the cached write index */
+size_t
+__xen_shm_pipe_read_contiguous(struct xen_shm_pipe_priv* p) {
+    size_t avail;
+    size_t to_end;
+
+    if(p->ring == xen_shm_pipe_ring_pow2) {
+        avail = (size_t) (p->remote - p->local);
+        to_end = p->buffer_size - __xen_shm_pipe_offset(p, p->local);
+        return (avail < to_end)?avail:to_end;
+    }
+
+    if(p->local <= p->remote) {
+        return (size_t) (p->remote - p->local);
+    } else {
+        return p->buffer_size - (size_t) p->local;
+    }
+}
+
+/* Returns the slot of a queue pipe at the local position. Positions are counted in bytes, like in the power of two ring. */
+struct xen_shm_queue_slot*
+__xen_shm_queue_slot(struct xen_shm_pipe_priv* p) {
+    return (struct xen_shm_queue_slot*) (p->shared->buffer + (ptrdiff_t) __xen_shm_pipe_offset(p, p->local));
+}
+
+/*
+ * Tells if there is something to read. The other side's index is only reloaded if asked.
+ * A queue pipe only looks at the sequence number of the next slot.
+ */
+int
+__xen_shm_pipe_read_ready(struct xen_shm_pipe_priv* p, int reload) {
+    if(p->type == xen_shm_pipe_type_queue) {
+        return __atomic_load_n(&__xen_shm_queue_slot(p)->seq, __ATOMIC_ACQUIRE) == (uint32_t) (XSHMP_QUEUE_POS(p->local) + 1);
+    }
+
+    if(reload) {
+        __xen_shm_pipe_load_remote(p);
+    }
+    return p->local != p->remote;
+}
+
+uint64_t
+__xen_shm_pipe_now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t) ts.tv_sec)*1000000000ull + (uint64_t) ts.tv_nsec;
+}
+
+/* Starts a wait: gives it its spin budget according to the wait policy */
+void
+__xen_shm_pipe_wait_begin(struct xen_shm_pipe_priv* p, struct xen_shm_pipe_wait_state* ws) {
+    ws->spins = 0;
+    ws->backoff = 1;
+    ws->slept = 0;
+    ws->start_ns = 0;
+    ws->budget_ns = 0;
+
+    switch(p->wait_policy) {
+        case xen_shm_pipe_wait_latency:
+            ws->budget_ns = XEN_SHM_PIPE_SPIN_LATENCY_NS;
+            ws->start_ns = __xen_shm_pipe_now_ns();
+            break;
+        case xen_shm_pipe_wait_adaptive:
+            if(p->wait_avg_ns <= XEN_SHM_PIPE_SPIN_ADAPTIVE_MAX_NS) { //Else, the other side is slow, don't spin at all
+                ws->budget_ns = 2*p->wait_avg_ns;
+                if(ws->budget_ns > XEN_SHM_PIPE_SPIN_ADAPTIVE_MAX_NS) {
+                    ws->budget_ns = XEN_SHM_PIPE_SPIN_ADAPTIVE_MAX_NS;
+                }
+            }
+            ws->start_ns = __xen_shm_pipe_now_ns();
+            break;
+        default:
+            break;
+    }
+}
+
+/*
+ * Spins once if the wait policy allows it, with an exponential backoff of cpu relax instructions.
+ * Returns 1 if it did, 0 if the caller must sleep.
+ */
+int
+__xen_shm_pipe_wait_spin(struct xen_shm_pipe_priv* p, struct xen_shm_pipe_wait_state* ws, uint32_t other_flags) {
+    uint32_t i;
+
+    switch(p->wait_policy) {
+        case xen_shm_pipe_wait_power_save:
+            return 0;
+        case xen_shm_pipe_wait_latency:
+        case xen_shm_pipe_wait_adaptive:
+            if(ws->budget_ns == 0) {
+                return 0;
+            }
+            if(ws->spins % XEN_SHM_PIPE_SPIN_CLOCK_INTERVAL == 0 && __xen_shm_pipe_now_ns() - ws->start_ns >= ws->budget_ns) {
+                ws->budget_ns = 0; //Exhausted, until the end of the wait
+                return 0;
+            }
+            break;
+        default: //Throughput
+            if(!(other_flags & XSHMP_ACTIVE) || ws->spins >= XEN_SHM_PIPE_WAIT_LOOP_ACTIVE_MAX) {
+                return 0;
+            }
+            break;
+    }
+
+    __xen_shm_pipe_send_deferred(p); //The other side can't answer while it sleeps
+
+    for(i=0; i<ws->backoff; i++) {
+        XSHMP_CPU_RELAX();
+    }
+    if(ws->backoff < XEN_SHM_PIPE_SPIN_BACKOFF_MAX) {
+        ws->backoff <<= 1;
+    }
+    ws->spins++;
+    return 1;
+}
+
+/* Ends a wait: the adaptive policy learns from its duration */
+void
+__xen_shm_pipe_wait_end(struct xen_shm_pipe_priv* p, struct xen_shm_pipe_wait_state* ws) {
+    uint64_t duration;
+
+    __xen_shm_pipe_send_deferred(p); //Never left behind a read
+
+    if(ws->spins == 0 && !ws->slept) { //The other side was already done
+        return;
+    }
+
+#ifdef XSHMP_STATS
+    if(ws->slept) {
+        p->stats.sleep_waits++;
+    } else {
+        p->stats.spin_waits++;
+    }
+    p->stats.spin_count += ws->spins;
+#endif
+
+    if(p->wait_policy == xen_shm_pipe_wait_adaptive) {
+        duration = __xen_shm_pipe_now_ns() - ws->start_ns;
+        if(duration > 4*XEN_SHM_PIPE_SPIN_ADAPTIVE_MAX_NS) { //A long idle period must not prevent spinning for long
+            duration = 4*XEN_SHM_PIPE_SPIN_ADAPTIVE_MAX_NS;
+        }
+        p->wait_avg_ns = (3*p->wait_avg_ns + duration)/4;
+    }
+}
+
+/*
+ * Sets or clears this side's sleeping flag. With several threads or processes on this side, the last one clears it.
+ * Its clear can come after another one set the flag again: it then wakes the sleepers up (XEN_SHM_IOCTL_PASS_WAKE),
+ * so that they set it once more (see __xen_shm_pipe_sleep_begin).
+ */
+void
+__xen_shm_pipe_set_sleeping(struct xen_shm_pipe_priv* p, int sleeping) {
+    uint32_t* sleepers;
+    uint32_t* flags;
+
+    sleepers = NULL;
+    if(p->multi_reader) {
+        sleepers = &p->shared->sleepers;
+    } else if(p->multi_writer) {
+        sleepers = &p->sleepers;
+    }
+    flags = __xen_shm_pipe_get_flags(p, 1);
+
+    if(sleeping) {
+        if(sleepers != NULL) {
+            __atomic_fetch_add(sleepers, 1, __ATOMIC_ACQ_REL);
+        }
+        __atomic_fetch_or(flags, XSHMP_SLEEPING, __ATOMIC_SEQ_CST); //Each sleeper sets it, the clear of the last one may be late
+    } else {
+        if(sleepers == NULL) {
+            __atomic_fetch_and(flags, ~XSHMP_SLEEPING, __ATOMIC_SEQ_CST);
+        } else if(__atomic_sub_fetch(sleepers, 1, __ATOMIC_ACQ_REL) == 0) {
+            __atomic_fetch_and(flags, ~XSHMP_SLEEPING, __ATOMIC_SEQ_CST);
+            if(__atomic_load_n(sleepers, __ATOMIC_SEQ_CST) != 0 && p->await_wake && p->status != NULL) { //A new sleeper may miss the flag
+                ioctl(p->fd, XEN_SHM_IOCTL_PASS_WAKE, 0);
+            }
+        }
+    }
+}
+
+/*
+ * Sets the sleeping flag before the last check of the other side's index, and returns the wake count to sleep with.
+ * The flag is set again until it is seen set after the wake count was read: if the last sleeper to wake up clears it
+ * later, its wake up changes the wake count.
+ */
+uint64_t
+__xen_shm_pipe_sleep_begin(struct xen_shm_pipe_priv* p) {
+    uint32_t* flags;
+    uint64_t wake;
+
+    flags = __xen_shm_pipe_get_flags(p, 1);
+    __xen_shm_pipe_set_sleeping(p, 1);
+    for(;;) {
+        wake = __xen_shm_pipe_wake_count(p);
+        if(__atomic_load_n(flags, __ATOMIC_SEQ_CST) & XSHMP_SLEEPING) {
+            return wake;
+        }
+        __atomic_fetch_or(flags, XSHMP_SLEEPING, __ATOMIC_SEQ_CST);
+    }
+}
+
+/*
+ * Sleeps along with the other threads or processes of this side (multi-reader and multi-writer modes).
+ * The exclusive sleepers are woken up one at a time.
+ * Modules without XEN_SHM_IOCTL_AWAIT_WAKE: the sleepers can take the latent signal of each other,
+ * so they only sleep XEN_SHM_PIPE_SHARED_AWAIT_MS at a time.
+ */
+int
+__xen_shm_pipe_wait_shared(struct xen_shm_pipe_priv* p, uint64_t wake, int exclusive) {
+    struct xen_shm_ioctlarg_await await;
+    int retval;
+
+#ifdef XSHMP_STATS
+    __atomic_fetch_add(&p->stats.ioctl_count_await, 1, __ATOMIC_RELAXED);
+#endif
+    if(p->await_wake && p->status != NULL) {
+        retval = __xen_shm_pipe_await_wake(p, wake, exclusive?XEN_SHM_IOCTL_AWAIT_WAKE_EXCLUSIVE:0);
+        if(retval == 0 || errno != ENOTTY) {
+            return retval;
+        }
+    }
+
+    await.request_flags = XEN_SHM_IOCTL_AWAIT_LATENT_USER;
+    await.timeout_ms = XEN_SHM_PIPE_SHARED_AWAIT_MS;
+    return ioctl(p->fd, XEN_SHM_IOCTL_AWAIT, &await);
+}
+
+/*
+ * Non-blocking mode: asks the other side to signal its next progress, so that a poll on the fd wakes up.
+ * First consumes the signal that woke up the poll, if any. The caller must look at the shared memory again after this.
+ */
+void
+__xen_shm_pipe_arm(struct xen_shm_pipe_priv* p) {
+    struct xen_shm_ioctlarg_await await;
+
+    if(p->status == NULL || p->status->latent_user_signal) { //Nothing to consume otherwise
+        await.request_flags = XEN_SHM_IOCTL_AWAIT_LATENT_USER | XEN_SHM_IOCTL_AWAIT_NOWAIT;
+        await.timeout_ms = 0;
+        ioctl(p->fd, XEN_SHM_IOCTL_AWAIT, &await); //Fails with EAGAIN if there was no signal
+    }
+
+    if(__atomic_exchange_n(&p->armed, 1, __ATOMIC_ACQ_REL) == 0) {
+        __xen_shm_pipe_set_sleeping(p, 1);
+    }
+}
+
+/* Non-blocking mode: the progress came, no more signal is needed */
+void
+__xen_shm_pipe_disarm(struct xen_shm_pipe_priv* p) {
+    if(__atomic_exchange_n(&p->armed, 0, __ATOMIC_ACQ_REL) == 1) {
+        __xen_shm_pipe_set_sleeping(p, 0);
+    }
+}
+
 /* Waits for available bytes to read. Return -1 if error. 0 if end of file. 1 if bytes available. */
 int
 __xen_shm_pipe_wait_reader(struct xen_shm_pipe_priv* p) {
@@ -334,28 +1490,57 @@ __xen_shm_pipe_wait_reader(struct xen_shm_pipe_priv* p) {
     volatile struct xen_shm_pipe_shared* sv;
 
     uint32_t writer_flags;
-    uint32_t read_p;
     uint32_t loop_count;
-    uint32_t active_count;
+    struct xen_shm_pipe_wait_state ws;
     int retval;
     int unset_wait;
+    int signaled; //A signal was sent to the sleeping other side during this round
+    uint64_t wake; //The wake count before the last check
 
     s = p->shared;
     sv = p->shared;
 
     unset_wait = 0;
+    signaled = 0;
     loop_count = XEN_SHM_PIPE_WAIT_LOOP_LIMIT;
-    active_count = XEN_SHM_PIPE_WAIT_LOOP_ACTIVE_MAX;
 
-    read_p = s->read;
-    while(read_p == sv->write) {
+    if(__xen_shm_pipe_read_ready(p, 0)) { //Known bytes are still unread
+#ifdef XSHMP_STATS
+        p->stats.remote_index_cached++;
+#endif
+        __xen_shm_pipe_send_deferred(p);
+        return 1;
+    }
+
+    if(p->nonblock) { //Never waits
+        __xen_shm_pipe_send_deferred(p);
+        writer_flags = sv->writer_flags;
+        if(!__xen_shm_pipe_read_ready(p, 1)) {
+            __xen_shm_pipe_arm(p); //So that a poll tells when to come back. Then look again
+            writer_flags = sv->writer_flags;
+            if(!__xen_shm_pipe_read_ready(p, 1)) {
+                if(writer_flags & XSHMP_CLOSED) {
+                    return 0;
+                }
+                errno = p->saw_epipe?EPIPE:EAGAIN;
+                return -1;
+            }
+        }
+        if(p->armed) {
+            __xen_shm_pipe_disarm(p);
+        }
+        return 1;
+    }
+
+    __xen_shm_pipe_wait_begin(p, &ws);
+    while(!__xen_shm_pipe_read_ready(p, 1)) {
 
         writer_flags = sv->writer_flags;
         --loop_count;
         s->reader_flags |= XSHMP_WAITING; //Say we are waiting
         unset_wait = 1;
 
-        if(read_p != sv->write) { //Check nothing changed
+        if(__xen_shm_pipe_read_ready(p, 1)) { //Check nothing changed
             break;
         }
 
@@ -364,11 +1549,12 @@ __xen_shm_pipe_wait_reader(struct xen_shm_pipe_priv* p) {
         }
 
         if(loop_count==0) {
-            if(__xen_shm_pipe_prone_for_epipe(p)<0) {
-                errno = EPIPE;
-                return -1;
+            if(__xen_shm_pipe_prone_for_epipe(p)<0) { //Look at the flags again: the writer may have closed meanwhile
+                p->saw_epipe = 1;
+                continue;
             }
             loop_count = XEN_SHM_PIPE_WAIT_LOOP_LIMIT;
+            signaled = 0;
         }
 
         if(p->saw_epipe) { //File is not closed but we saw a EPIPE. It's an error.
@@ -376,29 +1562,43 @@ __xen_shm_pipe_wait_reader(struct xen_shm_pipe_priv* p) {
             return -1;
         }
 
-        if(writer_flags & XSHMP_SLEEPING) { //Other is sleeping, must send a signal
+        if(p->deadline_ns != 0 && __xen_shm_pipe_now_ns() >= p->deadline_ns) { //Timed call
+            s->reader_flags &= ~XSHMP_WAITING;
+            __xen_shm_pipe_send_deferred(p);
+            errno = ETIME;
+            return -1;
+        }
+
+        if((writer_flags & XSHMP_SLEEPING) && !signaled) { //Other is sleeping, must send a signal
             __xen_shm_pipe_send_signal(p);
+            signaled = 1; //The signal stays pending until it wakes up, no need to repeat it until our next round
             continue;
         }
 
         if( writer_flags & XSHMP_WAITING ) { //Other is waiting, must do an active wait
+            __xen_shm_pipe_send_deferred(p);
             continue;
         }
 
-        if((writer_flags & XSHMP_ACTIVE) && active_count) {
-            --active_count;
+        if(__xen_shm_pipe_wait_spin(p, &ws, writer_flags)) {
             continue;
         }
 
-        sv->reader_flags |= XSHMP_SLEEPING; //Say we are sleeping
-        retval = __xen_shm_pipe_wait_signal(p);
+        ws.slept = 1;
+        __atomic_fetch_or(&s->reader_flags, XSHMP_SLEEPING, __ATOMIC_SEQ_CST); //Say we are sleeping
+        wake = __xen_shm_pipe_wake_count(p);
+        retval = 0;
+        if(!__xen_shm_pipe_read_ready(p, 1) && !(sv->writer_flags & XSHMP_CLOSED)) { //Check nothing changed before the writer could see the flag
+            retval = __xen_shm_pipe_wait_signal(p, wake);
+        }
         sv->reader_flags &= ~XSHMP_SLEEPING; //Wake up !
+        signaled = 0;
         if(retval == -1) {
             if(errno == EPIPE) {
                 p->saw_epipe = 1;
                 continue;
             } else {
-                s->writer_flags &= ~XSHMP_WAITING;
+                s->reader_flags &= ~XSHMP_WAITING;
                 return -1;
             }
         }
@@ -408,41 +1608,323 @@ __xen_shm_pipe_wait_reader(struct xen_shm_pipe_priv* p) {
     if(unset_wait) {
         s->reader_flags &= ~XSHMP_WAITING;
     }
+    __xen_shm_pipe_wait_end(p, &ws);
 
     return 1;
 }
 
 
-/* Waits for available bytes to read. Return -1 if error. 0 if end of file. 1 if bytes available. */
+/* Returns the number of bytes the ring can hold */
+size_t
+__xen_shm_pipe_capacity(struct xen_shm_pipe_priv* p) {
+    return p->buffer_size - ((p->ring == xen_shm_pipe_ring_pow2)?0:1); //The legacy ring never uses its last byte
+}
+
+/* Returns the number of written bytes the reader did not read yet, according to the other side's index (reloaded) */
+size_t
+__xen_shm_pipe_used(struct xen_shm_pipe_priv* p) {
+    uint64_t write_pos;
+    uint64_t read_pos;
+
+    __xen_shm_pipe_load_remote(p);
+    write_pos = (p->mod == xen_shm_pipe_mod_write)?p->local:p->remote;
+    read_pos = (p->mod == xen_shm_pipe_mod_write)?p->remote:p->local;
+
+    if(p->ring == xen_shm_pipe_ring_pow2 || write_pos >= read_pos) {
+        return (size_t) (write_pos - read_pos);
+    }
+    return p->buffer_size - (size_t) (read_pos - write_pos);
+}
+
+/*
+ * Tells if the other side sleeps and what it waits for reached its watermark (see xen_shm_pipe_set_lowat).
+ * Called after publishing.
+ */
 int
-__xen_shm_pipe_wait_writer(struct xen_shm_pipe_priv* p) {
-    struct xen_shm_pipe_shared* s;
+__xen_shm_pipe_peer_needs_wake(struct xen_shm_pipe_priv* p) {
     volatile struct xen_shm_pipe_shared* sv;
+    size_t lowat;
+    size_t used;
 
-    uint32_t reader_flags;
-    uint32_t write_p;
-    int retval;
-    int unset_wait;
-    uint32_t loop_count;
-    uint32_t active_count;
-
-    s = p->shared;
     sv = p->shared;
 
-    unset_wait = 0;
-    loop_count = XEN_SHM_PIPE_WAIT_LOOP_LIMIT;
-    active_count = XEN_SHM_PIPE_WAIT_LOOP_ACTIVE_MAX;
+    //The other side sets its flag, then looks at our index one last time before sleeping:
+    //the publication must be visible before its flag is read, or both could miss each other
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
 
-    if(sv->reader_flags & XSHMP_CLOSED) { //File was closed
+    if(p->mod == xen_shm_pipe_mod_write) {
+        if(!(sv->reader_flags & XSHMP_SLEEPING)) {
+            return 0;
+        }
+        lowat = sv->reader_lowat;
+    } else {
+        if(!(sv->writer_flags & XSHMP_SLEEPING)) {
+            return 0;
+        }
+        lowat = sv->writer_lowat;
+    }
+
+    if(lowat > 1) {
+        if(lowat > __xen_shm_pipe_capacity(p)) { //Could never be reached
+            lowat = __xen_shm_pipe_capacity(p);
+        }
+        used = __xen_shm_pipe_used(p);
+        if((p->mod == xen_shm_pipe_mod_write && used < lowat) //Not enough to read yet
+           || (p->mod == xen_shm_pipe_mod_read && __xen_shm_pipe_capacity(p) - used < lowat)) { //Not enough room yet
+            __xen_shm_pipe_notify_put_off(p, 0);
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/* Wakes up the other side if it sleeps and what it waits for reached its watermark */
+void
+__xen_shm_pipe_wake_peer(struct xen_shm_pipe_priv* p) {
+    if(__xen_shm_pipe_peer_needs_wake(p)) {
+        __xen_shm_pipe_send_signal(p);
+    }
+}
+
+/*
+ * Same at the end of a write call. With xen_shm_pipe_set_wake_on_read, the signal is left to the next read
+ * of the duplex channel, which sends it with its own wait, or at once if it doesn't sleep.
+ */
+void
+__xen_shm_pipe_wake_peer_last(struct xen_shm_pipe_priv* p) {
+    if(!__xen_shm_pipe_peer_needs_wake(p)) {
+        return;
+    }
+    if(p->wake_on_read && p->sibling != NULL && !p->sibling->nonblock && !p->sibling->multi_reader) {
+        p->wake_pending = 1;
+        __xen_shm_pipe_notify_put_off(p, 0);
+        return;
+    }
+    __xen_shm_pipe_send_signal(p);
+}
+
+/*
+ * Notification moderation. While reading/writing, the other side is checked every few bytes, and woken up
+ * if it sleeps, so that it works at the same time. Each check costs a look at its flags, each wake up
+ * an interrupt in the other domain.
+ * The automatic interval is the bytes transferred in the moderation time at the recent rate, up to twice more
+ * when the other side is usually found asleep (it keeps up easily, so it can wait longer between two wake ups).
+ */
+
+/* Bytes before the first check of a read/write call */
+size_t
+__xen_shm_pipe_notify_start(struct xen_shm_pipe_priv* p, uint32_t other_flags) {
+    size_t left;
+    uint64_t now;
+
+    left = p->notify_left;
+    if((other_flags & XSHMP_SLEEPING) && left > XEN_SHM_PIPE_NOTIFY_MIN_BYTES) {
+        now = __xen_shm_pipe_now_ns();
+        if(now - p->notify_last_ns >= p->notify_ns) { //Long enough since the last check: soon
+            p->notify_interval -= left - XEN_SHM_PIPE_NOTIFY_MIN_BYTES;
+            left = XEN_SHM_PIPE_NOTIFY_MIN_BYTES;
+        } else {
+            __xen_shm_pipe_notify_put_off(p, now);
+        }
+    }
+    return left;
+}
+
+/* A check was done (asleep tells if the other side was asleep): learns from it and returns the bytes before the next one */
+size_t
+__xen_shm_pipe_notify_next(struct xen_shm_pipe_priv* p, int asleep) {
+    uint64_t now;
+    uint64_t sample;
+    uint64_t next;
+    size_t max;
+
+    now = __xen_shm_pipe_now_ns();
+    if(p->notify_last_ns != 0 && now > p->notify_last_ns) {
+        sample = ((uint64_t) p->notify_interval)*1000000/(now - p->notify_last_ns);
+        p->notify_rate = (p->notify_rate == 0)?sample:(3*p->notify_rate + sample)/4;
+    }
+    p->notify_sleep_freq = (3*p->notify_sleep_freq + (asleep?256u:0u))/4;
+    p->notify_last_ns = now;
+
+    if(p->notify_bytes != XEN_SHM_PIPE_NOTIFY_AUTO) {
+        next = p->notify_bytes;
+        max = p->buffer_size;
+    } else {
+        next = p->notify_rate*p->notify_ns/1000000;
+        next += next*p->notify_sleep_freq/256;
+        max = p->buffer_size/XEN_SHM_PIPE_WAIT_CHECK_PER_ROUND;
+        if(next < XEN_SHM_PIPE_NOTIFY_MIN_BYTES) {
+            next = XEN_SHM_PIPE_NOTIFY_MIN_BYTES;
+        }
+    }
+    if(next > max) {
+        next = max;
+    }
+
+    p->notify_interval = (size_t) next;
+    return p->notify_interval;
+}
+
+/* Statistics: the sleeping other side is left asleep for now ('now' can be 0 if not known). Counted once until it is woken up. */
+void
+__xen_shm_pipe_notify_put_off(struct xen_shm_pipe_priv* p, uint64_t now) {
+#ifdef XSHMP_STATS
+    if(p->notify_put_off_ns == 0) {
+        p->stats.signals_suppressed++;
+        p->notify_put_off_ns = (now != 0)?now:__xen_shm_pipe_now_ns();
+    }
+#endif
+}
+
+/*
+ * Coalescing writer: adds the bytes just written (and not published) to the held ones.
+ * Returns 1 if they can all stay held, 0 if the byte threshold or the deadline is reached and they must be published.
+ */
+int
+__xen_shm_pipe_hold(struct xen_shm_pipe_priv* p, size_t bytes) {
+    uint64_t now;
+
+    now = __xen_shm_pipe_now_ns();
+    if(p->held == 0) {
+        p->held_since_ns = now;
+    }
+    p->held += bytes;
+
+    if(p->held >= p->coalesce_bytes || (p->coalesce_ns && now - p->held_since_ns >= p->coalesce_ns)) {
+        return 0;
+    }
+
+#ifdef XSHMP_STATS
+    p->stats.held_writes++;
+#endif
+    return 1;
+}
+
+/* Coalescing writer: publishes the held bytes and wakes the reader up if needed */
+void
+__xen_shm_pipe_release_held(struct xen_shm_pipe_priv* p) {
+    __xen_shm_pipe_publish(p);
+    __xen_shm_pipe_wake_peer(p);
+}
+
+/* Returns the number of bytes that can be written contiguously at the current write position, according to the cached read index */
+size_t
+__xen_shm_pipe_write_contiguous(struct xen_shm_pipe_priv* p) {
+    size_t room;
+    size_t to_end;
+
+    if(p->ring == xen_shm_pipe_ring_pow2) {
+        room = p->buffer_size - (size_t) (p->local - p->remote);
+        to_end = p->buffer_size - __xen_shm_pipe_offset(p, p->local);
+        return (room < to_end)?room:to_end;
+    }
+
+    if(p->local < p->remote) {
+        return (size_t) (p->remote - p->local - 1);
+    } else if(p->remote == 0) { //Cannot write the last byte
+        return p->buffer_size - (size_t) p->local - 1;
+    } else {
+        return p->buffer_size - (size_t) p->local;
+    }
+}
+
+/* Returns the number of bytes that could be written contiguously at the current write position if the reader was done */
+size_t
+__xen_shm_pipe_write_contiguous_max(struct xen_shm_pipe_priv* p) {
+    if(p->ring == xen_shm_pipe_ring_pow2) {
+        return p->buffer_size - __xen_shm_pipe_offset(p, p->local);
+    }
+    return p->buffer_size - (size_t) p->local - ((p->local == 0)?1:0);
+}
+
+/* Returns the number of bytes that can be written, contiguously or not, according to the cached read index */
+size_t
+__xen_shm_pipe_write_space(struct xen_shm_pipe_priv* p, int contiguous) {
+    if(contiguous) {
+        return __xen_shm_pipe_write_contiguous(p);
+    }
+
+    if(p->ring == xen_shm_pipe_ring_pow2) {
+        return p->buffer_size - (size_t) (p->local - p->remote);
+    }
+
+    if(p->local < p->remote) {
+        return (size_t) (p->remote - p->local - 1);
+    } else {
+        return p->buffer_size - (size_t) (p->local - p->remote) - 1;
+    }
+}
+
+/*
+ * Tells if at least 'needed' bytes (contiguous if asked) can be written. The other side's index is only reloaded if asked.
+ * A queue pipe only looks at the sequence number of the next slot.
+ */
+int
+__xen_shm_pipe_write_ready(struct xen_shm_pipe_priv* p, size_t needed, int contiguous, int reload) {
+    if(p->type == xen_shm_pipe_type_queue) {
+        return __atomic_load_n(&__xen_shm_queue_slot(p)->seq, __ATOMIC_ACQUIRE) == (uint32_t) XSHMP_QUEUE_POS(p->local);
+    }
+
+    if(reload) {
+        __xen_shm_pipe_load_remote(p);
+    }
+    return __xen_shm_pipe_write_space(p, contiguous) >= needed;
+}
+
+/* Waits for at least 'needed' (contiguous if asked) bytes to write. Return -1 if error. 1 if space available. */
+int
+__xen_shm_pipe_wait_writer(struct xen_shm_pipe_priv* p, size_t needed, int contiguous) {
+    struct xen_shm_pipe_shared* s;
+    volatile struct xen_shm_pipe_shared* sv;
+
+    uint32_t reader_flags;
+    int retval;
+    int unset_wait;
+    int signaled; //A signal was sent to the sleeping other side during this round
+    uint64_t wake; //The wake count before the last check
+    uint32_t loop_count;
+    struct xen_shm_pipe_wait_state ws;
+
+    s = p->shared;
+    sv = p->shared;
+
+    unset_wait = 0;
+    signaled = 0;
+    loop_count = XEN_SHM_PIPE_WAIT_LOOP_LIMIT;
+
+    if(sv->reader_flags & XSHMP_CLOSED) { //File was closed
+        errno = EPIPE;
         return -1;
     }
 
-    write_p = s->write + 1;
-    if(write_p == p->buffer_size) {
-        write_p = 0;
+    if(__xen_shm_pipe_write_ready(p, needed, contiguous, 0)) { //Enough room known without looking at the reader
+#ifdef XSHMP_STATS
+        p->stats.remote_index_cached++;
+#endif
+        return 1;
+    }
+
+    if(p->held) { //The reader can't give back room it doesn't see
+        __xen_shm_pipe_release_held(p);
+    }
+
+    if(p->nonblock) { //Never waits
+        if(!__xen_shm_pipe_write_ready(p, needed, contiguous, 1)) {
+            __xen_shm_pipe_arm(p); //So that a poll tells when to come back. Then look again
+            if(!__xen_shm_pipe_write_ready(p, needed, contiguous, 1)) {
+                errno = EAGAIN;
+                return -1;
+            }
+        }
+        if(p->armed) {
+            __xen_shm_pipe_disarm(p);
+        }
+        return 1;
     }
 
-    while(write_p == sv->read) {
+    __xen_shm_pipe_wait_begin(p, &ws);
+    while(!__xen_shm_pipe_write_ready(p, needed, contiguous, 1)) {
 
         reader_flags = sv->reader_flags;
         --loop_count;
@@ -450,11 +1932,12 @@ __xen_shm_pipe_wait_writer(struct xen_shm_pipe_priv* p) {
         s->writer_flags |= XSHMP_WAITING; //Say we are waiting
         unset_wait = 1;
 
-        if(write_p != sv->read) { //Check nothing changed
+        if(__xen_shm_pipe_write_ready(p, needed, contiguous, 1)) { //Check nothing changed
             break;
         }
 
         if(reader_flags & XSHMP_CLOSED) { //File was closed
+            errno = EPIPE;
             return -1;
         }
 
@@ -464,10 +1947,18 @@ __xen_shm_pipe_wait_writer(struct xen_shm_pipe_priv* p) {
                 return -1;
             }
             loop_count = XEN_SHM_PIPE_WAIT_LOOP_LIMIT;
+            signaled = 0;
         }
 
-        if(reader_flags & XSHMP_SLEEPING) { //Other is sleeping, must send a signal
+        if(p->deadline_ns != 0 && __xen_shm_pipe_now_ns() >= p->deadline_ns) { //Timed call
+            s->writer_flags &= ~XSHMP_WAITING;
+            errno = ETIME;
+            return -1;
+        }
+
+        if((reader_flags & XSHMP_SLEEPING) && !signaled) { //Other is sleeping, must send a signal
             __xen_shm_pipe_send_signal(p);
+            signaled = 1; //The signal stays pending until it wakes up, no need to repeat it until our next round
             continue;
         }
 
@@ -475,14 +1966,19 @@ __xen_shm_pipe_wait_writer(struct xen_shm_pipe_priv* p) {
             continue;
         }
 
-        if((reader_flags & XSHMP_ACTIVE) && active_count) {
-            --active_count;
+        if(__xen_shm_pipe_wait_spin(p, &ws, reader_flags)) {
             continue;
         }
 
-        sv->writer_flags |= XSHMP_SLEEPING; //Say we are sleeping
-        retval = __xen_shm_pipe_wait_signal(p);
+        ws.slept = 1;
+        __atomic_fetch_or(&s->writer_flags, XSHMP_SLEEPING, __ATOMIC_SEQ_CST); //Say we are sleeping
+        wake = __xen_shm_pipe_wake_count(p);
+        retval = 0;
+        if(!__xen_shm_pipe_write_ready(p, needed, contiguous, 1) && !(sv->reader_flags & XSHMP_CLOSED)) { //Check nothing changed before the reader could see the flag
+            retval = __xen_shm_pipe_wait_signal(p, wake);
+        }
         sv->writer_flags &= ~XSHMP_SLEEPING; //Wake up !
+        signaled = 0;
         if(retval == -1) {
             s->writer_flags &= ~XSHMP_WAITING;
             return -1;
@@ -493,437 +1989,1987 @@ __xen_shm_pipe_wait_writer(struct xen_shm_pipe_priv* p) {
     if(unset_wait) {
         s->writer_flags &= ~XSHMP_WAITING;
     }
+    __xen_shm_pipe_wait_end(p, &ws);
 
     return 1;
 }
 
 size_t
-__xen_shm_pipe_read_avail(struct xen_shm_pipe_priv* p, void* buf, size_t nbytes) {
+__xen_shm_pipe_read_avail(struct xen_shm_pipe_priv* p, const struct iovec* iov, int iovcnt, size_t offset) {
     struct xen_shm_pipe_shared* s;
     volatile struct xen_shm_pipe_shared* sv;
 
-    uint8_t is_aligned;
-    uint8_t gran_check;
+    const uint8_t* read_pos; //Read pointer in circular buffer
 
-    uint8_t* user_buf; //A cast of the given user buffer
+    uint8_t* current_buf;//Current position in the current user segment
+    size_t seg_left;//Remaining bytes in the current user segment
+    size_t usr_left;//Remaining bytes in all the user segments
 
-    uint8_t* read_pos; //Read pointer in circular buffer
-    uint64_t* read_pos64;//64b aligned
-    uint8_t* write_pos;//Write pointer in circ buff
-    uint8_t* shared_max; //Out of bound pointer in circ buffer
+    size_t chunk;//Bytes to read before updating the shared read position
+    size_t len;
+    size_t gran_left;//Bytes to read before checking if the writer is waiting
+    uint32_t other_flags;
+    size_t unpublished;//Bytes read but not given back to the writer yet
+    size_t readd;
+    int i;
 
-    uint8_t* current_buf;//Current write pos
-    uint64_t* current_buf64;//64b aligned
+    s = p->shared;
+    sv = p->shared;
 
-    uint8_t* usr_max_buf;//Out of bound given by the user
-    uint8_t* gran_max_buf;//Out of bound to check if the writer is waiting
-    uint8_t* circ_max_buf;//Out of bound given by the circ buffer
+    usr_left = 0;
+    for(i = 0; i < iovcnt; i++) {
+        usr_left += iov[i].iov_len;
+    }
+    usr_left -= offset;
 
-    uint8_t* min_max_buf;//Min value of the 3 different out of bound
-    uint64_t* min_max_buf64;//64b aligned
+    current_buf = NULL;
+    seg_left = 0;
+    if(iovcnt > 0) {
+        current_buf = (uint8_t*) iov->iov_base + (ptrdiff_t) offset;
+        seg_left = iov->iov_len - offset;
+    }
+    readd = 0;
+    unpublished = 0;
 
-    s = p->shared;
-    sv = p->shared;
+    gran_left = __xen_shm_pipe_notify_start(p, sv->writer_flags);
+
+    while(usr_left) //We read as much as we can
+    {
+
+        chunk = __xen_shm_pipe_read_contiguous(p);
+        if(chunk == 0) { //Nothing left according to the cached write index
+            __xen_shm_pipe_load_remote(p);
+            chunk = __xen_shm_pipe_read_contiguous(p);
+            if(chunk == 0) {
+                break;
+            }
+        }
+#ifdef XSHMP_STATS
+        else {
+            p->stats.remote_index_cached++;
+        }
+#endif
 
-    shared_max = s->buffer + (ptrdiff_t) p->buffer_size;
-    read_pos = s->buffer + (ptrdiff_t) s->read ;
-    write_pos = s->buffer + (ptrdiff_t) sv->write ;
+        /*
+         * Get the minimum of different boundaries
+         */
+        if(chunk > usr_left) {
+            chunk = usr_left;
+        }
+        if(chunk > gran_left) {
+            chunk = gran_left;
+        }
+        if(p->publish_interval && chunk > p->publish_interval - unpublished) {
+            chunk = p->publish_interval - unpublished;
+        }
+        usr_left -= chunk;
+        gran_left -= chunk;
+        unpublished += chunk;
+        readd += chunk;
 
-    user_buf = (uint8_t*) buf;
+        read_pos = s->buffer + (ptrdiff_t) __xen_shm_pipe_offset(p, p->local);
+        __xen_shm_pipe_advance(p, chunk);
 
-    current_buf = user_buf;
-    usr_max_buf = user_buf + (ptrdiff_t) nbytes;
+        /*
+         * Actually read, segment after segment
+         */
+        while(chunk) {
+            while(seg_left == 0) {
+                ++iov;
+                current_buf = (uint8_t*) iov->iov_base;
+                seg_left = iov->iov_len;
+            }
+            len = (chunk < seg_left)?chunk:seg_left;
+            p->copy(current_buf, read_pos, len);
+            current_buf += (ptrdiff_t) len;
+            read_pos += (ptrdiff_t) len;
+            seg_left -= len;
+            chunk -= len;
+        }
 
-    if(sv->writer_flags & XSHMP_SLEEPING) { //Writer is waiting
-        gran_max_buf = user_buf + (ptrdiff_t) XEN_SHM_PIPE_FAST_CHECK_INTERVAL;
-    } else {
-        gran_max_buf = user_buf + p->wait_check_interval;
+        /*
+         * Check boundary values
+         */
+        if(unpublished >= p->publish_interval || (sv->writer_flags & (XSHMP_WAITING|XSHMP_SLEEPING))) { //Time to publish, or the writer needs space
+            __xen_shm_pipe_publish(p); //Update read position in shared memory
+            unpublished = 0;
+        }
+
+        if(gran_left != 0 && (sv->writer_flags & XSHMP_SLEEPING)) { //Left asleep until the next check
+            __xen_shm_pipe_notify_put_off(p, 0);
+        }
+
+        if(gran_left == 0) { //Time to take news of the other guy
+            other_flags = sv->writer_flags;
+            if(other_flags & XSHMP_SLEEPING) { //Writer is waiting
+                if(unpublished) {
+                    __xen_shm_pipe_publish(p);
+                    unpublished = 0;
+                }
+                __xen_shm_pipe_wake_peer(p);
+            }
+            gran_left = __xen_shm_pipe_notify_next(p, (other_flags & XSHMP_SLEEPING) != 0);
+        }
+
+    }
+    p->notify_left = gran_left;
+
+    if(unpublished) { //Publish what was not published yet
+        __xen_shm_pipe_publish(p);
+    }
+
+    __xen_shm_pipe_wake_peer(p); //If the writer is waiting
+
+
+    return readd;
+
+}
+
+size_t
+__xen_shm_pipe_write_avail(struct xen_shm_pipe_priv* p, const struct iovec* iov, int iovcnt, size_t offset) {
+    struct xen_shm_pipe_shared* s;
+    volatile struct xen_shm_pipe_shared* sv;
+
+    uint8_t* write_pos;//Write pointer in circ buff
+
+    const uint8_t* current_buf;//Current position in the current user segment
+    size_t seg_left;//Remaining bytes in the current user segment
+    size_t usr_left;//Remaining bytes in all the user segments
+
+    size_t chunk;//Bytes to write before updating the shared write position
+    size_t len;
+    size_t gran_left;//Bytes to write before checking if the reader is waiting
+    uint32_t other_flags;
+    size_t unpublished;//Bytes written but not shown to the reader yet
+    size_t written;
+    int hold;//Coalescing: the bytes are only published by the end of the call, if at all
+    int i;
+
+    s = p->shared;
+    sv = p->shared;
+    hold = (p->coalesce_bytes != 0);
+
+    usr_left = 0;
+    for(i = 0; i < iovcnt; i++) {
+        usr_left += iov[i].iov_len;
     }
+    usr_left -= offset;
 
-    circ_max_buf = user_buf;
-    min_max_buf = user_buf;
+    current_buf = NULL;
+    seg_left = 0;
+    if(iovcnt > 0) {
+        current_buf = (const uint8_t*) iov->iov_base + (ptrdiff_t) offset;
+        seg_left = iov->iov_len - offset;
+    }
+    written = 0;
+    unpublished = 0;
 
-    is_aligned = 0;
+    gran_left = __xen_shm_pipe_notify_start(p, sv->reader_flags);
 
-    while(read_pos != write_pos && current_buf != usr_max_buf) //We read as much as we can
+    while(usr_left) //We write as much as we can
     {
 
-        if(read_pos <= write_pos) { //Updates the circ buffer threshold
-            circ_max_buf = current_buf + (ptrdiff_t)(write_pos - read_pos);
-        } else {
-            circ_max_buf = current_buf + (ptrdiff_t)(shared_max - read_pos);
+        chunk = __xen_shm_pipe_write_contiguous(p);
+        if(chunk == 0) { //Full according to the cached read index
+            __xen_shm_pipe_load_remote(p);
+            chunk = __xen_shm_pipe_write_contiguous(p);
+            if(chunk == 0) {
+                break;
+            }
+        }
+#ifdef XSHMP_STATS
+        else {
+            p->stats.remote_index_cached++;
         }
+#endif
 
         /*
          * Get the minimum of different boundaries
          */
-        min_max_buf = circ_max_buf;
-        gran_check = 0;
-        if(min_max_buf > usr_max_buf) {
-            min_max_buf = usr_max_buf;
+        if(chunk > usr_left) {
+            chunk = usr_left;
         }
-        if(min_max_buf > gran_max_buf) {
-            gran_check = 1;
-            min_max_buf = gran_max_buf;
+        if(chunk > gran_left) {
+            chunk = gran_left;
+        }
+        if(p->publish_interval && chunk > p->publish_interval - unpublished) {
+            chunk = p->publish_interval - unpublished;
+        }
+        usr_left -= chunk;
+        gran_left -= chunk;
+        unpublished += chunk;
+        written += chunk;
+
+        write_pos = s->buffer + (ptrdiff_t) __xen_shm_pipe_offset(p, p->local);
+        __xen_shm_pipe_advance(p, chunk);
+
+        /*
+         * Actually write, segment after segment
+         */
+        while(chunk) {
+            while(seg_left == 0) {
+                ++iov;
+                current_buf = (const uint8_t*) iov->iov_base;
+                seg_left = iov->iov_len;
+            }
+            len = (chunk < seg_left)?chunk:seg_left;
+            p->copy(write_pos, current_buf, len);
+            current_buf += (ptrdiff_t) len;
+            write_pos += (ptrdiff_t) len;
+            seg_left -= len;
+            chunk -= len;
         }
 
         /*
-         * Actually read
+         * Check boundary values
          */
-        //Tests 64b alignement
-        if( (is_aligned || (((unsigned long) current_buf) & ((unsigned long) 0x7u)) == (((unsigned long)read_pos) & ((unsigned long) 0x7u)) )
-                && min_max_buf - current_buf > 24) {
-            //Align optimized
-            if(!is_aligned) {
-                is_aligned = 1;
-                while( ((unsigned long) current_buf) & ((unsigned long) 0x7u)) { //Slow copy to align with 64b pointers
-                    *current_buf = *read_pos;
-                    ++current_buf;
-                    ++read_pos;
+        if(!hold && (unpublished >= p->publish_interval || (sv->reader_flags & (XSHMP_WAITING|XSHMP_SLEEPING)))) { //Time to publish, or the reader needs data
+            __xen_shm_pipe_publish(p); //Update write position in shared memory
+            unpublished = 0;
+        }
+
+        if(!hold && gran_left != 0 && (sv->reader_flags & XSHMP_SLEEPING)) { //Left asleep until the next check
+            __xen_shm_pipe_notify_put_off(p, 0);
+        }
+
+        if(gran_left == 0) { //Time to take news of the other guy
+            other_flags = sv->reader_flags;
+            if(!hold && (other_flags & XSHMP_SLEEPING)) { //Reader is waiting
+                if(unpublished) {
+                    __xen_shm_pipe_publish(p);
+                    unpublished = 0;
                 }
+                __xen_shm_pipe_wake_peer(p);
             }
+            gran_left = __xen_shm_pipe_notify_next(p, (other_flags & XSHMP_SLEEPING) != 0);
+        }
+
+    }
+    p->notify_left = gran_left;
+
+    if(hold) {
+        if(!__xen_shm_pipe_hold(p, written)) {
+            __xen_shm_pipe_release_held(p);
+        }
+        return written;
+    }
+
+    if(unpublished) { //Publish what was not published yet
+        __xen_shm_pipe_publish(p);
+    }
+
+    __xen_shm_pipe_wake_peer_last(p); //If the reader is waiting
+
+
+    return written;
+}
+
+ssize_t
+__xen_shm_pipe_readv(struct xen_shm_pipe_priv* p, const struct iovec* iov, int iovcnt, size_t offset)
+{
+    int wait_ret;
+    size_t read_ret;
+
+#ifdef XSHMP_STATS
+    p->stats.read_count++;
+#endif
+
+    if(p->mod == xen_shm_pipe_mod_write) { //Not reader
+        errno = EMEDIUMTYPE;
+        return -1;
+    }
+
+    if(p->shared == NULL || p->type != xen_shm_pipe_type_stream) { //Not initialized or not a byte stream
+        errno = EMEDIUMTYPE;
+        return -1;
+    }
+
+    if(iovcnt < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if(p->shared->reader_flags & XSHMP_CLOSED) {//Closed
+        return 0;
+    }
+
+    p->shared->reader_flags |= XSHMP_ACTIVE;
+
+    wait_ret = __xen_shm_pipe_wait_reader(p);
+    if(wait_ret <= 0) {
+        p->shared->reader_flags &= ~XSHMP_ACTIVE;
+        return (ssize_t) wait_ret;
+    }
+
+    read_ret = __xen_shm_pipe_read_avail(p, iov, iovcnt, offset);
+
+    p->shared->reader_flags &= ~XSHMP_ACTIVE;
+
+    return (ssize_t) read_ret;
+}
+
+ssize_t
+__xen_shm_pipe_writev(struct xen_shm_pipe_priv* p, const struct iovec* iov, int iovcnt, size_t offset) {
+    int wait_ret;
+    size_t write_ret;
+
+#ifdef XSHMP_STATS
+    p->stats.write_count++;
+#endif
+    if(p->mod == xen_shm_pipe_mod_read) { //Not reader
+        errno = EMEDIUMTYPE;
+        return -1;
+    }
+
+    if(p->shared == NULL || p->type != xen_shm_pipe_type_stream) { //Not initialized or not a byte stream
+        errno = EMEDIUMTYPE;
+        return -1;
+    }
+
+    if(p->multi_writer) { //Everything at once, or nothing
+        return __xen_shm_pipe_claim_writev(p, iov, iovcnt, offset, 0);
+    }
+
+    if(iovcnt < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if(p->shared->writer_flags & XSHMP_CLOSED) {//Closed
+        errno = EPIPE;
+        return -1;
+    }
+
+    p->shared->writer_flags |= XSHMP_ACTIVE;
+
+    wait_ret = __xen_shm_pipe_wait_writer(p, 1, 1);
+    if(wait_ret <= 0) {
+        p->shared->writer_flags &= ~XSHMP_ACTIVE;
+        return (ssize_t) wait_ret;
+    }
+
+    write_ret = __xen_shm_pipe_write_avail(p, iov, iovcnt, offset);
+
+    p->shared->writer_flags &= ~XSHMP_ACTIVE;
+
+    return (ssize_t) write_ret;
+
+}
+
+ssize_t
+xen_shm_pipe_read(xen_shm_pipe_p xpipe, void* buf, size_t nbytes)
+{
+    struct iovec iov;
+
+    iov.iov_base = buf;
+    iov.iov_len = nbytes;
+
+    return __xen_shm_pipe_readv(xpipe, &iov, 1, 0);
+}
+
+ssize_t
+xen_shm_pipe_readv(xen_shm_pipe_p xpipe, const struct iovec* iov, int iovcnt)
+{
+    return __xen_shm_pipe_readv(xpipe, iov, iovcnt, 0);
+}
+
+ssize_t
+xen_shm_pipe_write(xen_shm_pipe_p xpipe, const void* buf, size_t nbytes) {
+    struct iovec iov;
+
+    iov.iov_base = (void*) (uintptr_t) buf; //Will not be modified
+    iov.iov_len = nbytes;
+
+    return __xen_shm_pipe_writev(xpipe, &iov, 1, 0);
+}
+
+ssize_t
+xen_shm_pipe_writev(xen_shm_pipe_p xpipe, const struct iovec* iov, int iovcnt) {
+    return __xen_shm_pipe_writev(xpipe, iov, iovcnt, 0);
+}
+
+
+int
+xen_shm_pipe_write_reserve(xen_shm_pipe_p xpipe, size_t min_len, void** ptr, size_t* len) {
+    struct xen_shm_pipe_priv* p;
+    size_t needed;
+    size_t max_needed;
+    int wait_ret;
+
+    p = xpipe;
+
+#ifdef XSHMP_STATS
+    p->stats.write_count++;
+#endif
+    if(p->mod == xen_shm_pipe_mod_read) { //Not writer
+        errno = EMEDIUMTYPE;
+        return -1;
+    }
+
+    if(p->shared == NULL || p->type != xen_shm_pipe_type_stream) { //Not initialized or not a byte stream
+        errno = EMEDIUMTYPE;
+        return -1;
+    }
+
+    if(p->multi_writer) { //The region could not be published in order
+        errno = ENOTSUP;
+        return -1;
+    }
+
+    if(p->shared->writer_flags & XSHMP_CLOSED) {//Closed
+        errno = EPIPE;
+        return -1;
+    }
+
+    if(min_len >= p->buffer_size) { //Could never be given
+        errno = EINVAL;
+        return -1;
+    }
+
+    /*
+     * The region cannot go through the end of the circular buffer.
+     * Only wait for what can be given at the current write position.
+     */
+    max_needed = __xen_shm_pipe_write_contiguous_max(p);
+    needed = (min_len == 0)?1:min_len;
+    if(needed > max_needed) {
+        needed = max_needed;
+    }
+
+    p->shared->writer_flags |= XSHMP_ACTIVE; //Will be unset by commit
+
+    wait_ret = __xen_shm_pipe_wait_writer(p, needed, 1);
+    if(wait_ret <= 0) {
+        p->shared->writer_flags &= ~XSHMP_ACTIVE;
+        return -1;
+    }
+
+    p->reserved = __xen_shm_pipe_write_contiguous(p);
+    *ptr = p->shared->buffer + (ptrdiff_t) __xen_shm_pipe_offset(p, p->local);
+    *len = p->reserved;
+
+    return 0;
+}
+
+int
+xen_shm_pipe_write_commit(xen_shm_pipe_p xpipe, size_t nbytes) {
+    struct xen_shm_pipe_priv* p;
+    struct xen_shm_pipe_shared* s;
+    volatile struct xen_shm_pipe_shared* sv;
+
+    p = xpipe;
+    s = p->shared;
+    sv = p->shared;
+
+    if(p->mod == xen_shm_pipe_mod_read || s == NULL || p->type != xen_shm_pipe_type_stream) {
+        errno = EMEDIUMTYPE;
+        return -1;
+    }
+
+    if(nbytes > p->reserved) { //More than what was given
+        errno = EINVAL;
+        return -1;
+    }
+
+    __xen_shm_pipe_advance(p, nbytes);
+
+    p->reserved = 0;
+    __xen_shm_pipe_publish(p); //Publish the written bytes
+    sv->writer_flags &= ~XSHMP_ACTIVE;
+
+    __xen_shm_pipe_wake_peer_last(p); //If the reader is waiting
+
+    return 0;
+}
+
+
+ssize_t xen_shm_pipe_write_all(xen_shm_pipe_p xpipe, const void* buf, size_t nbytes) {
+    size_t written;
+    ssize_t retval;
+    const uint8_t* buffer;
+
+    written = 0;
+    buffer = (const uint8_t*) buf;
+    while(nbytes) {
+        if((retval = xen_shm_pipe_write(xpipe, buffer, nbytes ))<=0) {
+            return(written!=0)?((ssize_t) written):retval;
+        }
+        written += (size_t) retval;
+        buffer += (ptrdiff_t) retval;
+        nbytes -= (size_t) retval;
+    }
+
+    return (ssize_t) written;
+
+}
+
+
+int
+xen_shm_pipe_read_peek(xen_shm_pipe_p xpipe, const void** ptr, size_t* len) {
+    struct xen_shm_pipe_priv* p;
+    int wait_ret;
+
+    p = xpipe;
+
+#ifdef XSHMP_STATS
+    p->stats.read_count++;
+#endif
+
+    if(p->mod == xen_shm_pipe_mod_write) { //Not reader
+        errno = EMEDIUMTYPE;
+        return -1;
+    }
+
+    if(p->shared == NULL || p->type != xen_shm_pipe_type_stream) { //Not initialized or not a byte stream
+        errno = EMEDIUMTYPE;
+        return -1;
+    }
+
+    *len = 0;
+    if(p->shared->reader_flags & XSHMP_CLOSED) {//Closed
+        return 0;
+    }
+
+    p->shared->reader_flags |= XSHMP_ACTIVE; //Will be unset by consume
+
+    wait_ret = __xen_shm_pipe_wait_reader(p);
+    if(wait_ret <= 0) {
+        p->shared->reader_flags &= ~XSHMP_ACTIVE;
+        return wait_ret;
+    }
+
+    p->peeked = __xen_shm_pipe_read_contiguous(p);
+    *ptr = p->shared->buffer + (ptrdiff_t) __xen_shm_pipe_offset(p, p->local);
+    *len = p->peeked;
+
+    return 0;
+}
+
+int
+xen_shm_pipe_read_consume(xen_shm_pipe_p xpipe, size_t nbytes) {
+    struct xen_shm_pipe_priv* p;
+    struct xen_shm_pipe_shared* s;
+    volatile struct xen_shm_pipe_shared* sv;
+
+    p = xpipe;
+    s = p->shared;
+    sv = p->shared;
+
+    if(p->mod == xen_shm_pipe_mod_write || s == NULL || p->type != xen_shm_pipe_type_stream) {
+        errno = EMEDIUMTYPE;
+        return -1;
+    }
+
+    if(nbytes > p->peeked) { //More than what was given
+        errno = EINVAL;
+        return -1;
+    }
+
+    __xen_shm_pipe_advance(p, nbytes);
+
+    p->peeked = 0;
+    __xen_shm_pipe_publish(p); //Give the space back to the writer
+    sv->reader_flags &= ~XSHMP_ACTIVE;
+
+    __xen_shm_pipe_wake_peer(p); //If the writer is waiting
+
+    return 0;
+}
+
+
+ssize_t xen_shm_pipe_read_all(xen_shm_pipe_p xpipe, void* buf, size_t nbytes) {
+    size_t readd;
+    ssize_t retval;
+    uint8_t* buffer;
+
+    readd = 0;
+    buffer = (uint8_t*) buf;
+    while(nbytes) {
+        if((retval = xen_shm_pipe_read(xpipe, buffer, nbytes ))<=0) {
+            return(readd!=0)?((ssize_t) readd):retval;
+        }
+        readd += (size_t) retval;
+        buffer += (ptrdiff_t) retval;
+        nbytes -= (size_t) retval;
+    }
+
+    return (ssize_t) readd;
+
+}
+
+ssize_t xen_shm_pipe_writev_all(xen_shm_pipe_p xpipe, const struct iovec* iov, int iovcnt) {
+    size_t written;
+    size_t offset;
+    ssize_t retval;
+
+    written = 0;
+    offset = 0;
+    while(iovcnt > 0) {
+        if(offset == iov->iov_len) { //Segment done
+            ++iov;
+            --iovcnt;
+            offset = 0;
+            continue;
+        }
+        if((retval = __xen_shm_pipe_writev(xpipe, iov, iovcnt, offset))<=0) {
+            return(written!=0)?((ssize_t) written):retval;
+        }
+        written += (size_t) retval;
+        offset += (size_t) retval;
+        while(iovcnt > 0 && offset >= iov->iov_len) { //Skip the written segments
+            offset -= iov->iov_len;
+            ++iov;
+            --iovcnt;
+        }
+    }
+
+    return (ssize_t) written;
+
+}
+
+
+ssize_t xen_shm_pipe_readv_all(xen_shm_pipe_p xpipe, const struct iovec* iov, int iovcnt) {
+    size_t readd;
+    size_t offset;
+    ssize_t retval;
+
+    readd = 0;
+    offset = 0;
+    while(iovcnt > 0) {
+        if(offset == iov->iov_len) { //Segment done
+            ++iov;
+            --iovcnt;
+            offset = 0;
+            continue;
+        }
+        if((retval = __xen_shm_pipe_readv(xpipe, iov, iovcnt, offset))<=0) {
+            return(readd!=0)?((ssize_t) readd):retval;
+        }
+        readd += (size_t) retval;
+        offset += (size_t) retval;
+        while(iovcnt > 0 && offset >= iov->iov_len) { //Skip the read segments
+            offset -= iov->iov_len;
+            ++iov;
+            --iovcnt;
+        }
+    }
+
+    return (ssize_t) readd;
+
+}
+
+/* Read/write with a deadline, with or without the _all behaviour */
+ssize_t
+__xen_shm_pipe_timed(struct xen_shm_pipe_priv* p, const struct iovec* iov, int all, unsigned long timeout_ms) {
+    ssize_t retval;
+
+    if(p->multi_writer && p->mod == xen_shm_pipe_mod_write) { //The deadline is not per thread
+        errno = ENOTSUP;
+        return -1;
+    }
+
+    p->deadline_ns = __xen_shm_pipe_now_ns() + (uint64_t) timeout_ms*1000000ull;
+    if(p->mod == xen_shm_pipe_mod_write) {
+        retval = all?xen_shm_pipe_writev_all(p, iov, 1):__xen_shm_pipe_writev(p, iov, 1, 0);
+    } else {
+        retval = all?xen_shm_pipe_readv_all(p, iov, 1):__xen_shm_pipe_readv(p, iov, 1, 0);
+    }
+    p->deadline_ns = 0;
+
+    return retval;
+}
+
+ssize_t
+xen_shm_pipe_read_timed(xen_shm_pipe_p xpipe, void* buf, size_t nbytes, unsigned long timeout_ms) {
+    struct iovec iov;
+
+    iov.iov_base = buf;
+    iov.iov_len = nbytes;
+
+    return __xen_shm_pipe_timed(xpipe, &iov, 0, timeout_ms);
+}
+
+ssize_t
+xen_shm_pipe_read_all_timed(xen_shm_pipe_p xpipe, void* buf, size_t nbytes, unsigned long timeout_ms) {
+    struct iovec iov;
+
+    iov.iov_base = buf;
+    iov.iov_len = nbytes;
+
+    return __xen_shm_pipe_timed(xpipe, &iov, 1, timeout_ms);
+}
+
+ssize_t
+xen_shm_pipe_write_timed(xen_shm_pipe_p xpipe, const void* buf, size_t nbytes, unsigned long timeout_ms) {
+    struct iovec iov;
+
+    iov.iov_base = (void*) (uintptr_t) buf; //Will not be modified
+    iov.iov_len = nbytes;
+
+    return __xen_shm_pipe_timed(xpipe, &iov, 0, timeout_ms);
+}
+
+ssize_t
+xen_shm_pipe_write_all_timed(xen_shm_pipe_p xpipe, const void* buf, size_t nbytes, unsigned long timeout_ms) {
+    struct iovec iov;
+
+    iov.iov_base = (void*) (uintptr_t) buf; //Will not be modified
+    iov.iov_len = nbytes;
+
+    return __xen_shm_pipe_timed(xpipe, &iov, 1, timeout_ms);
+}
+
+/*
+ * Framed pipes
+ * Each message is a record: a header giving the payload length, then the payload padded to XSHMP_RECORD_ALIGN.
+ * The writer publishes whole records only, so the reader never waits in the middle of one.
+ */
+
+/* Checks the pipe is a connected framed pipe in the given mod */
+int
+__xen_shm_pipe_msg_check(struct xen_shm_pipe_priv* p, enum xen_shm_pipe_mod mod) {
+    if(p->mod != mod || p->shared == NULL || p->type != xen_shm_pipe_type_framed) {
+        errno = EMEDIUMTYPE;
+        return -1;
+    }
+    return 0;
+}
+
+/* Returns the biggest payload a record can carry */
+size_t
+__xen_shm_pipe_msg_max(struct xen_shm_pipe_priv* p) {
+    if(p->ring == xen_shm_pipe_ring_pow2) {
+        return p->buffer_size - sizeof(struct xen_shm_pipe_record);
+    }
+    //The legacy ring can't be full, so the last aligned slot is lost
+    return p->buffer_size - XSHMP_RECORD_ALIGN - sizeof(struct xen_shm_pipe_record);
+}
+
+/* Copies bytes at the local position and moves it forward, going through the end of the buffer if needed */
+void
+__xen_shm_pipe_to_ring(struct xen_shm_pipe_priv* p, const uint8_t* buf, size_t len) {
+    size_t offset;
+    size_t to_end;
+
+    offset = __xen_shm_pipe_offset(p, p->local);
+    to_end = p->buffer_size - offset;
+    if(len > to_end) { //Wraps
+        p->copy(p->shared->buffer + (ptrdiff_t) offset, buf, to_end);
+        __xen_shm_pipe_advance(p, to_end);
+        buf += (ptrdiff_t) to_end;
+        len -= to_end;
+        offset = 0;
+    }
+    p->copy(p->shared->buffer + (ptrdiff_t) offset, buf, len);
+    __xen_shm_pipe_advance(p, len);
+}
+
+/* Copies bytes from the local position and moves it forward, going through the end of the buffer if needed */
+void
+__xen_shm_pipe_from_ring(struct xen_shm_pipe_priv* p, uint8_t* buf, size_t len) {
+    size_t offset;
+    size_t to_end;
+
+    offset = __xen_shm_pipe_offset(p, p->local);
+    to_end = p->buffer_size - offset;
+    if(len > to_end) { //Wraps
+        p->copy(buf, p->shared->buffer + (ptrdiff_t) offset, to_end);
+        __xen_shm_pipe_advance(p, to_end);
+        buf += (ptrdiff_t) to_end;
+        len -= to_end;
+        offset = 0;
+    }
+    p->copy(buf, p->shared->buffer + (ptrdiff_t) offset, len);
+    __xen_shm_pipe_advance(p, len);
+}
+
+/* Writes a record at the local position, without publishing it. The room must have been checked. */
+void
+__xen_shm_pipe_put_record(struct xen_shm_pipe_priv* p, const void* buf, size_t len) {
+    struct xen_shm_pipe_record* record;
+
+    record = (struct xen_shm_pipe_record*) (p->shared->buffer + (ptrdiff_t) __xen_shm_pipe_offset(p, p->local));
+    record->len = (uint32_t) len;
+    record->pad = 0;
+    __xen_shm_pipe_advance(p, sizeof(struct xen_shm_pipe_record));
+    __xen_shm_pipe_to_ring(p, buf, len);
+    __xen_shm_pipe_advance(p, XSHMP_RECORD_SIZE(len) - sizeof(struct xen_shm_pipe_record) - len); //Padding
+}
+
+/* Same as put_record, the payload being gathered from the segments ('len' is their total length) */
+void
+__xen_shm_pipe_put_recordv(struct xen_shm_pipe_priv* p, const struct iovec* iov, int iovcnt, size_t len) {
+    struct xen_shm_pipe_record* record;
+    int i;
+
+    record = (struct xen_shm_pipe_record*) (p->shared->buffer + (ptrdiff_t) __xen_shm_pipe_offset(p, p->local));
+    record->len = (uint32_t) len;
+    record->pad = 0;
+    __xen_shm_pipe_advance(p, sizeof(struct xen_shm_pipe_record));
+    for(i = 0; i < iovcnt; i++) {
+        __xen_shm_pipe_to_ring(p, (const uint8_t*) iov[i].iov_base, iov[i].iov_len);
+    }
+    __xen_shm_pipe_advance(p, XSHMP_RECORD_SIZE(len) - sizeof(struct xen_shm_pipe_record) - len); //Padding
+}
+
+/* Returns the payload length of the record at the local position. A record must be there. */
+size_t
+__xen_shm_pipe_record_len(struct xen_shm_pipe_priv* p) {
+    const struct xen_shm_pipe_record* record;
+
+    record = (const struct xen_shm_pipe_record*) (p->shared->buffer + (ptrdiff_t) __xen_shm_pipe_offset(p, p->local));
+    return record->len;
+}
+
+/* Reads the payload of the record at the local position and skips it, without publishing. */
+void
+__xen_shm_pipe_get_record(struct xen_shm_pipe_priv* p, void* buf, size_t len) {
+    __xen_shm_pipe_advance(p, sizeof(struct xen_shm_pipe_record));
+    __xen_shm_pipe_from_ring(p, buf, len);
+    __xen_shm_pipe_advance(p, XSHMP_RECORD_SIZE(len) - sizeof(struct xen_shm_pipe_record) - len); //Padding
+}
+
+int
+xen_shm_pipe_send_msg(xen_shm_pipe_p xpipe, const void* buf, size_t len) {
+    struct iovec iov;
+
+    iov.iov_base = (void*) (uintptr_t) buf; //Will not be modified
+    iov.iov_len = len;
+    return xen_shm_pipe_send_msgv(xpipe, &iov, 1);
+}
+
+int
+xen_shm_pipe_send_msgv(xen_shm_pipe_p xpipe, const struct iovec* iov, int iovcnt) {
+    struct xen_shm_pipe_priv* p;
+    volatile struct xen_shm_pipe_shared* sv;
+    size_t len;
+    int i;
+
+    p = xpipe;
+
+#ifdef XSHMP_STATS
+    p->stats.write_count++;
+#endif
+
+    if(__xen_shm_pipe_msg_check(p, xen_shm_pipe_mod_write)) {
+        return -1;
+    }
+    sv = p->shared;
+
+    if(iovcnt < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if(p->multi_writer) {
+        return (__xen_shm_pipe_claim_writev(p, iov, iovcnt, 0, 1) < 0)?-1:0;
+    }
+
+    if(sv->writer_flags & XSHMP_CLOSED) {//Closed
+        errno = EPIPE;
+        return -1;
+    }
+
+    len = 0;
+    for(i = 0; i < iovcnt; i++) {
+        if(iov[i].iov_len > __xen_shm_pipe_msg_max(p) - len) {
+            errno = EMSGSIZE;
+            return -1;
+        }
+        len += iov[i].iov_len;
+    }
+
+    sv->writer_flags |= XSHMP_ACTIVE;
+
+    if(__xen_shm_pipe_wait_writer(p, XSHMP_RECORD_SIZE(len), 0) <= 0) {
+        sv->writer_flags &= ~XSHMP_ACTIVE;
+        return -1;
+    }
+
+    __xen_shm_pipe_put_recordv(p, iov, iovcnt, len);
+
+    if(p->coalesce_bytes && __xen_shm_pipe_hold(p, XSHMP_RECORD_SIZE(len))) {
+        sv->writer_flags &= ~XSHMP_ACTIVE;
+        return 0;
+    }
+
+    __xen_shm_pipe_publish(p);
+    sv->writer_flags &= ~XSHMP_ACTIVE;
+
+    __xen_shm_pipe_wake_peer_last(p); //If the reader is waiting
+
+    return 0;
+}
+
+/*
+ * Waits for the next record and returns its payload length (in msg_len).
+ * Returns -1 if error, 0 if end of file, 1 if a record is there.
+ * On success, the reader stays ACTIVE.
+ */
+int
+__xen_shm_pipe_wait_record(struct xen_shm_pipe_priv* p, size_t* msg_len) {
+    volatile struct xen_shm_pipe_shared* sv;
+    int wait_ret;
+
+    sv = p->shared;
+
+    if(sv->reader_flags & XSHMP_CLOSED) {//Closed
+        return 0;
+    }
+
+    sv->reader_flags |= XSHMP_ACTIVE;
+
+    wait_ret = __xen_shm_pipe_wait_reader(p);
+    if(wait_ret <= 0) {
+        sv->reader_flags &= ~XSHMP_ACTIVE;
+        return wait_ret;
+    }
+
+    *msg_len = __xen_shm_pipe_record_len(p);
+    if(*msg_len > __xen_shm_pipe_msg_max(p)) { //Not a record
+        sv->reader_flags &= ~XSHMP_ACTIVE;
+        errno = EPROTO;
+        return -1;
+    }
+
+    return 1;
+}
+
+/* Gives the space of the records read back to the writer and wakes it up if needed */
+void
+__xen_shm_pipe_release_records(struct xen_shm_pipe_priv* p) {
+    volatile struct xen_shm_pipe_shared* sv;
+
+    sv = p->shared;
+
+    __xen_shm_pipe_publish(p);
+    sv->reader_flags &= ~XSHMP_ACTIVE;
+
+    __xen_shm_pipe_wake_peer(p); //If the writer is waiting
+}
+
+int
+xen_shm_pipe_recv_msg(xen_shm_pipe_p xpipe, void* buf, size_t size, size_t* len) {
+    struct xen_shm_pipe_priv* p;
+    size_t msg_len;
+    int wait_ret;
+
+    p = xpipe;
+
+#ifdef XSHMP_STATS
+    p->stats.read_count++;
+#endif
+
+    if(__xen_shm_pipe_msg_check(p, xen_shm_pipe_mod_read)) {
+        return -1;
+    }
+
+    if(p->multi_reader) {
+        return __xen_shm_pipe_take_recv(p, buf, size, len);
+    }
+
+    wait_ret = __xen_shm_pipe_wait_record(p, &msg_len);
+    if(wait_ret <= 0) {
+        return wait_ret;
+    }
+
+    *len = msg_len;
+    if(msg_len > size) { //The record stays in the pipe
+        p->shared->reader_flags &= ~XSHMP_ACTIVE;
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    __xen_shm_pipe_get_record(p, buf, msg_len);
+    p->peeked = 0;
+
+    __xen_shm_pipe_release_records(p);
+
+    return 1;
+}
+
+int
+xen_shm_pipe_recv_msg_peek(xen_shm_pipe_p xpipe, const void** ptr, size_t* len) {
+    struct xen_shm_pipe_priv* p;
+    size_t msg_len;
+    size_t offset;
+    int wait_ret;
+
+    p = xpipe;
+
+#ifdef XSHMP_STATS
+    p->stats.read_count++;
+#endif
+
+    if(__xen_shm_pipe_msg_check(p, xen_shm_pipe_mod_read)) {
+        return -1;
+    }
+
+    if(p->multi_reader) { //The record could not be given back in order
+        errno = ENOTSUP;
+        return -1;
+    }
+
+    wait_ret = __xen_shm_pipe_wait_record(p, &msg_len); //Stays active until consume
+    if(wait_ret <= 0) {
+        return wait_ret;
+    }
+
+    offset = __xen_shm_pipe_offset(p, p->local) + sizeof(struct xen_shm_pipe_record);
+    if(offset == p->buffer_size) { //Header at the very end, the payload starts at the beginning
+        offset = 0;
+    }
+
+    *len = msg_len;
+    if(offset + msg_len <= p->buffer_size) {
+        *ptr = p->shared->buffer + (ptrdiff_t) offset;
+    } else { //Wraps
+        *ptr = NULL;
+    }
+    p->peeked = XSHMP_RECORD_SIZE(msg_len);
+
+    return 1;
+}
+
+int
+xen_shm_pipe_recv_msg_consume(xen_shm_pipe_p xpipe) {
+    struct xen_shm_pipe_priv* p;
+
+    p = xpipe;
+    if(__xen_shm_pipe_msg_check(p, xen_shm_pipe_mod_read)) {
+        return -1;
+    }
+
+    if(p->peeked == 0) { //Nothing was peeked
+        errno = EINVAL;
+        return -1;
+    }
+
+    __xen_shm_pipe_advance(p, p->peeked);
+    p->peeked = 0;
+
+    __xen_shm_pipe_release_records(p);
+
+    return 0;
+}
+
+int
+xen_shm_pipe_send_batch(xen_shm_pipe_p xpipe, const struct iovec* msgs, int count) {
+    struct xen_shm_pipe_priv* p;
+    volatile struct xen_shm_pipe_shared* sv;
+    size_t msg_max;
+    size_t record_size;
+    int i;
+
+    p = xpipe;
+
+#ifdef XSHMP_STATS
+    p->stats.write_count++;
+#endif
+
+    if(__xen_shm_pipe_msg_check(p, xen_shm_pipe_mod_write)) {
+        return -1;
+    }
+    sv = p->shared;
+
+    if(sv->writer_flags & XSHMP_CLOSED) {//Closed
+        errno = EPIPE;
+        return -1;
+    }
+
+    if(count <= 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if(p->multi_writer) { //One reservation per message
+        for(i = 0; i < count; i++) {
+            if(__xen_shm_pipe_claim_writev(p, &msgs[i], 1, 0, 1) < 0) {
+                return (i == 0)?-1:i;
+            }
+        }
+        return count;
+    }
+
+    msg_max = __xen_shm_pipe_msg_max(p);
+    for(i = 0; i < count; i++) {
+        if(msgs[i].iov_len > msg_max) {
+            errno = EMSGSIZE;
+            return -1;
+        }
+    }
+
+    sv->writer_flags |= XSHMP_ACTIVE;
+
+    if(__xen_shm_pipe_wait_writer(p, XSHMP_RECORD_SIZE(msgs[0].iov_len), 0) <= 0) {
+        sv->writer_flags &= ~XSHMP_ACTIVE;
+        return -1;
+    }
+
+    /*
+     * Write as many records as there is room for, then publish them all at once.
+     * The reader's index is only reloaded when the cached one says there is no room.
+     */
+    for(i = 0; i < count; i++) {
+        record_size = XSHMP_RECORD_SIZE(msgs[i].iov_len);
+        if(__xen_shm_pipe_write_space(p, 0) < record_size) {
+            __xen_shm_pipe_load_remote(p);
+            if(__xen_shm_pipe_write_space(p, 0) < record_size) {
+                break;
+            }
+        }
+#ifdef XSHMP_STATS
+        else {
+            p->stats.remote_index_cached++;
+        }
+#endif
+        __xen_shm_pipe_put_record(p, msgs[i].iov_base, msgs[i].iov_len);
+    }
+
+    __xen_shm_pipe_publish(p);
+    sv->writer_flags &= ~XSHMP_ACTIVE;
+
+    __xen_shm_pipe_wake_peer_last(p); //If the reader is waiting
+
+    return i;
+}
+
+int
+xen_shm_pipe_recv_batch(xen_shm_pipe_p xpipe, struct iovec* msgs, int count) {
+    struct xen_shm_pipe_priv* p;
+    uint64_t start;
+    size_t msg_len;
+    size_t msg_max;
+    int wait_ret;
+    int i;
+
+    p = xpipe;
+
+#ifdef XSHMP_STATS
+    p->stats.read_count++;
+#endif
+
+    if(__xen_shm_pipe_msg_check(p, xen_shm_pipe_mod_read)) {
+        return -1;
+    }
+
+    if(count <= 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if(p->multi_reader) { //One record at a time, the first one blocks
+        wait_ret = __xen_shm_pipe_take_recv(p, msgs[0].iov_base, msgs[0].iov_len, &msgs[0].iov_len);
+        if(wait_ret <= 0) {
+            return wait_ret;
+        }
+        for(i = 1; i < count; i++) {
+            if(__xen_shm_pipe_take_record(p, msgs[i].iov_len, &start, &msg_len) <= 0) {
+                break;
+            }
+            __xen_shm_pipe_copy_from(p, start + sizeof(struct xen_shm_pipe_record), msgs[i].iov_base, msg_len);
+            __xen_shm_pipe_take_release(p, start, msg_len);
+            msgs[i].iov_len = msg_len;
+        }
+        return i;
+    }
+
+    wait_ret = __xen_shm_pipe_wait_record(p, &msg_len);
+    if(wait_ret <= 0) {
+        return wait_ret;
+    }
+
+    if(msg_len > msgs[0].iov_len) { //The record stays in the pipe
+        msgs[0].iov_len = msg_len;
+        p->shared->reader_flags &= ~XSHMP_ACTIVE;
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    /*
+     * Read as many records as available, then give the space back at once.
+     * The writer's index is only reloaded when the cached one says there is nothing left.
+     */
+    msg_max = __xen_shm_pipe_msg_max(p);
+    for(i = 0; i < count; i++) {
+        if(i) {
+            if(p->local == p->remote && p->local == __xen_shm_pipe_load_remote(p)) {
+                break;
+            }
+            msg_len = __xen_shm_pipe_record_len(p);
+            if(msg_len > msgs[i].iov_len || msg_len > msg_max) { //Left for the next call
+                break;
+            }
+        }
+        __xen_shm_pipe_get_record(p, msgs[i].iov_base, msg_len);
+        msgs[i].iov_len = msg_len;
+    }
+    p->peeked = 0;
+
+    __xen_shm_pipe_release_records(p);
+
+    return i;
+}
+
+/*
+ * Queue pipes
+ */
+
+int
+xen_shm_queue_push(xen_shm_pipe_p xpipe, const void* buf, size_t len) {
+    struct xen_shm_pipe_priv* p;
+    volatile struct xen_shm_pipe_shared* sv;
+    struct xen_shm_queue_slot* slot;
+
+    p = xpipe;
+
+#ifdef XSHMP_STATS
+    p->stats.write_count++;
+#endif
+
+    if(p->mod != xen_shm_pipe_mod_write || p->shared == NULL || p->type != xen_shm_pipe_type_queue) {
+        errno = EMEDIUMTYPE;
+        return -1;
+    }
+    sv = p->shared;
+
+    if(sv->writer_flags & XSHMP_CLOSED) {//Closed
+        errno = EPIPE;
+        return -1;
+    }
+
+    if(len > XEN_SHM_QUEUE_MSG_MAX) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    sv->writer_flags |= XSHMP_ACTIVE;
+
+    if(__xen_shm_pipe_wait_writer(p, 1, 0) <= 0) {
+        sv->writer_flags &= ~XSHMP_ACTIVE;
+        return -1;
+    }
+
+    slot = __xen_shm_queue_slot(p);
+    slot->len = (uint32_t) len;
+    p->copy(slot->data, buf, len);
+    __atomic_store_n(&slot->seq, (uint32_t) (XSHMP_QUEUE_POS(p->local) + 1), __ATOMIC_RELEASE); //Full
+    p->local += sizeof(struct xen_shm_queue_slot);
+
+    sv->writer_flags &= ~XSHMP_ACTIVE;
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST); //Slot published before the flag is read
+    if(sv->reader_flags & XSHMP_SLEEPING) { //Reader is waiting
+        __xen_shm_pipe_send_signal(p);
+    }
+
+    return 0;
+}
+
+int
+xen_shm_queue_pop(xen_shm_pipe_p xpipe, void* buf, size_t* len) {
+    struct xen_shm_pipe_priv* p;
+    volatile struct xen_shm_pipe_shared* sv;
+    struct xen_shm_queue_slot* slot;
+    size_t msg_len;
+    int wait_ret;
+
+    p = xpipe;
+
+#ifdef XSHMP_STATS
+    p->stats.read_count++;
+#endif
+
+    if(p->mod != xen_shm_pipe_mod_read || p->shared == NULL || p->type != xen_shm_pipe_type_queue) {
+        errno = EMEDIUMTYPE;
+        return -1;
+    }
+    sv = p->shared;
+
+    if(sv->reader_flags & XSHMP_CLOSED) {//Closed
+        return 0;
+    }
+
+    sv->reader_flags |= XSHMP_ACTIVE;
+
+    wait_ret = __xen_shm_pipe_wait_reader(p);
+    if(wait_ret <= 0) {
+        sv->reader_flags &= ~XSHMP_ACTIVE;
+        return wait_ret;
+    }
+
+    slot = __xen_shm_queue_slot(p);
+    msg_len = slot->len;
+    if(msg_len > XEN_SHM_QUEUE_MSG_MAX) { //Not a message
+        sv->reader_flags &= ~XSHMP_ACTIVE;
+        errno = EPROTO;
+        return -1;
+    }
+
+    p->copy(buf, slot->data, msg_len);
+    *len = msg_len;
+    __atomic_store_n(&slot->seq, (uint32_t) (XSHMP_QUEUE_POS(p->local) + p->buffer_size/sizeof(struct xen_shm_queue_slot)),
+            __ATOMIC_RELEASE); //Free for the next round
+    p->local += sizeof(struct xen_shm_queue_slot);
+
+    sv->reader_flags &= ~XSHMP_ACTIVE;
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST); //Slot freed before the flag is read
+    if(sv->writer_flags & XSHMP_SLEEPING) { //Writer is waiting
+        __xen_shm_pipe_send_signal(p);
+    }
+
+    return 1;
+}
+
+/*
+ * Multi-writer mode
+ * Writer threads reserve their room with an atomic fetch-add on p->claim and copy without any lock.
+ * They publish in the order of their reservations: each one waits for the head to reach the start of
+ * its room before moving it to the end, so the reader never sees a room that is not completely written.
+ * Only the power of two ring allows it, as positions are free running counters.
+ */
+
+int
+xen_shm_pipe_set_multi_writer(xen_shm_pipe_p xpipe, int enable) {
+    struct xen_shm_pipe_priv* p;
+
+    p = xpipe;
+    if(p->mod != xen_shm_pipe_mod_write || p->shared == NULL
+            || (p->type != xen_shm_pipe_type_stream && p->type != xen_shm_pipe_type_framed)) {
+        errno = EMEDIUMTYPE;
+        return -1;
+    }
+
+    if(p->ring != xen_shm_pipe_ring_pow2) {
+        errno = EPROTONOSUPPORT;
+        return -1;
+    }
+
+    if(p->reserved) { //A zero-copy write is pending
+        errno = EBUSY;
+        return -1;
+    }
+
+    if(enable && !p->multi_writer) {
+        if(p->wake_pending) { //The writer threads never put a wake up off, nor send this one
+            __xen_shm_pipe_send_signal(p);
+        }
+        p->claim = p->local;
+    } else if(!enable && p->multi_writer) {
+        p->local = p->claim;
+    }
+    p->multi_writer = (enable)?1:0;
+    p->sleepers = 0;
+    p->publish_sleepers = 0;
+    p->claim_error = 0;
+
+    return 0;
+}
+
+/* Copies bytes at a position of the power of two ring, going through the end of the buffer if needed */
+void
+__xen_shm_pipe_copy_at(struct xen_shm_pipe_priv* p, uint64_t pos, const void* buf, size_t len) {
+    size_t offset;
+    size_t to_end;
+    const uint8_t* src;
+
+    src = buf;
+    offset = __xen_shm_pipe_offset(p, pos);
+    to_end = p->buffer_size - offset;
+    if(len > to_end) { //Wraps
+        p->copy(p->shared->buffer + (ptrdiff_t) offset, src, to_end);
+        src += (ptrdiff_t) to_end;
+        len -= to_end;
+        offset = 0;
+    }
+    p->copy(p->shared->buffer + (ptrdiff_t) offset, src, len);
+}
+
+/*
+ * Waits until the reader freed the ring up to the position 'end'. Return -1 if error. 1 if there is room.
+ * Called by several threads at once, which all sleep on the wake count (see __xen_shm_pipe_sleep_begin).
+ */
+int
+__xen_shm_pipe_claim_wait(struct xen_shm_pipe_priv* p, uint64_t end) {
+    volatile struct xen_shm_pipe_shared* sv;
+    uint64_t wake;
+    uint32_t reader_flags;
+    uint32_t active_count;
+    int error;
+    int retval;
+
+    sv = p->shared;
+    active_count = XEN_SHM_PIPE_WAIT_LOOP_ACTIVE_MAX;
+
+    while(end - __atomic_load_n(&sv->tail, __ATOMIC_ACQUIRE) > p->buffer_size) {
+
+        error = __atomic_load_n(&p->claim_error, __ATOMIC_RELAXED);
+        if(error) {
+            errno = error;
+            return -1;
+        }
+
+        reader_flags = sv->reader_flags;
+        if(reader_flags & XSHMP_CLOSED) { //File was closed
+            errno = EPIPE;
+            return -1;
+        }
+
+        if(reader_flags & XSHMP_SLEEPING) { //Other is sleeping, must send a signal
+            __xen_shm_pipe_send_signal(p);
+            continue;
+        }
+
+        if(active_count) {
+            --active_count;
+            XSHMP_CPU_RELAX();
+            continue;
+        }
+
+        wake = __xen_shm_pipe_sleep_begin(p); //Say we are sleeping
+        retval = 0;
+        if(end - __atomic_load_n(&sv->tail, __ATOMIC_ACQUIRE) > p->buffer_size
+                && !(sv->reader_flags & XSHMP_CLOSED)) { //Check nothing changed
+            retval = __xen_shm_pipe_wait_shared(p, wake, 0);
+        }
+        __xen_shm_pipe_set_sleeping(p, 0); //Wake up !
+        if(retval == -1 && errno != EINTR) {
+            return -1;
+        }
+        active_count = XEN_SHM_PIPE_WAIT_LOOP_ACTIVE_MAX;
+    }
+
+    return 1;
+}
+
+/*
+ * Waits until the writers that reserved before 'start' published their room, following the wait policy:
+ * they are only copying, so it spins first, then sleeps on the wake count until one of them publishes
+ * (see __xen_shm_pipe_publish_pass). Return -1 if error (one of them gave up its room). 0 otherwise.
+ */
+int
+__xen_shm_pipe_publish_wait(struct xen_shm_pipe_priv* p, uint64_t start) {
+    volatile struct xen_shm_pipe_shared* sv;
+    struct xen_shm_pipe_wait_state ws;
+    uint64_t wake;
+    int error;
+    int retval;
+
+    sv = p->shared;
+    __xen_shm_pipe_wait_begin(p, &ws);
+
+    while(__atomic_load_n(&sv->head, __ATOMIC_ACQUIRE) != start) {
+        error = __atomic_load_n(&p->claim_error, __ATOMIC_RELAXED);
+        if(error) {
+            errno = error;
+            return -1;
+        }
+
+        if(__xen_shm_pipe_wait_spin(p, &ws, XSHMP_ACTIVE)) {
+            continue;
+        }
+
+        __atomic_fetch_add(&p->publish_sleepers, 1, __ATOMIC_SEQ_CST); //Say we are sleeping
+        wake = __xen_shm_pipe_wake_count(p);
+        retval = 0;
+        if(__atomic_load_n(&sv->head, __ATOMIC_SEQ_CST) != start
+                && !__atomic_load_n(&p->claim_error, __ATOMIC_SEQ_CST)) { //Check nothing changed
+            retval = __xen_shm_pipe_wait_shared(p, wake, 0);
+        }
+        __atomic_fetch_sub(&p->publish_sleepers, 1, __ATOMIC_SEQ_CST);
+        if(retval == -1 && errno != EINTR) { //Can't sleep (the other side closed): the earlier writers are only copying
+            sched_yield();
+        }
+    }
+
+    return 0;
+}
+
+/* Wakes up the writer threads sleeping until the head moves, after it moved or a room was given up */
+void
+__xen_shm_pipe_publish_pass(struct xen_shm_pipe_priv* p) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST); //Head or error stored before the sleepers are read
+    if(__atomic_load_n(&p->publish_sleepers, __ATOMIC_SEQ_CST) != 0) {
+        ioctl(p->fd, XEN_SHM_IOCTL_PASS_WAKE, 0); //Fails with ENOTTY on older modules: the sleepers look again soon
+    }
+}
+
+/*
+ * Writes the segments (from 'offset') as a single unit, a record if asked, among the other writer threads.
+ * Returns the number of bytes written or -1 and errno is set approprietely.
+ */
+ssize_t
+__xen_shm_pipe_claim_writev(struct xen_shm_pipe_priv* p, const struct iovec* iov, int iovcnt, size_t offset, int record) {
+    volatile struct xen_shm_pipe_shared* sv;
+    struct xen_shm_pipe_record header;
+    uint64_t start;
+    uint64_t pos;
+    size_t total;
+    size_t size;
+    size_t len;
+    int armed;
+    int i;
+
+    sv = p->shared;
+
+    if(iovcnt < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    total = 0;
+    for(i = 0; i < iovcnt; i++) {
+        total += iov[i].iov_len;
+    }
+    total -= offset;
+
+    if(record) {
+        if(total > __xen_shm_pipe_msg_max(p)) {
+            errno = EMSGSIZE;
+            return -1;
+        }
+        size = XSHMP_RECORD_SIZE(total);
+    } else {
+        if(total > p->buffer_size) { //Would never fit at once
+            errno = EMSGSIZE;
+            return -1;
+        }
+        size = total;
+    }
+
+    if(sv->writer_flags & XSHMP_CLOSED) {//Closed
+        errno = EPIPE;
+        return -1;
+    }
 
+    if(size == 0) {
+        return 0;
+    }
 
-            min_max_buf64 = (uint64_t*)( ((unsigned long)min_max_buf) & ~((unsigned long) 0x7u)  );
-            current_buf64 = (uint64_t*)(current_buf);
-            read_pos64 = (uint64_t*)(read_pos);
-            while(current_buf64 != min_max_buf64) { //Fast copy
-                *current_buf64 = *read_pos64;
-                ++current_buf64;
-                ++read_pos64;
-            }
-            current_buf = (uint8_t*)(current_buf64);
-            read_pos = (uint8_t*)(read_pos64);
-
-            //Ending the copy
-            if((!gran_check) && (current_buf != min_max_buf)) {
-                is_aligned = 0;
-                while(current_buf != min_max_buf) {
-                    *current_buf = *read_pos;
-                    ++current_buf;
-                    ++read_pos;
+    if(p->nonblock) { //Only reserves room that is already free
+        armed = 0;
+        start = __atomic_load_n(&p->claim, __ATOMIC_RELAXED);
+        for(;;) {
+            if(start + size - __atomic_load_n(&sv->tail, __ATOMIC_ACQUIRE) <= p->buffer_size) {
+                if(__atomic_compare_exchange_n(&p->claim, &start, start + size, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                    break;
                 }
+                continue; //Another thread reserved first, 'start' was updated
             }
-
-        } else {
-            //Slow speed
-            is_aligned = 0;
-            while(current_buf != min_max_buf) {
-                *current_buf = *read_pos;
-                ++current_buf;
-                ++read_pos;
+            if(armed) {
+                errno = EAGAIN;
+                return -1;
             }
+            //So that a poll tells when to come back. Then look again. It stays armed: threads would disarm each other
+            __xen_shm_pipe_arm(p);
+            armed = 1;
         }
+    } else {
+        start = __atomic_fetch_add(&p->claim, (uint64_t) size, __ATOMIC_RELAXED);
+    }
 
+    if(__xen_shm_pipe_claim_wait(p, start + size) < 0) {
+        //This room will never be published, so the following writers can't publish theirs
+        __atomic_store_n(&p->claim_error, errno, __ATOMIC_RELAXED);
+        __xen_shm_pipe_publish_pass(p);
+        return -1;
+    }
 
-        /*
-         * Check boundary values
-         */
-        if(gran_check || (current_buf == gran_max_buf)) { //Time to take news of the other guy
-            if(sv->writer_flags & XSHMP_SLEEPING) { //Writer is waiting
-                __xen_shm_pipe_send_signal(p);
-            }
-            gran_max_buf += p->wait_check_interval;
-        }
-
-        if(read_pos == shared_max) { //Time to check if the read pointer must be rewind
-            read_pos = s->buffer;
+    pos = start;
+    if(record) {
+        header.len = (uint32_t) total;
+        header.pad = 0;
+        __xen_shm_pipe_copy_at(p, pos, &header, sizeof(struct xen_shm_pipe_record));
+        pos += sizeof(struct xen_shm_pipe_record);
+    }
+    for(i = 0; i < iovcnt; i++) {
+        if(offset >= iov[i].iov_len) {
+            offset -= iov[i].iov_len;
+            continue;
         }
+        len = iov[i].iov_len - offset;
+        __xen_shm_pipe_copy_at(p, pos, (const uint8_t*) iov[i].iov_base + (ptrdiff_t) offset, len);
+        pos += len;
+        offset = 0;
+    }
 
-        write_pos = s->buffer + (ptrdiff_t) sv->write; //Updates write_pos value (it could have changed)
-        s->read = (uint32_t) (read_pos - s->buffer); //Update read position in shared memory
-
-
-
-
+    //Publish after the writers that reserved before us, who are copying too
+    if(__xen_shm_pipe_publish_wait(p, start) < 0) {
+        return -1;
     }
+    __atomic_store_n(&sv->head, start + size, __ATOMIC_RELEASE);
 
-    if(sv->writer_flags & XSHMP_SLEEPING) { //Writer is waiting
+    __atomic_thread_fence(__ATOMIC_SEQ_CST); //Published before the flags are read
+    if(sv->reader_flags & XSHMP_SLEEPING) { //Reader is waiting
         __xen_shm_pipe_send_signal(p);
     }
+    __xen_shm_pipe_publish_pass(p);
 
-
-    return (size_t) (current_buf - user_buf);
-
+    return (ssize_t) total;
 }
 
-size_t
-__xen_shm_pipe_write_avail(struct xen_shm_pipe_priv* p, const void* buf, size_t nbytes) {
-    struct xen_shm_pipe_shared* s;
-    volatile struct xen_shm_pipe_shared* sv;
-
-    uint8_t is_aligned;
-    uint8_t gran_check;
+/*
+ * Multi-reader mode
+ * Reader threads, or processes sharing the pipe after a fork, take whole records by moving the shared
+ * claim cursor with a compare and swap, and copy them without any lock. They give the space back in
+ * the order of the records, like the writer threads of the multi-writer mode publish them.
+ * Only idle readers sleep. They wait exclusively on the wake count (XEN_SHM_IOCTL_AWAIT_WAKE_EXCLUSIVE),
+ * so a signal of the writer wakes exactly one of them. A woken reader that leaves records behind hands
+ * the wake up over to the next sleeper (XEN_SHM_IOCTL_PASS_WAKE).
+ */
 
-    uint8_t* read_pos_reduced; //Read pointer - 1 in circular buffer
-    uint8_t* write_pos;//Write pointer in circ buff
-    uint64_t* write_pos64;//64b aligned
-    uint8_t* shared_max; //Out of bound pointer in circ buffer
+int
+xen_shm_pipe_set_multi_reader(xen_shm_pipe_p xpipe, int enable) {
+    struct xen_shm_pipe_priv* p;
+    volatile struct xen_shm_pipe_shared* sv;
 
-    const uint8_t* user_buf; //A cast of the given user buffer
-    const uint8_t* current_buf;//Current write pos
-    const uint64_t* current_buf64;//64b aligned
+    p = xpipe;
+    if(__xen_shm_pipe_msg_check(p, xen_shm_pipe_mod_read)) {
+        return -1;
+    }
+    sv = p->shared;
 
-    const uint8_t* usr_max_buf;//Out of bound given by the user
-    const uint8_t* gran_max_buf;//Out of bound to check if the reader is waiting
-    const uint8_t* circ_max_buf;//Out of bound given by the circ buffer
+    if(p->ring != xen_shm_pipe_ring_pow2) {
+        errno = EPROTONOSUPPORT;
+        return -1;
+    }
 
-    const uint8_t* min_max_buf;//Min value of the 3 different out of bound
-    const uint64_t* min_max_buf64;//64b aligned
+    if(p->peeked) { //A zero-copy receive is pending
+        errno = EBUSY;
+        return -1;
+    }
 
-    s = p->shared;
-    sv = p->shared;
+    if(enable && !p->multi_reader) {
+        __xen_shm_pipe_send_deferred(p); //The taking threads don't send it
+        sv->claim = p->local;
+        sv->readers = 1;
+        sv->sleepers = 0;
+    } else if(!enable && p->multi_reader) {
+        if(sv->readers != 1 || sv->claim != __atomic_load_n(&sv->tail, __ATOMIC_ACQUIRE)) { //Still shared, or records being taken
+            errno = EBUSY;
+            return -1;
+        }
+        p->local = sv->tail;
+        p->remote = p->local;
+    }
+    p->multi_reader = (enable)?1:0;
 
-    shared_max = s->buffer + (ptrdiff_t) p->buffer_size;
+    return 0;
+}
 
-    read_pos_reduced = s->buffer + (ptrdiff_t) sv->read;
-    read_pos_reduced = (read_pos_reduced == s->buffer)?(shared_max-1):(read_pos_reduced-1);
-    write_pos = s->buffer + (ptrdiff_t) s->write ;
+int
+xen_shm_pipe_add_reader(xen_shm_pipe_p xpipe) {
+    struct xen_shm_pipe_priv* p;
 
-    user_buf = (const uint8_t*) buf;
+    p = xpipe;
+    if(!p->multi_reader) {
+        errno = EMEDIUMTYPE;
+        return -1;
+    }
 
-    current_buf = user_buf;
-    usr_max_buf = user_buf + (ptrdiff_t) nbytes;
+    __atomic_add_fetch(&p->shared->readers, 1, __ATOMIC_ACQ_REL);
+    return 0;
+}
 
-    if(sv->reader_flags & XSHMP_SLEEPING) { //Reader is waiting
-        gran_max_buf = user_buf + (ptrdiff_t) XEN_SHM_PIPE_FAST_CHECK_INTERVAL;
-    } else {
-        gran_max_buf = user_buf + p->wait_check_interval;
+/* Copies bytes from a position of the power of two ring, going through the end of the buffer if needed */
+void
+__xen_shm_pipe_copy_from(struct xen_shm_pipe_priv* p, uint64_t pos, void* buf, size_t len) {
+    size_t offset;
+    size_t to_end;
+    uint8_t* dst;
+
+    dst = buf;
+    offset = __xen_shm_pipe_offset(p, pos);
+    to_end = p->buffer_size - offset;
+    if(len > to_end) { //Wraps
+        p->copy(dst, p->shared->buffer + (ptrdiff_t) offset, to_end);
+        dst += (ptrdiff_t) to_end;
+        len -= to_end;
+        offset = 0;
     }
+    p->copy(dst, p->shared->buffer + (ptrdiff_t) offset, len);
+}
 
-    circ_max_buf = user_buf;
-    min_max_buf = user_buf;
+/*
+ * Takes the next record if it fits in 'size' bytes: its position is given in start and its payload length in msg_len.
+ * Returns 1 if a record was taken, 0 if there is none, -1 on error (EMSGSIZE: the record is left to another reader).
+ */
+int
+__xen_shm_pipe_take_record(struct xen_shm_pipe_priv* p, size_t size, uint64_t* start, size_t* msg_len) {
+    volatile struct xen_shm_pipe_shared* sv;
+    const struct xen_shm_pipe_record* record;
+    uint64_t claim;
+    size_t len;
 
-    is_aligned = 0;
+    sv = p->shared;
 
-    while(write_pos != read_pos_reduced && current_buf != usr_max_buf) //We write as much as we can
-    {
+    for(;;) {
+        claim = __atomic_load_n(&sv->claim, __ATOMIC_ACQUIRE);
+        if(claim == __atomic_load_n(&sv->head, __ATOMIC_ACQUIRE)) {
+            return 0;
+        }
 
-        if(write_pos <= read_pos_reduced) { //Set the circ_max_buf value
-            circ_max_buf = current_buf + (ptrdiff_t)(read_pos_reduced - write_pos); //Write up to read reduced
-        } else {
-            circ_max_buf = current_buf +  (ptrdiff_t)(shared_max - write_pos); //Write up to the end of the circular buffer
+        record = (const struct xen_shm_pipe_record*) (p->shared->buffer + (ptrdiff_t) __xen_shm_pipe_offset(p, claim));
+        len = __atomic_load_n(&record->len, __ATOMIC_RELAXED);
+        if(__atomic_load_n(&sv->claim, __ATOMIC_ACQUIRE) != claim) { //Taken meanwhile, the length may be a newer one
+            continue;
         }
 
-        /*
-         * Get the minimum of different boundaries
-         */
-        gran_check = 0;
-        min_max_buf = circ_max_buf;
-        if(min_max_buf > usr_max_buf) {
-            min_max_buf = usr_max_buf;
+        if(len > __xen_shm_pipe_msg_max(p)) { //Not a record
+            errno = EPROTO;
+            return -1;
         }
-        if(min_max_buf > gran_max_buf) {
-            gran_check = 1;
-            min_max_buf = gran_max_buf;
+        if(len > size) {
+            *msg_len = len;
+            errno = EMSGSIZE;
+            return -1;
         }
 
-        /*
-         * Actually write
-         */
+        if(__atomic_compare_exchange_n(&sv->claim, &claim, claim + XSHMP_RECORD_SIZE(len), 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            *start = claim;
+            *msg_len = len;
+            return 1;
+        }
+    }
+}
 
-        //Tests 64b alignement
-        if( (is_aligned || (((unsigned long) current_buf) & ((unsigned long) 0x7u)) == (((unsigned long) write_pos) & ((unsigned long) 0x7u)))
-                && min_max_buf - current_buf > 24  ) {
-            //Align optimized
-            if(!is_aligned) {
-                is_aligned = 1;
-                while( ((unsigned long) current_buf) & ((unsigned long) 0x7u)) { //Slow copy to align with 64b pointers
-                    *write_pos = *current_buf;
-                    ++current_buf;
-                    ++write_pos;
-                }
-            }
+/*
+ * Waits for a record nobody took yet. Return -1 if error. 0 if end of file. 1 if there is one.
+ * 'slept' is set once the reader slept.
+ */
+int
+__xen_shm_pipe_take_wait(struct xen_shm_pipe_priv* p, int* slept) {
+    volatile struct xen_shm_pipe_shared* sv;
+    uint64_t wake;
+    uint32_t writer_flags;
+    uint32_t active_count;
+    int armed;
+    int retval;
 
+    sv = p->shared;
+    active_count = XEN_SHM_PIPE_WAIT_LOOP_ACTIVE_MAX;
+    armed = 0;
 
-            min_max_buf64 = (uint64_t*)( ((unsigned long) min_max_buf) & ~((unsigned long) 0x7u)); //Previous aligned
-            current_buf64 = (const uint64_t*)(current_buf);
-            write_pos64 = (uint64_t*)(write_pos);
-            while(current_buf64 != min_max_buf64) { //Fast copy
-                *write_pos64 = *current_buf64;
-                ++current_buf64;
-                ++write_pos64;
+    while(__atomic_load_n(&sv->claim, __ATOMIC_ACQUIRE) == __atomic_load_n(&sv->head, __ATOMIC_ACQUIRE)) {
+
+        writer_flags = sv->writer_flags;
+        if(writer_flags & XSHMP_CLOSED) { //File was closed, check nothing was written just before
+            if(__atomic_load_n(&sv->claim, __ATOMIC_ACQUIRE) != __atomic_load_n(&sv->head, __ATOMIC_ACQUIRE)) {
+                break;
             }
-            current_buf = (const uint8_t*)(current_buf64);
-            write_pos = (uint8_t*)(write_pos64);
-
-            //Ending the copy
-            if((!gran_check) && (current_buf != min_max_buf)) {
-                is_aligned = 0;
-                while(current_buf != min_max_buf) {
-                    *write_pos = *current_buf;
-                    ++current_buf;
-                    ++write_pos;
-                }
+            if(*slept) { //The other sleepers must see it too
+                __xen_shm_pipe_take_pass(p);
             }
+            return 0;
+        }
 
-        } else {
-            //Slow speed
-            is_aligned = 0;
-            while(current_buf != min_max_buf) {
-                *write_pos = *current_buf;
-                ++current_buf;
-                ++write_pos;
+        if(p->nonblock) {
+            if(!armed) { //So that a poll tells when to come back. Then look again. It stays armed: readers would disarm each other
+                __xen_shm_pipe_arm(p);
+                armed = 1;
+                continue;
             }
+            errno = EAGAIN;
+            return -1;
         }
 
-        /*
-         * Check boundary values
-         */
-        if(gran_check || (current_buf == gran_max_buf)) { //Time to take news of the other guy
-            if(sv->reader_flags & XSHMP_SLEEPING) { //Reader is waiting
-                __xen_shm_pipe_send_signal(p);
-            }
-            gran_max_buf += p->wait_check_interval;
+        if((writer_flags & XSHMP_ACTIVE) && active_count) {
+            --active_count;
+            XSHMP_CPU_RELAX();
+            continue;
         }
 
-        if(write_pos == shared_max) {
-            write_pos = s->buffer;
+        wake = __xen_shm_pipe_sleep_begin(p); //Say we are sleeping
+        retval = 0;
+        if(__atomic_load_n(&sv->claim, __ATOMIC_ACQUIRE) == __atomic_load_n(&sv->head, __ATOMIC_ACQUIRE)
+                && !(sv->writer_flags & XSHMP_CLOSED)) { //Check nothing changed
+            retval = __xen_shm_pipe_wait_shared(p, wake, 1);
+            *slept = 1;
+        }
+        __xen_shm_pipe_set_sleeping(p, 0); //Wake up !
+        if(retval == -1 && errno != EINTR) {
+            if(errno == EPIPE && (__atomic_load_n(&sv->claim, __ATOMIC_ACQUIRE) != __atomic_load_n(&sv->head, __ATOMIC_ACQUIRE)
+                    || (sv->writer_flags & XSHMP_CLOSED))) {
+                continue; //Records are left, or the writer closed properly
+            }
+            return -1;
         }
+        active_count = XEN_SHM_PIPE_WAIT_LOOP_ACTIVE_MAX;
+    }
+
+    return 1;
+}
 
-        read_pos_reduced = s->buffer + (ptrdiff_t) sv->read;
-        read_pos_reduced = (read_pos_reduced == s->buffer)?(shared_max-1):(read_pos_reduced-1);
-        s->write = (uint32_t) (write_pos - s->buffer); //Update read position in shared memory
+/*
+ * A signal of the writer only wakes one sleeping reader up: once it took its record, it hands the wake up
+ * over to another one if records (or the end of file) are left behind.
+ */
+void
+__xen_shm_pipe_take_pass(struct xen_shm_pipe_priv* p) {
+    volatile struct xen_shm_pipe_shared* sv;
+
+    sv = p->shared;
+    if(!p->await_wake || p->status == NULL || __atomic_load_n(&sv->sleepers, __ATOMIC_SEQ_CST) == 0) {
+        return;
+    }
+    if(__atomic_load_n(&sv->claim, __ATOMIC_ACQUIRE) != __atomic_load_n(&sv->head, __ATOMIC_ACQUIRE)
+            || (sv->writer_flags & XSHMP_CLOSED)) {
+        ioctl(p->fd, XEN_SHM_IOCTL_PASS_WAKE, 0);
+    }
+}
 
+/* Gives the space of a taken record back to the writer, after the records taken before it */
+void
+__xen_shm_pipe_take_release(struct xen_shm_pipe_priv* p, uint64_t start, size_t msg_len) {
+    volatile struct xen_shm_pipe_shared* sv;
 
+    sv = p->shared;
 
+    while(__atomic_load_n(&sv->tail, __ATOMIC_ACQUIRE) != start) { //Readers that took before us are still copying
+        sched_yield();
     }
+    __atomic_store_n(&sv->tail, start + XSHMP_RECORD_SIZE(msg_len), __ATOMIC_RELEASE);
 
-    if(sv->reader_flags & XSHMP_SLEEPING) { //Reader is waiting
+    __atomic_thread_fence(__ATOMIC_SEQ_CST); //Freed before the flag is read
+    if(sv->writer_flags & XSHMP_SLEEPING) { //Writer is waiting
         __xen_shm_pipe_send_signal(p);
     }
+}
+
+/* recv_msg of the multi-reader mode */
+int
+__xen_shm_pipe_take_recv(struct xen_shm_pipe_priv* p, void* buf, size_t size, size_t* len) {
+    uint64_t start;
+    size_t msg_len;
+    int retval;
+    int slept;
+
+    slept = 0;
+    while((retval = __xen_shm_pipe_take_record(p, size, &start, &msg_len)) == 0) {
+        retval = __xen_shm_pipe_take_wait(p, &slept);
+        if(retval <= 0) {
+            return retval;
+        }
+    }
+    if(slept) {
+        __xen_shm_pipe_take_pass(p);
+    }
+
+    if(retval < 0) {
+        if(errno == EMSGSIZE) {
+            *len = msg_len;
+        }
+        return -1;
+    }
 
+    __xen_shm_pipe_copy_from(p, start + sizeof(struct xen_shm_pipe_record), buf, msg_len);
+    __xen_shm_pipe_take_release(p, start, msg_len);
+    *len = msg_len;
 
-    return (size_t) (current_buf - user_buf);
+    return 1;
 }
 
-ssize_t
-xen_shm_pipe_read(xen_shm_pipe_p xpipe, void* buf, size_t nbytes)
-{
+int
+xen_shm_pipe_readable(xen_shm_pipe_p xpipe) {
     struct xen_shm_pipe_priv* p;
-    int wait_ret;
-    size_t read_ret;
+    volatile struct xen_shm_pipe_shared* sv;
+    uint32_t writer_flags;
 
     p = xpipe;
 
-#ifdef XSHMP_STATS
-    p->stats.read_count++;
-#endif
-
-    if(p->mod == xen_shm_pipe_mod_write) { //Not reader
-        errno = EMEDIUMTYPE;
-        return -1;
-    }
-
-    if(p->shared == NULL) { //Not initialized
+    if(p->mod == xen_shm_pipe_mod_write || p->shared == NULL) {
         errno = EMEDIUMTYPE;
         return -1;
     }
+    sv = p->shared;
 
-    if(p->shared->reader_flags & XSHMP_CLOSED) {//Closed
-        return 0;
-    }
-
-    p->shared->reader_flags |= XSHMP_ACTIVE;
-
-    wait_ret = __xen_shm_pipe_wait_reader(p);
-    if(wait_ret <= 0) {
-        p->shared->reader_flags &= ~XSHMP_ACTIVE;
-        return (ssize_t) wait_ret;
+    writer_flags = sv->writer_flags; //Before the index, as in the waits
+    if(p->multi_reader) {
+        if(__atomic_load_n(&sv->claim, __ATOMIC_ACQUIRE) != __atomic_load_n(&sv->head, __ATOMIC_ACQUIRE)) {
+            return 1;
+        }
+    } else if(__xen_shm_pipe_read_ready(p, 1)) {
+        return 1;
     }
 
-    read_ret = __xen_shm_pipe_read_avail(p, buf, nbytes);
-
-    p->shared->reader_flags &= ~XSHMP_ACTIVE;
-
-    return (ssize_t) read_ret;
+    return ((writer_flags & XSHMP_CLOSED) || (sv->reader_flags & XSHMP_CLOSED) || p->saw_epipe)?1:0;
 }
 
-
-
-
-ssize_t
-xen_shm_pipe_write(xen_shm_pipe_p xpipe, const void* buf, size_t nbytes) {
+int
+xen_shm_pipe_writable(xen_shm_pipe_p xpipe, size_t len) {
     struct xen_shm_pipe_priv* p;
-    int wait_ret;
-    size_t write_ret;
+    volatile struct xen_shm_pipe_shared* sv;
+    size_t needed;
 
     p = xpipe;
 
-#ifdef XSHMP_STATS
-    p->stats.write_count++;
-#endif
-    if(p->mod == xen_shm_pipe_mod_read) { //Not reader
+    if(p->mod == xen_shm_pipe_mod_read || p->shared == NULL) {
         errno = EMEDIUMTYPE;
         return -1;
     }
+    sv = p->shared;
 
-    if(p->shared == NULL) { //Not initialized
-        errno = EMEDIUMTYPE;
-        return -1;
+    if(p->type == xen_shm_pipe_type_framed) {
+        if(len > __xen_shm_pipe_msg_max(p)) {
+            errno = EMSGSIZE;
+            return -1;
+        }
+        needed = XSHMP_RECORD_SIZE(len);
+    } else if(p->type == xen_shm_pipe_type_queue) {
+        needed = 1;
+    } else {
+        if(len > p->buffer_size - ((p->ring == xen_shm_pipe_ring_pow2)?0:1)) { //Legacy ring: one byte is never used
+            errno = EMSGSIZE;
+            return -1;
+        }
+        needed = len;
     }
 
-    if(p->shared->writer_flags & XSHMP_CLOSED) {//Closed
-        errno = EPIPE;
-        return -1;
+    if((sv->reader_flags & XSHMP_CLOSED) || (sv->writer_flags & XSHMP_CLOSED)) { //The write fails at once
+        return 1;
     }
 
-    p->shared->writer_flags |= XSHMP_ACTIVE;
-
-    wait_ret = __xen_shm_pipe_wait_writer(p);
-    if(wait_ret <= 0) {
-        p->shared->writer_flags &= ~XSHMP_ACTIVE;
-        return (ssize_t) wait_ret;
+    if(p->multi_writer) {
+        return (__atomic_load_n(&p->claim, __ATOMIC_RELAXED) + needed - __atomic_load_n(&sv->tail, __ATOMIC_ACQUIRE) <= p->buffer_size)?1:0;
     }
 
-    write_ret = __xen_shm_pipe_write_avail(p, buf, nbytes);
-
-    p->shared->writer_flags &= ~XSHMP_ACTIVE;
-
-    return (ssize_t) write_ret;
-
+    return __xen_shm_pipe_write_ready(p, needed, 0, 1);
 }
 
-
-ssize_t xen_shm_pipe_write_all(xen_shm_pipe_p xpipe, const void* buf, size_t nbytes) {
-    size_t written;
-    ssize_t retval;
-    const uint8_t* buffer;
-
-    written = 0;
-    buffer = (const uint8_t*) buf;
-    while(nbytes) {
-        if((retval = xen_shm_pipe_write(xpipe, buffer, nbytes ))<=0) {
-            return(written!=0)?((ssize_t) written):retval;
-        }
-        written += (size_t) retval;
-        buffer += (ptrdiff_t) retval;
-        nbytes -= (size_t) retval;
-    }
-
-    return (ssize_t) written;
-
+uint64_t
+xen_shm_pipe_wake_count(xen_shm_pipe_p xpipe) {
+    return __xen_shm_pipe_wake_count(xpipe);
 }
 
+int
+xen_shm_pipe_wait_wake(xen_shm_pipe_p xpipe, uint64_t wake_count) {
+    struct xen_shm_pipe_priv* p;
+    struct pollfd pfd;
+    int retval;
 
-ssize_t xen_shm_pipe_read_all(xen_shm_pipe_p xpipe, void* buf, size_t nbytes) {
-    size_t readd;
-    ssize_t retval;
-    uint8_t* buffer;
+    p = xpipe;
 
-    readd = 0;
-    buffer = (uint8_t*) buf;
-    while(nbytes) {
-        if((retval = xen_shm_pipe_read(xpipe, buffer, nbytes ))<=0) {
-            return(readd!=0)?((ssize_t) readd):retval;
+    if(p->await_wake && p->status != NULL) {
+        retval = __xen_shm_pipe_await_wake(p, wake_count, 0);
+        if(retval == 0 || errno != ENOTTY) {
+            return retval;
         }
-        readd += (size_t) retval;
-        buffer += (ptrdiff_t) retval;
-        nbytes -= (size_t) retval;
     }
 
-    return (ssize_t) readd;
+    //Older module: the latent signal may have been consumed by a pipe of the fd, look again soon
+    pfd.fd = p->fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    if(poll(&pfd, 1, XEN_SHM_PIPE_SHARED_AWAIT_MS) < 0) {
+        return -1;
+    }
+    if(pfd.revents & (POLLHUP | POLLERR)) {
+        errno = EPIPE;
+        return -1;
+    }
 
+    return 0;
 }
 
 int
@@ -941,6 +3987,10 @@ xen_shm_pipe_flush(xen_shm_pipe_p xpipe) {
         return -1;
     }
 
+    if(p->held) { //Coalesced bytes
+        __xen_shm_pipe_publish(p);
+    }
+
     return __xen_shm_pipe_send_signal(p);
 }
 
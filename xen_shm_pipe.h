@@ -19,6 +19,9 @@
 
 #include <inttypes.h>
 #include <unistd.h>
+#include <sys/uio.h>
+
+#include "xen_shm_pipe_copy.h"
 
 
 /*
@@ -37,8 +40,18 @@ struct xen_shm_pipe_stats {
     uint64_t ioctl_count_await;
     uint64_t ioctl_count_epipe_prone;
     uint64_t ioctl_count_ssig;
+    uint64_t ioctl_count_ssig_await; //Awaits that also sent the wake up left by the write side (see xen_shm_pipe_set_wake_on_read)
     uint64_t read_count;
     uint64_t write_count;
+    uint64_t remote_index_loads; //Loads of the other side's index from shared memory
+    uint64_t remote_index_cached; //Loads avoided thanks to the cached index
+    uint64_t spin_waits; //Waits that ended while spinning
+    uint64_t sleep_waits; //Waits that slept on the event channel
+    uint64_t spin_count; //Spins done by all the waits
+    uint64_t held_writes; //Coalescing writer: writes left unpublished
+    uint64_t signals_suppressed; //Wake ups of the sleeping other side that were put off (moderation, watermark)
+    uint64_t wake_latency_ns; //Time the sleeping other side was left asleep before the wake ups that were put off, summed
+    uint64_t wake_latency_count; //Wake ups that were put off
     uint8_t waiting;
 };
 #endif
@@ -68,6 +81,35 @@ enum  xen_shm_pipe_conv {
     xen_shm_pipe_conv_reader_offers
 };
 
+/*
+ * The kind of data the pipe carries. It is chosen by the offerer and written in the shared memory.
+ * A stream pipe is used with read/write and their variants, a framed pipe with send_msg/recv_msg
+ * and a queue pipe with xen_shm_queue_push/pop.
+ */
+enum xen_shm_pipe_type {
+    xen_shm_pipe_type_default, /* Stream for the offerer. The receiver takes what the offerer chose */
+    xen_shm_pipe_type_stream,
+    xen_shm_pipe_type_framed,
+    xen_shm_pipe_type_queue    /* Always uses the power of two ring */
+};
+
+/*
+ * Biggest message of a queue pipe. Each message uses one cache line of the buffer.
+ */
+#define XEN_SHM_QUEUE_MSG_MAX 56
+
+/*
+ * The geometry of the circular buffer. It is chosen by the offerer and written in the shared memory.
+ * The legacy ring uses all the shared pages but one byte is never used.
+ * The power of two ring uses 64 bits free running head/tail counters. Its buffer is the biggest power
+ * of two that fits (use 2^n + 1 pages to get a 2^n pages buffer) and is fully usable.
+ */
+enum xen_shm_pipe_ring {
+    xen_shm_pipe_ring_default, /* Legacy for the offerer. The receiver takes what the offerer chose */
+    xen_shm_pipe_ring_legacy,
+    xen_shm_pipe_ring_pow2
+};
+
 
 
 
@@ -80,6 +122,170 @@ int xen_shm_pipe_init(xen_shm_pipe_p * pipe,  /* A returned pointer to a pipe */
                       enum xen_shm_pipe_conv conv  /* The convention of the pipe */
                       );
 
+/*
+ * Init both directions of a full duplex channel, using a single grant and a single event channel.
+ * The shared pages are split in two halves, one ring per direction. The offers/connect/wait steps below
+ * are done once, with either of the two pipes (offers is non zero on the offerer's side).
+ * Ring geometry and type are chosen per direction, before offers/connect.
+ * Both directions share the event channel: a signal wakes up both of them, so both pipes can be used
+ * by their own thread (with a module lacking XEN_SHM_IOCTL_AWAIT_WAKE, a sleeping side re-checks its ring
+ * every few milliseconds instead, in case the other direction consumed its signal).
+ * Each pipe is freed with xen_shm_pipe_free. The grant is released with the second one.
+ * On succes, returns 0. On error, -1 is returned, and errno is set appropriately.
+ */
+int xen_shm_pipe_init_duplex(xen_shm_pipe_p* receive_pipe, xen_shm_pipe_p* send_pipe, int offers);
+
+/*
+ * The best copy kernel the CPU supports is chosen at init. This forces another one.
+ * Returns 0 on success, or -1 and errno is set to ENOTSUP if the CPU doesn't support it.
+ */
+int xen_shm_pipe_set_copy_kernel(xen_shm_pipe_p pipe, enum xen_shm_pipe_copy_kernel kernel);
+
+/*
+ * Chooses the ring geometry. Must be called before offers/connect.
+ * On the receiver's side, connect fails with EPROTONOSUPPORT if the offerer chose another geometry.
+ * Returns 0 on success, or -1 and errno is set to EISCONN if the pipe is already connected.
+ */
+int xen_shm_pipe_set_ring(xen_shm_pipe_p pipe, enum xen_shm_pipe_ring ring);
+
+/*
+ * Chooses the pipe type. Must be called before offers/connect.
+ * On the receiver's side, connect fails with EPROTONOSUPPORT if the offerer chose another type.
+ * Returns 0 on success, or -1 and errno is set to EISCONN if the pipe is already connected.
+ */
+int xen_shm_pipe_set_type(xen_shm_pipe_p pipe, enum xen_shm_pipe_type type);
+
+/*
+ * By default, the pipe index is published in the shared memory after each copied chunk.
+ * With a publish interval, it is only published every 'bytes' bytes and at the end of each read/write call,
+ * or earlier when the other side is waiting for it. Less stores in the shared memory means less cache line
+ * transfers between both sides for long streams.
+ * XEN_SHM_PIPE_PUBLISH_CHUNK restores the default and XEN_SHM_PIPE_PUBLISH_END only publishes at the end of the calls.
+ */
+#define XEN_SHM_PIPE_PUBLISH_CHUNK 0
+#define XEN_SHM_PIPE_PUBLISH_END   SIZE_MAX
+void xen_shm_pipe_set_publish_interval(xen_shm_pipe_p pipe, size_t bytes);
+
+/*
+ * How a read or write waits for the other side: spinning on the shared memory costs CPU time
+ * but avoids the event channel round trip, sleeping is the other way around.
+ */
+enum xen_shm_pipe_wait_policy {
+    xen_shm_pipe_wait_throughput, /* Default. Spins a bounded number of times while the other side is in a read/write call, then sleeps */
+    xen_shm_pipe_wait_latency,    /* Spins up to a millisecond whatever the other side does, then sleeps */
+    xen_shm_pipe_wait_power_save, /* Sleeps at once */
+    xen_shm_pipe_wait_adaptive    /* Spins about twice the recent waiting times. Sleeps at once when the other side is usually slower than that */
+};
+
+/*
+ * Chooses the wait policy. Can be changed at any time.
+ * The adaptive policy learns from the waits of the pipe: its spin budget follows a moving average of the time
+ * the waits took, bounded to a fraction of a millisecond.
+ */
+void xen_shm_pipe_set_wait_policy(xen_shm_pipe_p pipe, enum xen_shm_pipe_wait_policy policy);
+
+/*
+ * Non-blocking mode (like O_NONBLOCK). Can be changed at any time.
+ * Instead of waiting for the other side, the calls then fail with EAGAIN. Partial transfers are returned as usual,
+ * so a stream write (or a _all variant) returns the bytes that fit, and -1 with EAGAIN only if nothing moved.
+ * In multi-writer mode, a write only reserves room that is already free, so it does not block either.
+ * A broken pipe is not detected in this mode, as it is found while waiting.
+ */
+void xen_shm_pipe_set_nonblock(xen_shm_pipe_p pipe, int enable);
+
+/*
+ * Tells if a read (recv_msg, queue pop...) would return without waiting: 1 if data is there or the writer closed,
+ * 0 if not. Only looks at the shared memory.
+ * Returns -1 and errno is set to EMEDIUMTYPE if the pipe is not a connected reader.
+ */
+int xen_shm_pipe_readable(xen_shm_pipe_p pipe);
+
+/*
+ * Tells if a write of 'len' bytes (a message of 'len' bytes for a framed pipe, any message for a queue pipe)
+ * would complete without waiting: 1 if there is room or the reader closed, 0 if not. Only looks at the shared memory.
+ * Returns -1 and errno is set to EMEDIUMTYPE if the pipe is not a connected writer, or EMSGSIZE if the message can never fit.
+ */
+int xen_shm_pipe_writable(xen_shm_pipe_p pipe, size_t len);
+
+/*
+ * Reads the wake count of the pipe's fd, for xen_shm_pipe_wait_wake. Both pipes of a duplex channel share it.
+ * Must be read before the last look at the pipes (readable, writable or a call that failed with EAGAIN).
+ */
+uint64_t xen_shm_pipe_wake_count(xen_shm_pipe_p pipe);
+
+/*
+ * Sleeps until the other side signals after 'wake_count' was read with xen_shm_pipe_wake_count, or the memory is closed.
+ * It returns at once if a signal came in between. Nothing is consumed, so any number of threads can wait on the same fd.
+ * In non-blocking mode, the calls that fail with EAGAIN ask the other side for that signal.
+ * With a module that lacks XEN_SHM_IOCTL_AWAIT_WAKE, it sleeps a few milliseconds at most.
+ * Returns 0 when the pipes are worth a new look. On error, -1 is returned and errno is set approprietely
+ * (EPIPE if the other side is gone, EINTR if a signal interrupted the wait).
+ */
+int xen_shm_pipe_wait_wake(xen_shm_pipe_p pipe, uint64_t wake_count);
+
+/*
+ * Watermark of the wake ups (like SO_RCVLOWAT/SO_SNDLOWAT). Must be called on a connected stream or framed pipe.
+ * A sleeping reader is only woken up by the writer once at least 'bytes' bytes (whole records for a framed pipe) are ready,
+ * and a sleeping writer by the reader once at least 'bytes' bytes are free. This cuts the event channel
+ * interrupts of bulk transfers. 0 or 1 (the default) wakes up as soon as anything moved, bigger values are bounded to the buffer size.
+ * The writer must call xen_shm_pipe_flush after a burst smaller than the reader's watermark that must be seen at once.
+ * A side waiting for the other one to move still wakes it up whatever its watermark. Queue pipes and the
+ * multi-writer/multi-reader sides don't look at the other side's watermark.
+ * Returns 0 on success, or -1 and errno is set approprietely.
+ */
+int xen_shm_pipe_set_lowat(xen_shm_pipe_p pipe, size_t bytes);
+
+/*
+ * Coalescing of small writes (Nagle-like). Must be called on a writer. Can be changed at any time.
+ * Each write, writev and send_msg then leaves its bytes in the ring without publishing them or waking the reader up,
+ * until 'bytes' bytes are held or the first held byte is 'usecs' microseconds old (0: no deadline).
+ * The call that reaches one of these publishes everything at once. A call that has to wait for room also does.
+ * Nothing is published between the calls, so a writer that goes idle must call xen_shm_pipe_flush.
+ * 0 bytes stops coalescing and publishes what is held. Ignored in multi-writer mode.
+ * Returns 0 on success, or -1 and errno is set to EMEDIUMTYPE if the pipe is not a stream or framed writer.
+ */
+int xen_shm_pipe_set_coalesce(xen_shm_pipe_p pipe, size_t bytes, unsigned long usecs);
+
+/*
+ * Notification moderation (like the interrupt coalescing of network cards). While a read/write moves data,
+ * it checks the other side every few bytes and wakes it up if it sleeps, so that both sides work at the same time.
+ * Each wake up is an interrupt in the other domain. A sleeping other side is left asleep until the next check,
+ * which comes after 'bytes' bytes, or soon in a call that starts 'usecs' microseconds after the previous check.
+ * The end of each call still wakes it up. Can be changed at any time.
+ * With XEN_SHM_PIPE_NOTIFY_AUTO (the default), the bytes follow the recent transfer rate: the bytes moved in 'usecs'
+ * microseconds, up to twice more if the other side is usually asleep, within 128 bytes and a quarter of the buffer.
+ * 0 usecs restores the default of 50 microseconds.
+ * The statistics count the wake ups that were put off, and how long the other side was left asleep because of it.
+ */
+#define XEN_SHM_PIPE_NOTIFY_AUTO 0
+void xen_shm_pipe_set_notify_moderation(xen_shm_pipe_p pipe, size_t bytes, unsigned long usecs);
+
+/*
+ * Request-response protocols over a duplex channel. Must be called on its send pipe. Can be changed at any time.
+ * The wake up of the sleeping reader at the end of each write is then left to the next read of the receive pipe,
+ * which sends it and sleeps for the answer in a single system call, or sends it at once if it doesn't sleep.
+ * The application must read after each request (or call xen_shm_pipe_flush on the send pipe), otherwise the other side
+ * is not woken up. Not done while the receive pipe is in non-blocking or multi-reader mode.
+ * Disabling it sends the pending wake up.
+ * Returns 0 on success, or -1 and errno is set to EMEDIUMTYPE if the pipe is not the send pipe of a duplex channel.
+ */
+int xen_shm_pipe_set_wake_on_read(xen_shm_pipe_p pipe, int enable);
+
+/*
+ * Returns the file descriptor of the pipe, for poll/select/epoll (or an event loop such as libev), with the pipe
+ * in non-blocking mode. A call that fails with EAGAIN asks the other side for a signal on its next progress:
+ * the fd is then readable (POLLIN) once it is worth calling again. It is hung up (POLLHUP) when a side closed.
+ * Only the call that fails with EAGAIN consumes the signal, so call until EAGAIN before polling again.
+ * Both directions of a duplex channel share the same fd.
+ */
+int xen_shm_pipe_get_fd(xen_shm_pipe_p pipe);
+
+/*
+ * Returns 1 if the pipes are the receive and the send pipe of the same duplex channel (see xen_shm_pipe_init_duplex).
+ * 0 otherwise.
+ */
+int xen_shm_pipe_is_duplex(xen_shm_pipe_p receive_pipe, xen_shm_pipe_p send_pipe);
+
 /*
  * Receiver's side steps
  * Those functions all returns 0 on success and -1 on error and errno is set appropriately.
@@ -92,7 +298,10 @@ int xen_shm_pipe_getdomid(xen_shm_pipe_p pipe, uint32_t* receiver_domid);
 
 /* 3. Receive offerer's domid, grant ref and page_count */
 
-/* 4. Connects with the offerer */
+/* 4. Connects with the offerer
+ *    Fails with EPROTO if the offerer uses the old shared layout, or EPROTONOSUPPORT if it uses an unknown version
+ *    or another ring geometry/pipe type than the one set with xen_shm_pipe_set_ring/xen_shm_pipe_set_type.
+ *    (An old receiver sees the pipe as closed) */
 int xen_shm_pipe_connect(xen_shm_pipe_p pipe, uint8_t page_count, uint32_t offerer_domid, uint32_t grant_ref);
 
 
@@ -126,6 +335,41 @@ ssize_t xen_shm_pipe_write(xen_shm_pipe_p pipe, const void* buf, size_t nbytes);
  */
 ssize_t xen_shm_pipe_write_all(xen_shm_pipe_p pipe, const void* buf, size_t nbytes);
 
+/*
+ * Scatter/gather versions of write and write_all. The segments are written in order, as a single write would do.
+ */
+ssize_t xen_shm_pipe_writev(xen_shm_pipe_p pipe, const struct iovec* iov, int iovcnt);
+ssize_t xen_shm_pipe_writev_all(xen_shm_pipe_p pipe, const struct iovec* iov, int iovcnt);
+
+/*
+ * Zero-copy write. Gives a pointer to a contiguous writable region of the pipe in 'ptr' and its size in 'len'.
+ * Blocks until at least min_len bytes are available, unless the region reaches the end of the circular
+ * buffer (in which case 'len' can be smaller than min_len, and another reserve must follow the commit).
+ * The data written in the region is only seen by the reader after xen_shm_pipe_write_commit.
+ * Returns 0 on success. On error, -1 is returned and errno is set approprietely (EINVAL if min_len can never be given).
+ */
+int xen_shm_pipe_write_reserve(xen_shm_pipe_p pipe, size_t min_len, void** ptr, size_t* len);
+
+/*
+ * Publishes the first nbytes of the region given by the last reserve and wakes up the reader if needed.
+ * Returns 0 on success. On error, -1 is returned and errno is set approprietely (EINVAL if nbytes is bigger than the region).
+ */
+int xen_shm_pipe_write_commit(xen_shm_pipe_p pipe, size_t nbytes);
+
+/*
+ * Multi-writer mode: several threads of the process may then write into the same pipe at once.
+ * Each thread reserves the room of its write with an atomic operation, and writes are published in the order
+ * of their reservations, so the reader never sees them mixed or with a gap.
+ * Each write, writev (and their _all versions), send_msg and message of send_batch is done entirely or not at all:
+ * a stream write bigger than the buffer fails with EMSGSIZE. Zero-copy writes fail with ENOTSUP.
+ * The single writer path is unchanged while the mode is not enabled.
+ * Must be called on a connected power of two ring (stream or framed), while no other thread writes.
+ * If a thread fails after its reservation (closed reader, broken pipe), all the following writes fail.
+ * Statistics are approximate in this mode.
+ * Returns 0 on success, or -1 and errno is set approprietely (EPROTONOSUPPORT if the ring is not a power of two ring).
+ */
+int xen_shm_pipe_set_multi_writer(xen_shm_pipe_p pipe, int enable);
+
 /*
  * Read in the pipe. Returns the number of read bytes, 0 if EOF, or -1 and errno is set.
  * Blocks until at least one byte is read or an error occurs.
@@ -140,11 +384,136 @@ ssize_t xen_shm_pipe_read(xen_shm_pipe_p pipe, void* buf, size_t nbytes);
  */
 ssize_t xen_shm_pipe_read_all(xen_shm_pipe_p pipe, void* buf, size_t nbytes);
 
+/*
+ * Scatter/gather versions of read and read_all. The segments are filled in order, as a single read would do.
+ */
+ssize_t xen_shm_pipe_readv(xen_shm_pipe_p pipe, const struct iovec* iov, int iovcnt);
+ssize_t xen_shm_pipe_readv_all(xen_shm_pipe_p pipe, const struct iovec* iov, int iovcnt);
+
+/*
+ * Read, read_all, write and write_all bounded by a timeout, in ms, for the whole call (spins and sleeps included).
+ * When the time is over, the bytes already transfered are returned, or -1 with errno set to ETIME if there were none.
+ * A partial _all count also leaves errno set to ETIME. A timeout of 0 fails at once if the call would have to wait.
+ * Timed writes fail with ENOTSUP in multi-writer mode.
+ */
+ssize_t xen_shm_pipe_read_timed(xen_shm_pipe_p pipe, void* buf, size_t nbytes, unsigned long timeout_ms);
+ssize_t xen_shm_pipe_read_all_timed(xen_shm_pipe_p pipe, void* buf, size_t nbytes, unsigned long timeout_ms);
+ssize_t xen_shm_pipe_write_timed(xen_shm_pipe_p pipe, const void* buf, size_t nbytes, unsigned long timeout_ms);
+ssize_t xen_shm_pipe_write_all_timed(xen_shm_pipe_p pipe, const void* buf, size_t nbytes, unsigned long timeout_ms);
+
+/*
+ * Zero-copy read. Gives a pointer to the contiguous readable region of the pipe in 'ptr' and its size in 'len'.
+ * The region stops at the end of the circular buffer, the rest is given by the next peek.
+ * Blocks until at least one byte is available. The region stays valid until xen_shm_pipe_read_consume.
+ * Returns 0 on success ('len' is set to 0 if EOF). On error, -1 is returned and errno is set approprietely.
+ */
+int xen_shm_pipe_read_peek(xen_shm_pipe_p pipe, const void** ptr, size_t* len);
+
+/*
+ * Gives the first nbytes of the region given by the last peek back to the writer, and wakes it up if needed.
+ * Returns 0 on success. On error, -1 is returned and errno is set approprietely (EINVAL if nbytes is bigger than the region).
+ */
+int xen_shm_pipe_read_consume(xen_shm_pipe_p pipe, size_t nbytes);
+
+
+/*
+ * Framed pipes (xen_shm_pipe_type_framed). The byte stream functions fail with EMEDIUMTYPE on them.
+ * Messages are sent as records aligned on 8 bytes, with an 8 bytes header. A message can't be bigger than
+ * the buffer minus one header (minus 8 more bytes with the legacy ring).
+ */
+
+/*
+ * Sends one message. Blocks until there is room for the whole record.
+ * Returns 0 on success. On error, -1 is returned and errno is set approprietely (EMSGSIZE if the message can never fit).
+ */
+int xen_shm_pipe_send_msg(xen_shm_pipe_p pipe, const void* buf, size_t len);
+
+/*
+ * Same as send_msg, the message being gathered from several segments (a header and a payload, for example).
+ */
+int xen_shm_pipe_send_msgv(xen_shm_pipe_p pipe, const struct iovec* iov, int iovcnt);
+
+/*
+ * Receives exactly one message in buf, and its length in len. Blocks until a message is available.
+ * Returns 1 on success, 0 if EOF. On error, -1 is returned and errno is set approprietely.
+ * If the message is bigger than size, errno is set to EMSGSIZE, len to the message length and the message stays in the pipe.
+ */
+int xen_shm_pipe_recv_msg(xen_shm_pipe_p pipe, void* buf, size_t size, size_t* len);
+
+/*
+ * Zero-copy receive. Gives the length of the next message in len, and a pointer to it in the pipe in ptr.
+ * If the message goes through the end of the circular buffer, ptr is set to NULL and the message
+ * can be copied with xen_shm_pipe_recv_msg instead.
+ * Otherwise, the message stays valid until xen_shm_pipe_recv_msg_consume.
+ * Returns 1 on success, 0 if EOF. On error, -1 is returned and errno is set approprietely.
+ */
+int xen_shm_pipe_recv_msg_peek(xen_shm_pipe_p pipe, const void** ptr, size_t* len);
+
+/*
+ * Gives the message given by the last peek back to the writer, and wakes it up if needed.
+ * Returns 0 on success. On error, -1 is returned and errno is set approprietely (EINVAL if nothing was peeked).
+ */
+int xen_shm_pipe_recv_msg_consume(xen_shm_pipe_p pipe);
+
+/*
+ * Sends several messages in one pass: a single index publish and at most one signal to the reader.
+ * Blocks until the first message can be sent, then sends as many of the following ones as there is room for.
+ * Returns the number of messages sent. On error, -1 is returned and errno is set approprietely
+ * (EMSGSIZE if one of the messages can never fit, nothing is sent then).
+ */
+int xen_shm_pipe_send_batch(xen_shm_pipe_p pipe, const struct iovec* msgs, int count);
+
+/*
+ * Receives several messages in one pass: one message per segment, the segment length is set to the message length.
+ * Blocks until one message is available, then receives the following available ones that fit in their segments.
+ * Returns the number of messages received, 0 if EOF. On error, -1 is returned and errno is set approprietely.
+ * If the first message is bigger than the first segment, errno is set to EMSGSIZE, the first segment length
+ * to the message length and the message stays in the pipe.
+ */
+int xen_shm_pipe_recv_batch(xen_shm_pipe_p pipe, struct iovec* msgs, int count);
+
+/*
+ * Multi-reader mode (work queue): several threads, or processes forked after the connection, receive from the
+ * same framed pipe. Each message is received by exactly one of them, with xen_shm_pipe_recv_msg or xen_shm_pipe_recv_batch.
+ * A message bigger than the given buffer is left to another reader (EMSGSIZE). Zero-copy receive fails with ENOTSUP.
+ * A signal of the writer wakes exactly one idle reader, which wakes another one if it leaves messages behind.
+ * Must be called on a connected power of two ring, while no other thread reads.
+ * A reader that dies while copying a message blocks the pipe.
+ * Returns 0 on success, or -1 and errno is set approprietely (EPROTONOSUPPORT if the ring is not a power of two ring,
+ * EBUSY if the mode can't be left yet).
+ */
+int xen_shm_pipe_set_multi_reader(xen_shm_pipe_p pipe, int enable);
+
+/*
+ * Counts one more reader process. Call it before each fork, each process then frees its copy of the pipe:
+ * the writer only sees the pipe closed when the last reader freed it. Threads share one pipe and free it once.
+ * Returns 0 on success, or -1 and errno is set to EMEDIUMTYPE if the multi-reader mode is not enabled.
+ */
+int xen_shm_pipe_add_reader(xen_shm_pipe_p pipe);
+
+/*
+ * Queue pipes (xen_shm_pipe_type_queue). The buffer is a ring of cache line sized slots, one message
+ * per slot, for small messages. Each side only looks at the slot it uses, never at the other side's index.
+ */
+
+/*
+ * Pushes one message of at most XEN_SHM_QUEUE_MSG_MAX bytes. Blocks until a slot is free.
+ * Returns 0 on success. On error, -1 is returned and errno is set approprietely (EMSGSIZE if the message is too big).
+ */
+int xen_shm_queue_push(xen_shm_pipe_p pipe, const void* buf, size_t len);
+
+/*
+ * Pops one message in buf, that must be XEN_SHM_QUEUE_MSG_MAX bytes long, and its length in len.
+ * Blocks until a message is available.
+ * Returns 1 on success, 0 if EOF. On error, -1 is returned and errno is set approprietely.
+ */
+int xen_shm_queue_pop(xen_shm_pipe_p pipe, void* buf, size_t* len);
 
 /*
  * The channel is optimized to avoid system calls. So, sometime, one process can wait while data/space is available.
  * If the other process doesn't want to read/write anything, but want to be sure the other side will read/write the data,
  * it can use flush. It simply sends a signal and make sure the other process doesn't block before what precedes the flush.
+ * On a coalescing writer, it also publishes the held bytes.
  * Return 0 on success and -1 otherwise and errno is set approprietly.
  */
 int xen_shm_pipe_flush(xen_shm_pipe_p pipe);
@@ -0,0 +1,298 @@
+/*
+ * Xen shared memory pipe copy kernels
+ *
+ * Authors: Vincent Brillault <git@lerya.net>
+ *          Pierre Pfister    <oryon@darou.fr>
+ *
+ * This file contains the copy kernels used by the Xen shared
+ * memory pipe. See the headers file for precisions.
+ *
+ * SIMD kernels store the first vector unaligned, and then
+ * continue with aligned stores from unaligned loads. The last
+ * vector overlaps the previous one when the length isn't a
+ * multiple of the vector size. So misaligned buffers never
+ * fall back to byte copies.
+ *
+ */
+#include <inttypes.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "xen_shm_pipe_copy.h"
+
+#ifdef XSHMP_COPY_X86
+# include <immintrin.h>
+#endif
+
+
+void __xen_shm_pipe_copy_small(uint8_t* dst, const uint8_t* src, size_t len);
+void __xen_shm_pipe_copy_scalar(uint8_t* dst, const uint8_t* src, size_t len);
+
+#ifdef XSHMP_COPY_X86
+void __xen_shm_pipe_copy_sse2(uint8_t* dst, const uint8_t* src, size_t len) __attribute__ ((target ("sse2")));
+void __xen_shm_pipe_copy_avx2(uint8_t* dst, const uint8_t* src, size_t len) __attribute__ ((target ("avx2")));
+void __xen_shm_pipe_copy_avx512(uint8_t* dst, const uint8_t* src, size_t len) __attribute__ ((target ("avx512f")));
+#endif
+
+
+/*
+ * Copies less than 16 bytes, with two overlapping moves when possible
+ */
+void
+__xen_shm_pipe_copy_small(uint8_t* dst, const uint8_t* src, size_t len) {
+    uint64_t v64[2];
+    uint32_t v32[2];
+
+    if(len >= 8) {
+        memcpy(&v64[0], src, 8);
+        memcpy(&v64[1], src + len - 8, 8);
+        memcpy(dst, &v64[0], 8);
+        memcpy(dst + len - 8, &v64[1], 8);
+    } else if(len >= 4) {
+        memcpy(&v32[0], src, 4);
+        memcpy(&v32[1], src + len - 4, 4);
+        memcpy(dst, &v32[0], 4);
+        memcpy(dst + len - 4, &v32[1], 4);
+    } else {
+        while(len) {
+            *dst = *src;
+            ++dst;
+            ++src;
+            --len;
+        }
+    }
+}
+
+/*
+ * Copies 8 bytes at a time when both pointers have the same 64b alignment, byte per byte otherwise.
+ */
+void
+__xen_shm_pipe_copy_scalar(uint8_t* dst, const uint8_t* src, size_t len) {
+    uint8_t* dst_max;
+    uint64_t* dst64;
+    const uint64_t* src64;
+    uint64_t* dst_max64;
+
+    dst_max = dst + (ptrdiff_t) len;
+
+    //Tests 64b alignement
+    if( len > 24 && (((unsigned long) dst) & ((unsigned long) 0x7u)) == (((unsigned long) src) & ((unsigned long) 0x7u)) ) {
+        while( ((unsigned long) dst) & ((unsigned long) 0x7u)) { //Slow copy to align with 64b pointers
+            *dst = *src;
+            ++dst;
+            ++src;
+        }
+
+        dst_max64 = (uint64_t*)( ((unsigned long) dst_max) & ~((unsigned long) 0x7u)); //Previous aligned
+        dst64 = (uint64_t*)(dst);
+        src64 = (const uint64_t*)(src);
+        while(dst64 != dst_max64) { //Fast copy
+            *dst64 = *src64;
+            ++dst64;
+            ++src64;
+        }
+        dst = (uint8_t*)(dst64);
+        src = (const uint8_t*)(src64);
+    }
+
+    //Slow speed (or ending the copy)
+    while(dst != dst_max) {
+        *dst = *src;
+        ++dst;
+        ++src;
+    }
+}
+
+
+#ifdef XSHMP_COPY_X86
+
+void
+__xen_shm_pipe_copy_sse2(uint8_t* dst, const uint8_t* src, size_t len) {
+    uint8_t* dst_max;
+    size_t head;
+    __m128i v0, v1, v2, v3;
+
+    if(len < 16) {
+        __xen_shm_pipe_copy_small(dst, src, len);
+        return;
+    }
+
+    dst_max = dst + (ptrdiff_t) len;
+
+    //First vector is unaligned, then the destination is aligned
+    _mm_storeu_si128((__m128i*) dst, _mm_loadu_si128((const __m128i*) src));
+    head = 16 - (((uintptr_t) dst) & 15u);
+    dst += head;
+    src += head;
+    len -= head;
+
+    while(len >= 64) {
+        v0 = _mm_loadu_si128((const __m128i*) src);
+        v1 = _mm_loadu_si128((const __m128i*) (src + 16));
+        v2 = _mm_loadu_si128((const __m128i*) (src + 32));
+        v3 = _mm_loadu_si128((const __m128i*) (src + 48));
+        _mm_store_si128((__m128i*) dst, v0);
+        _mm_store_si128((__m128i*) (dst + 16), v1);
+        _mm_store_si128((__m128i*) (dst + 32), v2);
+        _mm_store_si128((__m128i*) (dst + 48), v3);
+        dst += 64;
+        src += 64;
+        len -= 64;
+    }
+
+    while(len >= 16) {
+        _mm_store_si128((__m128i*) dst, _mm_loadu_si128((const __m128i*) src));
+        dst += 16;
+        src += 16;
+        len -= 16;
+    }
+
+    if(len) { //Last vector overlaps the previous one
+        _mm_storeu_si128((__m128i*) (dst_max - 16), _mm_loadu_si128((const __m128i*) (src + len - 16)));
+    }
+}
+
+void
+__xen_shm_pipe_copy_avx2(uint8_t* dst, const uint8_t* src, size_t len) {
+    uint8_t* dst_max;
+    size_t head;
+    __m256i v0, v1, v2, v3;
+
+    if(len < 32) {
+        __xen_shm_pipe_copy_sse2(dst, src, len);
+        return;
+    }
+
+    dst_max = dst + (ptrdiff_t) len;
+
+    //First vector is unaligned, then the destination is aligned
+    _mm256_storeu_si256((__m256i*) dst, _mm256_loadu_si256((const __m256i*) src));
+    head = 32 - (((uintptr_t) dst) & 31u);
+    dst += head;
+    src += head;
+    len -= head;
+
+    while(len >= 128) {
+        v0 = _mm256_loadu_si256((const __m256i*) src);
+        v1 = _mm256_loadu_si256((const __m256i*) (src + 32));
+        v2 = _mm256_loadu_si256((const __m256i*) (src + 64));
+        v3 = _mm256_loadu_si256((const __m256i*) (src + 96));
+        _mm256_store_si256((__m256i*) dst, v0);
+        _mm256_store_si256((__m256i*) (dst + 32), v1);
+        _mm256_store_si256((__m256i*) (dst + 64), v2);
+        _mm256_store_si256((__m256i*) (dst + 96), v3);
+        dst += 128;
+        src += 128;
+        len -= 128;
+    }
+
+    while(len >= 32) {
+        _mm256_store_si256((__m256i*) dst, _mm256_loadu_si256((const __m256i*) src));
+        dst += 32;
+        src += 32;
+        len -= 32;
+    }
+
+    if(len) { //Last vector overlaps the previous one
+        _mm256_storeu_si256((__m256i*) (dst_max - 32), _mm256_loadu_si256((const __m256i*) (src + len - 32)));
+    }
+}
+
+void
+__xen_shm_pipe_copy_avx512(uint8_t* dst, const uint8_t* src, size_t len) {
+    uint8_t* dst_max;
+    size_t head;
+    __m512i v0, v1, v2, v3;
+
+    if(len < 64) {
+        __xen_shm_pipe_copy_avx2(dst, src, len);
+        return;
+    }
+
+    dst_max = dst + (ptrdiff_t) len;
+
+    //First vector is unaligned, then the destination is aligned
+    _mm512_storeu_si512((void*) dst, _mm512_loadu_si512((const void*) src));
+    head = 64 - (((uintptr_t) dst) & 63u);
+    dst += head;
+    src += head;
+    len -= head;
+
+    while(len >= 256) {
+        v0 = _mm512_loadu_si512((const void*) src);
+        v1 = _mm512_loadu_si512((const void*) (src + 64));
+        v2 = _mm512_loadu_si512((const void*) (src + 128));
+        v3 = _mm512_loadu_si512((const void*) (src + 192));
+        _mm512_store_si512((void*) dst, v0);
+        _mm512_store_si512((void*) (dst + 64), v1);
+        _mm512_store_si512((void*) (dst + 128), v2);
+        _mm512_store_si512((void*) (dst + 192), v3);
+        dst += 256;
+        src += 256;
+        len -= 256;
+    }
+
+    while(len >= 64) {
+        _mm512_store_si512((void*) dst, _mm512_loadu_si512((const void*) src));
+        dst += 64;
+        src += 64;
+        len -= 64;
+    }
+
+    if(len) { //Last vector overlaps the previous one
+        _mm512_storeu_si512((void*) (dst_max - 64), _mm512_loadu_si512((const void*) (src + len - 64)));
+    }
+}
+
+#endif
+
+
+xen_shm_pipe_copy_fn
+xen_shm_pipe_copy_get(enum xen_shm_pipe_copy_kernel kernel) {
+#ifdef XSHMP_COPY_X86
+    __builtin_cpu_init();
+#endif
+
+    switch(kernel) {
+    case xen_shm_pipe_copy_scalar:
+        return __xen_shm_pipe_copy_scalar;
+#ifdef XSHMP_COPY_X86
+    case xen_shm_pipe_copy_sse2:
+        return __builtin_cpu_supports("sse2")?__xen_shm_pipe_copy_sse2:NULL;
+    case xen_shm_pipe_copy_avx2:
+        return __builtin_cpu_supports("avx2")?__xen_shm_pipe_copy_avx2:NULL;
+    case xen_shm_pipe_copy_avx512:
+        return __builtin_cpu_supports("avx512f")?__xen_shm_pipe_copy_avx512:NULL;
+#endif
+    default:
+        return NULL;
+    }
+}
+
+enum xen_shm_pipe_copy_kernel
+xen_shm_pipe_copy_best(void) {
+    enum xen_shm_pipe_copy_kernel kernel;
+
+    kernel = xen_shm_pipe_copy_avx512;
+    while(kernel != xen_shm_pipe_copy_scalar && xen_shm_pipe_copy_get(kernel) == NULL) {
+        kernel = (enum xen_shm_pipe_copy_kernel) (kernel - 1);
+    }
+
+    return kernel;
+}
+
+const char*
+xen_shm_pipe_copy_name(enum xen_shm_pipe_copy_kernel kernel) {
+    switch(kernel) {
+    case xen_shm_pipe_copy_scalar:
+        return "scalar";
+    case xen_shm_pipe_copy_sse2:
+        return "sse2";
+    case xen_shm_pipe_copy_avx2:
+        return "avx2";
+    case xen_shm_pipe_copy_avx512:
+        return "avx512";
+    default:
+        return "unknown";
+    }
+}
@@ -0,0 +1,61 @@
+/*
+ * Xen shared memory pipe copy kernels headers
+ *
+ * Authors: Vincent Brillault <git@lerya.net>
+ *          Pierre Pfister    <oryon@darou.fr>
+ *
+ * The pipe spends most of its time copying bytes between the user
+ * buffers and the circular buffer. This file provides different
+ * implementations of this copy (scalar and SIMD ones) and the
+ * selection of the best one the CPU supports.
+ *
+ */
+
+#ifndef __XEN_SHM_PIPE_COPY_H__
+#define __XEN_SHM_PIPE_COPY_H__
+
+#include <inttypes.h>
+#include <stddef.h>
+
+
+/*
+ * SIMD kernels are only compiled on x86 (define XSHMP_COPY_NO_SIMD to disable them)
+ */
+#if (defined(__x86_64__) || defined(__i386__)) && !defined(XSHMP_COPY_NO_SIMD)
+# define XSHMP_COPY_X86
+#endif
+
+
+/*
+ * A copy kernel. Buffers must not overlap.
+ */
+typedef void (*xen_shm_pipe_copy_fn)(uint8_t* dst, const uint8_t* src, size_t len);
+
+/*
+ * The available kernels
+ */
+enum xen_shm_pipe_copy_kernel {
+    xen_shm_pipe_copy_scalar,  /* 64b copy when both sides share the same alignment, byte copy otherwise */
+    xen_shm_pipe_copy_sse2,    /* 16 bytes unaligned loads, aligned stores */
+    xen_shm_pipe_copy_avx2,    /* 32 bytes unaligned loads, aligned stores */
+    xen_shm_pipe_copy_avx512,  /* 64 bytes unaligned loads, aligned stores */
+    xen_shm_pipe_copy_kernel_count
+};
+
+
+/*
+ * Returns the given kernel, or NULL if it is not supported by the CPU.
+ */
+xen_shm_pipe_copy_fn xen_shm_pipe_copy_get(enum xen_shm_pipe_copy_kernel kernel);
+
+/*
+ * Returns the fastest kernel supported by the CPU (found with cpuid).
+ */
+enum xen_shm_pipe_copy_kernel xen_shm_pipe_copy_best(void);
+
+/*
+ * Returns a printable name of the kernel
+ */
+const char* xen_shm_pipe_copy_name(enum xen_shm_pipe_copy_kernel kernel);
+
+#endif
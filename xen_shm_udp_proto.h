@@ -20,14 +20,17 @@ struct xen_shm_udp_proto_header {
     uint32_t big_reserved;
 } __attribute__ ((__packed__));
 
+#define XEN_SHM_UDP_PROTO_GRANT_MODE_WRITER_OFFERER 0x01
+#define XEN_SHM_UDP_PROTO_GRANT_MODE_READER_OFFERER 0x02
+#define XEN_SHM_UDP_PROTO_GRANT_MODE_DUPLEX         0x03 //One grant for both directions, the client only connects
+#define XEN_SHM_UDP_PROTO_GRANT_MODE_MUX            0x04 //Duplex, the connections are the streams of a multiplexer (see xen_shm_mux.h)
+
 struct xen_shm_udp_proto_client_hello {
     struct xen_shm_udp_proto_header header;
     uint32_t domid;
+    uint8_t  mode; //Requested grant mode. Absent from older clients, that always get READER_OFFERER
 } __attribute__ ((__packed__));
 
-#define XEN_SHM_UDP_PROTO_GRANT_MODE_WRITER_OFFERER 0x01
-#define XEN_SHM_UDP_PROTO_GRANT_MODE_READER_OFFERER 0x02
-
 struct xen_shm_udp_proto_grant {
     struct xen_shm_udp_proto_header header;
     uint32_t grant_ref;
@@ -36,4 +39,11 @@ struct xen_shm_udp_proto_grant {
     uint8_t  page_count;
 } __attribute__ ((__packed__));
 
+//Server grant of the MUX mode: both sides must use the same streams
+struct xen_shm_udp_proto_mux_grant {
+    struct xen_shm_udp_proto_grant grant;
+    uint32_t stream_count;
+    uint32_t window;
+} __attribute__ ((__packed__));
+
 #endif /* __XEN_SHM_UDP_PROTO_H__ */